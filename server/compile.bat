@@ -3,7 +3,7 @@
 mkdir .\build
 pushd .\build
 
-cl -FAsc -Zi ..\src\main.cpp     /EHsc /link user32.lib Gdi32.lib Ws2_32.lib
+cl -FAsc -Zi ..\src\main.cpp     /EHsc /link user32.lib Gdi32.lib Ws2_32.lib Mswsock.lib Secur32.lib Crypt32.lib Dbghelp.lib
 set /A compile_exit_code=%errorlevel%
 
 popd
@@ -0,0 +1,40 @@
+@echo off 
+
+@REM The fuzz targets and the property tests of fuzz\, built with ASan and UBSan by clang-cl
+@REM ("fuzz.bat cl": the cl of VS 2022, ASan only). The property tests run, then every target
+@REM replays its corpus once. To fuzz a target afterwards:
+@REM     build\fuzz\fuzz_hpack.exe fuzz\corpus\hpack -max_total_time=600
+
+set compiler=clang-cl
+set sanitizers=-fsanitize=address,undefined
+if "%1"=="cl" (
+    set compiler=cl
+    set sanitizers=-fsanitize=address
+)
+set libs=user32.lib Gdi32.lib Ws2_32.lib Mswsock.lib Secur32.lib Crypt32.lib Dbghelp.lib
+
+mkdir .\build\fuzz
+pushd .\build\fuzz
+
+%compiler% -O1 -Zi %sanitizers% ..\..\fuzz\properties.cpp     /EHsc /link %libs%
+if errorlevel 1 goto done
+
+for %%t in (strings http_header hpack upload) do (
+    %compiler% -O1 -Zi %sanitizers% -fsanitize=fuzzer ..\..\fuzz\fuzz_%%t.cpp     /EHsc /link %libs%
+    if errorlevel 1 goto done
+)
+
+properties.exe
+if errorlevel 1 goto done
+
+for %%t in (strings http_header hpack upload) do (
+    fuzz_%%t.exe -runs=0 ..\..\fuzz\corpus\%%t
+    if errorlevel 1 goto done
+)
+
+:done
+set /A fuzz_exit_code=%errorlevel%
+
+popd
+
+exit /b %fuzz_exit_code%
@@ -0,0 +1,112 @@
+#ifndef H_CUPIDO_FUZZ
+#define H_CUPIDO_FUZZ
+
+// Shared by the fuzz targets and the property tests: the whole server (without its main()),
+// the check that stops a run, and the plain reference versions the parsers are compared to.
+// Build and run them with fuzz.bat.
+
+#define CUPIDO_NO_MAIN
+#include "../src/main.cpp"
+
+#define FUZZ_CHECK(__cond, __fmt_msg, ...) { \
+    if (!(__cond)) { \
+        fprintf(stderr, "[fuzz]: %s:%d: " __fmt_msg "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
+        abort(); \
+    } \
+}
+
+// The server logs every request on the stdout, it'd be most of the time of a run
+inline void fuzz_quiet()
+{
+    freopen("NUL", "w", stdout);
+}
+
+// The first index of the needle in the raw bytes, -1 if it isn't there. The needle has no NUL.
+s64 reference_find(String s, const char *needle)
+{
+    s64 n = (s64)strlen(needle);
+    for (s64 i = 0; i + n <= s.count; i++) {
+        if (memcmp(s.data + i, needle, n) == 0) return i;
+    }
+    return -1;
+}
+
+// An optional '-' and decimal digits, all of the string, in the range of s64.
+bool reference_to_s64(String s, s64 *out)
+{
+    s64 i = s.count && s.data[0] == '-' ? 1 : 0;
+    if (i == s.count) return false;
+
+    u64 limit = i ? (u64)LLONG_MAX + 1 : (u64)LLONG_MAX;
+    u64 r = 0;
+    for (; i < s.count; i++) {
+        if (s.data[i] < '0' || s.data[i] > '9') return false;
+
+        u64 digit = (u64)(s.data[i] - '0');
+        if (r > (limit - digit) / 10) return false;
+        r = r*10 + digit;
+    }
+
+    *out = s.data[0] == '-' ? (s64)(0 - r) : (s64)r;
+    return true;
+}
+
+// Where string_eat_until() stops: at 'c', a NUL or the end.
+s64 reference_eat_until(String s, char c)
+{
+    s64 i = 0;
+    while (i < s.count && s.data[i] && s.data[i] != c) i++;
+    return i;
+}
+
+// new_string.h against the references, on one haystack and needle. The 'step' is at most the
+// length of the haystack.
+void check_string_ops(String s, char *needle, u32 step)
+{
+    s64 n = (s64)strlen(needle);
+    s64 at = reference_find(s, needle);
+    FUZZ_CHECK(find_index_from_left(s, needle) == at, "find_index_from_left");
+
+    String rest;
+    bool found = false;
+    String head = split(s, needle, &rest, &found);
+    FUZZ_CHECK(found == (at >= 0), "split found");
+    if (found) {
+        FUZZ_CHECK(head.data == s.data && head.count == at, "split head");
+        FUZZ_CHECK(rest.data == s.data + at + n && rest.count == s.count - at - n, "split rest");
+    } else {
+        FUZZ_CHECK(head.data == s.data && head.count == s.count, "split not found");
+    }
+
+    // Every piece between the needles, the way the header lines are taken
+    String left = s;
+    s64 pieces = 0, offset = 0;
+    do {
+        String piece = split_and_move(&left, needle, &found);
+        s64 next = reference_find(String(s.data + offset, (u32)(s.count - offset)), needle);
+        FUZZ_CHECK(piece.data == s.data + offset && piece.count == (next >= 0 ? next : s.count - offset), "split_and_move");
+        if (found) offset += next + n;
+        pieces += 1;
+    } while (found);
+    FUZZ_CHECK(pieces <= s.count + 1, "split_and_move pieces");
+
+    String moved = advance(s, step);
+    FUZZ_CHECK(moved.data == s.data + step && moved.count == s.count - step, "advance");
+
+    s64 expected = 0;
+    bool expected_ok = reference_to_s64(s, &expected);
+    bool ok = true;
+    s64 value = string_to_s64(s, &ok);
+    FUZZ_CHECK(ok == expected_ok && (!ok || value == expected), "string_to_s64 -> %lld", value);
+
+    ok = true;
+    int small = string_to_int(s, &ok);
+    bool small_ok = expected_ok && expected >= INT_MIN && expected <= INT_MAX;
+    FUZZ_CHECK(ok == small_ok && (!ok || small == expected), "string_to_int -> %d", small);
+
+    String eaten = string_eat_until(s, needle[0]);
+    s64 stop = reference_eat_until(s, needle[0]);
+    FUZZ_CHECK(eaten.data == s.data + stop && eaten.count == s.count - stop, "string_eat_until");
+}
+
+#endif
@@ -0,0 +1,53 @@
+#include "fuzz.h"
+
+// The header blocks of one HTTP/2 connection, decoded with the same dynamic table. The input
+// is a length byte and that many bytes of block, again and again.
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    fuzz_quiet();
+    return 0;
+}
+
+// Reads every byte of the fields, ASan catches the ones that point to freed table entries
+bool fuzz_hpack_field(void *user, String name, String value)
+{
+    u64 *sum = (u64 *)user;
+    for (s64 i = 0; i < name.count; i++)  *sum += (u8)name.data[i];
+    for (s64 i = 0; i < value.count; i++) *sum += (u8)value.data[i];
+    return true;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const u8 *data, size_t size)
+{
+    Hpack_Decoder *d = (Hpack_Decoder *)malloc(sizeof(Hpack_Decoder));
+    hpack_decoder_init(d);
+
+    Hpack_Arena arena;
+    arena.data     = (char *)malloc(H2_MAX_HEADER_LIST);
+    arena.capacity = H2_MAX_HEADER_LIST;
+    arena.count    = 0;
+
+    u64 sum = 0;
+    size_t at = 0;
+    while (at < size) {
+        size_t count = data[at++];
+        if (count > size - at) count = size - at;
+
+        // Each block in its own allocation, like the header block buffer of the connection
+        u8 *block = (u8 *)malloc(count ? count : 1);
+        memcpy(block, data + at, count);
+        at += count;
+
+        bool ok = hpack_decode_block(d, block, (s64)count, &arena, fuzz_hpack_field, &sum);
+        free(block);
+
+        FUZZ_CHECK(d->size <= d->max_size && d->count <= HPACK_MAX_DYNAMIC_COUNT, "dynamic table over its size");
+        if (!ok) break; // A compression error ends the connection
+    }
+
+    hpack_decoder_free(d);
+    free(d);
+    free(arena.data);
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include "fuzz.h"
+
+// The bytes a client sends first on a connection: the header, then the path normalization,
+// the routing and the query lookup that every request goes through.
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    fuzz_quiet();
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const u8 *data, size_t size)
+{
+    // The header buffer is exactly the input, so ASan sees a read past it
+    Request c = {};
+    c.buf      = (char *)malloc(size ? size : 1);
+    c.buf_size = (s64)size;
+    memcpy(c.buf, data, size);
+
+    bool complete = false;
+    bool valid = http_parse_header_bytes(&c, (s64)size, &complete);
+
+    if (valid && complete) {
+        FUZZ_CHECK(c.body.count >= 0 && c.body.data + c.body.count <= c.buf + size, "body out of the buffer");
+
+        if (c.state == HTTP_STATE_HEADER_PARSED && url_normalize_path(&c.path)) {
+            FUZZ_CHECK(c.path.count > 0 && c.path.data[0] == '/', "normalized path");
+
+            Route_Params params;
+            Route_Handler handler = nullptr;
+            router_match(&ROUTER, ROUTES, c.method, c.path, &params, &handler);
+            FUZZ_CHECK(params.count <= ROUTER_MAX_PARAMS, "route params");
+        }
+
+        char value_buf[MAX_PATH];
+        String value;
+        url_query_get(c.query, "path", &value, value_buf, sizeof(value_buf));
+    }
+
+    free(c.buf);
+    return 0;
+}
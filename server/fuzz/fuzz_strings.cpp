@@ -0,0 +1,34 @@
+#include "fuzz.h"
+
+// new_string.h against the references. The input is a control byte, the needle (1 to 8
+// bytes, the NULs replaced) and the haystack.
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    fuzz_quiet();
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const u8 *data, size_t size)
+{
+    if (size < 2) return 0;
+
+    u8 control = data[0];
+    s64 needle_count = 1 + control % 8;
+    if ((s64)size < 1 + needle_count) return 0;
+
+    char needle[9];
+    for (s64 i = 0; i < needle_count; i++) needle[i] = data[1 + i] ? (char)data[1 + i] : 'a';
+    needle[needle_count] = 0;
+
+    // Its own allocation, so ASan sees a read past the end
+    s64 count = (s64)size - 1 - needle_count;
+    char *bytes = (char *)malloc(count ? count : 1);
+    memcpy(bytes, data + 1 + needle_count, count);
+    String s = String(bytes, (u32)count);
+
+    check_string_ops(s, needle, (u32)(control % (count + 1)));
+
+    free(bytes);
+    return 0;
+}
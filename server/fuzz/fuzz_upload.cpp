@@ -0,0 +1,47 @@
+#include "fuzz.h"
+
+// The body of POST /upload-batch, stored for real in a storage next to the working directory.
+// The first byte picks tar (bit 0 clear) or multipart with the boundary "fuzz", and bit 1 an
+// X-Expected-SHA256 on the request. The rest is the body.
+
+static Storage fuzz_storage;
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    fuzz_quiet();
+
+    bool success = storage_create(&fuzz_storage, "fuzz_storage");
+    ASSERT(success, "Failed to create the storage of the fuzzer!");
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const u8 *data, size_t size)
+{
+    if (size < 1) return 0;
+
+    // The body is in its own allocation, so ASan sees a read past it
+    s64 count = (s64)size - 1;
+    char *body = (char *)malloc(count ? count : 1);
+    memcpy(body, data + 1, count);
+
+    Request c = {};
+    c.socket         = INVALID_SOCKET;
+    c.content_type   = (data[0] & 1) ? Mime_Multipart_FormData : Mime_App_Tar;
+    c.boundary       = String("fuzz");
+    c.content_length = count;
+    c.body           = String(body, (u32)count);
+
+    if (data[0] & 2) {
+        c.has_expected_sha256 = true;
+        ZERO_MEMORY(c.expected_sha256, SHA256_DIGEST_SIZE);
+    }
+
+    // A small buffer, so the refills happen in the middle of the headers too
+    Upload_Result res;
+    upload_ingest(&fuzz_storage, &c, TAR_BLOCK_SIZE * 8, &res);
+    FUZZ_CHECK(c.body_received <= count, "read past the body");
+
+    free(res.digests);
+    free(body);
+    return 0;
+}
@@ -0,0 +1,482 @@
+#include "fuzz.h"
+
+// The property tests: the parsers against the references on random inputs, the known answers
+// of the RFCs, and the regressions. A failed check stops the run with its line.
+//   properties.exe [iterations] [seed]
+
+u64 property_random(u64 *state)
+{
+    // xorshift64
+    u64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+// Random bytes from a small alphabet, so the needles and the numbers actually show up
+void property_fill(u64 *state, char *out, s64 count, const char *alphabet)
+{
+    s64 n = (s64)strlen(alphabet);
+    for (s64 i = 0; i < count; i++) {
+        u64 r = property_random(state);
+        out[i] = (r % 16 == 0) ? 0 : alphabet[(r >> 8) % n];
+    }
+}
+
+//
+// new_string.h
+//
+
+struct Number_Case {
+    const char *text;
+    s64 count; // -1: strlen
+    bool ok;
+    s64 value;
+};
+
+void property_numbers()
+{
+    static const Number_Case cases[] = {
+        { "0", -1, true, 0 },
+        { "-0", -1, true, 0 },
+        { "010", -1, true, 10 },
+        { "9223372036854775807", -1, true, LLONG_MAX },
+        { "-9223372036854775808", -1, true, LLONG_MIN },
+        { "9223372036854775808", -1, false, 0 },
+        { "-9223372036854775809", -1, false, 0 },
+        { "", -1, false, 0 },
+        { "-", -1, false, 0 },
+        { " 5", -1, false, 0 },
+        { "5 ", -1, false, 0 },
+        { "+5", -1, false, 0 },
+        { "0x10", -1, false, 0 },
+        { "1e3", -1, false, 0 },
+        { "5\0junk", 6, false, 0 },
+    };
+
+    for (int i = 0; i < ARRAY_SIZE(cases); i++) {
+        const Number_Case *t = cases + i;
+        String s = String(t->text, (u32)(t->count < 0 ? strlen(t->text) : t->count));
+
+        bool ok = true;
+        s64 value = string_to_s64(s, &ok);
+        FUZZ_CHECK(ok == t->ok && (!ok || value == t->value), "string_to_s64(\"%s\") -> %lld", t->text, value);
+
+        s64 expected = 0;
+        FUZZ_CHECK(reference_to_s64(s, &expected) == t->ok && (!t->ok || expected == t->value), "reference_to_s64(\"%s\")", t->text);
+    }
+}
+
+void property_strings(u64 *state, s64 iterations)
+{
+    char haystack[64];
+    char needle[5];
+
+    for (s64 i = 0; i < iterations; i++) {
+        s64 count = property_random(state) % sizeof(haystack);
+        property_fill(state, haystack, count, "ab\r\n -0123456789");
+
+        s64 needle_count = 1 + property_random(state) % (sizeof(needle) - 1);
+        property_fill(state, needle, needle_count, "ab\r\n");
+        for (s64 j = 0; j < needle_count; j++) {
+            if (!needle[j]) needle[j] = 'a';
+        }
+        needle[needle_count] = 0;
+
+        // Its own allocation, so ASan sees a read past the end
+        char *bytes = (char *)malloc(count ? count : 1);
+        memcpy(bytes, haystack, count);
+        check_string_ops(String(bytes, (u32)count), needle, (u32)(property_random(state) % (count + 1)));
+        free(bytes);
+    }
+}
+
+//
+// The HTTP/1.1 header
+//
+
+void property_http_header(u64 *state, s64 iterations)
+{
+    static const char *methods[] = { "GET", "POST", "DELETE" };
+    static const Http_Method method_enums[] = { HTTP_METHOD_GET, HTTP_METHOD_POST, HTTP_METHOD_DELETE };
+
+    char path[64], query[32], text[512];
+
+    for (s64 i = 0; i < iterations; i++) {
+        int m = (int)(property_random(state) % ARRAY_SIZE(methods));
+
+        s64 path_count = 1 + property_random(state) % 40;
+        property_fill(state, path + 1, path_count - 1, "abc/._-%20");
+        path[0] = '/';
+        for (s64 j = 0; j < path_count; j++) {
+            if (!path[j] || path[j] == ' ' || path[j] == '?') path[j] = 'x';
+        }
+
+        s64 query_count = property_random(state) % 2 ? property_random(state) % 30 : -1;
+        if (query_count > 0) property_fill(state, query, query_count, "abc=&%2F");
+        for (s64 j = 0; j < query_count; j++) {
+            if (!query[j]) query[j] = 'q';
+        }
+
+        s64 content_length = (s64)(property_random(state) % 100000);
+        s64 body_count = property_random(state) % 8;
+
+        int n = snprintf(text, sizeof(text), "%s %.*s%s%.*s HTTP/1.1\r\nHost: localhost\r\nContent-Length: %lld\r\nX-Other: a: b\r\n\r\n%.*s",
+                         methods[m], (int)path_count, path, query_count >= 0 ? "?" : "", (int)(query_count > 0 ? query_count : 0), query,
+                         content_length, (int)body_count, "bodybody");
+
+        // Every prefix without the end of the header waits for more
+        s64 header_end = reference_find(String(text, (u32)n), "\r\n\r\n") + 4;
+        s64 cut = (s64)(property_random(state) % header_end);
+
+        Request c = {};
+        c.buf      = (char *)malloc(n);
+        c.buf_size = n;
+        memcpy(c.buf, text, n);
+
+        bool complete = true;
+        FUZZ_CHECK(http_parse_header_bytes(&c, cut, &complete) && !complete, "incomplete header %lld/%lld", cut, header_end);
+
+        complete = false;
+        bool ok = http_parse_header_bytes(&c, n, &complete);
+        FUZZ_CHECK(ok && complete && c.state == HTTP_STATE_HEADER_PARSED, "parse \"%.*s\"", (int)header_end, text);
+        FUZZ_CHECK(c.method == method_enums[m], "method");
+        FUZZ_CHECK(string_equal(c.path, String(path, (u32)path_count)), "path");
+        FUZZ_CHECK(c.query.count == (query_count > 0 ? query_count : 0), "query");
+        FUZZ_CHECK(c.content_length == content_length, "content length");
+        FUZZ_CHECK(c.body.data == c.buf + header_end && c.body.count == body_count, "body");
+
+        free(c.buf);
+    }
+}
+
+//
+// HPACK
+//
+
+s64 property_hex(const char *hex, u8 *out)
+{
+    s64 n = 0;
+    for (const char *p = hex; p[0] && p[1]; p += 2) {
+        out[n++] = (u8)(url_hex_value(p[0]) * 16 + url_hex_value(p[1]));
+    }
+    return n;
+}
+
+bool property_collect_field(void *user, String name, String value)
+{
+    String *fields = (String *)user;
+    if (name.count) join(fields, name.data, name.count);
+    join(fields, ": ");
+    if (value.count) join(fields, value.data, value.count);
+    join(fields, "\n");
+    return true;
+}
+
+struct Hpack_Case {
+    const char *block;
+    const char *fields;
+    u32 table_size;
+};
+
+// RFC 7541 C.3 and C.4: three requests on one connection, without and with Huffman
+void property_hpack_known_answers()
+{
+    static const Hpack_Case cases[2][3] = {
+        {
+            { "828684410f7777772e6578616d706c652e636f6d",
+              ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n", 57 },
+            { "828684be58086e6f2d6361636865",
+              ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n", 110 },
+            { "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565",
+              ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n", 164 },
+        },
+        {
+            { "828684418cf1e3c2e5f23a6ba0ab90f4ff",
+              ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n", 57 },
+            { "828684be5886a8eb10649cbf",
+              ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n", 110 },
+            { "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+              ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n", 164 },
+        },
+    };
+
+    Hpack_Arena arena;
+    arena.data     = (char *)malloc(H2_MAX_HEADER_LIST);
+    arena.capacity = H2_MAX_HEADER_LIST;
+
+    for (int huffman = 0; huffman < 2; huffman++) {
+        Hpack_Decoder d;
+        hpack_decoder_init(&d);
+
+        for (int i = 0; i < 3; i++) {
+            const Hpack_Case *t = &cases[huffman][i];
+            u8 block[64];
+            s64 count = property_hex(t->block, block);
+
+            String fields = string_create(256);
+            FUZZ_CHECK(hpack_decode_block(&d, block, count, &arena, property_collect_field, &fields), "C.%d.%d", 3 + huffman, i + 1);
+            FUZZ_CHECK(string_equal(fields, String(t->fields)), "C.%d.%d fields:\n%.*s", 3 + huffman, i + 1, (int)fields.count, fields.data);
+            FUZZ_CHECK(d.size == t->table_size, "C.%d.%d table size %u", 3 + huffman, i + 1, d.size);
+            free(fields);
+        }
+
+        hpack_decoder_free(&d);
+    }
+
+    free(arena.data);
+}
+
+// Appends a literal with incremental indexing: 'name_index' 0 for a new name
+void property_hpack_literal(char *out, s64 *w, s64 capacity, u32 name_index, String name, String value)
+{
+    hpack_encode_int(out, w, capacity, 6, 0x40, name_index);
+    if (!name_index) {
+        hpack_encode_int(out, w, capacity, 7, 0x00, (u32)name.count);
+        memcpy(out + *w, name.data, name.count);
+        *w += name.count;
+    }
+    hpack_encode_int(out, w, capacity, 7, 0x00, (u32)value.count);
+    memcpy(out + *w, value.data, value.count);
+    *w += value.count;
+}
+
+void property_hpack_regressions()
+{
+    Hpack_Arena arena;
+    arena.data     = (char *)malloc(H2_MAX_HEADER_LIST);
+    arena.capacity = H2_MAX_HEADER_LIST;
+
+    // A field indexing the name of the dynamic entry that its insert evicts, the name was read
+    // from the freed entry
+    {
+        static char name[3000], value[900], other[200];
+        memset(name, 'n', sizeof(name));
+        memset(value, 'v', sizeof(value));
+        memset(other, 'o', sizeof(other));
+
+        char block[8192];
+        s64 w = 0;
+        property_hpack_literal(block, &w, sizeof(block), 0, String(name, sizeof(name)), String(value, sizeof(value)));
+        property_hpack_literal(block, &w, sizeof(block), HPACK_STATIC_COUNT + 1, String(), String(other, sizeof(other)));
+
+        Hpack_Decoder d;
+        hpack_decoder_init(&d);
+        String fields = string_create(8192);
+        FUZZ_CHECK(hpack_decode_block(&d, (u8 *)block, w, &arena, property_collect_field, &fields), "evicted name");
+
+        String expected = string_create(8192);
+        property_collect_field(&expected, String(name, sizeof(name)), String(value, sizeof(value)));
+        property_collect_field(&expected, String(name, sizeof(name)), String(other, sizeof(other)));
+        FUZZ_CHECK(string_equal(fields, expected), "evicted name fields");
+
+        String entry_name, entry_value;
+        FUZZ_CHECK(d.count == 1 && hpack_get(&d, HPACK_STATIC_COUNT + 1, &entry_name, &entry_value), "evicted name table");
+        FUZZ_CHECK(string_equal(entry_name, String(name, sizeof(name))) && string_equal(entry_value, String(other, sizeof(other))), "evicted name entry");
+
+        free(fields);
+        free(expected);
+        hpack_decoder_free(&d);
+    }
+
+    free(arena.data);
+}
+
+void property_hpack_round_trip(u64 *state, s64 iterations)
+{
+    Hpack_Arena arena;
+    arena.data     = (char *)malloc(H2_MAX_HEADER_LIST);
+    arena.capacity = H2_MAX_HEADER_LIST;
+
+    char out[256];
+    char name[32], value[64];
+
+    for (s64 i = 0; i < iterations; i++) {
+        // The integers, on every prefix
+        int prefix_bits = 1 + (int)(property_random(state) % 8);
+        u32 number = (u32)(property_random(state) % (1u << (property_random(state) % 28)));
+
+        s64 w = 0;
+        FUZZ_CHECK(hpack_encode_int(out, &w, sizeof(out), prefix_bits, 0, number), "encode %u", number);
+
+        u8 *p = (u8 *)out;
+        u32 decoded = 0;
+        FUZZ_CHECK(hpack_decode_int(&p, (u8 *)out + w, prefix_bits, &decoded) && decoded == number && p == (u8 *)out + w, "decode %u/%d", number, prefix_bits);
+
+        // A field the way the responses are encoded comes back the same
+        s64 name_count = 1 + property_random(state) % sizeof(name);
+        property_fill(state, name, name_count, "abcdefghijklmnopqrstuvwxyz-:");
+        for (s64 j = 0; j < name_count; j++) {
+            if (!name[j]) name[j] = 'n';
+        }
+        s64 value_count = property_random(state) % sizeof(value);
+        property_fill(state, value, value_count, "abcXYZ 0123/;=\"");
+
+        w = 0;
+        FUZZ_CHECK(hpack_encode_field(out, &w, sizeof(out), String(name, (u32)name_count), String(value, (u32)value_count)), "encode field");
+
+        Hpack_Decoder d;
+        hpack_decoder_init(&d);
+        String fields = string_create(256);
+        FUZZ_CHECK(hpack_decode_block(&d, (u8 *)out, w, &arena, property_collect_field, &fields), "decode field");
+
+        String expected = string_create(256);
+        property_collect_field(&expected, String(name, (u32)name_count), String(value, (u32)value_count));
+        FUZZ_CHECK(string_equal(fields, expected), "field round trip");
+
+        free(fields);
+        free(expected);
+        hpack_decoder_free(&d);
+    }
+
+    free(arena.data);
+}
+
+//
+// The storage paths
+//
+
+struct Path_Case {
+    const char *path;
+    bool safe;
+};
+
+// NTFS ignores the case, and the device names open a device whatever their extension
+void property_storage_paths()
+{
+    static const Path_Case cases[] = {
+        { "photos/2024/a.jpg", true },
+        { ".tmpfoo", true },
+        { "a/.tmp/b", true },
+        { "photos/index.log", true },
+        { "COM10", true },
+        { "console.txt", true },
+        { "nulls/a", true },
+        { ".tmp", false },
+        { ".tmp/x", false },
+        { ".TMP/x", false },
+        { ".Tmp", false },
+        { "index.log", false },
+        { "INDEX.LOG", false },
+        { "Index.Log/x", false },
+        { "CON", false },
+        { "con.txt", false },
+        { "CON .txt", false },
+        { "a/nul", false },
+        { "a/Nul.tar.gz", false },
+        { "aux/b", false },
+        { "COM1", false },
+        { "lpt9.log", false },
+        { "conin$", false },
+        { "../a", false },
+        { "a/./b", false },
+        { "a:b", false },
+        { "a/b.", false },
+    };
+
+    for (int i = 0; i < ARRAY_SIZE(cases); i++) {
+        FUZZ_CHECK(storage_path_is_safe(String(cases[i].path)) == cases[i].safe, "storage_path_is_safe(\"%s\")", cases[i].path);
+    }
+}
+
+//
+// Tar
+//
+
+void property_tar_numbers(u64 *state, s64 iterations)
+{
+    char field[12];
+
+    for (s64 i = 0; i < iterations; i++) {
+        // Octal, with the leading spaces or zeros and the NUL or space after it of the writers
+        u64 value = property_random(state) % (1ull << (property_random(state) % 33));
+        int spaces = (int)(property_random(state) % 3);
+        char text[32];
+        int n = snprintf(text, sizeof(text), "%*s%0*llo", spaces, "", (int)(11 - spaces), value);
+        if (n > 11) continue;
+
+        memcpy(field, text, 11);
+        field[11] = property_random(state) % 2 ? ' ' : 0;
+        FUZZ_CHECK(tar_parse_number(field, 12) == (s64)value, "octal \"%.12s\"", field);
+    }
+}
+
+struct Tar_Number_Case {
+    u8 field[12];
+    s64 value;
+};
+
+// The GNU base-256 sizes: a negative or too large one used to come back negative, then an
+// entry copied that many bytes
+void property_tar_regressions()
+{
+    static const Tar_Number_Case cases[] = {
+        { { 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0x00 }, 256 },
+        { { 0x80, 0, 0, 0, 0x7f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }, LLONG_MAX },
+        { { 0x80, 0, 0, 0, 0x80, 0, 0, 0, 0, 0, 0, 0 }, -1 },
+        { { 0x80, 0, 0, 0x01, 0, 0, 0, 0, 0, 0, 0, 0 }, -1 },
+        { { 0xbf, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }, -1 },
+        { { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }, -1 },
+    };
+
+    for (int i = 0; i < ARRAY_SIZE(cases); i++) {
+        s64 value = tar_parse_number((char *)cases[i].field, 12);
+        FUZZ_CHECK(value == cases[i].value, "base-256 #%d -> %lld", i, value);
+    }
+}
+
+//
+// Erasure
+//
+
+// The unit checksums: the known answer of CRC-32C, and the SSE 4.2 one against the table
+void property_erasure_checksums(u64 *state, s64 iterations)
+{
+    FUZZ_CHECK(crc32c_scalar((u8 *)"123456789", 9) == 0xE3069283, "crc32c known answer");
+    if (!crc_cpu_has_sse42()) return;
+
+    u8 data[300];
+    for (s64 i = 0; i < iterations; i++) {
+        s64 count = property_random(state) % sizeof(data);
+        s64 at    = property_random(state) % 8;
+        property_fill(state, (char *)data, sizeof(data), "\x01\x80\xffab");
+        if (at + count > (s64)sizeof(data)) count = sizeof(data) - at;
+        FUZZ_CHECK(crc32c_sse42(data + at, count) == crc32c_scalar(data + at, count), "crc32c of %lld bytes at %lld", count, at);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    fuzz_quiet();
+
+    s64 iterations = argc > 1 ? atoll(argv[1]) : 100000;
+    u64 state      = argc > 2 ? strtoull(argv[2], nullptr, 10) : 0x9E3779B97F4A7C15ULL;
+    if (state == 0) state = 1;
+    fprintf(stderr, "[properties]: %lld iterations, seed %llu\n", iterations, state);
+
+    property_numbers();
+    property_strings(&state, iterations);
+    fprintf(stderr, "[properties]: new_string.h ok\n");
+
+    property_http_header(&state, iterations / 10);
+    fprintf(stderr, "[properties]: http header ok\n");
+
+    property_hpack_known_answers();
+    property_hpack_regressions();
+    property_hpack_round_trip(&state, iterations / 10);
+    fprintf(stderr, "[properties]: hpack ok\n");
+
+    property_storage_paths();
+    fprintf(stderr, "[properties]: storage paths ok\n");
+
+    property_tar_numbers(&state, iterations);
+    property_tar_regressions();
+    fprintf(stderr, "[properties]: tar ok\n");
+
+    property_erasure_checksums(&state, iterations / 10);
+    fprintf(stderr, "[properties]: erasure checksums ok\n");
+
+    return 0;
+}
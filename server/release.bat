@@ -3,6 +3,6 @@
 mkdir .\build
 pushd .\build
 
-cl -O2 -FAsc -Zi ..\src\main.cpp     /EHsc /link user32.lib Gdi32.lib Ws2_32.lib
+cl -O2 -FAsc -Zi ..\src\main.cpp     /EHsc /link user32.lib Gdi32.lib Ws2_32.lib Mswsock.lib Secur32.lib Crypt32.lib Dbghelp.lib
 
 popd
\ No newline at end of file
@@ -0,0 +1,604 @@
+#ifndef H_CUPIDO_ARCHIVE
+#define H_CUPIDO_ARCHIVE
+
+#include "server.h"
+#include "upload.h"
+#include "deflate.h"
+
+// A folder downloaded as one ZIP or tar, built while it's sent: no temporary file and no
+// Content-Length. HTTP/1.1 sends it in chunks, HTTP/2 in the DATA frames as usual. The headers
+// and the small parts are collected in a fixed buffer, a file goes out after them as the end
+// of the same chunk, with TransmitFile() (see send_file_to_client). The files on the disks
+// (see erasure.h) go through the buffer, there is no handle to transmit. So the memory is the
+// same whatever the size of the files, only the list of the entries is kept for the ZIP's
+// central directory.
+//
+// ZIP entries are stored by default. The CRC of a stored one is read before the header, then
+// the file is sent from the page cache. With ?method=deflate the entries are compressed
+// (see deflate.h), their CRC and sizes go after them in a data descriptor. ZIP64 fields are
+// only added where the 32-bit ones overflow. The tar is ustar with the GNU long names and
+// base-256 sizes, the same that the uploads understand, so a download can be uploaded again.
+
+bool send_to_client(Request *c, String *buffer, s64 at_once);
+bool send_file_to_client(Request *c, HANDLE h, s64 size, String *head);
+
+const s64 ARCHIVE_BUFFER_SIZE      = BYTES_TO_KB(64);
+const s64 ARCHIVE_SMALL_FILE_SIZE  = BYTES_TO_KB(16); // Copied into the buffer, not sent on its own
+const s64 ARCHIVE_HEAD_ROOM        = 24; // The size line of a chunk, and the CRLF ending the previous one
+const s64 ARCHIVE_DEFLATE_MAX_SIZE = 0xF0000000LL; // Bigger files are stored, the data descriptor has 32-bit sizes
+
+enum Archive_Format {
+    ARCHIVE_ZIP,
+    ARCHIVE_TAR,
+};
+
+struct Archive_Entry {
+    char *path; // Relative to the storage root
+    s64 size;
+
+    // Of the ZIP entry as it was sent, for the central directory
+    bool sent;
+    u16 method;
+    u16 dos_time;
+    u16 dos_date;
+    u32 crc;
+    s64 compressed_size;
+    s64 offset;
+};
+
+struct Archive {
+    Request *c;
+    Storage *st;
+    bool chunked;    // HTTP/1.1
+    bool chunk_open; // The last chunk ended with a file, its CRLF is still due
+
+    char *buf; // ARCHIVE_HEAD_ROOM, then the bytes not sent yet
+    s64 count;
+    s64 offset; // Of the archive, without the chunk framing
+
+    s64 name_skip; // The folder's parent is not part of the names
+    char *read_buf;
+
+    // ?method=deflate
+    Deflate *z;
+    u8 *z_out;
+};
+
+struct Crc32_Table {
+    u32 v[256];
+};
+
+constexpr Crc32_Table crc32_build()
+{
+    Crc32_Table t = {};
+    for (u32 i = 0; i < 256; i++) {
+        u32 c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        t.v[i] = c;
+    }
+    return t;
+}
+
+static constexpr Crc32_Table CRC32_TABLE = crc32_build();
+
+// Start with 0, the result of the previous call continues it.
+inline u32 crc32_update(u32 crc, u8 *data, s64 count)
+{
+    crc = ~crc;
+    for (s64 i = 0; i < count; i++) crc = CRC32_TABLE.v[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+int archive_entry_compare(const void *a, const void *b)
+{
+    return strcmp(((Archive_Entry *)a)->path, ((Archive_Entry *)b)->path);
+}
+
+// The stored files under the 'folder' (all of them if it's empty), sorted by path.
+Archive_Entry *archive_collect(Storage *st, String folder, s64 *count)
+{
+    s64 capacity = 64;
+    Archive_Entry *entries = (Archive_Entry *)malloc(capacity * sizeof(Archive_Entry));
+    assert(entries);
+    *count = 0;
+
+    AcquireSRWLockShared(&st->index.lock);
+    for (s64 i = 0; i < st->index.capacity; i++) {
+        Storage_Entry *e = st->index.entries + i;
+        if (e->path == nullptr) continue;
+
+        if (folder.count) {
+            if (e->path_count <= folder.count || e->path[folder.count] != '/') continue;
+            if (memcmp(e->path, folder.data, folder.count) != 0) continue;
+        }
+
+        if (*count == capacity) {
+            capacity *= 2;
+            entries = (Archive_Entry *)realloc(entries, capacity * sizeof(Archive_Entry));
+            assert(entries);
+        }
+
+        Archive_Entry *a = entries + (*count)++;
+        ZERO_MEMORY(a, sizeof(Archive_Entry));
+        a->path = _strdup(e->path);
+        a->size = e->size;
+    }
+    ReleaseSRWLockShared(&st->index.lock);
+
+    qsort(entries, *count, sizeof(Archive_Entry), archive_entry_compare);
+    return entries;
+}
+
+void archive_free_entries(Archive_Entry *entries, s64 count)
+{
+    for (s64 i = 0; i < count; i++) free(entries[i].path);
+    free(entries);
+}
+
+// The CRLF due and the size line of the next chunk, right before the buffered bytes.
+char *archive_chunk_head(Archive *a, s64 chunk_size, s64 *head_count)
+{
+    char line[ARCHIVE_HEAD_ROOM + 1];
+    int len = snprintf(line, sizeof(line), "%s%llx" CRLF, a->chunk_open ? CRLF : "", chunk_size);
+
+    char *head = a->buf + ARCHIVE_HEAD_ROOM - len;
+    memcpy(head, line, len);
+    *head_count = len + a->count;
+    return head;
+}
+
+bool archive_flush(Archive *a)
+{
+    if (a->count == 0) return true;
+
+    String out = String(a->buf + ARCHIVE_HEAD_ROOM, (u32)a->count);
+    if (a->chunked) {
+        s64 head_count = 0;
+        char *head = archive_chunk_head(a, a->count, &head_count);
+        memcpy(head + head_count, CRLF, 2);
+        out = String(head, (u32)(head_count + 2));
+        a->chunk_open = false;
+    }
+
+    a->count = 0;
+    return send_to_client(a->c, &out, -1);
+}
+
+bool archive_write(Archive *a, void *data, s64 count)
+{
+    u8 *p = (u8 *)data;
+    a->offset += count;
+
+    while (count > 0) {
+        if (a->count == ARCHIVE_BUFFER_SIZE && !archive_flush(a)) return false;
+
+        s64 n = ARCHIVE_BUFFER_SIZE - a->count;
+        if (n > count) n = count;
+        memcpy(a->buf + ARCHIVE_HEAD_ROOM + a->count, p, n);
+        a->count += n;
+        p     += n;
+        count -= n;
+    }
+
+    return true;
+}
+
+inline bool archive_write_zeros(Archive *a, s64 count)
+{
+    static u8 zeros[TAR_BLOCK_SIZE * 2];
+    assert(count <= (s64)sizeof(zeros));
+    return archive_write(a, zeros, count);
+}
+
+// The buffered bytes and the file, as one chunk. A small file is copied into the buffer
+// instead, a folder of thumbnails would otherwise be a send per file of a few KB each.
+bool archive_write_file(Archive *a, Storage_Reader *r, s64 size)
+{
+    if (size <= ARCHIVE_SMALL_FILE_SIZE || r->handle == INVALID_HANDLE_VALUE) {
+        for (s64 left = size; left > 0;) {
+            s64 n = left < ARCHIVE_BUFFER_SIZE ? left : ARCHIVE_BUFFER_SIZE;
+            profile_phase(&a->c->trace, PROFILE_STORAGE);
+            if (!storage_read(r, a->read_buf, n) || !archive_write(a, a->read_buf, n)) return false;
+            left -= n;
+        }
+        return true;
+    }
+
+    String head = String(a->buf + ARCHIVE_HEAD_ROOM, (u32)a->count);
+    if (a->chunked) {
+        s64 head_count = 0;
+        char *p = archive_chunk_head(a, a->count + size, &head_count);
+        head = String(p, (u32)head_count);
+        a->chunk_open = true;
+    }
+
+    a->count = 0;
+    a->offset += size;
+    return send_file_to_client(a->c, r->handle, size, &head);
+}
+
+bool archive_finish(Archive *a)
+{
+    if (!archive_flush(a)) return false;
+    if (!a->chunked) return true;
+
+    String last = String(a->chunk_open ? CRLF "0" CRLF CRLF : "0" CRLF CRLF);
+    return send_to_client(a->c, &last, -1);
+}
+
+inline void archive_put_u16(u8 **p, u32 v) { (*p)[0] = (u8)v; (*p)[1] = (u8)(v >> 8); *p += 2; }
+inline void archive_put_u32(u8 **p, u32 v) { for (int i = 0; i < 4; i++) (*p)[i] = (u8)(v >> (i*8)); *p += 4; }
+inline void archive_put_u64(u8 **p, u64 v) { for (int i = 0; i < 8; i++) (*p)[i] = (u8)(v >> (i*8)); *p += 8; }
+
+inline s64 archive_unix_time(FILETIME ft)
+{
+    u64 t = ((u64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return (s64)(t / 10000000) - 11644473600LL;
+}
+
+// In UTC. The days to the civil date, from Howard Hinnant's date algorithms.
+void archive_dos_time(s64 unix_time, u16 *time, u16 *date)
+{
+    s64 days = unix_time / 86400;
+    s64 secs = unix_time % 86400;
+
+    days += 719468;
+    s64 era = days / 146097;
+    s64 doe = days - era * 146097;
+    s64 yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+    s64 doy = doe - (365*yoe + yoe/4 - yoe/100);
+    s64 mp  = (5*doy + 2) / 153;
+    s64 d   = doy - (153*mp + 2)/5 + 1;
+    s64 m   = mp < 10 ? mp + 3 : mp - 9;
+    s64 y   = yoe + era * 400 + (m <= 2);
+
+    if (y < 1980) {
+        y = 1980; m = 1; d = 1; secs = 0;
+    }
+
+    *date = (u16)(((y - 1980) << 9) | (m << 5) | d);
+    *time = (u16)(((secs / 3600) << 11) | (((secs / 60) % 60) << 5) | ((secs % 60) / 2));
+}
+
+//
+// ZIP
+//
+
+const u16 ZIP_FLAG_DATA_DESCRIPTOR = 0x0008;
+const u16 ZIP_FLAG_UTF8            = 0x0800;
+const u16 ZIP_STORE   = 0;
+const u16 ZIP_DEFLATE = 8;
+const u32 ZIP_MAX32   = 0xFFFFFFFF;
+
+bool zip_write_entry(Archive *a, Archive_Entry *e, Storage_Reader *r, s64 size, s64 mtime)
+{
+    char *name = e->path + a->name_skip;
+    u16 name_count = (u16)strlen(name);
+
+    e->size   = size;
+    e->offset = a->offset;
+    e->method = a->z && size < ARCHIVE_DEFLATE_MAX_SIZE ? ZIP_DEFLATE : ZIP_STORE;
+    archive_dos_time(mtime, &e->dos_time, &e->dos_date);
+
+    if (e->method == ZIP_STORE) {
+        // The CRC goes before the data, the file is read once for it
+        u32 crc = 0;
+        for (s64 left = size; left > 0;) {
+            s64 n = left < ARCHIVE_BUFFER_SIZE ? left : ARCHIVE_BUFFER_SIZE;
+            profile_phase(&a->c->trace, PROFILE_STORAGE);
+            if (!storage_read(r, a->read_buf, n)) return false;
+            crc = crc32_update(crc, (u8 *)a->read_buf, n);
+            left -= n;
+        }
+        if (!storage_rewind(r)) return false;
+
+        e->crc = crc;
+        e->compressed_size = size;
+    }
+
+    bool zip64 = e->method == ZIP_STORE && size >= ZIP_MAX32;
+    u16 flags = ZIP_FLAG_UTF8 | (e->method == ZIP_DEFLATE ? ZIP_FLAG_DATA_DESCRIPTOR : 0);
+    u32 crc32_field = e->method == ZIP_STORE ? e->crc : 0;
+    u32 size_field  = e->method == ZIP_DEFLATE ? 0 : zip64 ? ZIP_MAX32 : (u32)size;
+
+    u8 header[30 + 20];
+    u8 *p = header;
+    archive_put_u32(&p, 0x04034b50);
+    archive_put_u16(&p, zip64 ? 45 : 20);
+    archive_put_u16(&p, flags);
+    archive_put_u16(&p, e->method);
+    archive_put_u16(&p, e->dos_time);
+    archive_put_u16(&p, e->dos_date);
+    archive_put_u32(&p, crc32_field);
+    archive_put_u32(&p, size_field);
+    archive_put_u32(&p, size_field);
+    archive_put_u16(&p, name_count);
+    archive_put_u16(&p, zip64 ? 20 : 0);
+
+    u8 *extra = p;
+    if (zip64) {
+        archive_put_u16(&p, 0x0001);
+        archive_put_u16(&p, 16);
+        archive_put_u64(&p, size);
+        archive_put_u64(&p, size);
+    }
+
+    if (!archive_write(a, header, extra - header) || !archive_write(a, name, name_count) || !archive_write(a, extra, p - extra)) return false;
+
+    if (e->method == ZIP_STORE) return archive_write_file(a, r, size);
+
+    // Deflated in blocks, the last one can be empty
+    deflate_init(a->z);
+    u32 crc = 0;
+    s64 compressed = 0;
+    s64 left = size;
+    do {
+        s64 n = left < DEFLATE_BLOCK ? left : DEFLATE_BLOCK;
+        profile_phase(&a->c->trace, PROFILE_STORAGE);
+        if (!storage_read(r, a->read_buf, n)) return false;
+        crc = crc32_update(crc, (u8 *)a->read_buf, n);
+        left -= n;
+
+        s64 w = deflate_block(a->z, (u8 *)a->read_buf, n, left == 0, a->z_out);
+        if (!archive_write(a, a->z_out, w)) return false;
+        compressed += w;
+    } while (left > 0);
+
+    e->crc = crc;
+    e->compressed_size = compressed;
+
+    u8 descriptor[16];
+    p = descriptor;
+    archive_put_u32(&p, 0x08074b50);
+    archive_put_u32(&p, crc);
+    archive_put_u32(&p, (u32)compressed);
+    archive_put_u32(&p, (u32)size);
+    return archive_write(a, descriptor, p - descriptor);
+}
+
+bool zip_write_central_directory(Archive *a, Archive_Entry *entries, s64 count)
+{
+    s64 directory_offset = a->offset;
+    s64 sent = 0;
+
+    for (s64 i = 0; i < count; i++) {
+        Archive_Entry *e = entries + i;
+        if (!e->sent) continue;
+        sent += 1;
+
+        char *name = e->path + a->name_skip;
+        u16 name_count = (u16)strlen(name);
+
+        // The zip64 extra has only the fields that overflowed, in this order
+        u8 extra[4 + 24];
+        u8 *x = extra + 4;
+        if (e->size >= ZIP_MAX32)            archive_put_u64(&x, e->size);
+        if (e->compressed_size >= ZIP_MAX32) archive_put_u64(&x, e->compressed_size);
+        if (e->offset >= ZIP_MAX32)          archive_put_u64(&x, e->offset);
+        u16 extra_count = x == extra + 4 ? 0 : (u16)(x - extra);
+        u8 *p = extra;
+        archive_put_u16(&p, 0x0001);
+        archive_put_u16(&p, extra_count ? extra_count - 4 : 0);
+
+        u16 version = extra_count ? 45 : 20;
+        u16 flags = ZIP_FLAG_UTF8 | (e->method == ZIP_DEFLATE ? ZIP_FLAG_DATA_DESCRIPTOR : 0);
+
+        u8 header[46];
+        p = header;
+        archive_put_u32(&p, 0x02014b50);
+        archive_put_u16(&p, version);
+        archive_put_u16(&p, version);
+        archive_put_u16(&p, flags);
+        archive_put_u16(&p, e->method);
+        archive_put_u16(&p, e->dos_time);
+        archive_put_u16(&p, e->dos_date);
+        archive_put_u32(&p, e->crc);
+        archive_put_u32(&p, e->compressed_size >= ZIP_MAX32 ? ZIP_MAX32 : (u32)e->compressed_size);
+        archive_put_u32(&p, e->size >= ZIP_MAX32 ? ZIP_MAX32 : (u32)e->size);
+        archive_put_u16(&p, name_count);
+        archive_put_u16(&p, extra_count);
+        archive_put_u16(&p, 0); // Comment
+        archive_put_u16(&p, 0); // Disk
+        archive_put_u16(&p, 0); // Internal attributes
+        archive_put_u32(&p, 0); // External attributes
+        archive_put_u32(&p, e->offset >= ZIP_MAX32 ? ZIP_MAX32 : (u32)e->offset);
+
+        if (!archive_write(a, header, sizeof(header)) || !archive_write(a, name, name_count)) return false;
+        if (extra_count && !archive_write(a, extra, extra_count)) return false;
+    }
+
+    s64 directory_size = a->offset - directory_offset;
+    u8 end[56 + 20 + 22];
+    u8 *p = end;
+
+    bool zip64 = sent >= 0xFFFF || directory_offset >= ZIP_MAX32 || directory_size >= ZIP_MAX32;
+    if (zip64) {
+        s64 record_offset = a->offset;
+        archive_put_u32(&p, 0x06064b50);
+        archive_put_u64(&p, 44); // The size of the rest of the record
+        archive_put_u16(&p, 45);
+        archive_put_u16(&p, 45);
+        archive_put_u32(&p, 0);
+        archive_put_u32(&p, 0);
+        archive_put_u64(&p, sent);
+        archive_put_u64(&p, sent);
+        archive_put_u64(&p, directory_size);
+        archive_put_u64(&p, directory_offset);
+
+        // The locator
+        archive_put_u32(&p, 0x07064b50);
+        archive_put_u32(&p, 0);
+        archive_put_u64(&p, record_offset);
+        archive_put_u32(&p, 1);
+    }
+
+    archive_put_u32(&p, 0x06054b50);
+    archive_put_u16(&p, 0);
+    archive_put_u16(&p, 0);
+    archive_put_u16(&p, zip64 ? 0xFFFF : (u32)sent);
+    archive_put_u16(&p, zip64 ? 0xFFFF : (u32)sent);
+    archive_put_u32(&p, zip64 ? ZIP_MAX32 : (u32)directory_size);
+    archive_put_u32(&p, zip64 ? ZIP_MAX32 : (u32)directory_offset);
+    archive_put_u16(&p, 0); // Comment
+
+    return archive_write(a, end, p - end);
+}
+
+//
+// Tar
+//
+
+void tar_put_number(char *field, int len, s64 v)
+{
+    // Octal while it fits with the terminating zero, GNU base-256 after that
+    if (v < (1LL << (3 * (len-1)))) {
+        snprintf(field, len, "%0*llo", len-1, v);
+        return;
+    }
+
+    field[0] = (char)0x80;
+    for (int i = len-1; i > 0; i--, v >>= 8) field[i] = (char)(v & 0xFF);
+}
+
+bool tar_write_header(Archive *a, char *name, s64 size, s64 mtime, char type)
+{
+    char h[TAR_BLOCK_SIZE];
+    ZERO_MEMORY(h, sizeof(h));
+
+    // The name, or the prefix and the name split at a '/'
+    s64 name_count = strlen(name);
+    if (name_count <= 100) {
+        memcpy(h, name, name_count);
+    } else {
+        char *slash = name + name_count;
+        while (slash > name && (*slash != '/' || slash - name > 155)) slash--;
+        memcpy(h + 345, name, slash - name);
+        memcpy(h, slash + 1, name_count - (slash - name) - 1);
+    }
+
+    memcpy(h + 100, "0000644", 8);
+    memcpy(h + 108, "0000000", 8);
+    memcpy(h + 116, "0000000", 8);
+    tar_put_number(h + 124, 12, size);
+    tar_put_number(h + 136, 12, mtime > 0 ? mtime : 0);
+    h[156] = type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+
+    s64 sum = 0;
+    memset(h + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++) sum += (u8)h[i];
+    snprintf(h + 148, 8, "%06llo", sum);
+
+    return archive_write(a, h, sizeof(h));
+}
+
+// A name fits the ustar header if it can be split into a prefix of 155 and a name of 100.
+bool tar_name_fits(char *name)
+{
+    s64 count = strlen(name);
+    if (count <= 100) return true;
+
+    for (s64 i = count-1; i > 0; i--) {
+        if (name[i] != '/') continue;
+        if (count - i - 1 > 100) return false;
+        if (i <= 155) return true;
+    }
+
+    return false;
+}
+
+bool tar_write_entry(Archive *a, Archive_Entry *e, Storage_Reader *r, s64 size, s64 mtime)
+{
+    char *name = e->path + a->name_skip;
+
+    if (!tar_name_fits(name)) {
+        // GNU long name: an entry before it with the whole name as the content
+        s64 name_count = strlen(name) + 1;
+        if (!tar_write_header(a, "././@LongLink", name_count, 0, 'L')) return false;
+        if (!archive_write(a, name, name_count)) return false;
+        if (!archive_write_zeros(a, (TAR_BLOCK_SIZE - name_count % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE)) return false;
+
+        char truncated[101];
+        snprintf(truncated, sizeof(truncated), "%s", name);
+        if (!tar_write_header(a, truncated, size, mtime, '0')) return false;
+    } else {
+        if (!tar_write_header(a, name, size, mtime, '0')) return false;
+    }
+
+    if (!archive_write_file(a, r, size)) return false;
+
+    // The padding goes with the next header
+    return archive_write_zeros(a, (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+}
+
+// Sends the archive of the entries after the response head. 'folder' is the common prefix of
+// the paths, the names in the archive start with its last component. A file that is gone
+// since the listing is left out. Returns false if the connection failed or a file couldn't be
+// read, the archive is cut then.
+bool archive_send(Request *c, Storage *st, Archive_Entry *entries, s64 count, String folder, Archive_Format format, bool deflate)
+{
+    Archive a;
+    ZERO_MEMORY(&a, sizeof(a));
+    a.c  = c;
+    a.st = st;
+    a.chunked = c->h2 == nullptr;
+    a.buf      = (char *)malloc(ARCHIVE_HEAD_ROOM + ARCHIVE_BUFFER_SIZE + 2);
+    a.read_buf = (char *)malloc(ARCHIVE_BUFFER_SIZE);
+    assert(a.buf && a.read_buf);
+
+    if (deflate) {
+        a.z     = (Deflate *)malloc(sizeof(Deflate));
+        a.z_out = (u8 *)malloc(DEFLATE_OUT_SIZE);
+        assert(a.z && a.z_out);
+    }
+
+    for (s64 i = folder.count - 1; i >= 0 && a.name_skip == 0; i--) {
+        if (folder.data[i] == '/') a.name_skip = i + 1;
+    }
+
+    bool success = true;
+    s64 sent = 0;
+
+    for (s64 i = 0; i < count && success; i++) {
+        Archive_Entry *e = entries + i;
+
+        // The open file is what's sent, even if it's replaced in the meantime
+        profile_phase(&c->trace, PROFILE_STORAGE);
+        Storage_Reader r;
+        if (!storage_open(st, e->path, &r)) {
+            fprintf(stderr, "[archive]: Skipped %s. Error code: %lu\n", e->path, GetLastError());
+            continue;
+        }
+
+        s64 mtime = archive_unix_time(r.written);
+        if (format == ARCHIVE_ZIP) success = zip_write_entry(&a, e, &r, r.size, mtime);
+        else                       success = tar_write_entry(&a, e, &r, r.size, mtime);
+
+        if (success) {
+            e->sent = true;
+            sent += 1;
+        } else {
+            fprintf(stderr, "[archive]: #%lld: Failed to send %s. Error code: %lu\n", c->socket, e->path, GetLastError());
+        }
+        storage_close(&r);
+    }
+
+    if (success) {
+        if (format == ARCHIVE_ZIP) success = zip_write_central_directory(&a, entries, count);
+        else                       success = archive_write_zeros(&a, TAR_BLOCK_SIZE * 2);
+    }
+    if (success) success = archive_finish(&a);
+
+    printf("[archive]: #%lld: %s of '" SFMT "', %lld/%lld file(s), %lld bytes%s\n", c->socket, format == ARCHIVE_ZIP ? "zip" : "tar",
+           SARG(folder), sent, count, a.offset, success ? "" : ", cut");
+
+    free(a.buf);
+    free(a.read_buf);
+    free(a.z);
+    free(a.z_out);
+
+    return success;
+}
+
+#endif
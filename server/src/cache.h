@@ -0,0 +1,296 @@
+#ifndef H_CUPIDO_CACHE
+#define H_CUPIDO_CACHE
+
+#include "storage.h"
+
+// Fully built responses (header and body in one buffer) of the small hot objects, so a hit is
+// one send from memory. The keys are split into shards by their hash and every key has a set
+// of CACHE_WAYS slots in its shard. The objects of the same key (the variants) are always in
+// the same set, that's what makes dropping all of them on a change cheap.
+//
+// The readers don't take any lock: they announce themselves in the shard's 'readers' counter
+// while they scan the set and take a reference of the object they found. The writers (under
+// the shard lock) unlink an object and put it on the shard's 'retired' list. The table's
+// reference of the retired objects is dropped once the counter is seen at zero, by the next
+// writer or by the reader that brings it there. After that no reader can still be about to
+// take a reference, and the object is freed by whoever drops the last one. Nobody waits.
+//
+// Eviction is CLOCK: a hit sets the object's 'referenced' bit, the hand clears the set bits and
+// evicts the first object without one. One hand goes over the whole shard to keep it under its
+// byte budget, the sets have their own hands for when all the ways are taken.
+
+const int CACHE_SHARD_COUNT    = 16;
+const int CACHE_SETS_PER_SHARD = 64;
+const int CACHE_WAYS           = 8;
+const int CACHE_SHARD_SLOTS    = CACHE_SETS_PER_SHARD * CACHE_WAYS;
+
+// The limits are set by the config (and can change while running), these are the defaults
+const s64 CACHE_DEFAULT_MAX_BYTES       = BYTES_TO_MB(64);
+const s64 CACHE_DEFAULT_MAX_OBJECT_SIZE = BYTES_TO_KB(256);
+
+struct Cache_Object {
+    volatile LONG refs; // The table holds one while it's linked or retired
+    volatile LONG referenced;
+    Cache_Object *retired_next;
+
+    u64 hash;
+    u32 variant;
+    ULONGLONG expires_ms; // Zero if it's only dropped by invalidation and eviction
+
+    char *key;
+    s64 key_count;
+    char *data; // The response
+    s64 count;
+};
+
+struct Cache_Shard {
+    CRITICAL_SECTION lock; // The writers only
+    volatile LONG readers;
+    Cache_Object *volatile retired; // Unlinked, the table's references still to drop
+    volatile LONG generation; // Incremented by every invalidation
+
+    Cache_Object *volatile slots[CACHE_SHARD_SLOTS];
+    u8  set_hands[CACHE_SETS_PER_SHARD];
+    int hand;
+    s64 bytes;
+};
+
+struct Cache {
+    Cache_Shard shards[CACHE_SHARD_COUNT];
+
+    volatile s64 shard_max_bytes;
+    volatile s64 max_object_size;
+
+    volatile LONGLONG hits;
+    volatile LONGLONG misses;
+    volatile LONGLONG evictions;
+    volatile LONGLONG invalidations;
+};
+
+inline Cache_Shard *cache_shard(Cache *cache, u64 hash)
+{
+    return cache->shards + (hash >> 32) % CACHE_SHARD_COUNT;
+}
+
+inline int cache_set_first_slot(u64 hash)
+{
+    return (int)(hash % CACHE_SETS_PER_SHARD) * CACHE_WAYS;
+}
+
+inline bool cache_object_is(Cache_Object *o, u64 hash, String key)
+{
+    return o->hash == hash && string_equal(String(o->key, (u32)o->key_count), key);
+}
+
+void cache_init(Cache *cache)
+{
+    ZERO_MEMORY(cache, sizeof(Cache));
+    cache->shard_max_bytes = CACHE_DEFAULT_MAX_BYTES / CACHE_SHARD_COUNT;
+    cache->max_object_size = CACHE_DEFAULT_MAX_OBJECT_SIZE;
+    for (int i = 0; i < CACHE_SHARD_COUNT; i++) InitializeCriticalSection(&cache->shards[i].lock);
+}
+
+// The shards shrink to a lower budget on their next put.
+void cache_set_limits(Cache *cache, s64 max_bytes, s64 max_object_size)
+{
+    cache->shard_max_bytes = max_bytes / CACHE_SHARD_COUNT;
+    cache->max_object_size = max_object_size;
+}
+
+// An object with room for a 'count' bytes response, to be filled by the caller. The caller
+// owns the only reference until it's put into the cache.
+Cache_Object *cache_object_create(String key, u32 variant, s64 count, DWORD ttl_ms = 0)
+{
+    Cache_Object *o = (Cache_Object *)malloc(sizeof(Cache_Object) + key.count + count);
+    if (o == nullptr) return nullptr;
+
+    o->refs       = 1;
+    o->referenced = 0;
+    o->hash       = storage_hash(key);
+    o->variant    = variant;
+    o->expires_ms = ttl_ms ? GetTickCount64() + ttl_ms : 0;
+
+    o->key       = (char *)(o + 1);
+    o->key_count = key.count;
+    memcpy(o->key, key.data, key.count);
+
+    o->data  = o->key + key.count;
+    o->count = count;
+
+    return o;
+}
+
+inline void cache_release(Cache_Object *o)
+{
+    if (InterlockedDecrement(&o->refs) == 0) free(o);
+}
+
+// Under the shard lock. Drops the table's reference of the retired objects if no reader is
+// scanning the shard, otherwise they wait for the next call.
+void cache_drain(Cache_Shard *sh)
+{
+    if (sh->readers) return;
+
+    Cache_Object *o = sh->retired;
+    sh->retired = nullptr;
+    while (o) {
+        Cache_Object *next = o->retired_next;
+        cache_release(o);
+        o = next;
+    }
+}
+
+// Returns the object with a reference (see cache_release), or nullptr.
+Cache_Object *cache_get(Cache *cache, String key, u32 variant)
+{
+    u64 hash = storage_hash(key);
+    Cache_Shard *sh = cache_shard(cache, hash);
+    int first = cache_set_first_slot(hash);
+
+    Cache_Object *found = nullptr;
+
+    InterlockedIncrement(&sh->readers);
+    for (int i = first; i < first + CACHE_WAYS; i++) {
+        Cache_Object *o = sh->slots[i];
+        if (o && o->variant == variant && cache_object_is(o, hash, key)) {
+            InterlockedIncrement(&o->refs);
+            found = o;
+            break;
+        }
+    }
+    if (InterlockedDecrement(&sh->readers) == 0 && sh->retired && TryEnterCriticalSection(&sh->lock)) {
+        cache_drain(sh);
+        LeaveCriticalSection(&sh->lock);
+    }
+
+    if (found && found->expires_ms && GetTickCount64() >= found->expires_ms) {
+        cache_release(found);
+        found = nullptr;
+    }
+
+    if (found) {
+        found->referenced = 1;
+        InterlockedIncrement64(&cache->hits);
+    } else {
+        InterlockedIncrement64(&cache->misses);
+    }
+
+    return found;
+}
+
+// Read before building a response from the disk, the response is only cached if there was no
+// invalidation in between (see cache_put).
+inline LONG cache_generation(Cache *cache, String key)
+{
+    return cache_shard(cache, storage_hash(key))->generation;
+}
+
+// Under the shard lock.
+void cache_unlink(Cache_Shard *sh, int slot)
+{
+    Cache_Object *o = sh->slots[slot];
+    InterlockedExchangePointer((void *volatile *)&sh->slots[slot], nullptr);
+    sh->bytes -= o->key_count + o->count;
+
+    o->retired_next = sh->retired;
+    sh->retired = o;
+}
+
+// Under the shard lock. Returns the freed slot of the range, or -1 if it was empty.
+int cache_evict_one(Cache *cache, Cache_Shard *sh, int first, int count, int *hand)
+{
+    // The second round finds an object, the first one cleared all the bits
+    for (int step = 0; step < 2*count; step++) {
+        int slot = first + *hand;
+        *hand = (*hand + 1) % count;
+
+        Cache_Object *o = sh->slots[slot];
+        if (o == nullptr) continue;
+
+        if (o->referenced) {
+            o->referenced = 0;
+            continue;
+        }
+
+        cache_unlink(sh, slot);
+        InterlockedIncrement64(&cache->evictions);
+        return slot;
+    }
+
+    return -1;
+}
+
+// Links the object (the caller keeps its own reference). Nothing happens if the key was
+// invalidated since 'generation' was read, the object could be built from the old file.
+void cache_put(Cache *cache, Cache_Object *o, LONG generation)
+{
+    s64 size = o->key_count + o->count;
+    if (size > cache->max_object_size || size > cache->shard_max_bytes) return;
+
+    Cache_Shard *sh = cache_shard(cache, o->hash);
+    int first = cache_set_first_slot(o->hash);
+    String key = String(o->key, (u32)o->key_count);
+
+    EnterCriticalSection(&sh->lock);
+
+    if (sh->generation != generation) {
+        LeaveCriticalSection(&sh->lock);
+        return;
+    }
+
+    int slot = -1;
+    for (int i = first; i < first + CACHE_WAYS; i++) {
+        Cache_Object *other = sh->slots[i];
+        if (other && other->variant == o->variant && cache_object_is(other, o->hash, key)) {
+            cache_unlink(sh, i);
+            slot = i;
+            break;
+        }
+    }
+
+    while (sh->bytes + size > cache->shard_max_bytes) {
+        if (cache_evict_one(cache, sh, 0, CACHE_SHARD_SLOTS, &sh->hand) < 0) break;
+    }
+
+    for (int i = first; i < first + CACHE_WAYS && slot < 0; i++) {
+        if (sh->slots[i] == nullptr) slot = i;
+    }
+
+    if (slot < 0) {
+        int hand = sh->set_hands[first / CACHE_WAYS];
+        slot = cache_evict_one(cache, sh, first, CACHE_WAYS, &hand);
+        sh->set_hands[first / CACHE_WAYS] = (u8)hand;
+    }
+
+    InterlockedIncrement(&o->refs);
+    sh->bytes += size;
+    InterlockedExchangePointer((void *volatile *)&sh->slots[slot], o);
+
+    cache_drain(sh);
+    LeaveCriticalSection(&sh->lock);
+}
+
+// Drops every variant of the key.
+void cache_invalidate(Cache *cache, String key)
+{
+    u64 hash = storage_hash(key);
+    Cache_Shard *sh = cache_shard(cache, hash);
+    int first = cache_set_first_slot(hash);
+
+    EnterCriticalSection(&sh->lock);
+
+    InterlockedIncrement(&sh->generation);
+
+    for (int i = first; i < first + CACHE_WAYS; i++) {
+        Cache_Object *o = sh->slots[i];
+        if (o && cache_object_is(o, hash, key)) {
+            cache_unlink(sh, i);
+            InterlockedIncrement64(&cache->invalidations);
+        }
+    }
+
+    cache_drain(sh);
+    LeaveCriticalSection(&sh->lock);
+}
+
+#endif
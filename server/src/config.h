@@ -0,0 +1,345 @@
+#ifndef H_CUPIDO_CONFIG
+#define H_CUPIDO_CONFIG
+
+#include "storage.h"
+#include "scrub.h"
+#include "cache.h"
+#include "tls.h"
+#include "import.h"
+
+#include <stddef.h>
+
+// The tunables of the server: the defaults, then the config file, then the command line.
+//   server.exe [--config cupido.conf] [--name=value | --name value]...
+// The file has one "name = value" per line and '#' starts a comment. The sizes can have a K, M
+// or G suffix. Ctrl+Break (the closest thing to a SIGHUP on Windows, a service manager can
+// send it with GenerateConsoleCtrlEvent) reloads the file and applies the hot options to the
+// running server. The others, marked as "restart" in --help, need a restart.
+//
+// "server.exe --upgrade" with the same config doesn't serve, it asks the server running on the
+// port to start the (new) executable and hand its sockets over, see handoff.h.
+// "server.exe --import <dir>" doesn't serve either, it indexes the directory into the storage,
+// see import.h.
+
+#define CONFIG_DEFAULT_PATH "cupido.conf"
+
+struct Config {
+    char path[MAX_PATH];
+    bool path_given; // A missing file is only an error if it was asked for
+
+    // Applied again over the file on every reload
+    int argc;
+    char **argv;
+    
+    bool upgrade; // --upgrade
+    char import_dir[MAX_PATH]; // --import, empty if not
+
+    s64 port;
+    s64 tls_port;
+    s64 workers;
+    s64 max_clients;
+    s64 header_buffer_size; // Request line and headers
+    char storage_root[MAX_PATH];
+    char disks[MAX_PATH]; // ';' separated, empty if the files are under the storage root
+    s64 disk_parity;
+
+    s64 client_timeout_ms;
+    s64 max_request_size;
+    s64 recv_buffer_size; // Upload streaming
+    s64 cache_max_bytes;
+    s64 cache_max_object_size;
+    s64 page_cache_ttl_ms;
+    s64 scrub_bytes_per_sec;
+    s64 commit_window_ms;
+    s64 drain_timeout_ms;
+    s64 send_rate_total;
+    s64 send_rate_per_address;
+    s64 send_rate_per_connection;
+    s64 import_threads;
+    s64 import_io;
+    s64 profile_hz;
+    s64 profile_trace_every;
+};
+
+enum Config_Kind {
+    CONFIG_NUMBER,
+    CONFIG_SIZE, // A number with an optional K, M or G
+    CONFIG_PATH,
+};
+
+struct Config_Option {
+    const char *name;
+    Config_Kind kind;
+    size_t offset;
+    s64 min;
+    s64 max;
+    bool hot;
+    const char *help;
+};
+
+const Config_Option CONFIG_OPTIONS[] = {
+    { "port",                  CONFIG_NUMBER, offsetof(Config, port),                  1, 65535,               false, "HTTP port" },
+    { "tls_port",              CONFIG_NUMBER, offsetof(Config, tls_port),              1, 65535,               false, "HTTPS port (if there is a certificate)" },
+    { "workers",               CONFIG_NUMBER, offsetof(Config, workers),               1, 256,                 false, "worker threads" },
+    { "max_clients",           CONFIG_NUMBER, offsetof(Config, max_clients),           1, 65536,               false, "connections at once" },
+    { "header_buffer_size",    CONFIG_SIZE,   offsetof(Config, header_buffer_size),    1024, BYTES_TO_MB(1),   false, "per connection, the longest request header" },
+    { "storage_root",          CONFIG_PATH,   offsetof(Config, storage_root),          0, 0,                   false, "directory of the stored files" },
+    { "disks",                 CONFIG_PATH,   offsetof(Config, disks),                 0, 0,                   false, "';' separated directories, one per disk, the files are erasure-coded over them" },
+    { "disk_parity",           CONFIG_NUMBER, offsetof(Config, disk_parity),           1, ERASURE_MAX_DISKS-1, false, "disks that can fail without losing a file" },
+    { "client_timeout_ms",     CONFIG_NUMBER, offsetof(Config, client_timeout_ms),     100, 3600000,           true,  "send/receive timeout of the new connections" },
+    { "max_request_size",      CONFIG_SIZE,   offsetof(Config, max_request_size),      1, BYTES_TO_GB(1024LL), true,  "largest upload body" },
+    { "recv_buffer_size",      CONFIG_SIZE,   offsetof(Config, recv_buffer_size),      BYTES_TO_KB(16), BYTES_TO_MB(64), true, "upload receive buffer" },
+    { "cache_max_bytes",       CONFIG_SIZE,   offsetof(Config, cache_max_bytes),       0, BYTES_TO_GB(64LL),   true,  "response cache budget" },
+    { "cache_max_object_size", CONFIG_SIZE,   offsetof(Config, cache_max_object_size), 0, BYTES_TO_MB(64),     true,  "largest cached response" },
+    { "page_cache_ttl_ms",     CONFIG_NUMBER, offsetof(Config, page_cache_ttl_ms),     0, 3600000,             true,  "how long index.html is cached" },
+    { "scrub_bytes_per_sec",   CONFIG_SIZE,   offsetof(Config, scrub_bytes_per_sec),   BYTES_TO_KB(64), BYTES_TO_GB(64LL), true, "scrubber read bandwidth" },
+    { "commit_window_ms",      CONFIG_NUMBER, offsetof(Config, commit_window_ms),      0, 1000,                true,  "group commit window of the uploads" },
+    { "drain_timeout_ms",      CONFIG_NUMBER, offsetof(Config, drain_timeout_ms),      0, 86400000,            true,  "on exit, how long the requests in flight can finish" },
+    { "send_rate_total",          CONFIG_SIZE, offsetof(Config, send_rate_total),          0, BYTES_TO_GB(100LL), true, "bytes/s of the uplink, shared fairly by the client addresses (0: no limit)" },
+    { "send_rate_per_address",    CONFIG_SIZE, offsetof(Config, send_rate_per_address),    0, BYTES_TO_GB(100LL), true, "bytes/s of a client address, all its connections (0: no limit)" },
+    { "send_rate_per_connection", CONFIG_SIZE, offsetof(Config, send_rate_per_connection), 0, BYTES_TO_GB(100LL), true, "bytes/s of a connection (0: no limit)" },
+    { "import_threads",        CONFIG_NUMBER, offsetof(Config, import_threads),        0, IMPORT_MAX_THREADS,  false, "--import workers (0: one per processor)" },
+    { "import_io",             CONFIG_NUMBER, offsetof(Config, import_io),             1, 256,                 false, "--import file reads at once" },
+    { "profile_hz",            CONFIG_NUMBER, offsetof(Config, profile_hz),            0, 1000,                true,  "stack samples per second of the busy workers, see /profile (0: off)" },
+    { "profile_trace_every",   CONFIG_NUMBER, offsetof(Config, profile_trace_every),   0, 1000000,             true,  "with the profiler on, 1 request in N gets its phases timed, see /profile/requests (0: none)" },
+};
+
+void config_defaults(Config *cfg)
+{
+    ZERO_MEMORY(cfg, sizeof(Config));
+    snprintf(cfg->path, MAX_PATH, "%s", CONFIG_DEFAULT_PATH);
+    snprintf(cfg->storage_root, MAX_PATH, "%s", STORAGE_DEFAULT_ROOT);
+
+    cfg->port                  = 6969;
+    cfg->tls_port              = TLS_DEFAULT_PORT;
+    cfg->workers               = 8;
+    cfg->max_clients           = 128;
+    cfg->header_buffer_size    = BYTES_TO_KB(4);
+    cfg->disk_parity           = 1;
+    cfg->client_timeout_ms     = 30000;
+    cfg->max_request_size      = BYTES_TO_GB(16LL);
+    cfg->recv_buffer_size      = BYTES_TO_KB(256);
+    cfg->cache_max_bytes       = CACHE_DEFAULT_MAX_BYTES;
+    cfg->cache_max_object_size = CACHE_DEFAULT_MAX_OBJECT_SIZE;
+    cfg->page_cache_ttl_ms     = 1000;
+    cfg->scrub_bytes_per_sec   = SCRUB_DEFAULT_BYTES_PER_SEC;
+    cfg->commit_window_ms      = STORAGE_DEFAULT_COMMIT_WINDOW_MS;
+    cfg->drain_timeout_ms      = 600000;
+    cfg->import_io             = IMPORT_DEFAULT_IO;
+    cfg->profile_trace_every   = 64;
+}
+
+inline s64 *config_number(Config *cfg, const Config_Option *opt)
+{
+    return (s64 *)((char *)cfg + opt->offset);
+}
+
+const Config_Option *config_find_option(String name)
+{
+    for (int i = 0; i < ARRAY_SIZE(CONFIG_OPTIONS); i++) {
+        if (string_equal(name, String(CONFIG_OPTIONS[i].name))) return CONFIG_OPTIONS + i;
+    }
+
+    return nullptr;
+}
+
+bool config_parse_number(String s, bool with_suffix, s64 *out)
+{
+    s64 n = 0;
+    s64 i = 0;
+    for (; i < s.count && s.data[i] >= '0' && s.data[i] <= '9'; i++) {
+        if (n > LLONG_MAX / 10 - 10) return false;
+        n = n*10 + (s.data[i] - '0');
+    }
+    if (i == 0) return false;
+
+    if (with_suffix && i < s.count) {
+        s64 scale = 0;
+        switch (s.data[i]) {
+            case 'k': case 'K': scale = BYTES_TO_KB(1LL); break;
+            case 'm': case 'M': scale = BYTES_TO_MB(1LL); break;
+            case 'g': case 'G': scale = BYTES_TO_GB(1LL); break;
+        }
+        if (scale == 0 || n > LLONG_MAX / scale) return false;
+
+        n *= scale;
+        i += 1;
+    }
+
+    if (i != s.count) return false;
+
+    *out = n;
+    return true;
+}
+
+inline String config_trim(String s)
+{
+    while (s.count && (s.data[0] == ' ' || s.data[0] == '\t')) advance(&s, 1);
+    while (s.count && (s.data[s.count-1] == ' ' || s.data[s.count-1] == '\t' || s.data[s.count-1] == '\r' || s.data[s.count-1] == '\n')) s.count -= 1;
+    return s;
+}
+
+// 'where' is the file and line or the command line argument, for the error message.
+bool config_set(Config *cfg, String name, String value, const char *where)
+{
+    const Config_Option *opt = config_find_option(name);
+    if (opt == nullptr) {
+        fprintf(stderr, "[config]: %s: Unknown option '" SFMT "'\n", where, SARG(name));
+        return false;
+    }
+
+    if (opt->kind == CONFIG_PATH) {
+        if (value.count == 0 || value.count >= MAX_PATH) {
+            fprintf(stderr, "[config]: %s: Invalid path for '%s'\n", where, opt->name);
+            return false;
+        }
+
+        char *dest = (char *)cfg + opt->offset;
+        memcpy(dest, value.data, value.count);
+        dest[value.count] = '\0';
+        return true;
+    }
+
+    s64 n = 0;
+    if (!config_parse_number(value, opt->kind == CONFIG_SIZE, &n) || n < opt->min || n > opt->max) {
+        fprintf(stderr, "[config]: %s: '%s' must be between %lld and %lld, got '" SFMT "'\n", where, opt->name, opt->min, opt->max, SARG(value));
+        return false;
+    }
+
+    *config_number(cfg, opt) = n;
+    return true;
+}
+
+bool config_load_file(Config *cfg)
+{
+    FILE *fp = fopen(cfg->path, "rb");
+    if (fp == nullptr) {
+        if (!cfg->path_given) return true;
+
+        fprintf(stderr, "[config]: Failed to open %s; errno: %d\n", cfg->path, errno);
+        return false;
+    }
+
+    bool success = true;
+    char line_buf[1024];
+    int line_number = 0;
+
+    while (fgets(line_buf, sizeof(line_buf), fp)) {
+        line_number += 1;
+
+        String line = String(line_buf, (u32)strlen(line_buf));
+        bool found = false;
+        line = split(line, "#", nullptr, &found);
+        line = config_trim(line);
+        if (line.count == 0) continue;
+
+        char where[MAX_PATH + 16];
+        snprintf(where, sizeof(where), "%s:%d", cfg->path, line_number);
+
+        String value;
+        String name = config_trim(split(line, "=", &value, &found));
+        if (!found) {
+            fprintf(stderr, "[config]: %s: Expected 'name = value'\n", where);
+            success = false;
+            continue;
+        }
+
+        if (!config_set(cfg, name, config_trim(value), where)) success = false;
+    }
+
+    fclose(fp);
+    return success;
+}
+
+void config_print_usage(char *program)
+{
+    Config d;
+    config_defaults(&d);
+
+    printf("Usage: %s [--config <file>] [--<option>=<value>]... [--upgrade | --import <dir>]\n\n", program);
+    printf("--upgrade hands the sockets of the server running on the port to a new process.\n");
+    printf("--import indexes the files of the directory into the storage (copied, unless it's the storage root).\n\n");
+    printf("The options (also the names in the config file, '%s' by default):\n", CONFIG_DEFAULT_PATH);
+    for (int i = 0; i < ARRAY_SIZE(CONFIG_OPTIONS); i++) {
+        const Config_Option *opt = CONFIG_OPTIONS + i;
+        if (opt->kind == CONFIG_PATH) {
+            printf("  %-22s %-8s %s (default: %s)\n", opt->name, opt->hot ? "" : "restart", opt->help, (char *)&d + opt->offset);
+        } else {
+            printf("  %-22s %-8s %s (default: %lld)\n", opt->name, opt->hot ? "" : "restart", opt->help, *config_number(&d, opt));
+        }
+    }
+}
+
+// The defaults, then the file, then the command line. Returns false on any invalid option,
+// 'help' is set on --help.
+bool config_load(Config *cfg, int argc, char **argv, bool *help = nullptr)
+{
+    config_defaults(cfg);
+    cfg->argc = argc;
+    cfg->argv = argv;
+
+    // The file has to be known before the rest of the arguments are applied over it
+    for (int i = 1; i < argc; i++) {
+        String arg = String(argv[i]);
+        if (arg == "--config" && i+1 < argc) {
+            snprintf(cfg->path, MAX_PATH, "%s", argv[i+1]);
+            cfg->path_given = true;
+        } else if (string_starts_with(arg, "--config=")) {
+            snprintf(cfg->path, MAX_PATH, "%s", argv[i] + strlen("--config="));
+            cfg->path_given = true;
+        }
+    }
+
+    bool success = config_load_file(cfg);
+
+    for (int i = 1; i < argc; i++) {
+        String arg = String(argv[i]);
+
+        if (arg == "--help" || arg == "-h") {
+            if (help) *help = true;
+            continue;
+        }
+        
+        if (arg == "--upgrade") {
+            cfg->upgrade = true;
+            continue;
+        }
+
+        if (arg == "--import" || string_starts_with(arg, "--import=")) {
+            char *dir = arg == "--import" ? (i+1 < argc ? argv[++i] : nullptr) : argv[i] + strlen("--import=");
+            if (dir == nullptr || dir[0] == '\0' || strlen(dir) >= MAX_PATH) {
+                fprintf(stderr, "[config]: Missing the directory of '--import'\n");
+                success = false;
+                continue;
+            }
+            snprintf(cfg->import_dir, MAX_PATH, "%s", dir);
+            continue;
+        }
+
+        if (!string_starts_with(arg, "--")) {
+            fprintf(stderr, "[config]: Unexpected argument '%s'\n", argv[i]);
+            success = false;
+            continue;
+        }
+        advance(&arg, 2);
+
+        bool found = false;
+        String value;
+        String name = split(arg, "=", &value, &found);
+        if (!found) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "[config]: Missing the value of '%s'\n", argv[i]);
+                success = false;
+                continue;
+            }
+            value = String(argv[++i]);
+        }
+
+        if (name == "config") continue;
+        if (!config_set(cfg, name, value, "command line")) success = false;
+    }
+
+    return success;
+}
+
+#endif
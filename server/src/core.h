@@ -4,11 +4,13 @@
 #define __STDC_WANT_LIB_EXT1__ 1
 
 #include <assert.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <winsock2.h>
+#include <mswsock.h>
 
 #include <iostream>
 
@@ -17,12 +19,12 @@
 typedef char s8;
 typedef short s16;
 typedef int s32;
-typedef long s64;
+typedef long long s64;
 
 typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned int u32;
-typedef unsigned long u64;
+typedef unsigned long long u64;
 
 #define COLOR_DEFAULT "\033[0m"
 #define COLOR_RED "\033[0;31m"
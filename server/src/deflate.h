@@ -0,0 +1,191 @@
+#ifndef H_CUPIDO_DEFLATE
+#define H_CUPIDO_DEFLATE
+
+#include "core.h"
+
+// Raw DEFLATE (RFC 1951) for the ZIP downloads. The input is compressed one block at a time
+// with greedy LZ77 over the 32 KB window (hash chains) and the fixed Huffman codes. A block that
+// doesn't get smaller that way goes out as a stored block, that's most of a photo. The state
+// is a fixed size, whatever the length of the input.
+
+const s64 DEFLATE_WINDOW    = BYTES_TO_KB(32);
+const s64 DEFLATE_BLOCK     = BYTES_TO_KB(32); // Input per deflate_block(), a stored block holds 64K at most
+const s64 DEFLATE_OUT_SIZE  = DEFLATE_BLOCK * 9 / 8 + 64; // All literals of 9 bits, the block headers
+const int DEFLATE_HASH_BITS = 15;
+const int DEFLATE_MAX_CHAIN = 32;
+const int DEFLATE_MIN_MATCH = 3;
+const int DEFLATE_MAX_MATCH = 258;
+
+struct Deflate {
+    // The window and the block being compressed. The positions in 'head' and 'prev' are
+    // indices of this buffer, -1 if none.
+    u8  buf[DEFLATE_WINDOW + DEFLATE_BLOCK];
+    s64 count;
+    s32 head[1 << DEFLATE_HASH_BITS];
+    s32 prev[DEFLATE_WINDOW];
+
+    u64 bits;
+    int bit_count;
+};
+
+static const u16 DEFLATE_LENGTH_BASE[29]  = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const u8  DEFLATE_LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const u16 DEFLATE_DIST_BASE[30]    = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const u8  DEFLATE_DIST_EXTRA[30]   = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+void deflate_init(Deflate *d)
+{
+    d->count = 0;
+    d->bits = 0;
+    d->bit_count = 0;
+    for (s64 i = 0; i < ARRAY_SIZE(d->head); i++) d->head[i] = -1;
+    for (s64 i = 0; i < ARRAY_SIZE(d->prev); i++) d->prev[i] = -1;
+}
+
+// The bits go out from the least significant one, full bytes are written to 'out'.
+inline void deflate_put_bits(Deflate *d, u8 *out, s64 *w, u32 value, int count)
+{
+    d->bits |= (u64)value << d->bit_count;
+    d->bit_count += count;
+    while (d->bit_count >= 8) {
+        out[(*w)++] = (u8)d->bits;
+        d->bits >>= 8;
+        d->bit_count -= 8;
+    }
+}
+
+// The Huffman codes are defined from the most significant bit.
+inline void deflate_put_code(Deflate *d, u8 *out, s64 *w, u32 code, int count)
+{
+    u32 reversed = 0;
+    for (int i = 0; i < count; i++) reversed |= ((code >> i) & 1) << (count - 1 - i);
+    deflate_put_bits(d, out, w, reversed, count);
+}
+
+void deflate_put_literal(Deflate *d, u8 *out, s64 *w, int symbol)
+{
+    if      (symbol < 144) deflate_put_code(d, out, w, 0x30 + symbol, 8);
+    else if (symbol < 256) deflate_put_code(d, out, w, 0x190 + symbol - 144, 9);
+    else if (symbol < 280) deflate_put_code(d, out, w, symbol - 256, 7);
+    else                   deflate_put_code(d, out, w, 0xC0 + symbol - 280, 8);
+}
+
+void deflate_put_match(Deflate *d, u8 *out, s64 *w, int length, int distance)
+{
+    int l = 28;
+    while (DEFLATE_LENGTH_BASE[l] > length) l--;
+    deflate_put_literal(d, out, w, 257 + l);
+    deflate_put_bits(d, out, w, length - DEFLATE_LENGTH_BASE[l], DEFLATE_LENGTH_EXTRA[l]);
+
+    int k = 29;
+    while (DEFLATE_DIST_BASE[k] > distance) k--;
+    deflate_put_code(d, out, w, k, 5);
+    deflate_put_bits(d, out, w, distance - DEFLATE_DIST_BASE[k], DEFLATE_DIST_EXTRA[k]);
+}
+
+inline u32 deflate_hash(u8 *p)
+{
+    u32 v = (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16);
+    return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+// Keeps the last DEFLATE_WINDOW bytes at the start of the buffer.
+void deflate_slide(Deflate *d)
+{
+    s64 shift = d->count - DEFLATE_WINDOW;
+    if (shift <= 0) return;
+
+    memmove(d->buf, d->buf + shift, DEFLATE_WINDOW);
+    d->count = DEFLATE_WINDOW;
+
+    for (s64 i = 0; i < ARRAY_SIZE(d->head); i++) d->head[i] = d->head[i] >= shift ? (s32)(d->head[i] - shift) : -1;
+    for (s64 i = 0; i < ARRAY_SIZE(d->prev); i++) d->prev[i] = d->prev[i] >= shift ? (s32)(d->prev[i] - shift) : -1;
+}
+
+// Compresses the next 'count' (at most DEFLATE_BLOCK) bytes of the input into 'out', which has
+// to have DEFLATE_OUT_SIZE bytes. Returns the bytes written. The last block has to be marked,
+// it can be empty.
+s64 deflate_block(Deflate *d, u8 *data, s64 count, bool last, u8 *out)
+{
+    assert(count <= DEFLATE_BLOCK);
+
+    if (d->count + count > ARRAY_SIZE(d->buf)) deflate_slide(d);
+    s64 start = d->count;
+    memcpy(d->buf + start, data, count);
+    d->count += count;
+
+    s64 w = 0;
+    u64 saved_bits = d->bits;
+    int saved_bit_count = d->bit_count;
+
+    // A fixed Huffman block first
+    deflate_put_bits(d, out, &w, last ? 1 : 0, 1);
+    deflate_put_bits(d, out, &w, 1, 2);
+
+    s64 end = d->count;
+    for (s64 p = start; p < end;) {
+        int best_length = 0;
+        s64 best_distance = 0;
+
+        if (p + DEFLATE_MIN_MATCH <= end) {
+            u32 h = deflate_hash(d->buf + p);
+            s64 max_length = end - p < DEFLATE_MAX_MATCH ? end - p : DEFLATE_MAX_MATCH;
+
+            s32 candidate = d->head[h];
+            for (int chain = 0; candidate >= 0 && chain < DEFLATE_MAX_CHAIN; chain++) {
+                if (p - candidate > DEFLATE_WINDOW) break;
+
+                int length = 0;
+                while (length < max_length && d->buf[candidate + length] == d->buf[p + length]) length++;
+                if (length > best_length) {
+                    best_length = length;
+                    best_distance = p - candidate;
+                    if (length == max_length) break;
+                }
+
+                s32 next = d->prev[candidate & (DEFLATE_WINDOW-1)];
+                if (next >= candidate) break; // The slot was reused by a newer position
+                candidate = next;
+            }
+        }
+
+        s64 advance_by = 1;
+        if (best_length >= DEFLATE_MIN_MATCH) {
+            deflate_put_match(d, out, &w, best_length, (int)best_distance);
+            advance_by = best_length;
+        } else {
+            deflate_put_literal(d, out, &w, d->buf[p]);
+        }
+
+        for (s64 i = 0; i < advance_by; i++, p++) {
+            if (p + DEFLATE_MIN_MATCH > end) continue;
+
+            u32 h = deflate_hash(d->buf + p);
+            d->prev[p & (DEFLATE_WINDOW-1)] = d->head[h];
+            d->head[h] = (s32)p;
+        }
+    }
+    deflate_put_literal(d, out, &w, 256); // End of the block
+
+    // Stored instead if it didn't get smaller: the header bits, the byte boundary, the length and its complement
+    if (w > count + 5) {
+        w = 0;
+        d->bits = saved_bits;
+        d->bit_count = saved_bit_count;
+
+        deflate_put_bits(d, out, &w, last ? 1 : 0, 1);
+        deflate_put_bits(d, out, &w, 0, 2);
+        if (d->bit_count) deflate_put_bits(d, out, &w, 0, 8 - d->bit_count);
+
+        deflate_put_bits(d, out, &w, (u32)count, 16);
+        deflate_put_bits(d, out, &w, (u32)count ^ 0xFFFF, 16);
+        memcpy(out + w, data, count);
+        w += count;
+    }
+
+    if (last && d->bit_count) deflate_put_bits(d, out, &w, 0, 8 - d->bit_count);
+
+    return w;
+}
+
+#endif
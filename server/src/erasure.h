@@ -0,0 +1,1002 @@
+#ifndef H_CUPIDO_ERASURE
+#define H_CUPIDO_ERASURE
+
+#include "core.h"
+#include "sha256.h"
+
+#ifdef _MSC_VER
+#define GF_SSSE3_TARGET
+#define CRC_SSE42_TARGET
+#else
+#define GF_SSSE3_TARGET __attribute__((target("ssse3")))
+#define CRC_SSE42_TARGET __attribute__((target("sse4.2")))
+#endif
+
+// The files erasure-coded over several disks (see the 'disks' option). A file is cut into
+// k = disks - parity data shards and 'parity' Reed-Solomon shards, one on every disk, at the
+// same relative path:
+//   <disk>/<path>           -> the header (the layout, size and digest of the file), the
+//                              stripes, then the CRC-32C of every unit of the shard
+//   <disk>/.tmp/            -> the shards being written, renamed into place once all of them are
+//   <disk>/.tmp/cupido-disk -> "slot i of n, parity m", written when the disk has all of its
+//                              shards. In the .tmp, where the clients can't upload.
+// A stripe is one unit (at most 64 KB, see erasure_unit_for) of every shard: k units of the file
+// and their parity. Any k shards give the file back, so 'parity' disks can fail. The first
+// shard of a file goes on the disk its path hashes to, the parity isn't all on the last disks.
+//
+// The parity rows are a Cauchy matrix over GF(2^8), so any k rows of [identity; parity] can be
+// inverted. The multiply-add of a unit by a constant does 16 bytes at once with PSHUFB: the
+// products of the low and the high 4 bits of a byte are two 16 byte tables.
+//
+// A read gets the k data shards of a few stripes from the disks at once (overlapped I/O) and
+// checks their units against the checksums. A missing or unreadable shard, or one with a unit
+// that doesn't match, is replaced by a parity one and decoded. The scrubber rewrites those
+// (see erasure_repair). A disk without its marker
+// (a new or a replaced one) is filled in by the rebuild (see storage_rebuild_thread), the files
+// uploaded meanwhile get their shard on it anyway.
+
+bool storage_make_dir(char *path);
+bool storage_make_parent_dirs(char *full_path);
+bool storage_read_all(HANDLE h, char *data, s64 count);
+inline u64 storage_hash(String s);
+
+const int ERASURE_MAX_DISKS   = 16;
+const s64 ERASURE_UNIT        = BYTES_TO_KB(64);
+const s64 ERASURE_UNIT_ALIGN  = 64;
+const s64 ERASURE_IO_SIZE     = BYTES_TO_KB(256); // Per disk and read (or write), a few stripes
+const s64 ERASURE_HEADER_SIZE = 128;
+const s64 ERASURE_CRC_SIZE    = 4;
+const u32 ERASURE_VERSION     = 2; // 2: the checksums of the units
+
+#define ERASURE_MAGIC   "CUPIDOEC"
+#define ERASURE_TMP_DIR ".tmp"
+#define ERASURE_MARKER  ERASURE_TMP_DIR "/cupido-disk"
+
+// At the start of every shard, padded to ERASURE_HEADER_SIZE.
+struct Erasure_Header {
+    char magic[8];
+    u32 version;
+    u8  data_shards;
+    u8  parity_shards;
+    u8  shard;
+    u8  reserved;
+    s64 unit;
+    s64 size;
+    u64 written; // FILETIME of the upload
+    u8  digest[SHA256_DIGEST_SIZE]; // Of the file, the shards of one upload have the same
+};
+
+struct Erasure_Set {
+    char disks[ERASURE_MAX_DISKS][MAX_PATH];
+    bool online[ERASURE_MAX_DISKS];
+    bool complete[ERASURE_MAX_DISKS]; // Has its marker
+    int disk_count;
+    int data_shards;
+    int parity_shards;
+
+    // Around the renames of the shards into place, a rebuild doesn't put an old shard over the
+    // one of a new upload
+    CRITICAL_SECTION put_lock;
+    volatile LONG tmp_counter;
+
+    HANDLE rebuilder;
+    volatile LONG rebuilding;
+
+    volatile LONGLONG reads;
+    volatile LONGLONG degraded_reads;
+    volatile LONGLONG checksum_failures;
+    volatile LONGLONG rebuilt_shards;
+    volatile LONGLONG lost_files;
+};
+
+// A file opened from its shards.
+struct Erasure_Reader {
+    Erasure_Set *set;
+    Erasure_Header header;
+    HANDLE shards[ERASURE_MAX_DISKS]; // By shard, INVALID_HANDLE_VALUE if missing, damaged or of another upload
+    HANDLE events[ERASURE_MAX_DISKS];
+    int present;
+    bool damaged[ERASURE_MAX_DISKS]; // Dropped because a unit didn't match its checksum
+
+    // The units of every shard from 'first_stripe' on, the missing data units decoded
+    u8 *units[ERASURE_MAX_DISKS];
+    u32 *crcs; // Of one shard's units, read from its trailer
+    s64 batch_stripes;
+    s64 first_stripe;
+    s64 stripe_count;
+
+    s64 position;
+    bool degraded;
+};
+
+struct Gf_Tables {
+    u8 exp[512]; // Twice, the sum of two logarithms needs no modulo
+    u8 log[256];
+};
+
+// GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1, the generator is 2.
+constexpr Gf_Tables gf_build()
+{
+    Gf_Tables t = {};
+    u32 x = 1;
+    for (int i = 0; i < 255; i++) {
+        t.exp[i]       = (u8)x;
+        t.exp[i + 255] = (u8)x;
+        t.log[x]       = (u8)i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11D;
+    }
+    return t;
+}
+
+static constexpr Gf_Tables GF = gf_build();
+
+inline u8 gf_mul(u8 a, u8 b)
+{
+    if (a == 0 || b == 0) return 0;
+    return GF.exp[GF.log[a] + GF.log[b]];
+}
+
+inline u8 gf_inv(u8 a)
+{
+    return GF.exp[255 - GF.log[a]];
+}
+
+// dst ^= c * src
+void gf_mul_add_scalar(u8 *dst, u8 *src, u8 c, s64 count)
+{
+    if (c == 0) return;
+
+    int log_c = GF.log[c];
+    for (s64 i = 0; i < count; i++) {
+        if (src[i]) dst[i] ^= GF.exp[GF.log[src[i]] + log_c];
+    }
+}
+
+GF_SSSE3_TARGET void gf_mul_add_ssse3(u8 *dst, u8 *src, u8 c, s64 count)
+{
+    if (c == 0) return;
+
+    u8 low[16], high[16];
+    for (int i = 0; i < 16; i++) {
+        low[i]  = gf_mul(c, (u8)i);
+        high[i] = gf_mul(c, (u8)(i << 4));
+    }
+
+    __m128i low_table  = _mm_loadu_si128((__m128i *)low);
+    __m128i high_table = _mm_loadu_si128((__m128i *)high);
+    __m128i mask       = _mm_set1_epi8(0x0F);
+
+    s64 i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i x  = _mm_loadu_si128((__m128i *)(src + i));
+        __m128i lo = _mm_and_si128(x, mask);
+        __m128i hi = _mm_and_si128(_mm_srli_epi64(x, 4), mask);
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(low_table, lo), _mm_shuffle_epi8(high_table, hi));
+
+        __m128i d = _mm_loadu_si128((__m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, product));
+    }
+
+    gf_mul_add_scalar(dst + i, src + i, c, count - i);
+}
+
+bool gf_cpu_has_ssse3()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] >> 9) & 1;
+#else
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+    return (c >> 9) & 1;
+#endif
+}
+
+typedef void (*Gf_Mul_Add_Proc)(u8 *dst, u8 *src, u8 c, s64 count);
+static Gf_Mul_Add_Proc gf_mul_add = nullptr;
+
+struct Crc32c_Table {
+    u32 v[256];
+};
+
+// CRC-32C (Castagnoli), the one SSE 4.2 has an instruction for.
+constexpr Crc32c_Table crc32c_build()
+{
+    Crc32c_Table t = {};
+    for (u32 i = 0; i < 256; i++) {
+        u32 c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0x82F63B78 ^ (c >> 1) : c >> 1;
+        t.v[i] = c;
+    }
+    return t;
+}
+
+static constexpr Crc32c_Table CRC32C_TABLE = crc32c_build();
+
+u32 crc32c_scalar(u8 *data, s64 count)
+{
+    u32 crc = 0xFFFFFFFF;
+    for (s64 i = 0; i < count; i++) crc = CRC32C_TABLE.v[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+CRC_SSE42_TARGET u32 crc32c_sse42(u8 *data, s64 count)
+{
+    u64 crc = 0xFFFFFFFF;
+
+    s64 i = 0;
+    for (; i + 8 <= count; i += 8) {
+        u64 word;
+        memcpy(&word, data + i, 8);
+        crc = _mm_crc32_u64(crc, word);
+    }
+    for (; i < count; i++) crc = _mm_crc32_u8((u32)crc, data[i]);
+
+    return ~(u32)crc;
+}
+
+bool crc_cpu_has_sse42()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] >> 20) & 1;
+#else
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+    return (c >> 20) & 1;
+#endif
+}
+
+typedef u32 (*Crc32c_Proc)(u8 *data, s64 count);
+static Crc32c_Proc erasure_crc = nullptr;
+
+// Inverts the n x n 'm' into 'inverse' (Gauss-Jordan), 'm' is overwritten.
+bool gf_invert(u8 *m, u8 *inverse, int n)
+{
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) inverse[i*n + j] = i == j;
+    }
+
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        while (pivot < n && m[pivot*n + col] == 0) pivot++;
+        if (pivot == n) return false;
+
+        if (pivot != col) {
+            for (int j = 0; j < n; j++) {
+                u8 t = m[col*n + j];       m[col*n + j] = m[pivot*n + j];             m[pivot*n + j] = t;
+                t = inverse[col*n + j];    inverse[col*n + j] = inverse[pivot*n + j]; inverse[pivot*n + j] = t;
+            }
+        }
+
+        u8 scale = gf_inv(m[col*n + col]);
+        for (int j = 0; j < n; j++) {
+            m[col*n + j]       = gf_mul(m[col*n + j], scale);
+            inverse[col*n + j] = gf_mul(inverse[col*n + j], scale);
+        }
+
+        for (int i = 0; i < n; i++) {
+            u8 f = m[i*n + col];
+            if (i == col || f == 0) continue;
+            for (int j = 0; j < n; j++) {
+                m[i*n + j]       ^= gf_mul(f, m[col*n + j]);
+                inverse[i*n + j] ^= gf_mul(f, inverse[col*n + j]);
+            }
+        }
+    }
+
+    return true;
+}
+
+// 1 / (x_r + y_c) with x_r = k + r and y_c = c, all of them different.
+inline u8 erasure_parity_coefficient(int data_shards, int parity_row, int column)
+{
+    return gf_inv((u8)((data_shards + parity_row) ^ column));
+}
+
+// The parity shards marked in 'only' (all of them without it) from the data shards.
+void erasure_encode(int k, int m, u8 **units, s64 count, bool *only = nullptr)
+{
+    for (int r = 0; r < m; r++) {
+        if (only && !only[k + r]) continue;
+
+        memset(units[k + r], 0, count);
+        for (int c = 0; c < k; c++) gf_mul_add(units[k + r], units[c], erasure_parity_coefficient(k, r, c), count);
+    }
+}
+
+// The data shards that aren't 'present' from the first k that are.
+bool erasure_decode(int k, int m, u8 **units, bool *present, s64 count)
+{
+    int sources[ERASURE_MAX_DISKS];
+    int source_count = 0;
+    for (int s = 0; s < k + m && source_count < k; s++) {
+        if (present[s]) sources[source_count++] = s;
+    }
+    if (source_count < k) return false;
+
+    // The rows of [identity; parity] of the sources, inverted
+    u8 matrix[ERASURE_MAX_DISKS * ERASURE_MAX_DISKS];
+    u8 inverse[ERASURE_MAX_DISKS * ERASURE_MAX_DISKS];
+    for (int i = 0; i < k; i++) {
+        int s = sources[i];
+        for (int c = 0; c < k; c++) matrix[i*k + c] = s < k ? (s == c) : erasure_parity_coefficient(k, s - k, c);
+    }
+    if (!gf_invert(matrix, inverse, k)) return false;
+
+    for (int d = 0; d < k; d++) {
+        if (present[d]) continue;
+
+        memset(units[d], 0, count);
+        for (int i = 0; i < k; i++) gf_mul_add(units[d], units[sources[i]], inverse[d*k + i], count);
+    }
+
+    return true;
+}
+
+inline int erasure_disk_of(Erasure_Set *set, char *rel_path, int shard)
+{
+    return (int)((storage_hash(String(rel_path)) + shard) % set->disk_count);
+}
+
+// The file spread evenly over the fewest stripes of at most ERASURE_UNIT, so the last stripe
+// isn't mostly padding: a 90 KB file over 2 data shards is 1 stripe of 45 KB units, not 64 KB.
+inline s64 erasure_unit_for(s64 size, int data_shards)
+{
+    s64 stripe_size = ERASURE_UNIT * data_shards;
+    s64 stripes = (size + stripe_size - 1) / stripe_size;
+    if (stripes == 0) stripes = 1;
+
+    s64 unit = (size + stripes * data_shards - 1) / (stripes * data_shards);
+    unit = (unit + ERASURE_UNIT_ALIGN - 1) / ERASURE_UNIT_ALIGN * ERASURE_UNIT_ALIGN;
+
+    return unit ? unit : ERASURE_UNIT_ALIGN;
+}
+
+inline s64 erasure_stripe_count(Erasure_Header *h)
+{
+    s64 stripe_size = h->unit * h->data_shards;
+    return (h->size + stripe_size - 1) / stripe_size;
+}
+
+// Where the checksums start, one per stripe.
+inline s64 erasure_trailer_offset(Erasure_Header *h)
+{
+    return ERASURE_HEADER_SIZE + erasure_stripe_count(h) * h->unit;
+}
+
+// One overlapped read or write at 'offset', erasure_io_wait() waits for it. The handle has to be
+// opened with FILE_FLAG_OVERLAPPED.
+bool erasure_io_start(HANDLE h, HANDLE event, OVERLAPPED *ov, bool write, void *data, s64 count, s64 offset)
+{
+    ZERO_MEMORY(ov, sizeof(OVERLAPPED));
+    ov->Offset     = (DWORD)offset;
+    ov->OffsetHigh = (DWORD)(offset >> 32);
+    ov->hEvent     = event;
+
+    BOOL ok = write ? WriteFile(h, data, (DWORD)count, NULL, ov) : ReadFile(h, data, (DWORD)count, NULL, ov);
+    return ok || GetLastError() == ERROR_IO_PENDING;
+}
+
+bool erasure_io_wait(HANDLE h, OVERLAPPED *ov, s64 count)
+{
+    DWORD done = 0;
+    return GetOverlappedResult(h, ov, &done, TRUE) && done == (DWORD)count;
+}
+
+bool erasure_header_valid(Erasure_Set *set, Erasure_Header *h, int shard, HANDLE file)
+{
+    if (memcmp(h->magic, ERASURE_MAGIC, 8) != 0 || h->version != ERASURE_VERSION) return false;
+    if (h->data_shards != set->data_shards || h->parity_shards != set->parity_shards || h->shard != shard) return false;
+    if (h->unit < ERASURE_UNIT_ALIGN || h->unit > ERASURE_UNIT || h->unit % ERASURE_UNIT_ALIGN || h->size < 0) return false;
+
+    // A torn write leaves it short
+    LARGE_INTEGER size;
+    return GetFileSizeEx(file, &size) && size.QuadPart == erasure_trailer_offset(h) + erasure_stripe_count(h) * ERASURE_CRC_SIZE;
+}
+
+void erasure_close(Erasure_Reader *r)
+{
+    for (int s = 0; s < ERASURE_MAX_DISKS; s++) {
+        if (r->shards[s] != INVALID_HANDLE_VALUE && r->shards[s] != NULL) CloseHandle(r->shards[s]);
+        if (r->events[s]) CloseHandle(r->events[s]);
+        r->shards[s] = INVALID_HANDLE_VALUE;
+        r->events[s] = NULL;
+    }
+
+    free(r->units[0]); // One block for all of them and the checksums
+    ZERO_MEMORY(r->units, sizeof(r->units));
+    r->crcs = nullptr;
+}
+
+inline void erasure_drop_shard(Erasure_Reader *r, int shard)
+{
+    CloseHandle(r->shards[shard]);
+    r->shards[shard] = INVALID_HANDLE_VALUE;
+    r->present -= 1;
+}
+
+// Opens the shards of the file and keeps the ones of the upload most of them are from. Returns
+// how many those are: fewer than the data shards can't be read, 0 is a file not on the disks.
+// The shards marked in 'exclude' are left out, as if they were missing.
+int erasure_open(Erasure_Set *set, char *rel_path, Erasure_Reader *r, bool *exclude = nullptr)
+{
+    ZERO_MEMORY(r, sizeof(Erasure_Reader));
+    r->set = set;
+
+    int n = set->disk_count;
+    Erasure_Header headers[ERASURE_MAX_DISKS];
+    OVERLAPPED ov[ERASURE_MAX_DISKS];
+    bool started[ERASURE_MAX_DISKS] = {};
+    bool valid[ERASURE_MAX_DISKS] = {};
+
+    for (int s = 0; s < ERASURE_MAX_DISKS; s++) r->shards[s] = INVALID_HANDLE_VALUE;
+
+    // All the headers at once
+    for (int s = 0; s < n; s++) {
+        int disk = erasure_disk_of(set, rel_path, s);
+        if (!set->online[disk] || (exclude && exclude[s])) continue;
+
+        char path[MAX_PATH];
+        snprintf(path, MAX_PATH, "%s/%s", set->disks[disk], rel_path);
+        r->shards[s] = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (r->shards[s] == INVALID_HANDLE_VALUE) continue;
+
+        r->events[s] = CreateEventA(NULL, TRUE, FALSE, NULL);
+        started[s] = r->events[s] && erasure_io_start(r->shards[s], r->events[s], ov + s, false, headers + s, sizeof(Erasure_Header), 0);
+    }
+    for (int s = 0; s < n; s++) {
+        if (started[s]) valid[s] = erasure_io_wait(r->shards[s], ov + s, sizeof(Erasure_Header)) && erasure_header_valid(set, headers + s, s, r->shards[s]);
+    }
+
+    int best = -1;
+    int best_count = 0;
+    for (int s = 0; s < n; s++) {
+        if (!valid[s]) continue;
+
+        int count = 0;
+        for (int t = 0; t < n; t++) {
+            if (valid[t] && headers[t].size == headers[s].size && memcmp(headers[t].digest, headers[s].digest, SHA256_DIGEST_SIZE) == 0) count++;
+        }
+        if (count > best_count) {
+            best = s;
+            best_count = count;
+        }
+    }
+
+    for (int s = 0; s < n; s++) {
+        bool keep = best >= 0 && valid[s] && memcmp(headers[s].digest, headers[best].digest, SHA256_DIGEST_SIZE) == 0 && headers[s].size == headers[best].size;
+        if (!keep && r->shards[s] != INVALID_HANDLE_VALUE) {
+            CloseHandle(r->shards[s]);
+            r->shards[s] = INVALID_HANDLE_VALUE;
+        }
+    }
+
+    r->present = best_count;
+    if (best < 0 || best_count < set->data_shards) return best_count;
+
+    r->header = headers[best];
+    s64 stripes = erasure_stripe_count(&r->header);
+    r->batch_stripes = ERASURE_IO_SIZE / r->header.unit;
+    if (r->batch_stripes > stripes) r->batch_stripes = stripes ? stripes : 1;
+
+    s64 batch_size = r->batch_stripes * r->header.unit;
+    u8 *block = (u8 *)malloc(batch_size * n + r->batch_stripes * ERASURE_CRC_SIZE);
+    assert(block);
+    for (int s = 0; s < n; s++) r->units[s] = block + s * batch_size;
+    r->crcs = (u32 *)(block + batch_size * n);
+
+    InterlockedIncrement64(&set->reads);
+    return best_count;
+}
+
+// The units of 'batch' stripes of the shard, just read, against the checksums in its trailer.
+bool erasure_units_valid(Erasure_Reader *r, int shard, s64 stripe, s64 batch)
+{
+    Erasure_Header *h = &r->header;
+    s64 count = batch * ERASURE_CRC_SIZE;
+
+    OVERLAPPED ov;
+    if (!erasure_io_start(r->shards[shard], r->events[shard], &ov, false, r->crcs, count, erasure_trailer_offset(h) + stripe * ERASURE_CRC_SIZE)) return false;
+    if (!erasure_io_wait(r->shards[shard], &ov, count)) return false;
+
+    for (s64 g = 0; g < batch; g++) {
+        if (erasure_crc(r->units[shard] + g * h->unit, h->unit) != r->crcs[g]) {
+            InterlockedIncrement64(&r->set->checksum_failures);
+            r->damaged[shard] = true;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Reads the stripes from 'stripe' on into the units: the data shards, and a parity shard for
+// each one that fails or doesn't match its checksums.
+bool erasure_fill(Erasure_Reader *r, s64 stripe)
+{
+    Erasure_Header *h = &r->header;
+    int k = h->data_shards;
+    int n = h->data_shards + h->parity_shards;
+
+    s64 batch = r->batch_stripes;
+    if (stripe + batch > erasure_stripe_count(h)) batch = erasure_stripe_count(h) - stripe;
+    s64 count  = batch * h->unit;
+    s64 offset = ERASURE_HEADER_SIZE + stripe * h->unit;
+
+    bool present[ERASURE_MAX_DISKS] = {};
+    bool tried[ERASURE_MAX_DISKS] = {};
+    int have = 0;
+
+    while (have < k) {
+        OVERLAPPED ov[ERASURE_MAX_DISKS];
+        bool started[ERASURE_MAX_DISKS] = {};
+        int in_flight = 0;
+
+        for (int s = 0; s < n && have + in_flight < k; s++) {
+            if (tried[s] || r->shards[s] == INVALID_HANDLE_VALUE) continue;
+            tried[s] = true;
+
+            started[s] = erasure_io_start(r->shards[s], r->events[s], ov + s, false, r->units[s], count, offset);
+            if (started[s]) in_flight++;
+            else            erasure_drop_shard(r, s);
+        }
+        if (in_flight == 0) break;
+
+        for (int s = 0; s < n; s++) {
+            if (!started[s]) continue;
+
+            if (erasure_io_wait(r->shards[s], ov + s, count) && erasure_units_valid(r, s, stripe, batch)) {
+                present[s] = true;
+                have++;
+            } else {
+                erasure_drop_shard(r, s);
+            }
+        }
+    }
+
+    if (have < k) return false;
+
+    bool all_data = true;
+    for (int s = 0; s < k; s++) all_data = all_data && present[s];
+    if (!all_data) {
+        if (!r->degraded) InterlockedIncrement64(&r->set->degraded_reads);
+        r->degraded = true;
+        if (!erasure_decode(k, h->parity_shards, r->units, present, count)) return false;
+    }
+
+    r->first_stripe = stripe;
+    r->stripe_count = batch;
+    return true;
+}
+
+// The next 'count' bytes of the file, all of them or false.
+bool erasure_read(Erasure_Reader *r, char *data, s64 count)
+{
+    Erasure_Header *h = &r->header;
+    s64 stripe_size = h->unit * h->data_shards;
+    if (count > h->size - r->position) return false;
+
+    while (count > 0) {
+        s64 stripe = r->position / stripe_size;
+        if (stripe < r->first_stripe || stripe >= r->first_stripe + r->stripe_count) {
+            if (!erasure_fill(r, stripe)) return false;
+        }
+
+        s64 in_stripe = r->position % stripe_size;
+        int shard = (int)(in_stripe / h->unit);
+        s64 in_unit = in_stripe % h->unit;
+
+        s64 n = h->unit - in_unit;
+        if (n > count) n = count;
+        memcpy(data, r->units[shard] + (stripe - r->first_stripe) * h->unit + in_unit, n);
+
+        data        += n;
+        count       -= n;
+        r->position += n;
+    }
+
+    return true;
+}
+
+struct Erasure_Output {
+    HANDLE file;
+    HANDLE event;
+    char tmp_path[MAX_PATH];
+    char final_path[MAX_PATH];
+};
+
+bool erasure_output_create(Erasure_Set *set, Erasure_Output *o, int disk, char *rel_path)
+{
+    LONG n = InterlockedIncrement(&set->tmp_counter);
+    snprintf(o->tmp_path,   MAX_PATH, "%s/" ERASURE_TMP_DIR "/%lu-%ld.shard", set->disks[disk], GetCurrentProcessId(), n);
+    snprintf(o->final_path, MAX_PATH, "%s/%s", set->disks[disk], rel_path);
+
+    o->event = CreateEventA(NULL, TRUE, FALSE, NULL);
+    o->file  = CreateFileA(o->tmp_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_OVERLAPPED, NULL);
+    if (o->file == INVALID_HANDLE_VALUE || o->event == NULL) {
+        fprintf(stderr, "[disks]: Failed to create %s. Error code: %lu\n", o->tmp_path, GetLastError());
+        return false;
+    }
+
+    return true;
+}
+
+// Flushed and closed, 'rename' moves it into place (under the put_lock), otherwise it's deleted.
+bool erasure_output_close(Erasure_Output *o, bool flush)
+{
+    bool ok = true;
+    if (o->file != INVALID_HANDLE_VALUE) {
+        if (flush && !FlushFileBuffers(o->file)) {
+            fprintf(stderr, "[disks]: Failed to flush %s. Error code: %lu\n", o->tmp_path, GetLastError());
+            ok = false;
+        }
+        CloseHandle(o->file);
+        o->file = INVALID_HANDLE_VALUE;
+    }
+    if (o->event) CloseHandle(o->event);
+    o->event = NULL;
+
+    return ok;
+}
+
+bool erasure_output_rename(Erasure_Output *o)
+{
+    if (!storage_make_parent_dirs(o->final_path) || !MoveFileExA(o->tmp_path, o->final_path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        fprintf(stderr, "[disks]: Failed to move %s -> %s. Error code: %lu\n", o->tmp_path, o->final_path, GetLastError());
+        DeleteFileA(o->tmp_path);
+        return false;
+    }
+
+    return true;
+}
+
+// The header, a shard's own written at 0 of each output.
+bool erasure_write_headers(Erasure_Output *outputs, int *shards, int count, Erasure_Header *h)
+{
+    u8 blocks[ERASURE_MAX_DISKS][ERASURE_HEADER_SIZE];
+    OVERLAPPED ov[ERASURE_MAX_DISKS];
+    bool started[ERASURE_MAX_DISKS] = {};
+    bool success = true;
+
+    for (int i = 0; i < count; i++) {
+        ZERO_MEMORY(blocks[i], ERASURE_HEADER_SIZE);
+        memcpy(blocks[i], h, sizeof(Erasure_Header));
+        ((Erasure_Header *)blocks[i])->shard = (u8)shards[i];
+
+        started[i] = erasure_io_start(outputs[i].file, outputs[i].event, ov + i, true, blocks[i], ERASURE_HEADER_SIZE, 0);
+        success = success && started[i];
+    }
+    for (int i = 0; i < count; i++) {
+        if (started[i]) success = erasure_io_wait(outputs[i].file, ov + i, ERASURE_HEADER_SIZE) && success;
+    }
+
+    return success;
+}
+
+// Writes 'count' bytes of each unit buffer to its output, all of them at once.
+bool erasure_write_units(Erasure_Output *outputs, u8 **units, int output_count, s64 count, s64 offset)
+{
+    OVERLAPPED ov[ERASURE_MAX_DISKS];
+    bool started[ERASURE_MAX_DISKS] = {};
+    bool success = true;
+
+    for (int i = 0; i < output_count; i++) {
+        started[i] = erasure_io_start(outputs[i].file, outputs[i].event, ov + i, true, units[i], count, offset);
+        success = success && started[i];
+    }
+    for (int i = 0; i < output_count; i++) {
+        if (started[i]) success = erasure_io_wait(outputs[i].file, ov + i, count) && success;
+    }
+
+    if (!success) fprintf(stderr, "[disks]: Failed to write the shards. Error code: %lu\n", GetLastError());
+    return success;
+}
+
+// The checksums of 'batch' units of each buffer into 'crcs' ('batch' per output), then written
+// to the trailers.
+bool erasure_write_checksums(Erasure_Output *outputs, u8 **units, int output_count, Erasure_Header *h, u32 *crcs, s64 stripe, s64 batch)
+{
+    u8 *slices[ERASURE_MAX_DISKS];
+    for (int i = 0; i < output_count; i++) {
+        u32 *c = crcs + i * batch;
+        for (s64 g = 0; g < batch; g++) c[g] = erasure_crc(units[i] + g * h->unit, h->unit);
+        slices[i] = (u8 *)c;
+    }
+
+    return erasure_write_units(outputs, slices, output_count, batch * ERASURE_CRC_SIZE, erasure_trailer_offset(h) + stripe * ERASURE_CRC_SIZE);
+}
+
+// Writes the shards of the (closed) file at 'source_path' on every disk and renames them into
+// place. Called by the committer, the file is in the index only if this succeeds.
+bool erasure_put(Erasure_Set *set, char *source_path, char *rel_path, u8 *digest)
+{
+    int k = set->data_shards;
+    int n = set->disk_count;
+
+    for (int d = 0; d < n; d++) {
+        if (!set->online[d]) {
+            fprintf(stderr, "[disks]: %s is offline, %s can't be stored\n", set->disks[d], rel_path);
+            return false;
+        }
+    }
+
+    HANDLE source = CreateFileA(source_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (source == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "[disks]: Failed to open %s. Error code: %lu\n", source_path, GetLastError());
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    FILETIME written;
+    if (!GetFileSizeEx(source, &size) || !GetFileTime(source, NULL, NULL, &written)) {
+        CloseHandle(source);
+        return false;
+    }
+
+    Erasure_Header h;
+    ZERO_MEMORY(&h, sizeof(h));
+    memcpy(h.magic, ERASURE_MAGIC, 8);
+    h.version       = ERASURE_VERSION;
+    h.data_shards   = (u8)k;
+    h.parity_shards = (u8)set->parity_shards;
+    h.unit          = erasure_unit_for(size.QuadPart, k);
+    h.size          = size.QuadPart;
+    h.written       = ((u64)written.dwHighDateTime << 32) | written.dwLowDateTime;
+    memcpy(h.digest, digest, SHA256_DIGEST_SIZE);
+
+    s64 stripes = erasure_stripe_count(&h);
+    s64 batch_stripes = ERASURE_IO_SIZE / h.unit;
+    if (batch_stripes > stripes) batch_stripes = stripes ? stripes : 1;
+    s64 batch_size = batch_stripes * h.unit;
+
+    // The units of every shard, the input of a batch, then their checksums
+    u8 *block = (u8 *)malloc(batch_size * n + batch_size * k + batch_stripes * n * ERASURE_CRC_SIZE);
+    assert(block);
+    u8 *units[ERASURE_MAX_DISKS];
+    for (int s = 0; s < n; s++) units[s] = block + s * batch_size;
+    u8 *input = block + batch_size * n;
+    u32 *crcs = (u32 *)(input + batch_size * k);
+
+    Erasure_Output outputs[ERASURE_MAX_DISKS];
+    int shards[ERASURE_MAX_DISKS];
+    ZERO_MEMORY(outputs, sizeof(outputs));
+    for (int s = 0; s < n; s++) outputs[s].file = INVALID_HANDLE_VALUE;
+
+    bool success = true;
+    for (int s = 0; s < n && success; s++) {
+        shards[s] = s;
+        success = erasure_output_create(set, outputs + s, erasure_disk_of(set, rel_path, s), rel_path);
+    }
+    success = success && erasure_write_headers(outputs, shards, n, &h);
+
+    s64 left = h.size;
+    for (s64 stripe = 0; stripe < stripes && success; stripe += batch_stripes) {
+        s64 batch = stripes - stripe < batch_stripes ? stripes - stripe : batch_stripes;
+        s64 input_count = batch * h.unit * k;
+        s64 read_count = left < input_count ? left : input_count;
+
+        if (!storage_read_all(source, (char *)input, read_count)) {
+            fprintf(stderr, "[disks]: Failed to read %s. Error code: %lu\n", source_path, GetLastError());
+            success = false;
+            break;
+        }
+        memset(input + read_count, 0, input_count - read_count);
+        left -= read_count;
+
+        // Unit i of the stripe g goes to the data shard i
+        for (s64 g = 0; g < batch; g++) {
+            for (int i = 0; i < k; i++) memcpy(units[i] + g * h.unit, input + (g * k + i) * h.unit, h.unit);
+        }
+        erasure_encode(k, set->parity_shards, units, batch * h.unit);
+
+        success = erasure_write_units(outputs, units, n, batch * h.unit, ERASURE_HEADER_SIZE + stripe * h.unit) &&
+                  erasure_write_checksums(outputs, units, n, &h, crcs, stripe, batch);
+    }
+    CloseHandle(source);
+    free(block);
+
+    for (int s = 0; s < n; s++) success = erasure_output_close(outputs + s, success) && success;
+
+    if (success) {
+        EnterCriticalSection(&set->put_lock);
+        for (int s = 0; s < n; s++) success = erasure_output_rename(outputs + s) && success;
+        LeaveCriticalSection(&set->put_lock);
+    } else {
+        for (int s = 0; s < n; s++) DeleteFileA(outputs[s].tmp_path);
+    }
+
+    return success;
+}
+
+// Writes again the shards of the file that are missing, damaged or of another upload, and the
+// ones marked in 'exclude' (their units didn't match). Returns false if there aren't enough
+// shards left to do it (the file is lost) or a write failed.
+bool erasure_repair(Erasure_Set *set, char *rel_path, bool *exclude = nullptr)
+{
+    Erasure_Reader r;
+    int found = erasure_open(set, rel_path, &r, exclude);
+    int n = set->disk_count;
+    int k = set->data_shards;
+
+    if (found == 0 || found == n) {
+        erasure_close(&r);
+        return true; // Not on the disks (stored before they were set), or nothing to do
+    }
+    if (found < k) {
+        printf("[disks]: %s is lost, %d shard(s) of the %d needed\n", rel_path, found, k);
+        InterlockedIncrement64(&set->lost_files);
+        erasure_close(&r);
+        return false;
+    }
+
+    Erasure_Output outputs[ERASURE_MAX_DISKS];
+    int shards[ERASURE_MAX_DISKS];
+    u8 *units[ERASURE_MAX_DISKS];
+    bool missing[ERASURE_MAX_DISKS] = {};
+    int output_count = 0;
+    int good_shard = -1;
+    bool success = true;
+
+    ZERO_MEMORY(outputs, sizeof(outputs));
+    for (int s = 0; s < n && success; s++) {
+        int disk = erasure_disk_of(set, rel_path, s);
+        if (r.shards[s] != INVALID_HANDLE_VALUE) {
+            good_shard = s;
+            continue;
+        }
+        if (!set->online[disk]) continue;
+
+        missing[s] = true;
+        shards[output_count] = s;
+        units[output_count]  = r.units[s];
+        outputs[output_count].file = INVALID_HANDLE_VALUE;
+        success = erasure_output_create(set, outputs + output_count, disk, rel_path);
+        output_count++;
+    }
+    success = success && erasure_write_headers(outputs, shards, output_count, &r.header);
+
+    u32 *crcs = (u32 *)malloc(r.batch_stripes * n * ERASURE_CRC_SIZE);
+    assert(crcs);
+
+    // The data shards come decoded, the parity ones are computed again
+    s64 stripes = erasure_stripe_count(&r.header);
+    for (s64 stripe = 0; stripe < stripes && success; stripe += r.batch_stripes) {
+        success = erasure_fill(&r, stripe);
+        if (!success) break;
+
+        s64 count = r.stripe_count * r.header.unit;
+        erasure_encode(k, set->parity_shards, r.units, count, missing);
+        success = erasure_write_units(outputs, units, output_count, count, ERASURE_HEADER_SIZE + stripe * r.header.unit) &&
+                  erasure_write_checksums(outputs, units, output_count, &r.header, crcs, stripe, r.stripe_count);
+    }
+    free(crcs);
+
+    for (int i = 0; i < output_count; i++) success = erasure_output_close(outputs + i, success) && success;
+
+    // Only if the file wasn't uploaded again meanwhile, that wrote all of its shards
+    if (success) {
+        EnterCriticalSection(&set->put_lock);
+
+        Erasure_Reader now;
+        int now_found = erasure_open(set, rel_path, &now);
+        bool same = now_found >= k && now.shards[good_shard] != INVALID_HANDLE_VALUE &&
+                    memcmp(now.header.digest, r.header.digest, SHA256_DIGEST_SIZE) == 0;
+        erasure_close(&now);
+
+        for (int i = 0; i < output_count; i++) {
+            if (same && erasure_output_rename(outputs + i)) InterlockedIncrement64(&set->rebuilt_shards);
+            else if (!same) DeleteFileA(outputs[i].tmp_path);
+        }
+
+        LeaveCriticalSection(&set->put_lock);
+    } else {
+        for (int i = 0; i < output_count; i++) DeleteFileA(outputs[i].tmp_path);
+        fprintf(stderr, "[disks]: Failed to rebuild %s\n", rel_path);
+    }
+
+    erasure_close(&r);
+    return success;
+}
+
+// 'list' is the ';' separated directories, one per disk, in the order of their slots. A disk
+// that can't be opened is offline: the reads do without it, the uploads fail.
+bool erasure_attach(Erasure_Set *set, char *list, int parity)
+{
+    ZERO_MEMORY(set, sizeof(Erasure_Set));
+    InitializeCriticalSection(&set->put_lock);
+
+    if (gf_mul_add == nullptr) gf_mul_add = gf_cpu_has_ssse3() ? gf_mul_add_ssse3 : gf_mul_add_scalar;
+    if (erasure_crc == nullptr) erasure_crc = crc_cpu_has_sse42() ? crc32c_sse42 : crc32c_scalar;
+
+    String rest = String(list);
+    while (rest.count) {
+        bool found = false;
+        String dir = split_and_move(&rest, ";", &found);
+        if (!found) rest.count = 0;
+        if (dir.count == 0) continue;
+
+        if (set->disk_count == ERASURE_MAX_DISKS || dir.count >= MAX_PATH - 64) {
+            fprintf(stderr, "[disks]: At most %d disks with paths shorter than %d\n", ERASURE_MAX_DISKS, MAX_PATH - 64);
+            return false;
+        }
+        char *disk = set->disks[set->disk_count++];
+        snprintf(disk, MAX_PATH, SFMT, SARG(dir));
+        for (char *p = disk; *p; p++) {
+            if (*p == '\\') *p = '/'; // Like the rest of the paths, and the disks in /status are JSON strings
+        }
+    }
+
+    if (set->disk_count < 2 || parity < 1 || parity >= set->disk_count) {
+        fprintf(stderr, "[disks]: %d disk(s) with a parity of %d, it needs at least one data and one parity disk\n", set->disk_count, parity);
+        return false;
+    }
+    set->parity_shards = parity;
+    set->data_shards   = set->disk_count - parity;
+
+    for (int d = 0; d < set->disk_count; d++) {
+        char tmp_dir[MAX_PATH];
+        snprintf(tmp_dir, MAX_PATH, "%s/" ERASURE_TMP_DIR, set->disks[d]);
+        set->online[d] = storage_make_dir(set->disks[d]) && storage_make_dir(tmp_dir);
+        if (!set->online[d]) {
+            fprintf(stderr, "[disks]: %s is offline. Error code: %lu\n", set->disks[d], GetLastError());
+            continue;
+        }
+
+        // The marker says which slot the disk is, the disks can't be swapped around
+        char marker[MAX_PATH];
+        snprintf(marker, MAX_PATH, "%s/" ERASURE_MARKER, set->disks[d]);
+        FILE *fp = fopen(marker, "rb");
+        if (fp == nullptr) continue;
+
+        int slot = -1, count = 0, marked_parity = 0;
+        bool ok = fscanf(fp, "slot %d of %d, parity %d", &slot, &count, &marked_parity) == 3;
+        fclose(fp);
+        if (!ok || slot != d || count != set->disk_count || marked_parity != parity) {
+            fprintf(stderr, "[disks]: %s is the slot %d of %d disks with a parity of %d, not %d of %d with %d. Changing the layout isn't supported.\n",
+                    set->disks[d], slot, count, marked_parity, d, set->disk_count, parity);
+            return false;
+        }
+        set->complete[d] = true;
+    }
+
+    printf("[disks]: %d disk(s), %d data and %d parity shard(s) per file%s\n", set->disk_count, set->data_shards, set->parity_shards,
+           gf_mul_add == gf_mul_add_ssse3 ? ", SSSE3" : "");
+
+    return true;
+}
+
+// After a complete rebuild: every online disk has all of its shards.
+void erasure_mark_complete(Erasure_Set *set)
+{
+    for (int d = 0; d < set->disk_count; d++) {
+        if (!set->online[d] || set->complete[d]) continue;
+
+        char marker[MAX_PATH];
+        snprintf(marker, MAX_PATH, "%s/" ERASURE_MARKER, set->disks[d]);
+        FILE *fp = fopen(marker, "wb");
+        if (fp == nullptr) {
+            fprintf(stderr, "[disks]: Failed to write %s; errno: %d\n", marker, errno);
+            continue;
+        }
+        fprintf(fp, "slot %d of %d, parity %d\n", d, set->disk_count, set->parity_shards);
+        bool ok = fflush(fp) == 0;
+        fclose(fp);
+
+        set->complete[d] = ok;
+        if (ok) printf("[disks]: %s is complete\n", set->disks[d]);
+    }
+}
+
+bool erasure_has_incomplete_disk(Erasure_Set *set)
+{
+    for (int d = 0; d < set->disk_count; d++) {
+        if (set->online[d] && !set->complete[d]) return true;
+    }
+    return false;
+}
+
+#endif
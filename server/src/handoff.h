@@ -0,0 +1,247 @@
+#ifndef H_CUPIDO_HANDOFF
+#define H_CUPIDO_HANDOFF
+
+#include "core.h"
+
+// Upgrades without refusing a connection. The running server starts the executable again (with
+// the same command line, so a new build in its place is what starts) and gives the new process
+// its listening sockets. The accept queues are the same ones in both processes, so the
+// connections keep landing somewhere while the old one drains.
+//
+// Windows has no SCM_RIGHTS: WSADuplicateSocket fills a WSAPROTOCOL_INFO for the other process,
+// which turns it back into the socket with WSASocket. The infos go through an anonymous pipe
+// that only the child inherits, its handle values are passed in HANDOFF_ENV.
+//
+//   old process                            new process
+//   CreateProcess, the sockets ----------> handoff_receive()
+//   (keeps accepting)                      server_create() ... handoff_ready()
+//   stops accepting, drains, exits <-----  one byte
+//   the pipe breaks ---------------------> handoff_parent_alive() is false
+//
+// Until the new one is ready the old one keeps serving, if it fails to start nothing changes.
+// Both processes commit uploads to the same storage while they overlap.
+
+#define HANDOFF_ENV "CUPIDO_HANDOFF"
+#define HANDOFF_UPGRADE_EVENT "cupido-upgrade-%lld" // 'server --upgrade' sets it, per port
+
+const u32   HANDOFF_MAGIC = 0x48444E43;
+const DWORD HANDOFF_READY_TIMEOUT_MS = 120000; // The new one loads the index before it's ready
+
+struct Handoff_Message {
+    u32 magic;
+    u32 has_tls;
+    WSAPROTOCOL_INFOA plain;
+    WSAPROTOCOL_INFOA tls;
+};
+
+// The new process's end of the pipes
+struct Handoff {
+    HANDLE from_parent = INVALID_HANDLE_VALUE; // Breaks when the old process exits
+    HANDLE to_parent   = INVALID_HANDLE_VALUE;
+};
+
+inline bool handoff_requested()
+{
+    return GetEnvironmentVariableA(HANDOFF_ENV, NULL, 0) > 0;
+}
+
+// A broken pipe means the other end exited (or closed it).
+bool handoff_wait_byte(HANDLE pipe, DWORD timeout_ms)
+{
+    ULONGLONG deadline = GetTickCount64() + timeout_ms;
+
+    while (GetTickCount64() < deadline) {
+        DWORD available = 0;
+        if (!PeekNamedPipe(pipe, NULL, 0, NULL, &available, NULL)) return false;
+
+        if (available) {
+            char byte;
+            DWORD read = 0;
+            return ReadFile(pipe, &byte, 1, &read, NULL) && read == 1;
+        }
+
+        Sleep(50);
+    }
+
+    return false;
+}
+
+// The old process's side. Returns true once the new process is accepting on the sockets, this
+// one can stop accepting then. The pipe to the child is left open until this process exits.
+bool handoff_start(SOCKET plain, SOCKET tls)
+{
+    SECURITY_ATTRIBUTES sa;
+    ZERO_MEMORY(&sa, sizeof(sa));
+    sa.nLength = sizeof(sa);
+    sa.bInheritHandle = TRUE;
+
+    HANDLE to_child_read, to_child_write;
+    HANDLE from_child_read, from_child_write;
+    if (!CreatePipe(&to_child_read, &to_child_write, &sa, 0)) {
+        fprintf(stderr, "[handoff]: Failed to create a pipe. Error code: %lu\n", GetLastError());
+        return false;
+    }
+    if (!CreatePipe(&from_child_read, &from_child_write, &sa, 0)) {
+        fprintf(stderr, "[handoff]: Failed to create a pipe. Error code: %lu\n", GetLastError());
+        CloseHandle(to_child_read);
+        CloseHandle(to_child_write);
+        return false;
+    }
+    SetHandleInformation(to_child_write,  HANDLE_FLAG_INHERIT, 0);
+    SetHandleInformation(from_child_read, HANDLE_FLAG_INHERIT, 0);
+
+    // Only the two pipe ends are inherited. The sockets are inheritable by default and a client
+    // connection held open by the child wouldn't close when this process closes it.
+    HANDLE inherited[2] = { to_child_read, from_child_write };
+    SIZE_T attrs_size = 0;
+    InitializeProcThreadAttributeList(NULL, 1, 0, &attrs_size);
+    LPPROC_THREAD_ATTRIBUTE_LIST attrs = (LPPROC_THREAD_ATTRIBUTE_LIST)malloc(attrs_size);
+    bool attrs_ok = attrs && InitializeProcThreadAttributeList(attrs, 1, 0, &attrs_size);
+    if (attrs_ok) attrs_ok = UpdateProcThreadAttribute(attrs, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, inherited, sizeof(inherited), NULL, NULL);
+
+    char value[64];
+    snprintf(value, sizeof(value), "%llu,%llu", (u64)(uintptr_t)to_child_read, (u64)(uintptr_t)from_child_write);
+
+    // CreateProcess can write into the command line
+    char *command_line = _strdup(GetCommandLineA());
+
+    STARTUPINFOEXA si;
+    ZERO_MEMORY(&si, sizeof(si));
+    si.StartupInfo.cb = sizeof(si);
+    si.lpAttributeList = attrs;
+
+    PROCESS_INFORMATION pi;
+    BOOL started = FALSE;
+    if (attrs_ok && command_line && SetEnvironmentVariableA(HANDOFF_ENV, value)) {
+        started = CreateProcessA(NULL, command_line, NULL, NULL, TRUE, EXTENDED_STARTUPINFO_PRESENT, NULL, NULL, &si.StartupInfo, &pi);
+        if (!started) fprintf(stderr, "[handoff]: Failed to start %s. Error code: %lu\n", command_line, GetLastError());
+        SetEnvironmentVariableA(HANDOFF_ENV, NULL);
+    } else {
+        fprintf(stderr, "[handoff]: Failed to prepare the new process. Error code: %lu\n", GetLastError());
+    }
+
+    if (attrs_ok) DeleteProcThreadAttributeList(attrs);
+    free(attrs);
+    free(command_line);
+    CloseHandle(to_child_read);
+    CloseHandle(from_child_write);
+
+    if (!started) {
+        CloseHandle(to_child_write);
+        CloseHandle(from_child_read);
+        return false;
+    }
+
+    Handoff_Message m;
+    ZERO_MEMORY(&m, sizeof(m));
+    m.magic = HANDOFF_MAGIC;
+
+    bool sent = WSADuplicateSocketA(plain, pi.dwProcessId, &m.plain) == 0;
+    if (sent && tls != INVALID_SOCKET) {
+        m.has_tls = 1;
+        sent = WSADuplicateSocketA(tls, pi.dwProcessId, &m.tls) == 0;
+    }
+    if (!sent) fprintf(stderr, "[handoff]: WSADuplicateSocket() failed. Error code: %d\n", WSAGetLastError());
+
+    DWORD written = 0;
+    if (sent) sent = WriteFile(to_child_write, &m, sizeof(m), &written, NULL) && written == sizeof(m);
+
+    bool ready = sent && handoff_wait_byte(from_child_read, HANDOFF_READY_TIMEOUT_MS);
+    if (!ready) {
+        // It may hold the sockets already, it must not accept next to us in some broken state
+        fprintf(stderr, "[handoff]: The new process (%lu) didn't get ready\n", pi.dwProcessId);
+        TerminateProcess(pi.hProcess, 1);
+        CloseHandle(to_child_write);
+    }
+
+    CloseHandle(from_child_read);
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+
+    return ready;
+}
+
+// The new process's side, only if handoff_requested(). The sockets are in the non-blocking mode
+// of the accept loop.
+bool handoff_receive(Handoff *ho, SOCKET *plain, SOCKET *tls)
+{
+    char value[64];
+    DWORD n = GetEnvironmentVariableA(HANDOFF_ENV, value, sizeof(value));
+    SetEnvironmentVariableA(HANDOFF_ENV, NULL); // Not for our own upgrade
+
+    u64 from_parent = 0;
+    u64 to_parent   = 0;
+    if (n == 0 || n >= sizeof(value) || sscanf(value, "%llu,%llu", &from_parent, &to_parent) != 2) {
+        fprintf(stderr, "[handoff]: Invalid %s\n", HANDOFF_ENV);
+        return false;
+    }
+    ho->from_parent = (HANDLE)(uintptr_t)from_parent;
+    ho->to_parent   = (HANDLE)(uintptr_t)to_parent;
+
+    Handoff_Message m;
+    DWORD read = 0;
+    if (!ReadFile(ho->from_parent, &m, sizeof(m), &read, NULL) || read != sizeof(m) || m.magic != HANDOFF_MAGIC) {
+        fprintf(stderr, "[handoff]: Failed to read the sockets from the old process. Error code: %lu\n", GetLastError());
+        return false;
+    }
+
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        fprintf(stderr, "[handoff]: Failed to initialize Winsock.\n");
+        return false;
+    }
+
+    *plain = WSASocketA(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &m.plain, 0, WSA_FLAG_OVERLAPPED);
+    *tls   = INVALID_SOCKET;
+    if (*plain != INVALID_SOCKET && m.has_tls) {
+        *tls = WSASocketA(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &m.tls, 0, WSA_FLAG_OVERLAPPED);
+    }
+    if (*plain == INVALID_SOCKET || (m.has_tls && *tls == INVALID_SOCKET)) {
+        fprintf(stderr, "[handoff]: WSASocket() failed on the inherited socket. Error code: %d\n", WSAGetLastError());
+        return false;
+    }
+
+    u_long non_blocking = 1;
+    ioctlsocket(*plain, FIONBIO, &non_blocking);
+    if (*tls != INVALID_SOCKET) ioctlsocket(*tls, FIONBIO, &non_blocking);
+
+    printf("[handoff]: Took over the listening sockets\n");
+    return true;
+}
+
+// Tells the old process to stop accepting.
+void handoff_ready(Handoff *ho)
+{
+    char byte = 1;
+    DWORD written = 0;
+    WriteFile(ho->to_parent, &byte, 1, &written, NULL);
+    CloseHandle(ho->to_parent);
+    ho->to_parent = INVALID_HANDLE_VALUE;
+}
+
+inline bool handoff_parent_alive(Handoff *ho)
+{
+    DWORD available = 0;
+    return PeekNamedPipe(ho->from_parent, NULL, 0, NULL, &available, NULL) != 0;
+}
+
+// 'server --upgrade': wakes the server_upgrade_thread() of the server on the port.
+bool handoff_signal(s64 port)
+{
+    char name[64];
+    snprintf(name, sizeof(name), HANDOFF_UPGRADE_EVENT, port);
+
+    HANDLE event = OpenEventA(EVENT_MODIFY_STATE, FALSE, name);
+    if (event == NULL) {
+        fprintf(stderr, "[handoff]: No server to upgrade on port %lld. Error code: %lu\n", port, GetLastError());
+        return false;
+    }
+
+    bool success = SetEvent(event) != 0;
+    CloseHandle(event);
+
+    if (success) printf("[handoff]: Upgrade of the server on port %lld requested\n", port);
+    return success;
+}
+
+#endif
@@ -0,0 +1,491 @@
+#ifndef H_CUPIDO_HPACK
+#define H_CUPIDO_HPACK
+
+#include "core.h"
+
+// HPACK (RFC 7541) for the HTTP/2 connections: the decoder with the dynamic table of the
+// connection, and the small encoder the responses need. Our encoder never indexes, so the
+// table size the peer allows us doesn't matter.
+
+const u32 HPACK_TABLE_SIZE        = 4096; // SETTINGS_HEADER_TABLE_SIZE, we keep the default
+const int HPACK_STATIC_COUNT      = 61;
+const int HPACK_MAX_DYNAMIC_COUNT = HPACK_TABLE_SIZE / 32; // Every entry costs 32 + its strings
+
+struct Hpack_Static_Entry {
+    const char *name;
+    const char *value;
+};
+
+static const Hpack_Static_Entry HPACK_STATIC_TABLE[HPACK_STATIC_COUNT] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+struct Hpack_Huffman_Code {
+    u32 code;
+    u8  length;
+};
+
+static constexpr Hpack_Huffman_Code HPACK_HUFFMAN_CODES[256] = {
+    {0x00001ff8, 13}, {0x007fffd8, 23}, {0x0fffffe2, 28}, {0x0fffffe3, 28},
+    {0x0fffffe4, 28}, {0x0fffffe5, 28}, {0x0fffffe6, 28}, {0x0fffffe7, 28},
+    {0x0fffffe8, 28}, {0x00ffffea, 24}, {0x3ffffffc, 30}, {0x0fffffe9, 28},
+    {0x0fffffea, 28}, {0x3ffffffd, 30}, {0x0fffffeb, 28}, {0x0fffffec, 28},
+    {0x0fffffed, 28}, {0x0fffffee, 28}, {0x0fffffef, 28}, {0x0ffffff0, 28},
+    {0x0ffffff1, 28}, {0x0ffffff2, 28}, {0x3ffffffe, 30}, {0x0ffffff3, 28},
+    {0x0ffffff4, 28}, {0x0ffffff5, 28}, {0x0ffffff6, 28}, {0x0ffffff7, 28},
+    {0x0ffffff8, 28}, {0x0ffffff9, 28}, {0x0ffffffa, 28}, {0x0ffffffb, 28},
+    {0x00000014,  6}, {0x000003f8, 10}, {0x000003f9, 10}, {0x00000ffa, 12},
+    {0x00001ff9, 13}, {0x00000015,  6}, {0x000000f8,  8}, {0x000007fa, 11},
+    {0x000003fa, 10}, {0x000003fb, 10}, {0x000000f9,  8}, {0x000007fb, 11},
+    {0x000000fa,  8}, {0x00000016,  6}, {0x00000017,  6}, {0x00000018,  6},
+    {0x00000000,  5}, {0x00000001,  5}, {0x00000002,  5}, {0x00000019,  6},
+    {0x0000001a,  6}, {0x0000001b,  6}, {0x0000001c,  6}, {0x0000001d,  6},
+    {0x0000001e,  6}, {0x0000001f,  6}, {0x0000005c,  7}, {0x000000fb,  8},
+    {0x00007ffc, 15}, {0x00000020,  6}, {0x00000ffb, 12}, {0x000003fc, 10},
+    {0x00001ffa, 13}, {0x00000021,  6}, {0x0000005d,  7}, {0x0000005e,  7},
+    {0x0000005f,  7}, {0x00000060,  7}, {0x00000061,  7}, {0x00000062,  7},
+    {0x00000063,  7}, {0x00000064,  7}, {0x00000065,  7}, {0x00000066,  7},
+    {0x00000067,  7}, {0x00000068,  7}, {0x00000069,  7}, {0x0000006a,  7},
+    {0x0000006b,  7}, {0x0000006c,  7}, {0x0000006d,  7}, {0x0000006e,  7},
+    {0x0000006f,  7}, {0x00000070,  7}, {0x00000071,  7}, {0x00000072,  7},
+    {0x000000fc,  8}, {0x00000073,  7}, {0x000000fd,  8}, {0x00001ffb, 13},
+    {0x0007fff0, 19}, {0x00001ffc, 13}, {0x00003ffc, 14}, {0x00000022,  6},
+    {0x00007ffd, 15}, {0x00000003,  5}, {0x00000023,  6}, {0x00000004,  5},
+    {0x00000024,  6}, {0x00000005,  5}, {0x00000025,  6}, {0x00000026,  6},
+    {0x00000027,  6}, {0x00000006,  5}, {0x00000074,  7}, {0x00000075,  7},
+    {0x00000028,  6}, {0x00000029,  6}, {0x0000002a,  6}, {0x00000007,  5},
+    {0x0000002b,  6}, {0x00000076,  7}, {0x0000002c,  6}, {0x00000008,  5},
+    {0x00000009,  5}, {0x0000002d,  6}, {0x00000077,  7}, {0x00000078,  7},
+    {0x00000079,  7}, {0x0000007a,  7}, {0x0000007b,  7}, {0x00007ffe, 15},
+    {0x000007fc, 11}, {0x00003ffd, 14}, {0x00001ffd, 13}, {0x0ffffffc, 28},
+    {0x000fffe6, 20}, {0x003fffd2, 22}, {0x000fffe7, 20}, {0x000fffe8, 20},
+    {0x003fffd3, 22}, {0x003fffd4, 22}, {0x003fffd5, 22}, {0x007fffd9, 23},
+    {0x003fffd6, 22}, {0x007fffda, 23}, {0x007fffdb, 23}, {0x007fffdc, 23},
+    {0x007fffdd, 23}, {0x007fffde, 23}, {0x00ffffeb, 24}, {0x007fffdf, 23},
+    {0x00ffffec, 24}, {0x00ffffed, 24}, {0x003fffd7, 22}, {0x007fffe0, 23},
+    {0x00ffffee, 24}, {0x007fffe1, 23}, {0x007fffe2, 23}, {0x007fffe3, 23},
+    {0x007fffe4, 23}, {0x001fffdc, 21}, {0x003fffd8, 22}, {0x007fffe5, 23},
+    {0x003fffd9, 22}, {0x007fffe6, 23}, {0x007fffe7, 23}, {0x00ffffef, 24},
+    {0x003fffda, 22}, {0x001fffdd, 21}, {0x000fffe9, 20}, {0x003fffdb, 22},
+    {0x003fffdc, 22}, {0x007fffe8, 23}, {0x007fffe9, 23}, {0x001fffde, 21},
+    {0x007fffea, 23}, {0x003fffdd, 22}, {0x003fffde, 22}, {0x00fffff0, 24},
+    {0x001fffdf, 21}, {0x003fffdf, 22}, {0x007fffeb, 23}, {0x007fffec, 23},
+    {0x001fffe0, 21}, {0x001fffe1, 21}, {0x003fffe0, 22}, {0x001fffe2, 21},
+    {0x007fffed, 23}, {0x003fffe1, 22}, {0x007fffee, 23}, {0x007fffef, 23},
+    {0x000fffea, 20}, {0x003fffe2, 22}, {0x003fffe3, 22}, {0x003fffe4, 22},
+    {0x007ffff0, 23}, {0x003fffe5, 22}, {0x003fffe6, 22}, {0x007ffff1, 23},
+    {0x03ffffe0, 26}, {0x03ffffe1, 26}, {0x000fffeb, 20}, {0x0007fff1, 19},
+    {0x003fffe7, 22}, {0x007ffff2, 23}, {0x003fffe8, 22}, {0x01ffffec, 25},
+    {0x03ffffe2, 26}, {0x03ffffe3, 26}, {0x03ffffe4, 26}, {0x07ffffde, 27},
+    {0x07ffffdf, 27}, {0x03ffffe5, 26}, {0x00fffff1, 24}, {0x01ffffed, 25},
+    {0x0007fff2, 19}, {0x001fffe3, 21}, {0x03ffffe6, 26}, {0x07ffffe0, 27},
+    {0x07ffffe1, 27}, {0x03ffffe7, 26}, {0x07ffffe2, 27}, {0x00fffff2, 24},
+    {0x001fffe4, 21}, {0x001fffe5, 21}, {0x03ffffe8, 26}, {0x03ffffe9, 26},
+    {0x0ffffffd, 28}, {0x07ffffe3, 27}, {0x07ffffe4, 27}, {0x07ffffe5, 27},
+    {0x000fffec, 20}, {0x00fffff3, 24}, {0x000fffed, 20}, {0x001fffe6, 21},
+    {0x003fffe9, 22}, {0x001fffe7, 21}, {0x001fffe8, 21}, {0x007ffff3, 23},
+    {0x003fffea, 22}, {0x003fffeb, 22}, {0x01ffffee, 25}, {0x01ffffef, 25},
+    {0x00fffff4, 24}, {0x00fffff5, 24}, {0x03ffffea, 26}, {0x007ffff4, 23},
+    {0x03ffffeb, 26}, {0x07ffffe6, 27}, {0x03ffffec, 26}, {0x03ffffed, 26},
+    {0x07ffffe7, 27}, {0x07ffffe8, 27}, {0x07ffffe9, 27}, {0x07ffffea, 27},
+    {0x07ffffeb, 27}, {0x0ffffffe, 28}, {0x07ffffec, 27}, {0x07ffffed, 27},
+    {0x07ffffee, 27}, {0x07ffffef, 27}, {0x07fffff0, 27}, {0x03ffffee, 26},
+};
+
+// The decoding tree is built at compile time. The children are node indices, or -(symbol+1)
+// for the leaves; the root is the node 0, so 0 is never a child. 257 leaves (EOS too) need
+// 256 inner nodes.
+struct Hpack_Huffman_Tree {
+    s16 nodes[256][2];
+    int count;
+};
+
+constexpr Hpack_Huffman_Tree hpack_build_huffman_tree()
+{
+    Hpack_Huffman_Tree t = {};
+    t.count = 1;
+
+    for (int sym = 0; sym <= 256; sym++) {
+        u32 code   = sym < 256 ? HPACK_HUFFMAN_CODES[sym].code   : 0x3fffffff; // EOS
+        int length = sym < 256 ? HPACK_HUFFMAN_CODES[sym].length : 30;
+
+        int node = 0;
+        for (int i = length - 1; i > 0; i--) {
+            int bit = (code >> i) & 1;
+            if (t.nodes[node][bit] == 0) t.nodes[node][bit] = (s16)t.count++;
+            node = t.nodes[node][bit];
+        }
+        t.nodes[node][code & 1] = (s16)-(sym + 1);
+    }
+
+    return t;
+}
+
+static constexpr Hpack_Huffman_Tree HPACK_HUFFMAN_TREE = hpack_build_huffman_tree();
+
+// Returns the decoded length, or -1 on a malformed string or if 'out' is too small.
+s64 hpack_huffman_decode(u8 *in, s64 count, char *out, s64 out_size)
+{
+    s64 w = 0;
+    int node = 0;
+    int pending_bits = 0;      // Since the last symbol
+    bool pending_ones = true;
+
+    for (s64 i = 0; i < count; i++) {
+        for (int b = 7; b >= 0; b--) {
+            int bit = (in[i] >> b) & 1;
+            int next = HPACK_HUFFMAN_TREE.nodes[node][bit];
+            pending_bits += 1;
+            pending_ones = pending_ones && bit;
+
+            if (next > 0) {
+                node = next;
+                continue;
+            }
+
+            int sym = -next - 1;
+            if (sym == 256 || w == out_size) return -1; // EOS can't be in the string
+
+            out[w++] = (char)sym;
+            node = 0;
+            pending_bits = 0;
+            pending_ones = true;
+        }
+    }
+
+    // The padding is the shortest prefix of EOS (ones) that fills the last byte
+    if (pending_bits > 7 || !pending_ones) return -1;
+
+    return w;
+}
+
+bool hpack_decode_int(u8 **p, u8 *end, int prefix_bits, u32 *value)
+{
+    if (*p >= end) return false;
+
+    u32 max_prefix = (1u << prefix_bits) - 1;
+    u32 v = **p & max_prefix;
+    *p += 1;
+
+    if (v == max_prefix) {
+        for (int shift = 0; ; shift += 7) {
+            if (*p >= end || shift > 21) return false; // We don't need more than 2^28
+
+            u8 b = **p;
+            *p += 1;
+            v += (u32)(b & 0x7f) << shift;
+            if (!(b & 0x80)) break;
+        }
+    }
+
+    *value = v;
+    return true;
+}
+
+// Where the decoded strings of a header block go
+struct Hpack_Arena {
+    char *data;
+    s64 count;
+    s64 capacity;
+};
+
+bool hpack_decode_string(u8 **p, u8 *end, Hpack_Arena *arena, String *s)
+{
+    if (*p >= end) return false;
+
+    bool huffman = (**p & 0x80) != 0;
+    u32 length = 0;
+    if (!hpack_decode_int(p, end, 7, &length) || length > end - *p) return false;
+
+    char *dest = arena->data + arena->count;
+    s64 n = length;
+    if (huffman) {
+        n = hpack_huffman_decode(*p, length, dest, arena->capacity - arena->count);
+        if (n < 0) return false;
+    } else {
+        if (n > arena->capacity - arena->count) return false;
+        memcpy(dest, *p, n);
+    }
+
+    *p += length;
+    arena->count += n;
+    *s = String(dest, (u32)n);
+
+    return true;
+}
+
+// Copies a string into the arena, for the ones that point into the dynamic table.
+bool hpack_arena_keep(Hpack_Arena *arena, String *s)
+{
+    if (s->count > arena->capacity - arena->count) return false;
+
+    char *dest = arena->data + arena->count;
+    memcpy(dest, s->data, s->count);
+    arena->count += s->count;
+    *s = String(dest, (u32)s->count);
+
+    return true;
+}
+
+struct Hpack_Entry {
+    char *name; // The value follows the name in the same allocation
+    u32 name_count;
+    u32 value_count;
+};
+
+// The dynamic table is a ring, the newest entry is at 'first'.
+struct Hpack_Decoder {
+    Hpack_Entry entries[HPACK_MAX_DYNAMIC_COUNT];
+    int first;
+    int count;
+    u32 size;
+    u32 max_size;
+};
+
+void hpack_decoder_init(Hpack_Decoder *d)
+{
+    ZERO_MEMORY(d, sizeof(Hpack_Decoder));
+    d->max_size = HPACK_TABLE_SIZE;
+}
+
+void hpack_evict_oldest(Hpack_Decoder *d)
+{
+    Hpack_Entry *e = d->entries + (d->first + d->count - 1) % HPACK_MAX_DYNAMIC_COUNT;
+    d->size  -= e->name_count + e->value_count + 32;
+    d->count -= 1;
+    free(e->name);
+    e->name = nullptr;
+}
+
+void hpack_decoder_free(Hpack_Decoder *d)
+{
+    while (d->count) hpack_evict_oldest(d);
+}
+
+void hpack_add(Hpack_Decoder *d, String name, String value)
+{
+    u32 size = (u32)(name.count + value.count + 32);
+    while (d->count && d->size + size > d->max_size) hpack_evict_oldest(d);
+
+    // Larger than the whole table: it just empties the table
+    if (size > d->max_size) return;
+
+    d->first = (d->first + HPACK_MAX_DYNAMIC_COUNT - 1) % HPACK_MAX_DYNAMIC_COUNT;
+    Hpack_Entry *e = d->entries + d->first;
+    e->name = (char *)malloc(name.count + value.count);
+    assert(e->name);
+    memcpy(e->name, name.data, name.count);
+    memcpy(e->name + name.count, value.data, value.count);
+    e->name_count  = (u32)name.count;
+    e->value_count = (u32)value.count;
+
+    d->count += 1;
+    d->size  += size;
+}
+
+bool hpack_get(Hpack_Decoder *d, u32 index, String *name, String *value)
+{
+    if (index == 0) return false;
+
+    if (index <= HPACK_STATIC_COUNT) {
+        *name  = String(HPACK_STATIC_TABLE[index-1].name);
+        *value = String(HPACK_STATIC_TABLE[index-1].value);
+        return true;
+    }
+
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= (u32)d->count) return false;
+
+    Hpack_Entry *e = d->entries + (d->first + index) % HPACK_MAX_DYNAMIC_COUNT;
+    *name  = String(e->name, e->name_count);
+    *value = String(e->name + e->name_count, e->value_count);
+    return true;
+}
+
+// The strings only live until the next field: the ones of the dynamic table can be evicted by
+// its insert, the others are in the arena that the next header block reuses.
+typedef bool (*Hpack_Header_Proc)(void *user, String name, String value);
+
+// Decodes a whole header block. Returns false on a compression error, that's fatal to the
+// connection (the dynamic table can't be trusted anymore).
+bool hpack_decode_block(Hpack_Decoder *d, u8 *block, s64 count, Hpack_Arena *arena, Hpack_Header_Proc proc, void *user)
+{
+    u8 *p = block, *end = block + count;
+    bool fields_started = false;
+    arena->count = 0;
+
+    while (p < end) {
+        u8 b = *p;
+        String name, value;
+
+        if (b & 0x80) {
+            // Indexed field
+            u32 index;
+            if (!hpack_decode_int(&p, end, 7, &index) || !hpack_get(d, index, &name, &value)) return false;
+
+        } else if ((b & 0xe0) == 0x20) {
+            // Dynamic table size update, only before the fields
+            u32 size;
+            if (fields_started || !hpack_decode_int(&p, end, 5, &size) || size > HPACK_TABLE_SIZE) return false;
+
+            d->max_size = size;
+            while (d->count && d->size > d->max_size) hpack_evict_oldest(d);
+            continue;
+
+        } else {
+            // Literal, with incremental indexing (01), without indexing (0000) or never indexed (0001)
+            bool indexing = (b & 0xc0) == 0x40;
+            u32 index;
+            if (!hpack_decode_int(&p, end, indexing ? 6 : 4, &index)) return false;
+
+            if (index) {
+                String unused;
+                if (!hpack_get(d, index, &name, &unused)) return false;
+            } else {
+                if (!hpack_decode_string(&p, end, arena, &name)) return false;
+            }
+            if (!hpack_decode_string(&p, end, arena, &value)) return false;
+
+            // The entry of the name can be the one the insert evicts (RFC 7541 4.4)
+            if (indexing && index > HPACK_STATIC_COUNT && !hpack_arena_keep(arena, &name)) return false;
+            if (indexing) hpack_add(d, name, value);
+        }
+
+        fields_started = true;
+        if (!proc(user, name, value)) return false;
+    }
+
+    return true;
+}
+
+bool hpack_encode_int(char *out, s64 *w, s64 capacity, int prefix_bits, u8 first_bits, u32 value)
+{
+    u32 max_prefix = (1u << prefix_bits) - 1;
+    if (*w >= capacity) return false;
+
+    if (value < max_prefix) {
+        out[(*w)++] = (char)(first_bits | value);
+        return true;
+    }
+
+    out[(*w)++] = (char)(first_bits | max_prefix);
+    value -= max_prefix;
+    while (value >= 0x80) {
+        if (*w >= capacity) return false;
+        out[(*w)++] = (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    if (*w >= capacity) return false;
+    out[(*w)++] = (char)value;
+
+    return true;
+}
+
+// Index of the name in the static table, or 0. The name must be lowercase.
+int hpack_static_name_index(String name)
+{
+    for (int i = 0; i < HPACK_STATIC_COUNT; i++) {
+        if (string_equal(name, String(HPACK_STATIC_TABLE[i].name))) return i + 1;
+    }
+    return 0;
+}
+
+// Appends a literal field without indexing (no Huffman either, we don't save much on our few
+// response headers). The name must be lowercase.
+bool hpack_encode_field(char *out, s64 *w, s64 capacity, String name, String value)
+{
+    int index = hpack_static_name_index(name);
+    if (!hpack_encode_int(out, w, capacity, 4, 0x00, index)) return false;
+
+    if (!index) {
+        if (!hpack_encode_int(out, w, capacity, 7, 0x00, (u32)name.count) || capacity - *w < name.count) return false;
+        memcpy(out + *w, name.data, name.count);
+        *w += name.count;
+    }
+
+    if (!hpack_encode_int(out, w, capacity, 7, 0x00, (u32)value.count) || capacity - *w < value.count) return false;
+    memcpy(out + *w, value.data, value.count);
+    *w += value.count;
+
+    return true;
+}
+
+bool hpack_encode_status(char *out, s64 *w, s64 capacity, int status)
+{
+    // The statuses of the static table
+    switch (status) {
+        case 200: return hpack_encode_int(out, w, capacity, 7, 0x80, 8);
+        case 204: return hpack_encode_int(out, w, capacity, 7, 0x80, 9);
+        case 206: return hpack_encode_int(out, w, capacity, 7, 0x80, 10);
+        case 304: return hpack_encode_int(out, w, capacity, 7, 0x80, 11);
+        case 400: return hpack_encode_int(out, w, capacity, 7, 0x80, 12);
+        case 404: return hpack_encode_int(out, w, capacity, 7, 0x80, 13);
+        case 500: return hpack_encode_int(out, w, capacity, 7, 0x80, 14);
+    }
+
+    char digits[8];
+    snprintf(digits, sizeof(digits), "%03d", status);
+    return hpack_encode_field(out, w, capacity, String(":status"), String(digits));
+}
+
+#endif
@@ -0,0 +1,973 @@
+#ifndef H_CUPIDO_HTTP2
+#define H_CUPIDO_HTTP2
+
+#include "server.h"
+#include "hpack.h"
+
+// HTTP/2 (RFC 9113) on top of the Request handling, so a gallery can fetch all its thumbnails
+// over one connection instead of taking a client slot for each. A connection becomes
+// HTTP/2 when it starts with the preface: h2c with prior knowledge on the plain port, or h2
+// negotiated with ALPN on the TLS port.
+//
+// The connection stays on the worker that accepted it. Every stream gets its own Request
+// (outside of the clients table) and goes through the same handle_request() as HTTP/1.1. The
+// handlers still write an HTTP/1.1 response head, h2_send() turns that into a HEADERS frame
+// and the rest into DATA frames under the flow control windows.
+//
+// The streams are served one at a time: the most urgent first (the RFC 9218 priority header
+// and PRIORITY_UPDATE frames), in arrival order on ties. While a handler runs, the frames of
+// the other streams are still read; their request bodies are buffered up to the stream window.
+
+const int H2_MAX_STREAMS       = 32;                 // SETTINGS_MAX_CONCURRENT_STREAMS
+const s64 H2_STREAM_WINDOW     = BYTES_TO_KB(64);    // SETTINGS_INITIAL_WINDOW_SIZE, and the body buffer
+const s64 H2_CONNECTION_WINDOW = BYTES_TO_MB(16);
+const s64 H2_DEFAULT_WINDOW    = 65535;
+const u32 H2_MAX_FRAME_SIZE    = 16384;              // We never raise SETTINGS_MAX_FRAME_SIZE
+const s64 H2_MAX_HEADER_LIST   = BYTES_TO_KB(16);    // Header block and the decoded headers
+const s64 H2_READ_BUF_SIZE     = BYTES_TO_KB(64);
+const s64 H2_WRITE_BUF_SIZE    = BYTES_TO_KB(32);
+const s64 H2_MAX_WINDOW        = 0x7fffffff;
+
+enum H2_Frame_Type {
+    H2_DATA            = 0x0,
+    H2_HEADERS         = 0x1,
+    H2_PRIORITY        = 0x2,
+    H2_RST_STREAM      = 0x3,
+    H2_SETTINGS        = 0x4,
+    H2_PUSH_PROMISE    = 0x5,
+    H2_PING            = 0x6,
+    H2_GOAWAY          = 0x7,
+    H2_WINDOW_UPDATE   = 0x8,
+    H2_CONTINUATION    = 0x9,
+    H2_PRIORITY_UPDATE = 0x10, // RFC 9218
+};
+
+enum H2_Flags {
+    H2_FLAG_END_STREAM  = 0x01,
+    H2_FLAG_ACK         = 0x01,
+    H2_FLAG_END_HEADERS = 0x04,
+    H2_FLAG_PADDED      = 0x08,
+    H2_FLAG_PRIORITY    = 0x20,
+};
+
+enum H2_Settings {
+    H2_SETTINGS_HEADER_TABLE_SIZE      = 0x1,
+    H2_SETTINGS_ENABLE_PUSH            = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE    = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE         = 0x5,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE   = 0x6,
+};
+
+enum H2_Error {
+    H2_NO_ERROR           = 0x0,
+    H2_PROTOCOL_ERROR     = 0x1,
+    H2_INTERNAL_ERROR     = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED      = 0x5,
+    H2_FRAME_SIZE_ERROR   = 0x6,
+    H2_REFUSED_STREAM     = 0x7,
+    H2_CANCEL             = 0x8,
+    H2_COMPRESSION_ERROR  = 0x9,
+    H2_ENHANCE_YOUR_CALM  = 0xb,
+};
+
+struct H2_Frame {
+    u32 length;
+    u8  type;
+    u8  flags;
+    u32 stream_id;
+    u8 *payload; // Valid until the next frame is read
+};
+
+struct H2_Stream {
+    Request req;
+    u32 id;
+    bool used;
+
+    bool ready;               // The request head is complete, waiting for its turn
+    bool bad;                 // Malformed request head
+    bool end_stream_received;
+    bool reset;
+    bool headers_sent;
+    bool end_stream_sent;
+
+    u8  urgency;              // 0 (most urgent) .. 7, RFC 9218
+    u64 seq;                  // Arrival order
+    s64 buf_used;             // Of the 'req.buf', for the header values the request keeps
+
+    s64 send_window;
+    s64 recv_window;
+    s64 recv_consumed;        // Read by the handler since our last WINDOW_UPDATE
+    s64 response_remaining;   // Content-Length of the response still to send, -1 if unknown
+
+    char *body;               // Received DATA not read by the handler yet
+    s64 body_start;
+    s64 body_end;
+
+    char buf[4096];           // The 'req.buf'
+};
+
+struct H2_Conn {
+    Server  *s;
+    Request *c; // The connection itself: the socket and the TLS state
+
+    Hpack_Decoder hpack;
+    Hpack_Arena   arena;
+
+    char *in;
+    s64 in_size;  // H2_READ_BUF_SIZE, more when the request header read ahead further
+    s64 in_start;
+    s64 in_end;
+
+    char *out;
+    s64 out_count;
+
+    // HEADERS + CONTINUATION
+    char *header_block;
+    s64 header_block_count;
+    u32 header_stream_id;
+    bool header_end_stream;
+    bool in_continuation;
+
+    H2_Stream *streams;
+    u32 last_stream_id;
+    u64 next_seq;
+
+    s64 send_window;
+    s64 recv_unacked;       // DATA bytes since our last connection WINDOW_UPDATE
+    s64 peer_initial_window;
+    u32 peer_max_frame_size;
+
+    bool goaway_received;
+    bool failed;
+};
+
+void handle_request(Server *s, Request *c);
+bool send_to_client(Request *c, String *buffer, s64 at_once);
+
+inline u32 h2_read_u32(u8 *p)
+{
+    return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | (u32)p[3];
+}
+
+inline void h2_write_u32(u8 *p, u32 v)
+{
+    p[0] = (u8)(v >> 24);
+    p[1] = (u8)(v >> 16);
+    p[2] = (u8)(v >> 8);
+    p[3] = (u8)v;
+}
+
+bool h2_flush(H2_Conn *h)
+{
+    if (h->failed) return false;
+    if (h->out_count == 0) return true;
+
+    String buffer = String(h->out, (u32)h->out_count);
+    h->out_count = 0;
+    if (!send_to_client(h->c, &buffer, -1)) {
+        h->failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+// The frames are collected in the write buffer, it is flushed when it's full and before we
+// block on reading.
+bool h2_write(H2_Conn *h, u8 type, u8 flags, u32 stream_id, void *payload, u32 length)
+{
+    if (h->failed) return false;
+    assert(9 + length <= H2_WRITE_BUF_SIZE);
+
+    if (h->out_count + 9 + length > H2_WRITE_BUF_SIZE && !h2_flush(h)) return false;
+
+    u8 *p = (u8 *)h->out + h->out_count;
+    p[0] = (u8)(length >> 16);
+    p[1] = (u8)(length >> 8);
+    p[2] = (u8)length;
+    p[3] = type;
+    p[4] = flags;
+    h2_write_u32(p + 5, stream_id & 0x7fffffff);
+    if (length) memcpy(p + 9, payload, length);
+
+    h->out_count += 9 + length;
+    return true;
+}
+
+bool h2_write_window_update(H2_Conn *h, u32 stream_id, s64 increment)
+{
+    u8 payload[4];
+    h2_write_u32(payload, (u32)increment);
+    return h2_write(h, H2_WINDOW_UPDATE, 0, stream_id, payload, 4);
+}
+
+bool h2_write_rst_stream(H2_Conn *h, u32 stream_id, H2_Error code)
+{
+    u8 payload[4];
+    h2_write_u32(payload, code);
+    return h2_write(h, H2_RST_STREAM, 0, stream_id, payload, 4);
+}
+
+// Returns false, so the frame processing can just return it.
+bool h2_connection_error(H2_Conn *h, H2_Error code)
+{
+    if (!h->failed) {
+        fprintf(stderr, "[h2]: #%lld: Connection error 0x%x\n", h->c->socket, code);
+
+        u8 payload[8];
+        h2_write_u32(payload, h->last_stream_id);
+        h2_write_u32(payload + 4, code);
+        h2_write(h, H2_GOAWAY, 0, 0, payload, 8);
+        h2_flush(h);
+        h->failed = true;
+    }
+
+    return false;
+}
+
+H2_Stream *h2_find_stream(H2_Conn *h, u32 id)
+{
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (h->streams[i].used && h->streams[i].id == id) return h->streams + i;
+    }
+    return nullptr;
+}
+
+H2_Stream *h2_new_stream(H2_Conn *h, u32 id)
+{
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        H2_Stream *st = h->streams + i;
+        if (st->used) continue;
+
+        ZERO_MEMORY(st, sizeof(H2_Stream));
+        st->used = true;
+        st->id   = id;
+        st->urgency            = 3; // The default of RFC 9218
+        st->send_window        = h->peer_initial_window;
+        st->recv_window        = H2_STREAM_WINDOW;
+        st->response_remaining = -1;
+
+        Request *c = &st->req;
+        c->id        = h->c->id;
+        c->connected = true;
+        c->socket    = h->c->socket;
+        c->h2        = h;
+        c->h2_stream = st;
+        c->protocol  = String("HTTP/2");
+        c->content_length = -1;
+        c->buf       = st->buf;
+        c->buf_size  = sizeof(st->buf);
+
+        return st;
+    }
+
+    return nullptr;
+}
+
+void h2_release_stream(H2_Stream *st)
+{
+    free(st->body);
+    st->body = nullptr;
+    st->used = false;
+}
+
+void h2_stream_error(H2_Conn *h, H2_Stream *st, H2_Error code)
+{
+    h2_write_rst_stream(h, st->id, code);
+    st->reset = true;
+
+    // The running one is released when its handler returns
+    if (st->ready) h2_release_stream(st);
+}
+
+// Copies a header value into the request buffer of the stream, the arena is reused by the
+// next header block.
+bool h2_stream_keep(H2_Stream *st, String *value)
+{
+    if (value->count > st->req.buf_size - st->buf_used) return false;
+
+    char *dest = st->req.buf + st->buf_used;
+    memcpy(dest, value->data, value->count);
+    st->buf_used += value->count;
+    *value = String(dest, (u32)value->count);
+
+    return true;
+}
+
+// "u=N" of a priority field value (RFC 9218), the incremental flag means nothing here as we
+// don't interleave the responses.
+void h2_parse_priority(H2_Stream *st, String value)
+{
+    for (s64 i = 0; i + 2 < value.count; i++) {
+        bool at_item = i == 0 || value.data[i-1] == ' ' || value.data[i-1] == ',';
+        if (at_item && value.data[i] == 'u' && value.data[i+1] == '=' && value.data[i+2] >= '0' && value.data[i+2] <= '7') {
+            st->urgency = value.data[i+2] - '0';
+            return;
+        }
+    }
+}
+
+bool h2_on_header(void *user, String name, String value)
+{
+    H2_Stream *st = (H2_Stream *)user;
+    if (!st || st->bad) return true; // The block still has to be decoded for the dynamic table
+
+    for (s64 i = 0; i < name.count; i++) {
+        if (name.data[i] >= 'A' && name.data[i] <= 'Z') {
+            st->bad = true;
+            return true;
+        }
+    }
+
+    Request *c = &st->req;
+
+    if (name.count && name.data[0] == ':') {
+        if (string_equal(name, String(":method"))) {
+            c->method = http_method_str_to_enum(value);
+        } else if (string_equal(name, String(":path"))) {
+            if (!h2_stream_keep(st, &value)) st->bad = true;
+            c->path = split(value, "?", &c->query);
+        } else if (!string_equal(name, String(":scheme")) && !string_equal(name, String(":authority"))) {
+            st->bad = true;
+        }
+        return true;
+    }
+
+    if (string_equal(name, String("priority"))) {
+        h2_parse_priority(st, value);
+        return true;
+    }
+
+    if (string_equal(name, String("connection")) || string_equal(name, String("transfer-encoding"))) {
+        st->bad = true;
+        return true;
+    }
+
+    if (string_equal(name, String("content-type")) && !h2_stream_keep(st, &value)) {
+        st->bad = true;
+        return true;
+    }
+
+    if (!http_request_apply_header(c, name, value)) st->bad = true;
+    return true;
+}
+
+bool h2_finish_headers(H2_Conn *h)
+{
+    h->in_continuation = false;
+    u32 id = h->header_stream_id;
+
+    H2_Stream *st = h2_find_stream(h, id);
+    if (st) {
+        // Trailers: nothing in them for us, but they have to end the stream
+        if (!hpack_decode_block(&h->hpack, (u8 *)h->header_block, h->header_block_count, &h->arena, h2_on_header, nullptr)) {
+            return h2_connection_error(h, H2_COMPRESSION_ERROR);
+        }
+        if (!h->header_end_stream) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+
+        st->end_stream_received = true;
+        return true;
+    }
+
+    if (id <= h->last_stream_id) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+    h->last_stream_id = id;
+
+    st = h2_new_stream(h, id);
+    if (!hpack_decode_block(&h->hpack, (u8 *)h->header_block, h->header_block_count, &h->arena, h2_on_header, st)) {
+        return h2_connection_error(h, H2_COMPRESSION_ERROR);
+    }
+
+    if (!st) return h2_write_rst_stream(h, id, H2_REFUSED_STREAM);
+
+    if (st->bad || st->req.method == HTTP_METHOD_NONE || st->req.path.count == 0) {
+        h2_write_rst_stream(h, id, H2_PROTOCOL_ERROR);
+        h2_release_stream(st);
+        return true;
+    }
+
+    st->req.state = HTTP_STATE_HEADER_PARSED;
+    st->end_stream_received = h->header_end_stream;
+    st->ready = true;
+    st->seq   = h->next_seq++;
+
+    return true;
+}
+
+bool h2_process_data(H2_Conn *h, H2_Frame *f)
+{
+    if (f->stream_id == 0) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+
+    u8 *data = f->payload;
+    s64 count = f->length;
+    if (f->flags & H2_FLAG_PADDED) {
+        if (count < 1 || f->payload[0] >= count) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+        count -= 1 + f->payload[0];
+        data  += 1;
+    }
+
+    // The connection window is given back right away, the streams are limited by their own
+    h->recv_unacked += f->length;
+    if (h->recv_unacked >= H2_CONNECTION_WINDOW / 2) {
+        if (!h2_write_window_update(h, 0, h->recv_unacked)) return false;
+        h->recv_unacked = 0;
+    }
+
+    H2_Stream *st = h2_find_stream(h, f->stream_id);
+    if (!st) {
+        if (f->stream_id > h->last_stream_id) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+        return h2_write_rst_stream(h, f->stream_id, H2_STREAM_CLOSED);
+    }
+    if (st->reset) return true;
+
+    if (st->end_stream_received) {
+        h2_stream_error(h, st, H2_STREAM_CLOSED);
+        return true;
+    }
+
+    st->recv_window -= f->length;
+    if (st->recv_window < 0) {
+        h2_stream_error(h, st, H2_FLOW_CONTROL_ERROR);
+        return true;
+    }
+
+    // The padding is never read by the handler
+    st->recv_consumed += f->length - count;
+
+    if (count) {
+        if (!st->body) {
+            st->body = (char *)malloc(H2_STREAM_WINDOW);
+            assert(st->body);
+        }
+        if (st->body_end + count > H2_STREAM_WINDOW) {
+            memmove(st->body, st->body + st->body_start, st->body_end - st->body_start);
+            st->body_end  -= st->body_start;
+            st->body_start = 0;
+        }
+        assert(st->body_end + count <= H2_STREAM_WINDOW); // The window guarantees it
+
+        memcpy(st->body + st->body_end, data, count);
+        st->body_end += count;
+    }
+
+    if (f->flags & H2_FLAG_END_STREAM) st->end_stream_received = true;
+
+    return true;
+}
+
+bool h2_process_settings(H2_Conn *h, H2_Frame *f)
+{
+    if (f->stream_id != 0) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+
+    if (f->flags & H2_FLAG_ACK) {
+        if (f->length != 0) return h2_connection_error(h, H2_FRAME_SIZE_ERROR);
+        return true;
+    }
+    if (f->length % 6) return h2_connection_error(h, H2_FRAME_SIZE_ERROR);
+
+    for (u32 i = 0; i < f->length; i += 6) {
+        u16 id = (u16)((f->payload[i] << 8) | f->payload[i+1]);
+        u32 value = h2_read_u32(f->payload + i + 2);
+
+        switch (id) {
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+            break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > H2_MAX_WINDOW) return h2_connection_error(h, H2_FLOW_CONTROL_ERROR);
+
+                s64 delta = (s64)value - h->peer_initial_window;
+                for (int s = 0; s < H2_MAX_STREAMS; s++) {
+                    if (!h->streams[s].used) continue;
+                    h->streams[s].send_window += delta;
+                    if (h->streams[s].send_window > H2_MAX_WINDOW) return h2_connection_error(h, H2_FLOW_CONTROL_ERROR);
+                }
+                h->peer_initial_window = value;
+            } break;
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < 16384 || value > 16777215) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+                h->peer_max_frame_size = value;
+            break;
+            default:
+                // The header table size doesn't matter to our encoder, the rest is advisory
+            break;
+        }
+    }
+
+    return h2_write(h, H2_SETTINGS, H2_FLAG_ACK, 0, nullptr, 0);
+}
+
+// Returns false on a connection error (it is already reported to the peer).
+bool h2_process_frame(H2_Conn *h, H2_Frame *f)
+{
+    if (h->in_continuation && (f->type != H2_CONTINUATION || f->stream_id != h->header_stream_id)) {
+        return h2_connection_error(h, H2_PROTOCOL_ERROR);
+    }
+
+    switch (f->type) {
+        case H2_DATA:
+            return h2_process_data(h, f);
+
+        case H2_HEADERS: {
+            if (f->stream_id == 0 || (f->stream_id & 1) == 0) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+
+            u8 *fragment = f->payload;
+            s64 count = f->length;
+            if (f->flags & H2_FLAG_PADDED) {
+                if (count < 1) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+                u8 pad = fragment[0];
+                fragment += 1;
+                count    -= 1 + pad;
+            }
+            if (f->flags & H2_FLAG_PRIORITY) {
+                // The RFC 7540 priority tree is deprecated, we only skip it
+                fragment += 5;
+                count    -= 5;
+            }
+            if (count < 0) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+
+            memcpy(h->header_block, fragment, count);
+            h->header_block_count = count;
+            h->header_stream_id   = f->stream_id;
+            h->header_end_stream  = (f->flags & H2_FLAG_END_STREAM) != 0;
+
+            if (f->flags & H2_FLAG_END_HEADERS) return h2_finish_headers(h);
+            h->in_continuation = true;
+            return true;
+        }
+
+        case H2_CONTINUATION:
+            if (!h->in_continuation) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+            if (h->header_block_count + f->length > H2_MAX_HEADER_LIST) return h2_connection_error(h, H2_ENHANCE_YOUR_CALM);
+
+            memcpy(h->header_block + h->header_block_count, f->payload, f->length);
+            h->header_block_count += f->length;
+
+            if (f->flags & H2_FLAG_END_HEADERS) return h2_finish_headers(h);
+            return true;
+
+        case H2_PRIORITY:
+            if (f->stream_id == 0) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+            if (f->length != 5)    return h2_connection_error(h, H2_FRAME_SIZE_ERROR);
+            return true;
+
+        case H2_RST_STREAM: {
+            if (f->stream_id == 0 || f->stream_id > h->last_stream_id) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+            if (f->length != 4) return h2_connection_error(h, H2_FRAME_SIZE_ERROR);
+
+            H2_Stream *st = h2_find_stream(h, f->stream_id);
+            if (st) {
+                st->reset = true;
+                // The running one is released when its handler returns
+                if (st->ready) h2_release_stream(st);
+            }
+            return true;
+        }
+
+        case H2_SETTINGS:
+            return h2_process_settings(h, f);
+
+        case H2_PUSH_PROMISE:
+            return h2_connection_error(h, H2_PROTOCOL_ERROR);
+
+        case H2_PING:
+            if (f->stream_id != 0) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+            if (f->length != 8)    return h2_connection_error(h, H2_FRAME_SIZE_ERROR);
+            if (f->flags & H2_FLAG_ACK) return true;
+            return h2_write(h, H2_PING, H2_FLAG_ACK, 0, f->payload, 8);
+
+        case H2_GOAWAY:
+            if (f->stream_id != 0) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+            h->goaway_received = true;
+            return true;
+
+        case H2_WINDOW_UPDATE: {
+            if (f->length != 4) return h2_connection_error(h, H2_FRAME_SIZE_ERROR);
+            s64 increment = h2_read_u32(f->payload) & 0x7fffffff;
+
+            if (f->stream_id == 0) {
+                if (increment == 0) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+                h->send_window += increment;
+                if (h->send_window > H2_MAX_WINDOW) return h2_connection_error(h, H2_FLOW_CONTROL_ERROR);
+                return true;
+            }
+
+            H2_Stream *st = h2_find_stream(h, f->stream_id);
+            if (!st || st->reset) return true;
+
+            if (increment == 0) {
+                h2_stream_error(h, st, H2_PROTOCOL_ERROR);
+            } else {
+                st->send_window += increment;
+                if (st->send_window > H2_MAX_WINDOW) h2_stream_error(h, st, H2_FLOW_CONTROL_ERROR);
+            }
+            return true;
+        }
+
+        case H2_PRIORITY_UPDATE: {
+            if (f->stream_id != 0) return h2_connection_error(h, H2_PROTOCOL_ERROR);
+            if (f->length < 4)     return h2_connection_error(h, H2_FRAME_SIZE_ERROR);
+
+            H2_Stream *st = h2_find_stream(h, h2_read_u32(f->payload) & 0x7fffffff);
+            if (st) h2_parse_priority(st, String((char *)f->payload + 4, f->length - 4));
+            return true;
+        }
+    }
+
+    return true; // The unknown frame types are ignored
+}
+
+// Reads until a whole frame is in the buffer. Returns false if the connection is closed or
+// broken.
+bool h2_read_frame(H2_Conn *h, H2_Frame *f)
+{
+    while (!h->failed) {
+        s64 available = h->in_end - h->in_start;
+
+        if (available >= 9) {
+            u8 *p = (u8 *)h->in + h->in_start;
+            u32 length = ((u32)p[0] << 16) | ((u32)p[1] << 8) | p[2];
+            if (length > H2_MAX_FRAME_SIZE) return h2_connection_error(h, H2_FRAME_SIZE_ERROR);
+
+            if (available >= 9 + length) {
+                f->length    = length;
+                f->type      = p[3];
+                f->flags     = p[4];
+                f->stream_id = h2_read_u32(p + 5) & 0x7fffffff;
+                f->payload   = p + 9;
+                h->in_start += 9 + length;
+                return true;
+            }
+        }
+
+        if (h->in_start) {
+            memmove(h->in, h->in + h->in_start, available);
+            h->in_start = 0;
+            h->in_end   = available;
+        }
+
+        // Never block with frames in the write buffer
+        if (!h2_flush(h)) return false;
+
+        int r = request_recv(h->c, h->in + h->in_end, (int)(h->in_size - h->in_end));
+        if (r == SOCKET_ERROR || r == 0) {
+            h->failed = true;
+            return false;
+        }
+        h->in_end += r;
+    }
+
+    return false;
+}
+
+// Reads and processes one frame, that's how we wait for anything on the connection.
+inline bool h2_pump(H2_Conn *h)
+{
+    H2_Frame f;
+    return h2_read_frame(h, &f) && h2_process_frame(h, &f);
+}
+
+// The request body of a stream, see request_recv().
+int h2_recv(Request *c, char *dest, int max)
+{
+    H2_Conn *h = c->h2;
+    H2_Stream *st = c->h2_stream;
+
+    while (st->body_start == st->body_end) {
+        if (st->reset || h->failed) {
+            WSASetLastError(WSAECONNABORTED);
+            return SOCKET_ERROR;
+        }
+        if (st->end_stream_received) return 0;
+
+        if (!h2_pump(h)) {
+            WSASetLastError(WSAECONNABORTED);
+            return SOCKET_ERROR;
+        }
+    }
+
+    s64 available = st->body_end - st->body_start;
+    int n = available < max ? (int)available : max;
+    memcpy(dest, st->body + st->body_start, n);
+    st->body_start += n;
+    if (st->body_start == st->body_end) st->body_start = st->body_end = 0;
+
+    st->recv_consumed += n;
+    if (st->recv_consumed >= H2_STREAM_WINDOW / 2 && !st->end_stream_received) {
+        h2_write_window_update(h, st->id, st->recv_consumed);
+        st->recv_window  += st->recv_consumed;
+        st->recv_consumed = 0;
+    }
+
+    return n;
+}
+
+bool h2_send_data(H2_Conn *h, H2_Stream *st, char *data, s64 count)
+{
+    if (st->response_remaining >= 0 && count > st->response_remaining) {
+        fprintf(stderr, "[h2]: #%lld: The response is longer than its Content-Length!\n", h->c->socket);
+        return false;
+    }
+
+    while (count > 0) {
+        if (st->reset || h->failed) return false;
+
+        s64 n = count;
+        if (n > h->send_window)  n = h->send_window;
+        if (n > st->send_window) n = st->send_window;
+        if (n > H2_MAX_FRAME_SIZE) n = H2_MAX_FRAME_SIZE;
+
+        if (n <= 0) {
+            // Waiting for a WINDOW_UPDATE
+            if (!h2_pump(h)) return false;
+            continue;
+        }
+
+        bool end = st->response_remaining == n;
+        if (!h2_write(h, H2_DATA, end ? H2_FLAG_END_STREAM : 0, st->id, data, (u32)n)) return false;
+
+        h->send_window  -= n;
+        st->send_window -= n;
+        if (st->response_remaining >= 0) st->response_remaining -= n;
+        if (end) st->end_stream_sent = true;
+
+        data  += n;
+        count -= n;
+    }
+
+    return true;
+}
+
+// Turns the HTTP/1.1 response head of the handlers into a HEADERS frame.
+bool h2_send_head(H2_Conn *h, H2_Stream *st, String head)
+{
+    bool found = false;
+    String line = split_and_move(&head, CRLF, &found);
+
+    String code;
+    split(line, " ", &code);
+    bool ok = true;
+    int status = string_to_int(split(code, " "), &ok, 10);
+    if (!ok) return false;
+
+    char block[H2_MAX_FRAME_SIZE];
+    s64 w = 0;
+    if (!hpack_encode_status(block, &w, sizeof(block), status)) return false;
+
+    while (found && head.count) {
+        line = split_and_move(&head, CRLF, &found);
+        if (line.count == 0) continue;
+
+        String value;
+        bool has_value = false;
+        String key = split(line, ": ", &value, &has_value);
+        if (!has_value || key.count > 64) continue;
+
+        char name_buf[64];
+        for (s64 i = 0; i < key.count; i++) {
+            char ch = key.data[i];
+            name_buf[i] = (ch >= 'A' && ch <= 'Z') ? ch - 'A' + 'a' : ch;
+        }
+        String name = String(name_buf, (u32)key.count);
+
+        // Connection specific fields are not allowed in HTTP/2
+        if (string_equal(name, String("connection")) || string_equal(name, String("keep-alive")) ||
+            string_equal(name, String("transfer-encoding")) || string_equal(name, String("upgrade"))) {
+            continue;
+        }
+
+        if (string_equal(name, String("content-length"))) {
+            st->response_remaining = string_to_s64(value, &ok);
+            if (!ok) return false;
+        }
+
+        if (!hpack_encode_field(block, &w, sizeof(block), name, value)) return false;
+    }
+
+    bool end = st->response_remaining == 0;
+    if (!h2_write(h, H2_HEADERS, H2_FLAG_END_HEADERS | (end ? H2_FLAG_END_STREAM : 0), st->id, block, (u32)w)) return false;
+
+    st->headers_sent = true;
+    if (end) st->end_stream_sent = true;
+
+    return true;
+}
+
+// send_to_client() of the stream requests. The first call is the response head.
+bool h2_send(Request *c, char *data, s64 count)
+{
+    H2_Conn *h = c->h2;
+    H2_Stream *st = c->h2_stream;
+    if (st->reset || h->failed) return false;
+
+    if (!st->headers_sent) {
+        String rest;
+        bool found = false;
+        String head = split(String(data, (u32)count), CRLF CRLF, &rest, &found);
+        if (!found || !h2_send_head(h, st, head)) {
+            fprintf(stderr, "[h2]: #%lld: Invalid response head on stream %u!\n", h->c->socket, st->id);
+            return false;
+        }
+
+        data  = rest.data;
+        count = rest.count;
+    }
+
+    return count == 0 || h2_send_data(h, st, data, count);
+}
+
+bool h2_send_file(Request *c, HANDLE file, s64 size)
+{
+    char chunk[H2_MAX_FRAME_SIZE];
+
+    while (size > 0) {
+        DWORD r = 0;
+        DWORD want = size < (s64)sizeof(chunk) ? (DWORD)size : (DWORD)sizeof(chunk);
+        if (!ReadFile(file, chunk, want, &r, NULL) || r == 0) {
+            fprintf(stderr, "[h2]: #%lld: Failed to read the file! Error code: %lu\n", c->socket, GetLastError());
+            return false;
+        }
+
+        if (!h2_send_data(c->h2, c->h2_stream, chunk, r)) return false;
+        size -= r;
+    }
+
+    return true;
+}
+
+inline bool h2_has_open_streams(H2_Conn *h)
+{
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (h->streams[i].used) return true;
+    }
+    return false;
+}
+
+// The next stream to serve: the most urgent, the oldest among those.
+H2_Stream *h2_next_stream(H2_Conn *h)
+{
+    H2_Stream *best = nullptr;
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        H2_Stream *st = h->streams + i;
+        if (!st->used || !st->ready) continue;
+
+        if (!best || st->urgency < best->urgency || (st->urgency == best->urgency && st->seq < best->seq)) best = st;
+    }
+    return best;
+}
+
+void h2_run_stream(H2_Conn *h, H2_Stream *st)
+{
+    st->ready = false;
+
+    // From the route on, the header block was parsed with the others of the connection
+    profile_trace_begin(&h->s->profiler, &st->req.trace, PROFILE_ROUTE);
+    handle_request(h->s, &st->req);
+
+    if (!st->reset && !h->failed) {
+        if (st->headers_sent && !st->end_stream_sent && st->response_remaining < 0) {
+            // No Content-Length, the end of the stream ends the response
+            h2_write(h, H2_DATA, H2_FLAG_END_STREAM, st->id, nullptr, 0);
+        } else if (!st->end_stream_sent) {
+            h2_write_rst_stream(h, st->id, H2_INTERNAL_ERROR);
+        } else if (!st->end_stream_received) {
+            // The response is complete, we don't need the rest of the request
+            h2_write_rst_stream(h, st->id, H2_NO_ERROR);
+        }
+    }
+
+    h2_flush(h);
+    profile_trace_end(&h->s->profiler, &st->req.trace, http_method_enum_to_str(st->req.method), st->req.path);
+    h2_release_stream(st);
+}
+
+// Serves the HTTP/2 connection until it's closed. The 'c->body' is the rest of the preface
+// that http_parse_header() left.
+void h2_serve(Server *s, Request *c)
+{
+    H2_Conn *h = (H2_Conn *)malloc(sizeof(H2_Conn));
+    assert(h);
+    ZERO_MEMORY(h, sizeof(H2_Conn));
+
+    h->s = s;
+    h->c = c;
+    // What the request header read took past the preface line can be as long as
+    // 'header_buffer_size', it all has to fit.
+    h->in_size      = c->body.count > H2_READ_BUF_SIZE ? c->body.count : H2_READ_BUF_SIZE;
+    h->in           = (char *)malloc(h->in_size);
+    h->out          = (char *)malloc(H2_WRITE_BUF_SIZE);
+    h->header_block = (char *)malloc(H2_MAX_HEADER_LIST);
+    h->arena.data   = (char *)malloc(H2_MAX_HEADER_LIST);
+    h->arena.capacity = H2_MAX_HEADER_LIST;
+    h->streams      = (H2_Stream *)malloc(sizeof(H2_Stream) * H2_MAX_STREAMS);
+    assert(h->in && h->out && h->header_block && h->arena.data && h->streams);
+    ZERO_MEMORY(h->streams, sizeof(H2_Stream) * H2_MAX_STREAMS);
+
+    hpack_decoder_init(&h->hpack);
+    h->send_window         = H2_DEFAULT_WINDOW;
+    h->peer_initial_window = H2_DEFAULT_WINDOW;
+    h->peer_max_frame_size = H2_MAX_FRAME_SIZE;
+
+    memcpy(h->in, c->body.data, c->body.count);
+    h->in_end = c->body.count;
+
+    bool preface_ok = true;
+    while (h->in_end < 6) {
+        int r = request_recv(c, h->in + h->in_end, (int)(h->in_size - h->in_end));
+        if (r == SOCKET_ERROR || r == 0) {
+            preface_ok = false;
+            break;
+        }
+        h->in_end += r;
+    }
+
+    if (preface_ok && memcmp(h->in, "SM\r\n\r\n", 6) == 0) {
+        h->in_start = 6;
+
+        u8 settings[18];
+        u16 ids[3]    = { H2_SETTINGS_MAX_CONCURRENT_STREAMS, H2_SETTINGS_INITIAL_WINDOW_SIZE, H2_SETTINGS_MAX_HEADER_LIST_SIZE };
+        u32 values[3] = { H2_MAX_STREAMS, (u32)H2_STREAM_WINDOW, (u32)H2_MAX_HEADER_LIST };
+        for (int i = 0; i < 3; i++) {
+            settings[i*6]   = (u8)(ids[i] >> 8);
+            settings[i*6+1] = (u8)ids[i];
+            h2_write_u32(settings + i*6 + 2, values[i]);
+        }
+        h2_write(h, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+        h2_write_window_update(h, 0, H2_CONNECTION_WINDOW - H2_DEFAULT_WINDOW);
+
+        while (!h->failed) {
+            H2_Stream *st = h2_next_stream(h);
+            if (st) {
+                h2_run_stream(h, st);
+                continue;
+            }
+
+            if (h->goaway_received) break;
+            // The GOAWAY below sends the client's next streams to a new connection (and process)
+            if (h->s->draining && !h->in_continuation && !h2_has_open_streams(h)) break;
+            if (!h2_pump(h)) break;
+        }
+
+        if (!h->failed) {
+            u8 payload[8];
+            h2_write_u32(payload, h->last_stream_id);
+            h2_write_u32(payload + 4, H2_NO_ERROR);
+            h2_write(h, H2_GOAWAY, 0, 0, payload, 8);
+            h2_flush(h);
+        }
+    } else {
+        fprintf(stderr, "[h2]: #%lld: Invalid connection preface!\n", c->socket);
+    }
+
+    for (int i = 0; i < H2_MAX_STREAMS; i++) free(h->streams[i].body);
+    hpack_decoder_free(&h->hpack);
+    free(h->streams);
+    free(h->arena.data);
+    free(h->header_block);
+    free(h->out);
+    free(h->in);
+    free(h);
+}
+
+#endif
@@ -0,0 +1,657 @@
+#ifndef H_CUPIDO_IMPORT
+#define H_CUPIDO_IMPORT
+
+#include "storage.h"
+
+// Indexing an existing archive: "server.exe --import <dir>" walks the directory tree, hashes
+// every file and puts it in the index, then exits.
+//   - <dir> is the storage root: the files stay where they are, only the ones missing from the
+//     index are hashed and added (the initial scan of an archive the server is set up on).
+//   - Any other directory: the files are copied into the storage under the same relative paths,
+//     through the committer like an upload. A file with the content of one already stored is a
+//     hard link to that one instead of a copy.
+//
+// The walk runs on a pool of workers with a deque each. A worker pushes what it finds in a
+// directory to its own deque and takes from the back (depth first, the deques stay short),
+// an idle one steals from the front of the others, that's the top of some subtree, the most
+// work for one steal. The reads of the files are bounded separately from the workers, so the
+// hashing can use every core without a hundred reads seeking on one disk.
+//
+// The index log is the checkpoint. A file whose path is in the index with the same size is
+// skipped without reading it, so an interrupted import (Ctrl+C, a crash) starts again where it
+// stopped. The lines of the in-place files and the links go to the log in bulk, one append and
+// flush per IMPORT_LOAD_BATCH lines or per second, whichever comes first.
+//
+// The index is only read at startup: run it before the server, or restart the server after.
+
+const int IMPORT_MAX_THREADS     = 64; // WaitForMultipleObjects() takes that many
+const int IMPORT_DEFAULT_IO      = 4;
+const s64 IMPORT_READ_SIZE       = BYTES_TO_MB(1);
+const int IMPORT_LOAD_BATCH      = 4096;
+const int IMPORT_COMMIT_EVERY    = 1024; // Copies per storage_batch_commit() of a worker
+const s64 IMPORT_DIGEST_MIN_CAPACITY = 1024;
+
+struct Import_Task {
+    bool is_dir;
+    s64 size;
+    char *rel_path; // '/' separated, "" for the root, allocated with the task
+};
+
+// The owner works at the back, the thieves take from the front.
+struct Import_Deque {
+    CRITICAL_SECTION lock;
+    Import_Task **tasks; // Ring buffer
+    s64 capacity;
+    s64 head;
+    s64 count;
+};
+
+struct Import_Digest {
+    u8 digest[SHA256_DIGEST_SIZE];
+    char *rel_path; // nullptr if the slot is free
+};
+
+// Where the content of each digest is stored, for the deduplication
+struct Import_Digests {
+    SRWLOCK lock;
+    Import_Digest *slots;
+    s64 capacity;
+    s64 count;
+};
+
+struct Import_Line {
+    char *rel_path;
+    s64 size;
+    u8 digest[SHA256_DIGEST_SIZE];
+};
+
+// The index lines that don't go through the committer
+struct Import_Loader {
+    CRITICAL_SECTION lock;
+    Import_Line lines[IMPORT_LOAD_BATCH];
+    int count;
+};
+
+struct Importer {
+    Storage *st;
+    char dir[MAX_PATH];
+    bool in_place;
+
+    int thread_count;
+    Import_Deque deques[IMPORT_MAX_THREADS];
+    volatile LONGLONG pending; // Tasks pushed and not finished yet, the walk is over at zero
+    volatile bool finished;
+
+    CRITICAL_SECTION io_lock;
+    CONDITION_VARIABLE io_released;
+    int io_free;
+
+    Import_Digests digests;
+    Import_Loader loader;
+
+    volatile LONGLONG files_found;
+    volatile LONGLONG bytes_found;
+    volatile LONGLONG files_done;
+    volatile LONGLONG bytes_done;
+    volatile LONGLONG already_imported;
+    volatile LONGLONG duplicates;
+    volatile LONGLONG skipped;
+    volatile LONGLONG failed;
+};
+
+struct Import_Worker {
+    Importer *im;
+    int index;
+    char *buf;
+
+    Storage_Batch batch;
+    int batch_files;
+};
+
+void import_deque_push(Import_Deque *d, Import_Task *t)
+{
+    EnterCriticalSection(&d->lock);
+    if (d->count == d->capacity) {
+        s64 capacity = d->capacity ? d->capacity * 2 : 256;
+        Import_Task **tasks = (Import_Task **)malloc(capacity * sizeof(Import_Task *));
+        assert(tasks);
+        for (s64 i = 0; i < d->count; i++) tasks[i] = d->tasks[(d->head + i) & (d->capacity-1)];
+
+        free(d->tasks);
+        d->tasks    = tasks;
+        d->capacity = capacity;
+        d->head     = 0;
+    }
+
+    d->tasks[(d->head + d->count) & (d->capacity-1)] = t;
+    d->count += 1;
+    LeaveCriticalSection(&d->lock);
+}
+
+Import_Task *import_deque_pop(Import_Deque *d, bool owner)
+{
+    Import_Task *t = nullptr;
+
+    EnterCriticalSection(&d->lock);
+    if (d->count) {
+        if (owner) {
+            t = d->tasks[(d->head + d->count - 1) & (d->capacity-1)];
+        } else {
+            t = d->tasks[d->head];
+            d->head = (d->head + 1) & (d->capacity-1);
+        }
+        d->count -= 1;
+    }
+    LeaveCriticalSection(&d->lock);
+
+    return t;
+}
+
+void import_push(Import_Worker *w, bool is_dir, s64 size, char *rel_path)
+{
+    s64 len = strlen(rel_path);
+    Import_Task *t = (Import_Task *)malloc(sizeof(Import_Task) + len + 1);
+    assert(t);
+    t->is_dir   = is_dir;
+    t->size     = size;
+    t->rel_path = (char *)(t + 1);
+    memcpy(t->rel_path, rel_path, len + 1);
+
+    // Counted before it's visible, a thief can't finish it before it's pending
+    InterlockedIncrement64(&w->im->pending);
+    import_deque_push(&w->im->deques[w->index], t);
+}
+
+inline u64 import_digest_hash(u8 *digest)
+{
+    u64 h;
+    memcpy(&h, digest, sizeof(h)); // It's a SHA-256 already
+    return h;
+}
+
+// Under the exclusive lock.
+void import_digests_grow(Import_Digests *m)
+{
+    Import_Digest *old = m->slots;
+    s64 old_capacity = m->capacity;
+
+    m->capacity = old_capacity ? old_capacity * 2 : IMPORT_DIGEST_MIN_CAPACITY;
+    m->slots = (Import_Digest *)calloc(m->capacity, sizeof(Import_Digest));
+    assert(m->slots);
+
+    for (s64 i = 0; i < old_capacity; i++) {
+        if (old[i].rel_path == nullptr) continue;
+
+        s64 j = import_digest_hash(old[i].digest) & (m->capacity-1);
+        while (m->slots[j].rel_path) j = (j+1) & (m->capacity-1);
+        m->slots[j] = old[i];
+    }
+
+    free(old);
+}
+
+// Under a lock.
+Import_Digest *import_digests_find(Import_Digests *m, u8 *digest)
+{
+    if (m->capacity == 0) return nullptr;
+
+    for (s64 i = import_digest_hash(digest) & (m->capacity-1);; i = (i+1) & (m->capacity-1)) {
+        Import_Digest *d = m->slots + i;
+        if (d->rel_path == nullptr) return nullptr;
+        if (memcmp(d->digest, digest, SHA256_DIGEST_SIZE) == 0) return d;
+    }
+}
+
+// Returns false if the content is already somewhere, the first path is kept.
+bool import_digests_add(Import_Digests *m, u8 *digest, String rel_path)
+{
+    AcquireSRWLockExclusive(&m->lock);
+    bool added = import_digests_find(m, digest) == nullptr;
+    if (added) {
+        if ((m->count+1) * 10 >= m->capacity * 7) import_digests_grow(m);
+
+        s64 i = import_digest_hash(digest) & (m->capacity-1);
+        while (m->slots[i].rel_path) i = (i+1) & (m->capacity-1);
+
+        memcpy(m->slots[i].digest, digest, SHA256_DIGEST_SIZE);
+        m->slots[i].rel_path = string_to_new_cstr(rel_path);
+        m->count += 1;
+    }
+    ReleaseSRWLockExclusive(&m->lock);
+
+    return added;
+}
+
+// Copies the path of the content into 'rel_path' (MAX_PATH).
+bool import_digests_lookup(Import_Digests *m, u8 *digest, char *rel_path)
+{
+    AcquireSRWLockShared(&m->lock);
+    Import_Digest *d = import_digests_find(m, digest);
+    if (d) snprintf(rel_path, MAX_PATH, "%s", d->rel_path);
+    ReleaseSRWLockShared(&m->lock);
+
+    return d != nullptr;
+}
+
+// The committer's on_change, a copy is the one to link to from now on.
+void import_committed(void *user, String rel_path)
+{
+    Importer *im = (Importer *)user;
+
+    Storage_Entry e;
+    if (storage_lookup(im->st, rel_path, &e) && e.has_digest) import_digests_add(&im->digests, e.digest, rel_path);
+}
+
+// One append and one flush of the index log for everything in the loader, then the index.
+void import_load_flush(Importer *im)
+{
+    Import_Loader *l = &im->loader;
+    Storage *st = im->st;
+
+    EnterCriticalSection(&l->lock);
+    if (l->count == 0) {
+        LeaveCriticalSection(&l->lock);
+        return;
+    }
+
+    String log_lines = string_create(l->count * 128);
+    for (int i = 0; i < l->count; i++) {
+        char hex[SHA256_HEX_SIZE+1];
+        sha256_to_hex(l->lines[i].digest, hex);
+
+        char line[MAX_PATH + SHA256_HEX_SIZE + 32];
+        int len = snprintf(line, sizeof(line), "%lld\t%s\t%s\n", l->lines[i].size, hex, l->lines[i].rel_path);
+        join(&log_lines, line, len);
+    }
+
+    bool log_ok = storage_append_all(st->index.log, log_lines.data, log_lines.count) && FlushFileBuffers(st->index.log);
+    free(log_lines);
+
+    if (log_ok) {
+        AcquireSRWLockExclusive(&st->index.lock);
+        for (int i = 0; i < l->count; i++) {
+            storage_index_put(&st->index, String(l->lines[i].rel_path), l->lines[i].size, l->lines[i].digest);
+        }
+        ReleaseSRWLockExclusive(&st->index.lock);
+    } else {
+        // Not in the index, the next run does them again
+        fprintf(stderr, "[import]: Failed to append the index log. Error code: %lu\n", GetLastError());
+        InterlockedExchangeAdd64(&im->failed, l->count);
+    }
+
+    for (int i = 0; i < l->count; i++) free(l->lines[i].rel_path);
+    l->count = 0;
+    LeaveCriticalSection(&l->lock);
+}
+
+void import_load(Importer *im, char *rel_path, s64 size, u8 *digest)
+{
+    Import_Loader *l = &im->loader;
+
+    EnterCriticalSection(&l->lock);
+    Import_Line *line = l->lines + l->count++;
+    line->rel_path = _strdup(rel_path);
+    line->size     = size;
+    memcpy(line->digest, digest, SHA256_DIGEST_SIZE);
+
+    // The lock is recursive, it's kept so no one adds in between
+    if (l->count == IMPORT_LOAD_BATCH) import_load_flush(im);
+    LeaveCriticalSection(&l->lock);
+}
+
+// A read of the source, at most 'io' of them at once.
+bool import_read(Importer *im, HANDLE h, char *buf, DWORD *read)
+{
+    EnterCriticalSection(&im->io_lock);
+    while (im->io_free == 0) SleepConditionVariableCS(&im->io_released, &im->io_lock, INFINITE);
+    im->io_free -= 1;
+    LeaveCriticalSection(&im->io_lock);
+
+    bool success = ReadFile(h, buf, (DWORD)IMPORT_READ_SIZE, read, NULL) != 0;
+
+    EnterCriticalSection(&im->io_lock);
+    im->io_free += 1;
+    WakeConditionVariable(&im->io_released);
+    LeaveCriticalSection(&im->io_lock);
+
+    return success;
+}
+
+void import_commit_batch(Import_Worker *w)
+{
+    if (w->batch_files == 0) return;
+
+    storage_batch_commit(w->im->st, &w->batch);
+    InterlockedExchangeAdd64(&w->im->failed, w->batch.failed_files);
+
+    free(w->batch.digests);
+    w->batch = {};
+    w->batch_files = 0;
+}
+
+void import_dir(Import_Worker *w, Import_Task *t)
+{
+    Importer *im = w->im;
+
+    char pattern[MAX_PATH];
+    snprintf(pattern, MAX_PATH, "%s/%s%s*", im->dir, t->rel_path, t->rel_path[0] ? "/" : "");
+
+    WIN32_FIND_DATAA fd;
+    HANDLE find = FindFirstFileA(pattern, &fd);
+    if (find == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "[import]: Failed to list %s. Error code: %lu\n", pattern, GetLastError());
+        InterlockedIncrement64(&im->failed);
+        return;
+    }
+
+    do {
+        char *name = fd.cFileName;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        // The storage's own files
+        if (im->in_place && t->rel_path[0] == '\0' && (strcmp(name, STORAGE_TMP_DIR) == 0 || strcmp(name, STORAGE_INDEX_LOG) == 0)) continue;
+
+        char rel_path[MAX_PATH];
+        int len = snprintf(rel_path, MAX_PATH, "%s%s%s", t->rel_path, t->rel_path[0] ? "/" : "", name);
+
+        // Links and junctions can point anywhere, even to a parent
+        if ((fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) || len >= MAX_PATH || !storage_path_is_safe(String(rel_path))) {
+            printf("[import]: Skipped %s/%s\n", t->rel_path[0] ? t->rel_path : ".", name);
+            InterlockedIncrement64(&im->skipped);
+            continue;
+        }
+
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            import_push(w, true, 0, rel_path);
+        } else {
+            s64 size = ((s64)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+            InterlockedIncrement64(&im->files_found);
+            InterlockedExchangeAdd64(&im->bytes_found, size);
+            import_push(w, false, size, rel_path);
+        }
+    } while (FindNextFileA(find, &fd));
+
+    FindClose(find);
+}
+
+// Replaces whatever is at the path with a link to the stored 'existing'.
+bool import_link(Importer *im, char *rel_path, char *existing)
+{
+    char link_path[MAX_PATH];
+    char target_path[MAX_PATH];
+    snprintf(link_path,   MAX_PATH, "%s/%s", im->st->root, rel_path);
+    snprintf(target_path, MAX_PATH, "%s/%s", im->st->root, existing);
+
+    if (!storage_make_parent_dirs(link_path)) return false;
+    DeleteFileA(link_path); // Left by an interrupted run
+
+    return CreateHardLinkA(link_path, target_path, NULL) != 0;
+}
+
+void import_file(Import_Worker *w, Import_Task *t)
+{
+    Importer *im = w->im;
+    Storage *st = im->st;
+    String rel_path = String(t->rel_path);
+
+    Storage_Entry e;
+    if (storage_lookup(st, rel_path, &e) && e.size == t->size) {
+        InterlockedIncrement64(&im->already_imported);
+        InterlockedIncrement64(&im->files_done);
+        InterlockedExchangeAdd64(&im->bytes_done, t->size);
+        return;
+    }
+
+    char source_path[MAX_PATH];
+    snprintf(source_path, MAX_PATH, "%s/%s", im->dir, t->rel_path);
+
+    HANDLE h = CreateFileA(source_path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "[import]: Failed to open %s. Error code: %lu\n", source_path, GetLastError());
+        InterlockedIncrement64(&im->failed);
+        return;
+    }
+
+    Storage_File f;
+    bool copying = !im->in_place;
+    if (copying && !storage_file_begin(st, rel_path, &f)) {
+        CloseHandle(h);
+        InterlockedIncrement64(&im->failed);
+        return;
+    }
+
+    // In place the file is only hashed
+    Sha256 sha;
+    sha256_init(&sha);
+    s64 size = 0;
+
+    bool success = true;
+    while (true) {
+        DWORD r = 0;
+        if (!import_read(im, h, w->buf, &r)) {
+            fprintf(stderr, "[import]: Failed to read %s. Error code: %lu\n", source_path, GetLastError());
+            success = false;
+            break;
+        }
+        if (r == 0) break;
+
+        if (copying) {
+            if (!storage_file_write(&f, w->buf, r)) {
+                success = false;
+                break;
+            }
+        } else {
+            sha256_update(&sha, w->buf, r);
+        }
+        size += r;
+        InterlockedExchangeAdd64(&im->bytes_done, r);
+    }
+    CloseHandle(h);
+
+    if (copying) success = success && storage_file_finish(&f);
+    if (!success) {
+        if (copying) storage_file_abort(&f);
+        InterlockedIncrement64(&im->failed);
+        return;
+    }
+
+    InterlockedIncrement64(&im->files_done);
+    InterlockedExchangeAdd64(&im->bytes_done, t->size - size); // It may have changed since the listing
+
+    if (!copying) {
+        u8 digest[SHA256_DIGEST_SIZE];
+        sha256_final(&sha, digest);
+        if (!import_digests_add(&im->digests, digest, rel_path)) InterlockedIncrement64(&im->duplicates);
+
+        import_load(im, t->rel_path, size, digest);
+        return;
+    }
+
+    // The stored file has to still be that content, a changed one was imported over it maybe.
+    // The shards on the disks aren't linked, every file has its own.
+    char existing[MAX_PATH];
+    bool stored = !st->disks && import_digests_lookup(&im->digests, f.digest, existing) && strcmp(existing, t->rel_path) != 0 &&
+                  storage_lookup(st, String(existing), &e) && e.has_digest && memcmp(e.digest, f.digest, SHA256_DIGEST_SIZE) == 0;
+    if (stored && import_link(im, t->rel_path, existing)) {
+        storage_file_abort(&f);
+        InterlockedIncrement64(&im->duplicates);
+        import_load(im, t->rel_path, size, f.digest);
+        return;
+    }
+
+    // The first of its content (or the link failed, it's a copy then)
+    storage_batch_add(st, &w->batch, &f);
+    w->batch_files += 1;
+    if (w->batch_files >= IMPORT_COMMIT_EVERY) import_commit_batch(w);
+}
+
+DWORD WINAPI import_worker_thread(void *param)
+{
+    Import_Worker *w = (Import_Worker *)param;
+    Importer *im = w->im;
+
+    while (true) {
+        Import_Task *t = import_deque_pop(&im->deques[w->index], true);
+        for (int i = 1; t == nullptr && i < im->thread_count; i++) {
+            t = import_deque_pop(&im->deques[(w->index + i) % im->thread_count], false);
+        }
+
+        if (t == nullptr) {
+            if (im->pending == 0) break;
+            Sleep(1); // The others are still listing directories
+            continue;
+        }
+
+        if (t->is_dir) import_dir(w, t);
+        else           import_file(w, t);
+
+        free(t);
+        InterlockedDecrement64(&im->pending);
+    }
+
+    import_commit_batch(w);
+    return 0;
+}
+
+void import_print_progress(Importer *im, s64 files_per_sec, s64 bytes_per_sec)
+{
+    printf("[import]: %lld/%lld files, %.2f/%.2f GB, %lld files/s, %.1f MB/s, %lld duplicate(s), %lld already imported, %lld skipped, %lld failed\n",
+           im->files_done, im->files_found,
+           (double)im->bytes_done / BYTES_TO_GB(1), (double)im->bytes_found / BYTES_TO_GB(1),
+           files_per_sec, (double)bytes_per_sec / BYTES_TO_MB(1),
+           im->duplicates, im->already_imported, im->skipped, im->failed);
+}
+
+// Once a second. The loader is flushed too, the checkpoint is never more than a second behind.
+DWORD WINAPI import_progress_thread(void *param)
+{
+    Importer *im = (Importer *)param;
+
+    s64 files = 0;
+    s64 bytes = 0;
+    while (!im->finished) {
+        Sleep(1000);
+        import_load_flush(im);
+
+        s64 files_now = im->files_done;
+        s64 bytes_now = im->bytes_done;
+        import_print_progress(im, files_now - files, bytes_now - bytes);
+        files = files_now;
+        bytes = bytes_now;
+    }
+
+    return 0;
+}
+
+// The absolute path with '/' separators and without a trailing one.
+bool import_full_path(char *path, char *out)
+{
+    DWORD n = GetFullPathNameA(path, MAX_PATH, out, NULL);
+    if (n == 0 || n >= MAX_PATH) return false;
+
+    for (char *p = out; *p; p++) if (*p == '\\') *p = '/';
+    while (n > 1 && out[n-1] == '/' && out[n-2] != ':') out[--n] = '\0';
+
+    return true;
+}
+
+// 'a' is 'b' or a directory under it.
+inline bool import_path_is_under(char *a, char *b)
+{
+    size_t len = strlen(b);
+    return _strnicmp(a, b, len) == 0 && (a[len] == '\0' || a[len] == '/');
+}
+
+// Returns false if any file failed, the next run retries those.
+bool import_run(Storage *st, char *dir, int thread_count, int io_count)
+{
+    Importer *im = (Importer *)calloc(1, sizeof(Importer));
+    assert(im);
+    im->st = st;
+
+    char root[MAX_PATH];
+    if (!import_full_path(dir, im->dir) || !import_full_path(st->root, root)) {
+        fprintf(stderr, "[import]: Invalid path %s. Error code: %lu\n", dir, GetLastError());
+        return false;
+    }
+
+    DWORD attributes = GetFileAttributesA(im->dir);
+    if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        fprintf(stderr, "[import]: %s is not a directory\n", im->dir);
+        return false;
+    }
+
+    im->in_place = _stricmp(im->dir, root) == 0;
+    if (!im->in_place && (import_path_is_under(im->dir, root) || import_path_is_under(root, im->dir))) {
+        fprintf(stderr, "[import]: %s and the storage root %s are inside each other, import the storage root itself to index the files in it\n", im->dir, root);
+        return false;
+    }
+
+    if (thread_count == 0) {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        thread_count = (int)info.dwNumberOfProcessors;
+    }
+    if (thread_count > IMPORT_MAX_THREADS) thread_count = IMPORT_MAX_THREADS;
+    im->thread_count = thread_count;
+
+    InitializeCriticalSection(&im->io_lock);
+    InitializeConditionVariable(&im->io_released);
+    im->io_free = io_count;
+
+    InitializeSRWLock(&im->digests.lock);
+    InitializeCriticalSection(&im->loader.lock);
+    for (int i = 0; i < thread_count; i++) InitializeCriticalSection(&im->deques[i].lock);
+
+    // What's stored already is where its content is linked from
+    for (s64 i = 0; i < st->index.capacity; i++) {
+        Storage_Entry *e = st->index.entries + i;
+        if (e->path && e->has_digest) import_digests_add(&im->digests, e->digest, String(e->path, e->path_count));
+    }
+    st->on_change      = import_committed;
+    st->on_change_user = im;
+
+    printf("[import]: %s %s with %d thread(s), %d read(s) at once\n", im->in_place ? "Indexing" : "Importing", im->dir, thread_count, io_count);
+
+    Import_Worker workers[IMPORT_MAX_THREADS];
+    HANDLE threads[IMPORT_MAX_THREADS];
+    ZERO_MEMORY(workers, sizeof(workers));
+
+    for (int i = 0; i < thread_count; i++) {
+        workers[i].im    = im;
+        workers[i].index = i;
+        workers[i].buf   = (char *)malloc(IMPORT_READ_SIZE);
+        assert(workers[i].buf);
+    }
+    import_push(&workers[0], true, 0, (char *)"");
+
+    ULONGLONG started = GetTickCount64();
+    HANDLE progress = CreateThread(NULL, 0, import_progress_thread, im, 0, NULL);
+
+    int started_count = 0;
+    for (; started_count < thread_count; started_count++) {
+        threads[started_count] = CreateThread(NULL, 0, import_worker_thread, workers + started_count, 0, NULL);
+        if (threads[started_count] == NULL) {
+            fprintf(stderr, "[import]: Failed to start a worker thread! Error code: %lu\n", GetLastError());
+            break;
+        }
+    }
+
+    // With fewer workers the others' deques are still stolen from
+    if (started_count) WaitForMultipleObjects(started_count, threads, TRUE, INFINITE);
+    im->finished = true;
+    if (progress) WaitForSingleObject(progress, INFINITE);
+    import_load_flush(im);
+
+    for (int i = 0; i < started_count; i++) CloseHandle(threads[i]);
+    for (int i = 0; i < thread_count; i++) free(workers[i].buf);
+
+    ULONGLONG elapsed_ms = GetTickCount64() - started;
+    if (elapsed_ms == 0) elapsed_ms = 1;
+    printf("[import]: Done in %.1f s\n", (double)elapsed_ms / 1000);
+    import_print_progress(im, im->files_done * 1000 / (s64)elapsed_ms, im->bytes_done * 1000 / (s64)elapsed_ms);
+
+    return started_count && im->failed == 0;
+}
+
+#endif
@@ -1,4 +1,9 @@
 #include "server.h"
+#include "upload.h"
+#include "url.h"
+#include "http2.h"
+#include "router.h"
+#include "archive.h"
  
 SOCKET create_listening_socket(int port) {
     // Initialize Winsock
@@ -36,7 +41,7 @@ SOCKET create_listening_socket(int port) {
         return -1;
     }
     
-    u64 blocking_is_enabled = 1;
+    u_long blocking_is_enabled = 1;
     int r = ioctlsocket(listenSocket, FIONBIO, &blocking_is_enabled);
     if (r != NO_ERROR) {
         printf("ioctlsocket failed with error: %ld\n", r);
@@ -46,20 +51,140 @@ SOCKET create_listening_socket(int port) {
     return listenSocket;
 }
 
-bool server_create(Server *s, int port)
+DWORD WINAPI worker_thread(void *param);
+
+void server_storage_changed(void *user, String rel_path)
+{
+    Server *s = (Server *)user;
+    cache_invalidate(&s->cache, rel_path);
+}
+
+// The hot options into the parts that keep their own copy. The rest of them (the timeouts and
+// the limits of the requests) are read from the 'config' at every use.
+void server_apply_config(Server *s)
+{
+    Config *cfg = &s->config;
+    cache_set_limits(&s->cache, cfg->cache_max_bytes, cfg->cache_max_object_size);
+    s->scrubber.bytes_per_sec   = cfg->scrub_bytes_per_sec;
+    s->storage.commit_window_ms = (LONG)cfg->commit_window_ms;
+    shaper_set_rates(&s->shaper, cfg->send_rate_total, cfg->send_rate_per_address, cfg->send_rate_per_connection);
+    profile_set_rates(&s->profiler, cfg->profile_hz, cfg->profile_trace_every);
+}
+
+// Loads the config file and the command line again and applies what can change while running.
+// Nothing changes if there is an invalid option.
+void server_reload_config(Server *s)
 {
-    s->socket = create_listening_socket(port);
-    if (s->socket == INVALID_SOCKET) {
-        fprintf(stderr, "Failed to create listening socket.\n");
+    EnterCriticalSection(&s->config_lock);
+    
+    Config next;
+    if (!config_load(&next, s->config.argc, s->config.argv)) {
+        fprintf(stderr, "[config]: Reload failed, keeping the current config\n");
+        LeaveCriticalSection(&s->config_lock);
+        return;
+    }
+    
+    for (int i = 0; i < ARRAY_SIZE(CONFIG_OPTIONS); i++) {
+        const Config_Option *opt = CONFIG_OPTIONS + i;
+        
+        if (opt->kind == CONFIG_PATH) {
+            if (strcmp((char *)&s->config + opt->offset, (char *)&next + opt->offset) != 0) {
+                printf("[config]: '%s' changes only on a restart\n", opt->name);
+            }
+            continue;
+        }
+        
+        s64 *current = config_number(&s->config, opt);
+        s64 value    = *config_number(&next, opt);
+        if (*current == value) continue;
+        
+        if (!opt->hot) {
+            printf("[config]: '%s' changes only on a restart\n", opt->name);
+            continue;
+        }
+        
+        // One aligned store, the workers see either the old or the new value
+        printf("[config]: %s: %lld -> %lld\n", opt->name, *current, value);
+        *current = value;
+    }
+    
+    server_apply_config(s);
+    LeaveCriticalSection(&s->config_lock);
+}
+
+bool server_create(Server *s)
+{
+    Config *cfg = &s->config;
+    InitializeCriticalSection(&s->config_lock);
+    
+    if (!storage_create(&s->storage, cfg->storage_root, cfg->disks, (int)cfg->disk_parity)) {
+        fprintf(stderr, "Failed to open the storage at %s\n", cfg->storage_root);
         return false;
     }
     
-    s->port = port;
-    s->clients = (Request *)malloc(sizeof(Request) * MAX_CLIENTS);
-    for (auto i = 0; i < MAX_CLIENTS; i++) s->clients[i].id = i;
-    assert(s->clients);
-    memset(s->free_clients, 1, MAX_CLIENTS);
-     
+    cache_init(&s->cache);
+    shaper_init(&s->shaper, (int)cfg->max_clients);
+    profile_init(&s->profiler);
+    s->storage.on_change      = server_storage_changed;
+    s->storage.on_change_user = s;
+    
+    if (!scrub_start(&s->scrubber, &s->storage)) return false;
+    
+    server_apply_config(s);
+    
+    // On an upgrade the sockets (and so the ports) are the ones of the old process
+    if (handoff_requested()) {
+        if (!handoff_receive(&s->handoff, &s->socket, &s->tls_socket)) return false;
+    } else {
+        s->socket = create_listening_socket((int)cfg->port);
+        if (s->socket == INVALID_SOCKET) {
+            fprintf(stderr, "Failed to create listening socket.\n");
+            return false;
+        }
+    }
+    
+    // TLS is optional, the plain port works without a certificate
+    if (tls_server_create(&s->tls)) {
+        if (s->tls_socket == INVALID_SOCKET) s->tls_socket = create_listening_socket((int)cfg->tls_port);
+        if (s->tls_socket == INVALID_SOCKET) {
+            fprintf(stderr, "Failed to create the TLS listening socket.\n");
+            return false;
+        }
+    } else if (s->tls_socket != INVALID_SOCKET) {
+        closesocket(s->tls_socket); // The old process had a certificate, this one doesn't
+        s->tls_socket = INVALID_SOCKET;
+    }
+    
+    s->port = (int)cfg->port;
+    s->clients = (Request *)calloc(cfg->max_clients, sizeof(Request));
+    s->free_clients = (bool *)malloc(cfg->max_clients);
+    s->queue   = (Request **)calloc(cfg->max_clients, sizeof(Request *));
+    s->workers = (HANDLE *)calloc(cfg->workers, sizeof(HANDLE));
+    assert(s->clients && s->free_clients && s->queue && s->workers);
+    
+    for (auto i = 0; i < cfg->max_clients; i++) {
+        s->clients[i].id       = i;
+        s->clients[i].buf      = (char *)malloc(cfg->header_buffer_size);
+        s->clients[i].buf_size = cfg->header_buffer_size;
+        assert(s->clients[i].buf);
+    }
+    memset(s->free_clients, 1, cfg->max_clients);
+    
+    InitializeCriticalSection(&s->clients_lock);
+    InitializeConditionVariable(&s->queue_not_empty);
+    s->queue_head  = 0;
+    s->queue_count = 0;
+    
+    for (auto i = 0; i < cfg->workers; i++) {
+        s->workers[i] = CreateThread(NULL, 0, worker_thread, s, 0, NULL);
+        if (s->workers[i] == NULL) {
+            fprintf(stderr, "Failed to start worker thread #%d. Error code: %lu\n", i, GetLastError());
+            return false;
+        }
+    }
+    profile_attach(&s->profiler, s->workers, (int)cfg->workers);
+    
+    s->running = true;
     return true;
 }
 
@@ -67,8 +192,11 @@ void server_shutdown(Server *s, bool force = false)
 {
     printf("[server]: Shutdown...\n");
 
-    if (s->running) {
+    if (s->socket != INVALID_SOCKET) {
         ASSERT(closesocket(s->socket) == 0, "Failed to close server (listen socket) socket!\n");
+        if (s->tls_socket != INVALID_SOCKET) closesocket(s->tls_socket);
+        s->socket     = INVALID_SOCKET;
+        s->tls_socket = INVALID_SOCKET;
         printf("[server]: Socket closed!\n");
     }
         
@@ -82,6 +210,103 @@ void server_shutdown(Server *s, bool force = false)
     printf("[server]: Stopped!\n");
 }
 
+int server_busy_clients(Server *s)
+{
+    int busy = 0;
+    EnterCriticalSection(&s->clients_lock);
+    for (auto i = 0; i < s->config.max_clients; i++) {
+        if (!s->free_clients[i]) busy += 1;
+    }
+    LeaveCriticalSection(&s->clients_lock);
+    
+    return busy;
+}
+
+// After the accept loop stopped: closes the listening sockets (if they were handed over, the new
+// process has its own) and gives the accepted connections 'drain_timeout_ms' to finish. The
+// ones still busy after that are cut. An upload keeps the files it received completely, they are
+// committed like after any broken connection, and the client sends the rest to the new process.
+void server_drain(Server *s)
+{
+    s->draining = true;
+    
+    if (s->socket != INVALID_SOCKET) {
+        closesocket(s->socket);
+        s->socket = INVALID_SOCKET;
+    }
+    if (s->tls_socket != INVALID_SOCKET) {
+        closesocket(s->tls_socket);
+        s->tls_socket = INVALID_SOCKET;
+    }
+    
+    ULONGLONG deadline = GetTickCount64() + s->config.drain_timeout_ms;
+    int busy = server_busy_clients(s);
+    if (busy) printf("[server]: Draining %d connection(s), at most %lld ms\n", busy, s->config.drain_timeout_ms);
+    
+    while (busy && GetTickCount64() < deadline) {
+        Sleep(100);
+        busy = server_busy_clients(s);
+    }
+    
+    if (busy) {
+        printf("[server]: Closing the %d connection(s) still busy\n", busy);
+        
+        EnterCriticalSection(&s->clients_lock);
+        for (auto i = 0; i < s->config.max_clients; i++) {
+            SOCKET socket = s->clients[i].socket;
+            if (!s->free_clients[i] && s->clients[i].connected) shutdown(socket, SD_BOTH);
+        }
+        LeaveCriticalSection(&s->clients_lock);
+        
+        // The workers notice at their next recv() or send() and commit what they have
+        deadline = GetTickCount64() + s->config.client_timeout_ms;
+        while (server_busy_clients(s) && GetTickCount64() < deadline) Sleep(100);
+    }
+    
+    printf("[server]: Drained\n");
+}
+
+// Waits for 'server --upgrade'. Once the new process accepts on the sockets, the accept loop of
+// this one stops and main() drains it.
+DWORD WINAPI server_upgrade_thread(void *param)
+{
+    Server *s = (Server *)param;
+    
+    while (s->running) {
+        if (WaitForSingleObject(s->upgrade_event, INFINITE) != WAIT_OBJECT_0 || !s->running) break;
+        
+        printf("[handoff]: Upgrade requested, starting the new process\n");
+        if (handoff_start(s->socket, s->tls_socket)) {
+            printf("[handoff]: The new process is accepting, draining this one\n");
+            s->running = false;
+            break;
+        }
+        
+        fprintf(stderr, "[handoff]: Upgrade failed, this process keeps serving\n");
+    }
+    
+    return 0;
+}
+
+// In the new process of an upgrade. The old one still commits its uploads while it drains, they
+// are picked up from the index log until it exits.
+DWORD WINAPI server_old_process_thread(void *param)
+{
+    Server *s = (Server *)param;
+    
+    while (handoff_parent_alive(&s->handoff)) {
+        Sleep(1000);
+        storage_index_refresh(&s->storage);
+    }
+    storage_index_refresh(&s->storage);
+    
+    CloseHandle(s->handoff.from_parent);
+    s->handoff.from_parent = INVALID_HANDLE_VALUE;
+    printf("[handoff]: The old process exited\n");
+    
+    return 0;
+}
+
 inline bool http_header_parse_line(String line, String *key, String *value)
 {
     bool success = true;
@@ -91,19 +316,51 @@ inline bool http_header_parse_line(String line, String *key, String *value)
 
 inline void close_client(Server *s, Request *c)
 {
+    if (c->tls) tls_close(&s->tls, c->tls, c->socket);
+    
     if (c->connected) {
         ASSERT(closesocket(c->socket) == 0, "Failed to close the client socket!", c->socket);
-        s->free_clients[c->id] = true;
-        
         printf("#%lld: Connection closed!\n", c->socket);
     }
     
+    if (c->flow) shaper_release(c->flow);
+    profile_trace_end(&s->profiler, &c->trace, http_method_enum_to_str(c->method), c->path);
+    
+    u32 id = c->id;
+    char *buf = c->buf;
+    s64 buf_size = c->buf_size;
     ZERO_MEMORY(c, sizeof(Request));
+    c->id = id;
+    c->buf = buf;
+    c->buf_size = buf_size;
+    
+    // The slot can be reused by the accept loop right after this
+    EnterCriticalSection(&s->clients_lock);
+    s->free_clients[id] = true;
+    LeaveCriticalSection(&s->clients_lock);
+}
+
+// Up to 'want' bytes that the shaper lets the connection send now (see shaper.h).
+inline s64 send_grant(Request *c, s64 want)
+{
+    return c->flow ? shaper_take(c->flow, &c->send_bucket, want) : want;
 }
 
 bool send_to_client(Request *c, String *buffer, s64 at_once = -1)
 {
     if (!c->connected) return false;
+    profile_phase(&c->trace, PROFILE_SEND);
+    if (c->h2)  return h2_send(c, buffer->data, buffer->count);
+    
+    if (c->tls) {
+        for (s64 done = 0; done < buffer->count;) {
+            s64 n = send_grant(c, buffer->count - done);
+            if (!tls_send(c->tls, c->socket, buffer->data + done, n)) return false;
+            done += n;
+        }
+        return true;
+    }
+    
     if (at_once <= 0) at_once = buffer->count;
     
     // printf("[send/start]: len: %d ; at_once: %d\n", buffer->count, at_once);
@@ -113,20 +370,28 @@ bool send_to_client(Request *c, String *buffer, s64 at_once = -1)
     s32 err   = 0;
     
     while (remain != 0) {
-        sent = send(c->socket, buffer->data, at_once, 0);
-        err = WSAGetLastError();
+        s64 chunk = remain < at_once ? remain : at_once;
+        if (chunk > INT_MAX) chunk = INT_MAX;
+        chunk = send_grant(c, chunk);
+        
+        sent = send(c->socket, buffer->data + (buffer->count - remain), (int)chunk, 0);
         
         if (sent == 0) {
             fprintf(stderr, "Connection is closed!\n");
             return false;
-        } else if (err == WSAEWOULDBLOCK) {
-            // print("[send/progress]: WSAEWOULDBLOCK\n");
-            continue;        
         } else if (sent == SOCKET_ERROR) {
-            // It is valid??
-            fprintf(stderr, "SOCKET ERROR. Error code: %d\n", WSAGetLastError());
+            err = WSAGetLastError();
+            if (c->flow) shaper_give_back(c->flow, &c->send_bucket, chunk);
+            if (err == WSAEWOULDBLOCK) {
+                // print("[send/progress]: WSAEWOULDBLOCK\n");
+                continue;
+            }
+            
+            fprintf(stderr, "SOCKET ERROR. Error code: %d\n", err);
             return false;
         }
+        
+        if (c->flow && sent < chunk) shaper_give_back(c->flow, &c->send_bucket, chunk - sent);
 
         remain -= sent;
         
@@ -138,89 +403,98 @@ bool send_to_client(Request *c, String *buffer, s64 at_once = -1)
     return true;
 }
 
-bool http_parse_header(Request *c)
+// Parses the header in the first 'received' bytes of the 'buf'. 'complete' is false if its end
+// hasn't arrived yet. Returns false if the header is invalid.
+bool http_parse_header_bytes(Request *c, s64 received, bool *complete)
 {
-    auto buf_size = sizeof(c->buf);
+    // The rest of the buffer (if any) is the beginning of the body
+    bool found = false;
+    String buf = String(c->buf, (u32)received);
+    c->header = split(buf, CRLF CRLF, &c->body, &found);
     
-    while (true) {
-        int r = recv(c->socket, c->buf, buf_size, 0);
-        int err = WSAGetLastError();
+    *complete = found;
+    if (!found) return true;
+    
+    printf("\n-------------------\nsocket: #%lld\n" SFMT "\n", c->socket, SARG(c->header));
+    
+    String line = split_and_move(&c->header, CRLF, &found);
+    if (!found) c->header.count = 0; // Only the request line, like the HTTP/2 preface
+    {
+        String method = split_and_move(&line, " ", &found);
+        if (!found) return false;
         
-        if (r == 0) {
-            fprintf(stderr, "Connection is closed!");
-            return false;
-        } else if (err == WSAEWOULDBLOCK) {
-            // print("WSAEWOULDBLOCK\n");
-            continue;            
-        } else if (r == SOCKET_ERROR) {
-            fprintf(stderr, "SOCKET ERROR - Connection is closed!");
-            std::cerr << "SOCKET ERROR. Error code: " <<  WSAGetLastError() << std::endl;
-            return false;
+        c->path = split_and_move(&line, " ", &found);
+        if (!found) return false;
+        c->path = split(c->path, "?", &c->query);
+        
+        c->protocol = line;
+        
+        // The HTTP/2 connection preface looks like a request, and its "body" is the
+        // rest of the preface and the frames
+        if (method == "PRI" && c->path == "*" && c->protocol == "HTTP/2.0") {
+            c->state = HTTP_STATE_H2_PREFACE;
+            return true;
         }
         
-        bool found = false;
-        String buf = String(c->buf, r);
-        c->header = split(buf, CRLF CRLF, &c->body, &found);
-        if (c->body.count != 0) {
-            printf("\nBODY\n" SFMT "\n\n", SARG(c->body));
-            ASSERT(c->body.count == 0, "Probably the body camed with the header? %ld\n", c->body.count);    
+        if (c->protocol != HTTP_1_1) {
+            printf("Invalid protocol -> " SFMT "\n", SARG(c->protocol));
+            return false;
         }
         
-        if (!found) {
-            printf("Not found the end of the http header!\n");
+        c->method = http_method_str_to_enum(method);
+    }
+    
+    do {
+        line = split_and_move(&c->header, CRLF, &found);
+        
+        String key, value;
+        if (!http_header_parse_line(line, &key, &value)) {
+            fprintf(stderr, "Failed to parse header line -> " SFMT "\n", SARG(line));
             return false;
         }
         
-        printf("\n-------------------\nsocket: #%lld\n" SFMT "\n", c->socket, SARG(c->header));
+        if (!http_request_apply_header(c, key, value)) return false;
         
-        String line = split_and_move(&c->header, CRLF, &found);
-        if (!found) return false;
-        {
-            String method = split_and_move(&line, " ", &found);
-            if (!found) return false;
-            
-            c->path = split_and_move(&line, " ", &found);
-            if (!found) return false;
-            
-            c->protocol = line;
-            if (c->protocol != HTTP_1_1) {
-                printf("Invalid protocol -> " SFMT "\n", SARG(c->protocol));
-                return false;
+    } while (found);
+    
+    c->state = HTTP_STATE_HEADER_PARSED;
+    
+    return true;
+}
+
+bool http_parse_header(Request *c)
+{
+    auto buf_size = c->buf_size;
+    int received = 0;
+    
+    while (true) {
+        int r = request_recv(c, c->buf + received, (int)(buf_size - received));
+        
+        if (r == 0) {
+            fprintf(stderr, "Connection is closed!");
+            return false;
+        } else if (r == SOCKET_ERROR) {
+            int err = WSAGetLastError();
+            if (err == WSAEWOULDBLOCK) {
+                // print("WSAEWOULDBLOCK\n");
+                continue;
             }
             
-            c->method = http_method_str_to_enum(method);
+            fprintf(stderr, "SOCKET ERROR - Connection is closed!");
+            std::cerr << "SOCKET ERROR. Error code: " << err << std::endl;
+            return false;
         }
         
-        do {
-            line = split_and_move(&c->header, CRLF, &found);
-            
-            String key, value;
-            if (!http_header_parse_line(line, &key, &value)) {
-                fprintf(stderr, "Failed to parse header line -> " SFMT "\n", SARG(line));
-                return false;
-            }
-            
-            if (key == "Content-Type") {
-                c->content_type = content_type_str_to_enum(value);
-                if (c->content_type == Mime_None) {
-                    printf("Content type not handled as enum -> " SFMT "\n", SARG(value));
-                }
-                
-            } else if (key == "Content-Length") {
-                bool to_int_ok = true;
-                c->content_length = string_to_int(value, &to_int_ok);
-                
-                if (!to_int_ok) {
-                    fprintf(stderr, "Failed to parse Content-Length to int -> " SFMT "\n", SARG(value));
-                    return false;
-                }
-            }
-            
-        } while (found);
+        received += r;
         
-        c->state = HTTP_STATE_HEADER_PARSED;
+        bool complete = false;
+        if (!http_parse_header_bytes(c, received, &complete)) return false;
+        if (complete) return true;
         
-        return true;
+        if (received < buf_size) continue;
+        
+        printf("Not found the end of the http header!\n");
+        return false;
     }
 }
 
@@ -243,12 +517,18 @@ String http_header_create(Http_Response_Status status)
         case HTTP_OK:
             http_header_append(&h, HTTP_1_1 " 200 Ok");
         break;
+        case HTTP_CREATED:
+            http_header_append(&h, HTTP_1_1 " 201 Created");
+        break;
         case HTTP_NOT_FOUND: 
             http_header_append(&h, HTTP_1_1 " 404 Not Found");
         break;
         case HTTP_BAD_REQUEST: 
             http_header_append(&h, HTTP_1_1 " 400 Bad Request");
         break;
+        case HTTP_METHOD_NOT_ALLOWED: 
+            http_header_append(&h, HTTP_1_1 " 405 Method Not Allowed");
+        break;
         case HTTP_MOVED_PERMANENTLY: 
             http_header_append(&h, HTTP_1_1 " 301 Moved Permanently");
         break;
@@ -261,6 +541,18 @@ String http_header_create(Http_Response_Status status)
         case HTTP_PERMANENT_REDIRECT: 
             http_header_append(&h, HTTP_1_1 " 308 Permanent Redirect");
         break;
+        case HTTP_UNPROCESSABLE_ENTITY: 
+            http_header_append(&h, HTTP_1_1 " 422 Unprocessable Entity");
+        break;
+        case HTTP_PAYLOAD_TOO_LARGE: 
+            http_header_append(&h, HTTP_1_1 " 413 Payload Too Large");
+        break;
+        case HTTP_UNSUPPORTED_MEDIA_TYPE: 
+            http_header_append(&h, HTTP_1_1 " 415 Unsupported Media Type");
+        break;
+        case HTTP_INTERNAL_SERVER_ERROR: 
+            http_header_append(&h, HTTP_1_1 " 500 Internal Server Error");
+        break;
         default:
             ASSERT(0, "TODO more http header!\n");
     }
@@ -268,52 +560,583 @@ String http_header_create(Http_Response_Status status)
     return h;
 }
 
-void handle_request(Request *c)
+// The whole header, with the empty line at the end.
+String http_response_header(Http_Response_Status status, Mime_Type content_type, s64 content_length, char *location = nullptr)
 {
+    String header = http_header_create(status); 
+    http_header_append(&header, "Connection: close");
+    
+    char line[512] = {0};
+    if (location) {
+        snprintf(line, sizeof(line), "Location: %s", location);
+        http_header_append(&header, line);
+    }
+    
+    if (content_type != Mime_None) {
+        snprintf(line, sizeof(line), "Content-Type: %s", content_type_enum_to_str(content_type));
+        http_header_append(&header, line);
+    }
+    
+    snprintf(line, sizeof(line), "Content-Length: %lld", content_length);
+    http_header_append(&header, line);
+
+    printf("\nResponse:\n" SFMT " \n", SARG(header));
+    
+    join(&header, CRLF);
+    
+    return header;
+}
+
+void http_respond(Request *c, Http_Response_Status status, Mime_Type content_type, String body, char *location = nullptr)
+{
+    String header = http_response_header(status, content_type, body.count, location);
+    send_to_client(c, &header);
+    if (body.count) send_to_client(c, &body);
+    
+    free(header);
+}
+
+inline bool send_cached(Request *c, Cache_Object *o)
+{
+    String response = String(o->data, (u32)o->count);
+    return send_to_client(c, &response);
+}
+
+// POST /upload-batch: multipart/form-data with any number of files, or a tar stream.
+// POST /upload-photo: the same, but it redirects back to the index page like a form does.
+void handle_upload(Server *s, Request *c, bool redirect)
+{
+    if (c->content_length <= 0) {
+        http_respond(c, HTTP_BAD_REQUEST, Mime_None, String());
+        return;
+    }
+    
+    if (c->content_type != Mime_Multipart_FormData && c->content_type != Mime_App_Tar) {
+        http_respond(c, HTTP_UNSUPPORTED_MEDIA_TYPE, Mime_None, String());
+        return;
+    }
+    
+    if (c->content_length > s->config.max_request_size) {
+        http_respond(c, HTTP_PAYLOAD_TOO_LARGE, Mime_None, String());
+        return;
+    }
+    
+    Upload_Result res;
+    bool success = upload_ingest(&s->storage, c, s->config.recv_buffer_size, &res);
+    
+    if (redirect && success && res.mismatched == 0) {
+        http_respond(c, HTTP_SEE_OTHER, Mime_None, String(), "/");
+        free(res.digests);
+        return;
+    }
+    
     Http_Response_Status status = HTTP_OK;
+    if (!success)          status = HTTP_BAD_REQUEST;
+    if (res.mismatched)    status = HTTP_UNPROCESSABLE_ENTITY;
+    
+    char counts[256] = {0};
+    snprintf(counts, sizeof(counts), "{\"files\": %lld, \"bytes\": %lld, \"failed\": %lld, \"mismatched\": %lld, \"sha256\": {",
+             res.files, res.bytes, res.failed, res.mismatched);
+    
+    String json = string_create(256 + res.digests.count);
+    join(&json, counts);
+    if (res.digests.count) join(&json, &res.digests);
+    join(&json, "}}");
+    
+    http_respond(c, status, Mime_App_Json, json);
+    
+    free(json);
+    free(res.digests);
+}
+
+void handle_upload_batch(Server *s, Request *c, Route_Params *params)
+{
+    handle_upload(s, c, false);
+}
 
-    if (c->method == HTTP_METHOD_POST) {
-        if (c->path == "/upload-photo") {
+void handle_upload_photo(Server *s, Request *c, Route_Params *params)
+{
+    handle_upload(s, c, true);
+}
+
+// The variants of a key in the response cache
+enum Cached_Response {
+    CACHED_FILE_INLINE = 0,
+    CACHED_FILE_ATTACHMENT,
+    CACHED_PAGE,
+};
+
+void handle_index(Server *s, Request *c, Route_Params *params)
+{
+    String key = String("index.html");
+    Cache_Object *o = cache_get(&s->cache, key, CACHED_PAGE);
+    
+    if (o == nullptr) {
+        LONG generation = cache_generation(&s->cache, key);
+        String body = read_entire_file(key, "rb");
+        String header = http_response_header(HTTP_OK, Mime_Text_Html, body.count);
+        
+        // Nothing notifies us when the index.html changes, so it's only cached for a short time
+        o = cache_object_create(key, CACHED_PAGE, header.count + body.count, (DWORD)s->config.page_cache_ttl_ms);
+        if (o) {
+            memcpy(o->data, header.data, header.count);
+            memcpy(o->data + header.count, body.data, body.count);
+            cache_put(&s->cache, o, generation);
+        } else {
+            if (send_to_client(c, &header)) send_to_client(c, &body);
         }
+        
+        free(header);
+        free(body);
+        if (o == nullptr) return;
+    }
+    
+    send_cached(c, o);
+    cache_release(o);
+}
 
-        status = HTTP_SEE_OTHER;
-    } else {
+// Sends 'size' bytes of the file after the header. The plain connections use TransmitFile(),
+// so the file goes from the cache to the socket without passing through our buffers. The TLS
+// ones encrypt the file in the record buffer (see tls_send_file), the HTTP/2 streams send it
+// in DATA frames. The 'head' goes right before the file, in the same TransmitFile() call when
+// there is one.
+bool send_file_to_client(Request *c, HANDLE h, s64 size, String *head = nullptr)
+{
+    profile_phase(&c->trace, PROFILE_SEND);
+    bool shaped = c->flow && shaper_is_limited(c->flow->shaper);
+    if (head && head->count && (c->h2 || c->tls || shaped)) {
+        if (!send_to_client(c, head)) return false;
+        head = nullptr;
     }
     
-    String header = http_header_create(status); 
+    if (c->h2) return h2_send_file(c, h, size);
+    
+    if (c->tls) {
+        while (size > 0) {
+            s64 n = send_grant(c, size);
+            if (!tls_send_file(c->tls, c->socket, h, n)) return false;
+            size -= n;
+        }
+        return true;
+    }
+    
+    TRANSMIT_FILE_BUFFERS buffers;
+    ZERO_MEMORY(&buffers, sizeof(buffers));
+    if (head) {
+        buffers.Head       = head->data;
+        buffers.HeadLength = (DWORD)head->count;
+    }
+    if (c->flow && !shaped) shaper_take(c->flow, &c->send_bucket, size + buffers.HeadLength); // Only counted
+    
+    // At most TRANSMIT_FILE_MAX_CALL bytes per call, the shaped connections one grant per call.
+    // The 'head' goes with the first one.
+    LARGE_INTEGER offset = {0};
+    while (size > 0) {
+        s64 n = shaped ? send_grant(c, size) : size;
+        if (n > TRANSMIT_FILE_MAX_CALL) n = TRANSMIT_FILE_MAX_CALL;
+        
+        SetFilePointerEx(h, offset, NULL, FILE_BEGIN);
+        if (!TransmitFile(c->socket, h, (DWORD)n, 0, NULL, head ? &buffers : NULL, TF_USE_KERNEL_APC)) {
+            fprintf(stderr, "#%lld: TransmitFile() failed! Error code: %d\n", c->socket, WSAGetLastError());
+            return false;
+        }
+        head = nullptr;
+        
+        offset.QuadPart += n;
+        size -= n;
+    }
+    
+    // An empty file, only the head
+    if (head && head->count) return send_to_client(c, head);
+    
+    return true;
+}
+
+// GET /files/*path: a stored file. With ?download=1 it is sent as an attachment. The small
+// ones are served from the response cache.
+void handle_file(Server *s, Request *c, Route_Params *params)
+{
+    // The path is already normalized, the storage still rejects what Windows would misread
+    String rel_path = params->values[0];
+    if (!storage_path_is_safe(rel_path)) {
+        http_respond(c, HTTP_NOT_FOUND, Mime_None, String());
+        return;
+    }
+    
+    char value_buf[16];
+    String download;
+    bool attachment = url_query_get(c->query, "download", &download, value_buf, sizeof(value_buf)) && download == "1";
+    u32 variant = attachment ? CACHED_FILE_ATTACHMENT : CACHED_FILE_INLINE;
+    
+    Cache_Object *o = cache_get(&s->cache, rel_path, variant);
+    if (o) {
+        send_cached(c, o);
+        cache_release(o);
+        return;
+    }
+    
+    // Before the file is opened: if it's replaced after this, the response won't be cached
+    LONG generation = cache_generation(&s->cache, rel_path);
+    
+    Storage_Entry entry;
+    if (!storage_lookup(&s->storage, rel_path, &entry)) {
+        http_respond(c, HTTP_NOT_FOUND, Mime_None, String());
+        return;
+    }
+    
+    char path[MAX_PATH];
+    snprintf(path, MAX_PATH, SFMT, SARG(rel_path));
+    
+    Storage_Reader r;
+    if (!storage_open(&s->storage, path, &r)) {
+        http_respond(c, HTTP_NOT_FOUND, Mime_None, String());
+        return;
+    }
+    
+    String header = http_header_create(HTTP_OK);
     http_header_append(&header, "Connection: close");
-    if (status == HTTP_TEMPORARY_REDIRECT) {
-        http_header_append(&header, "Location: /");
+    
+    char line[512] = {0};
+    snprintf(line, sizeof(line), "Content-Type: %s", content_type_enum_to_str(content_type_from_extension(rel_path)));
+    http_header_append(&header, line);
+    snprintf(line, sizeof(line), "Content-Length: %lld", r.size);
+    http_header_append(&header, line);
+    
+    if (attachment) http_header_append(&header, "Content-Disposition: attachment");
+    
+    join(&header, CRLF);
+    
+    if (header.count + r.size <= s->cache.max_object_size) {
+        o = cache_object_create(rel_path, variant, header.count + r.size);
+    }
+    
+    if (o) {
+        memcpy(o->data, header.data, header.count);
+        if (storage_read(&r, o->data + header.count, r.size)) {
+            cache_put(&s->cache, o, generation);
+            send_cached(c, o);
+        } else {
+            fprintf(stderr, "Failed to read %s. Error code: %lu\n", path, GetLastError());
+            http_respond(c, HTTP_INTERNAL_SERVER_ERROR, Mime_None, String());
+        }
+        cache_release(o);
+    } else if (send_to_client(c, &header)) {
+        if (r.handle != INVALID_HANDLE_VALUE) {
+            send_file_to_client(c, r.handle, r.size);
+        } else {
+            // From the disks, a few stripes at a time
+            String chunk = string_create(ERASURE_IO_SIZE);
+            for (s64 left = r.size; left > 0;) {
+                s64 n = left < ERASURE_IO_SIZE ? left : ERASURE_IO_SIZE;
+                profile_phase(&c->trace, PROFILE_STORAGE);
+                if (!storage_read(&r, chunk.data, n)) {
+                    fprintf(stderr, "Failed to read %s\n", path);
+                    break;
+                }
+                chunk.count = n;
+                if (!send_to_client(c, &chunk)) break;
+                left -= n;
+            }
+            free(chunk);
+        }
     }
+    
+    free(header);
+    storage_close(&r);
+}
 
-    printf("\nResponse:\n" SFMT " \n", SARG(header));
-        
-    String body = read_entire_file("index.html", "r");
-    {
-        char cl[128] = {0};
-        snprintf(*&cl, 128, "Content-Length: %ld", body.count);
-        http_header_append(&header, cl);
+// GET /zip/*path, GET /tar/*path: the files under the folder (every file without a path) as
+// one archive, built while it's sent (see archive.h). ?method=deflate compresses the ZIP entries.
+void handle_archive(Server *s, Request *c, Route_Params *params, Archive_Format format)
+{
+    String folder = params->count ? params->values[0] : String();
+    if (folder.count && !storage_path_is_safe(folder)) {
+        http_respond(c, HTTP_NOT_FOUND, Mime_None, String());
+        return;
     }
     
+    s64 count = 0;
+    Archive_Entry *entries = archive_collect(&s->storage, folder, &count);
+    if (count == 0) {
+        archive_free_entries(entries, count);
+        http_respond(c, HTTP_NOT_FOUND, Mime_None, String());
+        return;
+    }
+    
+    char value_buf[16];
+    String method;
+    bool deflate = format == ARCHIVE_ZIP && url_query_get(c->query, "method", &method, value_buf, sizeof(value_buf)) && method == "deflate";
+    
+    // Named after the folder
+    String name = folder.count ? folder : String("storage");
+    for (s64 i = name.count - 1; i >= 0; i--) {
+        if (name.data[i] == '/') {
+            advance(&name, (u32)(i + 1));
+            break;
+        }
+    }
+    
+    String header = http_header_create(HTTP_OK);
+    http_header_append(&header, "Connection: close");
+    
+    char line[MAX_PATH + 64] = {0};
+    snprintf(line, sizeof(line), "Content-Type: %s", content_type_enum_to_str(format == ARCHIVE_ZIP ? Mime_App_Zip : Mime_App_Tar));
+    http_header_append(&header, line);
+    snprintf(line, sizeof(line), "Content-Disposition: attachment; filename=\"" SFMT ".%s\"", SARG(name), format == ARCHIVE_ZIP ? "zip" : "tar");
+    http_header_append(&header, line);
+    
+    // HTTP/2 has its own framing
+    if (c->h2 == nullptr) http_header_append(&header, "Transfer-Encoding: chunked");
+    
     join(&header, CRLF);
-    send_to_client(c, &header);
-    send_to_client(c, &body);
+    
+    if (send_to_client(c, &header)) archive_send(c, &s->storage, entries, count, folder, format, deflate);
     
     free(header);
-    free(body);
+    archive_free_entries(entries, count);
+}
+
+void handle_zip(Server *s, Request *c, Route_Params *params)
+{
+    handle_archive(s, c, params, ARCHIVE_ZIP);
+}
+
+void handle_tar(Server *s, Request *c, Route_Params *params)
+{
+    handle_archive(s, c, params, ARCHIVE_TAR);
+}
+
+// GET /status: the counters of the shaping, with the client addresses connected now, and the
+// ones of the disks if the files are erasure-coded over them.
+void handle_status(Server *s, Request *c, Route_Params *params)
+{
+    Shaper *sh = &s->shaper;
+    char line[512];
+    
+    snprintf(line, sizeof(line), "{\"shaping\": {\"send_rate_total\": %lld, \"send_rate_per_address\": %lld, \"send_rate_per_connection\": %lld, "
+             "\"bytes_sent\": %lld, \"throttled_ms\": %lld, \"grants\": %lld, \"clients\": [",
+             sh->total_rate, sh->address_rate, sh->connection_rate, sh->bytes_sent, sh->throttled_ms, sh->grants);
+    
+    String json = string_create(1024);
+    join(&json, line);
+    
+    bool first = true;
+    EnterCriticalSection(&sh->lock);
+    for (int i = 0; i < sh->flow_capacity; i++) {
+        Shaper_Flow *f = sh->flows + i;
+        if (f->connections == 0) continue;
+        
+        u8 *a = (u8 *)&f->address;
+        snprintf(line, sizeof(line), "%s{\"address\": \"%u.%u.%u.%u\", \"connections\": %d, \"bytes_sent\": %lld, \"throttled_ms\": %lld}",
+                 first ? "" : ", ", a[0], a[1], a[2], a[3], f->connections, f->bytes_sent, f->throttled_ms);
+        join(&json, line);
+        first = false;
+    }
+    LeaveCriticalSection(&sh->lock);
+    
+    join(&json, "]}");
+    
+    Erasure_Set *set = s->storage.disks;
+    if (set) {
+        snprintf(line, sizeof(line), ", \"disks\": {\"data_shards\": %d, \"parity_shards\": %d, \"rebuilding\": %s, "
+                 "\"reads\": %lld, \"degraded_reads\": %lld, \"checksum_failures\": %lld, \"rebuilt_shards\": %lld, \"lost_files\": %lld, \"disks\": [",
+                 set->data_shards, set->parity_shards, set->rebuilding ? "true" : "false",
+                 set->reads, set->degraded_reads, set->checksum_failures, set->rebuilt_shards, set->lost_files);
+        join(&json, line);
+        
+        for (int d = 0; d < set->disk_count; d++) {
+            snprintf(line, sizeof(line), "%s{\"path\": \"%s\", \"online\": %s, \"complete\": %s}", d ? ", " : "",
+                     set->disks[d], set->online[d] ? "true" : "false", set->complete[d] ? "true" : "false");
+            join(&json, line);
+        }
+        join(&json, "]}");
+    }
+    
+    join(&json, "}");
+    http_respond(c, HTTP_OK, Mime_App_Json, json);
+    free(json);
+}
+
+// GET /profile: the stacks sampled from the workers, collapsed (see profile.h). Not found while
+// the profiler was never turned on.
+void handle_profile(Server *s, Request *c, Route_Params *params)
+{
+    if (!s->profiler.samples) {
+        http_respond(c, HTTP_NOT_FOUND, Mime_None, String());
+        return;
+    }
+    
+    String stacks = profile_collapsed(&s->profiler);
+    http_respond(c, HTTP_OK, Mime_Text_Plain, stacks);
+    free(stacks);
+}
+
+// GET /profile/requests: the time spent in each phase by the traced requests.
+void handle_profile_requests(Server *s, Request *c, Route_Params *params)
+{
+    if (!s->profiler.requests) {
+        http_respond(c, HTTP_NOT_FOUND, Mime_None, String());
+        return;
+    }
+    
+    String json = profile_requests_json(&s->profiler);
+    http_respond(c, HTTP_OK, Mime_App_Json, json);
+    free(json);
+}
+
+static constexpr Route ROUTES[] = {
+    { HTTP_METHOD_POST, "/upload-batch", handle_upload_batch },
+    { HTTP_METHOD_POST, "/upload-photo", handle_upload_photo },
+    { HTTP_METHOD_GET,  "/files/*path",  handle_file },
+    { HTTP_METHOD_GET,  "/zip",          handle_zip },
+    { HTTP_METHOD_GET,  "/zip/*path",    handle_zip },
+    { HTTP_METHOD_GET,  "/tar",          handle_tar },
+    { HTTP_METHOD_GET,  "/tar/*path",    handle_tar },
+    { HTTP_METHOD_GET,  "/status",       handle_status },
+    { HTTP_METHOD_GET,  "/profile",      handle_profile },
+    { HTTP_METHOD_GET,  "/profile/requests", handle_profile_requests },
+    { HTTP_METHOD_GET,  "/*page",        handle_index },
+};
+
+static constexpr Router_Table ROUTER = router_build(ROUTES, ARRAY_SIZE(ROUTES));
+
+void handle_request(Server *s, Request *c)
+{
+    profile_phase(&c->trace, PROFILE_ROUTE);
+    if (!url_normalize_path(&c->path)) {
+        http_respond(c, HTTP_BAD_REQUEST, Mime_None, String());
+        return;
+    }
+    
+    Route_Params params;
+    Route_Handler handler = nullptr;
+    
+    switch (router_match(&ROUTER, ROUTES, c->method, c->path, &params, &handler)) {
+        case ROUTE_FOUND:
+            // The work of the handler counts as storage, until it sends
+            profile_phase(&c->trace, PROFILE_STORAGE);
+            handler(s, c, &params);
+        break;
+        case ROUTE_NOT_FOUND:
+            http_respond(c, HTTP_NOT_FOUND, Mime_None, String());
+        break;
+        case ROUTE_METHOD_NOT_ALLOWED:
+            http_respond(c, HTTP_METHOD_NOT_ALLOWED, Mime_None, String());
+        break;
+    }
+}
+
+// The accept loop hands the connections over to the workers. Every worker serves one request
+// at a time from the header to closing the connection, so slow clients and the upload commits
+// don't block the others.
+DWORD WINAPI worker_thread(void *param)
+{
+    Server *s = (Server *)param;
+    
+    while (true) {
+        EnterCriticalSection(&s->clients_lock);
+        while (s->queue_count == 0) {
+            SleepConditionVariableCS(&s->queue_not_empty, &s->clients_lock, INFINITE);
+        }
+        
+        Request *c = s->queue[s->queue_head];
+        s->queue_head   = (s->queue_head + 1) % s->config.max_clients;
+        s->queue_count -= 1;
+        LeaveCriticalSection(&s->clients_lock);
+        
+        if (c->wants_tls) {
+            c->tls = tls_accept(&s->tls, c->socket);
+            if (!c->tls) {
+                close_client(s, c);
+                continue;
+            }
+        }
+        
+        profile_phase(&c->trace, PROFILE_PARSE);
+        bool success = http_parse_header(c);
+        if (!success) {
+            fprintf(stderr, "Failed to parse http header!\n");
+            close_client(s, c);
+            continue;
+        }
+        
+        if (c->state == HTTP_STATE_H2_PREFACE) {
+            c->trace.sampled = false; // Its streams are traced one by one
+            h2_serve(s, c);
+            close_client(s, c);
+            continue;
+        }
+        
+        handle_request(s, c);
+        close_client(s, c);
+    }
+    
+    return 0;
+}
+
+// Takes a free slot for the new connection and queues it for the workers.
+void server_accept(Server *s, SOCKET listen_socket, bool tls)
+{
+    Request *c = nullptr;
+    EnterCriticalSection(&s->clients_lock);
+    for (auto i = 0; i < s->config.max_clients; i++) {
+        if (s->free_clients[i]) {
+            c = s->clients+i;
+            c->connected = true;
+            s->free_clients[i] = false;
+            break;
+        }
+    }
+    LeaveCriticalSection(&s->clients_lock);
+    
+    if (c == nullptr) {
+        fprintf(stderr, "No more room to connect!\n");
+        Sleep(1); // Let the workers finish something, select() would return immediately
+        return;
+    }
+    
+    sockaddr_in address;
+    int address_size = sizeof(address);
+    c->socket = accept(listen_socket, (sockaddr *)&address, &address_size);
+    if (c->socket == INVALID_SOCKET) {
+        fprintf(stderr, "Failed to accept new connection. Error code: %d\n", WSAGetLastError());
+        c->connected = false;
+        close_client(s, c);
+        return;
+    }
+    
+    c->flow = shaper_acquire(&s->shaper, address.sin_addr.s_addr);
+    profile_trace_begin(&s->profiler, &c->trace, PROFILE_ACCEPT);
+    
+    // The accepted socket inherits the non-blocking mode of the listen socket. The bodies
+    // can be gigabytes, so we rather block (with a timeout) than spin on WSAEWOULDBLOCK.
+    u_long non_blocking = 0;
+    ioctlsocket(c->socket, FIONBIO, &non_blocking);
+    DWORD timeout_ms = (DWORD)s->config.client_timeout_ms;
+    setsockopt(c->socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout_ms, sizeof(timeout_ms));
+    setsockopt(c->socket, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout_ms, sizeof(timeout_ms));
+    
+    c->wants_tls = tls;
+    
+    EnterCriticalSection(&s->clients_lock);
+    s->queue[(s->queue_head + s->queue_count) % s->config.max_clients] = c;
+    s->queue_count += 1;
+    WakeConditionVariable(&s->queue_not_empty);
+    LeaveCriticalSection(&s->clients_lock);
 }
 
 void server_listen(Server *s)
 {
     printf("\n\nServer listening at %d...\n\n", s->port);
-    
-    s->running = true;
+    if (s->tls_socket != INVALID_SOCKET) printf("TLS at %lld\n\n", s->config.tls_port);
 
     fd_set _read_fds, read_fds;
     TIMEVAL _polltime, polltime;
     FD_ZERO(&_read_fds);
     FD_SET(s->socket, &_read_fds);
-    _polltime.tv_sec = 10000;
+    if (s->tls_socket != INVALID_SOCKET) FD_SET(s->tls_socket, &_read_fds);
+    _polltime.tv_sec  = 1; // How late a stop (Ctrl+C or an upgrade) is noticed
+    _polltime.tv_usec = 0;
     
     while (s->running) {
         read_fds = _read_fds;
@@ -355,86 +1178,74 @@ void server_listen(Server *s)
             continue;
         }
     
-        Request *c = nullptr;
-        for (auto i = 0; i < MAX_CLIENTS; i++) {
-            if (s->free_clients[i]) {
-                c = s->clients+i;
-                c->connected = true;
-                s->free_clients[i] = false;
-                break;
-            }
-        }
-        
-        if (c == nullptr) {
-            fprintf(stderr, "No more room to connect!\n");
-            continue;
-        }
-        
-        c->socket = accept(s->socket, NULL, NULL);
-        if (c->socket == INVALID_SOCKET) {
-            fprintf(stderr, "Failed to accept new connection. Error code: %d\n", WSAGetLastError());
-            continue;
-        }
-        
-        bool success = http_parse_header(c);
-        if (!success) {
-            fprintf(stderr, "Failed to parse http header!\n");
-            close_client(s, c);
-            continue;
-        }
-        
-        // if (c->method == HTTP_METHOD_POST) {
-        //     print("POST -> cl: %ld\n", c->content_length);
-        //     // @Debug: Just for testing...
-        //     if (c->content_length) {
-        //         char buf[RECV_BUF_SIZE] = {0};
-        //         ZERO_MEMORY(buf, RECV_BUF_SIZE);
-        //         snprintf(buf, RECV_BUF_SIZE, ".\\%lld.tmp", c->socket);
-        //         FILE *fp = fopen(buf, "wb");
-        //         ASSERT(fp, "Failed to create file handler for %s!", buf);
-                
-        //         auto remain = c->content_length;
-        //         while (remain != 0) {
-        //             int r = recv(c->socket, buf, RECV_BUF_SIZE, 0);
-        //             int err = WSAGetLastError();
-                    
-        //             if (r == 0) {
-        //                 fprintf(stderr, "#%lld: Connection is closed!\n", c->socket);
-        //                 return;
-        //             } else if (err == WSAEWOULDBLOCK) {
-        //                 // print("WSAEWOULDBLOCK\n");
-        //                 continue;            
-        //             } else if (r == SOCKET_ERROR) {
-        //                 fprintf(stderr, "#%lld: SOCKET ERROR. Error code: %d\n", c->socket, WSAGetLastError());
-        //                 return;
-        //             }
-                    
-        //             remain -= r;
-        //             ASSERT(remain >= 0, "TOTAL FAIL!?");
-        //             printf("r: %ld\n", remain);
-                    
-        //             size_t rr = fwrite(buf, 1, r, fp);
-        //             ASSERT(rr == (size_t)r, "#%lld: recv() -> %llu not equal to fwrite() -> %llu results\n", c->socket, (size_t)r, rr);
-        //         }
-                
-        //         printf("[%lld/%p]: body received successfully\n", c->socket, c);
-                
-        //         ASSERT(fclose(fp) == 0, "Failed to close file handler!");
-        //     }            
-        // }
-        
-        handle_request(c);
-        close_client(s, c);
+        if (FD_ISSET(s->socket, &read_fds)) server_accept(s, s->socket, false);
+        if (s->tls_socket != INVALID_SOCKET && FD_ISSET(s->tls_socket, &read_fds)) server_accept(s, s->tls_socket, true);
+    }
+}
+
+// The console control handler runs on its own thread and gets nothing but the event
+static Server *console_server = nullptr;
+
+BOOL WINAPI server_console_ctrl(DWORD type)
+{
+    if (console_server == nullptr) return FALSE;
+    
+    if (type == CTRL_BREAK_EVENT) {
+        printf("[config]: Reloading %s\n", console_server->config.path);
+        server_reload_config(console_server);
+        return TRUE;
     }
+    
+    // The first Ctrl+C drains, the second one kills
+    if (type == CTRL_C_EVENT && console_server->running) {
+        printf("[server]: Stopping, Ctrl+C again to stop now\n");
+        console_server->running = false;
+        return TRUE;
+    }
+    
+    return FALSE;
 }
 
+// The fuzz targets and the property tests of fuzz/ bring their own
+#ifndef CUPIDO_NO_MAIN
 int main(int argc, char **argv)
 {
     Server s;
-    int port = 6969;
-    bool success = server_create(&s, port);
-    ASSERT(success, "Failed to create server! Port: %d\n", port);
+    bool help = false;
+    if (!config_load(&s.config, argc, argv, &help) || help) {
+        config_print_usage(argv[0]);
+        return help ? 0 : 1;
+    }
+    
+    if (s.config.upgrade) return handoff_signal(s.config.port) ? 0 : 1;
+
+    if (s.config.import_dir[0]) {
+        if (!storage_create(&s.storage, s.config.storage_root, s.config.disks, (int)s.config.disk_parity)) return 1;
+        s.storage.commit_window_ms = (LONG)s.config.commit_window_ms;
+        return import_run(&s.storage, s.config.import_dir, (int)s.config.import_threads, (int)s.config.import_io) ? 0 : 1;
+    }
+    
+    bool success = server_create(&s);
+    ASSERT(success, "Failed to create server! Port: %lld\n", s.config.port);
+    
+    console_server = &s;
+    SetConsoleCtrlHandler(server_console_ctrl, TRUE);
+    
+    char upgrade_event_name[64];
+    snprintf(upgrade_event_name, sizeof(upgrade_event_name), HANDOFF_UPGRADE_EVENT, (s64)s.port);
+    s.upgrade_event = CreateEventA(NULL, FALSE, FALSE, upgrade_event_name);
+    if (s.upgrade_event == NULL || !CreateThread(NULL, 0, server_upgrade_thread, &s, 0, NULL)) {
+        fprintf(stderr, "[handoff]: Upgrades are disabled. Error code: %lu\n", GetLastError());
+    }
+    
+    if (s.handoff.to_parent != INVALID_HANDLE_VALUE) {
+        handoff_ready(&s.handoff);
+        CreateThread(NULL, 0, server_old_process_thread, &s, 0, NULL);
+    }
+    
     server_listen(&s);
+    server_drain(&s);
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -187,8 +187,9 @@ inline void join(String *a, char *b, s64 b_len = -1)
         alloc(a, b_len);
     }
     
-    memcpy_s(a->data + a->used_size, a->allocated_size - a->used_size, b, b_len);
-    assert(errno == 0);
+    // Check the result instead of errno, it can be left set by any earlier call
+    int copy_failed = memcpy_s(a->data + a->used_size, a->allocated_size - a->used_size, b, b_len);
+    assert(copy_failed == 0);
     
     a->count += b_len;
     a->used_size += b_len;
@@ -242,6 +243,20 @@ inline bool string_equal(String a, String b)
     return true;
 }
 
+inline bool string_equal_ignore_case(String a, String b)
+{
+    if (a.count != b.count) return false;
+
+    for (int i = 0; i < a.count; i++) {
+        char x = a.data[i], y = b.data[i];
+        if (x >= 'A' && x <= 'Z') x += 'a' - 'A';
+        if (y >= 'A' && y <= 'Z') y += 'a' - 'A';
+        if (x != y) return false;
+    }
+    
+    return true;
+}
+
 inline bool string_equal_cstr(String a, char *b)
 {
     return string_equal(a, String(b));
@@ -298,15 +313,38 @@ inline int string_to_int(String s, String *remained = nullptr, int base = 0)
     return r;
 }
 
-inline int string_to_int(String s, bool *success, int base = 0)
+// The whole string has to be the number: no white space or '+' before it, nothing after it
+// (a NUL inside included) and no overflow. These parse the bytes from the network, like the
+// Content-Length, where "010" or " 5" have to be errors and not 8 or 5.
+inline s64 string_to_s64(String s, bool *success, int base = 10)
 {
     assert(success);
     
-    int r = string_to_int(s);
-    if (r == 0 && string_equal_cstr(s, "0") == false) *success = false;
+    if (s.count == 0 || !(IS_ALNUM(s.data[0]) || (s.data[0] == '-' && s.count > 1 && IS_ALNUM(s.data[1])))) {
+        *success = false;
+        return 0;
+    }
+    
+    char *temp = string_to_new_cstr(s);
+    char *end = nullptr;
+    errno = 0;
+    s64 r = strtoll(temp, &end, base);
+    if (end != temp + s.count || errno == ERANGE) *success = false;
+    free(temp);
     
     return r;
-} 
+}
+
+inline int string_to_int(String s, bool *success, int base = 10)
+{
+    s64 r = string_to_s64(s, success, base);
+    if (r < INT_MIN || r > INT_MAX) {
+        *success = false;
+        return 0;
+    }
+    
+    return (int)r;
+}
 
 inline float string_to_float(String s, String *remained = nullptr)
 {
@@ -322,7 +360,7 @@ inline float string_to_float(String s, String *remained = nullptr)
 inline String string_eat_until(String s, const char c)
 {
     // @Speed
-    while (*s.data && *s.data != c) {
+    while (s.count && *s.data && *s.data != c) {
         advance(&s);
     }
     
@@ -0,0 +1,602 @@
+#ifndef H_CUPIDO_PROFILE
+#define H_CUPIDO_PROFILE
+
+#include "core.h"
+
+#include <windows.h>
+#include <dbghelp.h>
+
+// The built-in sampling profiler, off unless 'profile_hz' is set (the thread and the buffers
+// only exist once it was turned on, a request pays one branch per phase change otherwise).
+//
+// The stacks: a sampler thread wakes 'profile_hz' times a second (Sleep() rounds it to the
+// timer resolution, 15.6 ms by default) and samples every worker that used some CPU since the
+// last time (QueryThreadCycleTime), the idle ones waiting for a connection are skipped. The
+// worker is suspended only to read its registers and copy the top of its stack, the unwinding
+// (RtlVirtualUnwind on the copy) runs after it's resumed. The unwinder can take a lock of the
+// loader, a worker suspended in the middle of loading a DLL would deadlock us otherwise. The last
+// PROFILE_RING_SIZE stacks are kept as addresses, GET /profile symbolizes them (DbgHelp and the
+// PDB next to the executable) into the collapsed format of flamegraph.pl and speedscope:
+//   worker_thread;handle_request;handle_file;storage_read 42
+//
+// The phases: with the profiler on, 1 request in 'profile_trace_every' gets the wall-clock time
+// of its accept (the queue and the TLS handshake), parse, route, storage and send phases. They
+// are switched as the request goes, the time between two switches goes to the earlier phase.
+// GET /profile/requests has their totals and the last PROFILE_TRACE_HISTORY requests.
+
+const int   PROFILE_MAX_FRAMES     = 48;
+const s64   PROFILE_RING_SIZE      = 8192;
+const s64   PROFILE_STACK_COPY     = BYTES_TO_KB(64); // The deeper frames are cut
+const s64   PROFILE_STACK_SLACK    = BYTES_TO_KB(4);  // The unwinder can read a bit above the copied frames
+const int   PROFILE_MAX_THREADS    = 256;
+const int   PROFILE_TRACE_HISTORY  = 256;
+const int   PROFILE_PATH_SIZE      = 128;
+const DWORD PROFILE_IDLE_MS        = 500; // How soon the sampler notices that it was turned on again
+const int   PROFILE_MAX_NAME       = 256;
+
+enum Profile_Phase {
+    PROFILE_ACCEPT,
+    PROFILE_PARSE,
+    PROFILE_ROUTE,
+    PROFILE_STORAGE,
+    PROFILE_SEND,
+
+    PROFILE_PHASE_COUNT
+};
+
+static const char *PROFILE_PHASE_NAMES[PROFILE_PHASE_COUNT] = { "accept", "parse", "route", "storage", "send" };
+
+// Of one request, in QueryPerformanceCounter() ticks. Zero (not sampled) in a new Request.
+struct Profile_Trace {
+    bool sampled;
+    Profile_Phase phase;
+    s64 started;
+    s64 phase_started;
+    s64 ticks[PROFILE_PHASE_COUNT];
+};
+
+struct Profile_Sample {
+    int frame_count;
+    u64 frames[PROFILE_MAX_FRAMES]; // The innermost first
+};
+
+struct Profile_Request {
+    char method[8];
+    char path[PROFILE_PATH_SIZE];
+    s64 ticks;
+    s64 phase_ticks[PROFILE_PHASE_COUNT];
+};
+
+struct Profiler {
+    volatile LONG hz;
+    volatile LONG trace_every;
+    s64 ticks_per_sec;
+
+    HANDLE threads[PROFILE_MAX_THREADS];
+    u64 thread_cycles[PROFILE_MAX_THREADS];
+    int thread_count;
+
+    HANDLE sampler;
+    CRITICAL_SECTION lock; // The rings
+    Profile_Sample *samples;
+    s64 sample_count; // Written so far, the ring has the last PROFILE_RING_SIZE
+    volatile LONGLONG idle_skips;
+    volatile LONGLONG failed_samples;
+
+    volatile LONGLONG trace_counter;
+    volatile LONGLONG traced;
+    volatile LONGLONG phase_ticks[PROFILE_PHASE_COUNT];
+    Profile_Request *requests;
+    s64 request_count;
+
+    CRITICAL_SECTION symbol_lock; // DbgHelp is single threaded
+    bool symbols_loaded;
+};
+
+void profile_init(Profiler *p)
+{
+    ZERO_MEMORY(p, sizeof(Profiler));
+    InitializeCriticalSection(&p->lock);
+    InitializeCriticalSection(&p->symbol_lock);
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    p->ticks_per_sec = frequency.QuadPart;
+}
+
+inline s64 profile_now()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+inline s64 profile_ticks_to_us(Profiler *p, s64 ticks)
+{
+    return ticks / p->ticks_per_sec * 1000000 + ticks % p->ticks_per_sec * 1000000 / p->ticks_per_sec;
+}
+
+//
+// Phases
+//
+
+inline void profile_trace_begin(Profiler *p, Profile_Trace *t, Profile_Phase phase)
+{
+    t->sampled = false;
+
+    // Read once, a reload can set them to zero in between
+    LONG hz          = p->hz;
+    LONG trace_every = p->trace_every;
+    if (hz == 0 || trace_every == 0) return;
+    if (InterlockedIncrement64(&p->trace_counter) % trace_every != 0) return;
+
+    ZERO_MEMORY(t, sizeof(Profile_Trace));
+    t->sampled = true;
+    t->phase   = phase;
+    t->started = t->phase_started = profile_now();
+}
+
+inline void profile_phase(Profile_Trace *t, Profile_Phase phase)
+{
+    if (!t->sampled || t->phase == phase) return;
+
+    s64 now = profile_now();
+    t->ticks[t->phase] += now - t->phase_started;
+    t->phase = phase;
+    t->phase_started = now;
+}
+
+void profile_trace_end(Profiler *p, Profile_Trace *t, const char *method, String path)
+{
+    if (!t->sampled) return;
+    t->sampled = false;
+
+    s64 now = profile_now();
+    t->ticks[t->phase] += now - t->phase_started;
+
+    Profile_Request r;
+    ZERO_MEMORY(&r, sizeof(r));
+    snprintf(r.method, sizeof(r.method), "%s", method);
+    r.ticks = now - t->started;
+
+    // Into a JSON string as it is
+    s64 count = path.count < PROFILE_PATH_SIZE - 1 ? path.count : PROFILE_PATH_SIZE - 1;
+    for (s64 i = 0; i < count; i++) {
+        char ch = path.data[i];
+        r.path[i] = (ch < 0x20 || ch == '"' || ch == '\\') ? '?' : ch;
+    }
+
+    InterlockedIncrement64(&p->traced);
+    for (int i = 0; i < PROFILE_PHASE_COUNT; i++) {
+        r.phase_ticks[i] = t->ticks[i];
+        InterlockedExchangeAdd64(&p->phase_ticks[i], t->ticks[i]);
+    }
+
+    EnterCriticalSection(&p->lock);
+    if (p->requests) p->requests[p->request_count++ % PROFILE_TRACE_HISTORY] = r;
+    LeaveCriticalSection(&p->lock);
+}
+
+//
+// Stacks
+//
+
+#if defined(_M_X64) || defined(__x86_64__)
+// How far above its base the unwind of a frame reads (the allocation, the saved registers and the
+// return address), from the function's unwind codes. The base is the stack pointer, or the frame
+// register less 'frame_offset' once the function set it. 'frame_register' is its index from Rax
+// in the CONTEXT, -1 if there is none. Returns -1 for the frames it can't tell (machine frames).
+s64 profile_frame_extent(DWORD64 image_base, PRUNTIME_FUNCTION function, int *frame_register, s64 *frame_offset)
+{
+    *frame_register = -1;
+    *frame_offset   = 0;
+
+    s64 size  = 0; // Pushed and allocated
+    s64 saved = 0; // Above the furthest register saved with a move
+    while (function) {
+        u8  *info       = (u8 *)(image_base + function->UnwindData);
+        u8   flags      = info[0] >> 3;
+        int  code_count = info[2];
+        u16 *codes      = (u16 *)(info + 4);
+
+        if ((info[3] & 0x0f) && *frame_register < 0) {
+            *frame_register = info[3] & 0x0f;
+            *frame_offset   = (info[3] >> 4) * 16;
+        }
+
+        for (int i = 0; i < code_count; ) {
+            int op      = (codes[i] >> 8) & 0x0f;
+            int op_info = codes[i] >> 12;
+            s64 at      = 0;
+            switch (op) {
+            case 0: size += 8;                 i += 1; break; // UWOP_PUSH_NONVOL
+            case 2: size += op_info * 8 + 8;   i += 1; break; // UWOP_ALLOC_SMALL
+            case 3:                            i += 1; break; // UWOP_SET_FPREG
+            case 1:                                           // UWOP_ALLOC_LARGE
+                if (op_info == 0) {
+                    size += (s64)codes[i + 1] * 8;
+                    i += 2;
+                } else {
+                    size += codes[i + 1] | (s64)codes[i + 2] << 16;
+                    i += 3;
+                }
+                break;
+            case 4: at = (s64)codes[i + 1] * 8 + 8;                    i += 2; break; // UWOP_SAVE_NONVOL
+            case 5: at = (codes[i + 1] | (s64)codes[i + 2] << 16) + 8;  i += 3; break; // UWOP_SAVE_NONVOL_FAR
+            case 8: at = (s64)codes[i + 1] * 16 + 16;                  i += 2; break; // UWOP_SAVE_XMM128
+            case 9: at = (codes[i + 1] | (s64)codes[i + 2] << 16) + 16; i += 3; break; // UWOP_SAVE_XMM128_FAR
+            default: return -1; // UWOP_PUSH_MACHFRAME, the epilog codes of the version 2
+            }
+            if (at > saved) saved = at;
+        }
+
+        // A chained entry continues with the unwind info of the function it was split from
+        function = (flags & UNW_FLAG_CHAININFO) ? (PRUNTIME_FUNCTION)(codes + ((code_count + 1) & ~1)) : nullptr;
+    }
+
+    return (size > saved ? size : saved) + 8;
+}
+#endif
+
+// Suspends the thread just long enough to copy its registers and the top of its stack, then
+// walks the copy. The pointers into the stack (saved frame pointers, the addresses of locals)
+// are moved to the copy first. The walk stops at the first frame the copy doesn't hold whole,
+// the deepest frames of a long stack are cut. Returns the frame count, 0 if the thread couldn't
+// be sampled.
+int profile_sample_thread(HANDLE thread, u8 *copy, u64 *frames)
+{
+#if defined(_M_X64) || defined(__x86_64__)
+    if (SuspendThread(thread) == (DWORD)-1) return 0;
+
+    CONTEXT ctx;
+    ZERO_MEMORY(&ctx, sizeof(ctx));
+    ctx.ContextFlags = CONTEXT_FULL;
+
+    s64 copied = 0;
+    if (GetThreadContext(thread, &ctx)) {
+        // The committed part of a stack ends at its base
+        MEMORY_BASIC_INFORMATION region;
+        if (VirtualQuery((void *)ctx.Rsp, &region, sizeof(region))) {
+            copied = (s64)((u64)region.BaseAddress + region.RegionSize - ctx.Rsp);
+            if (copied > PROFILE_STACK_COPY) copied = PROFILE_STACK_COPY;
+            memcpy(copy, (void *)ctx.Rsp, copied);
+        }
+    }
+
+    ResumeThread(thread);
+    if (copied <= 0) return 0;
+
+    u64 low  = ctx.Rsp;
+    u64 high = ctx.Rsp + copied;
+    u64 delta = (u64)copy - low;
+    for (s64 at = 0; at + 8 <= copied; at += 8) {
+        u64 *word = (u64 *)(copy + at);
+        if (*word >= low && *word < high) *word += delta;
+    }
+
+    DWORD64 *registers[] = { &ctx.Rsp, &ctx.Rbp, &ctx.Rbx, &ctx.Rsi, &ctx.Rdi, &ctx.R12, &ctx.R13, &ctx.R14, &ctx.R15 };
+    for (int i = 0; i < ARRAY_SIZE(registers); i++) {
+        if (*registers[i] >= low && *registers[i] < high) *registers[i] += delta;
+    }
+
+    int count = 0;
+    while (count < PROFILE_MAX_FRAMES && ctx.Rip) {
+        frames[count++] = ctx.Rip;
+        if (ctx.Rsp < (u64)copy || ctx.Rsp + 8 > (u64)copy + copied) break;
+
+        DWORD64 image_base = 0;
+        PRUNTIME_FUNCTION function = RtlLookupFunctionEntry(ctx.Rip, &image_base, NULL);
+        if (function) {
+            // RtlVirtualUnwind reads the whole frame before we could check where it ended up
+            int frame_register;
+            s64 frame_offset;
+            s64 extent = profile_frame_extent(image_base, function, &frame_register, &frame_offset);
+            u64 end = (u64)copy + copied;
+            if (extent < 0 || ctx.Rsp + extent > end) break;
+            if (frame_register >= 0) {
+                u64 base = (&ctx.Rax)[frame_register] - frame_offset;
+                if (base < (u64)copy || base + extent > end) break;
+            }
+
+            void *handler_data = nullptr;
+            DWORD64 establisher_frame = 0;
+            RtlVirtualUnwind(UNW_FLAG_NHANDLER, image_base, ctx.Rip, function, &ctx, &handler_data, &establisher_frame, NULL);
+        } else if (count == 1) {
+            // A leaf function has no unwind info and leaves the stack alone, the return address is on top
+            ctx.Rip = *(u64 *)ctx.Rsp;
+            ctx.Rsp += 8;
+        } else {
+            break;
+        }
+    }
+
+    return count;
+#else
+    return 0; // The unwinding is x64 only
+#endif
+}
+
+DWORD WINAPI profile_sampler_thread(void *param)
+{
+    Profiler *p = (Profiler *)param;
+
+    // On time even when the workers keep the processors busy, that's when it matters
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+
+    u8 *copy = (u8 *)malloc(PROFILE_STACK_COPY + PROFILE_STACK_SLACK);
+    assert(copy);
+    ZERO_MEMORY(copy, PROFILE_STACK_COPY + PROFILE_STACK_SLACK);
+
+    while (true) {
+        LONG hz = p->hz;
+        if (hz == 0) {
+            Sleep(PROFILE_IDLE_MS);
+            continue;
+        }
+        Sleep(1000 / hz);
+
+        for (int i = 0; i < p->thread_count; i++) {
+            ULONG64 cycles = 0;
+            if (QueryThreadCycleTime(p->threads[i], &cycles) && cycles == p->thread_cycles[i]) {
+                InterlockedIncrement64(&p->idle_skips);
+                continue;
+            }
+            p->thread_cycles[i] = cycles;
+
+            Profile_Sample sample;
+            sample.frame_count = profile_sample_thread(p->threads[i], copy, sample.frames);
+            if (sample.frame_count == 0) {
+                InterlockedIncrement64(&p->failed_samples);
+                continue;
+            }
+
+            EnterCriticalSection(&p->lock);
+            p->samples[p->sample_count++ % PROFILE_RING_SIZE] = sample;
+            LeaveCriticalSection(&p->lock);
+        }
+    }
+
+    return 0;
+}
+
+// The rings and the sampler thread are made the first time it's turned on.
+bool profile_start(Profiler *p)
+{
+    if (p->sampler) return true;
+
+#if !defined(_M_X64) && !defined(__x86_64__)
+    fprintf(stderr, "[profile]: The stack sampling needs an x64 build, only the phases are traced\n");
+#endif
+
+    EnterCriticalSection(&p->lock);
+    if (!p->samples)  p->samples  = (Profile_Sample *)calloc(PROFILE_RING_SIZE, sizeof(Profile_Sample));
+    if (!p->requests) p->requests = (Profile_Request *)calloc(PROFILE_TRACE_HISTORY, sizeof(Profile_Request));
+    LeaveCriticalSection(&p->lock);
+    if (!p->samples || !p->requests) return false;
+
+    p->sampler = CreateThread(NULL, 0, profile_sampler_thread, p, 0, NULL);
+    if (p->sampler == NULL) {
+        fprintf(stderr, "[profile]: Failed to start the sampler thread! Error code: %lu\n", GetLastError());
+        return false;
+    }
+
+    printf("[profile]: Sampling %d thread(s)\n", p->thread_count);
+    return true;
+}
+
+// The threads to sample. The profiler starts here if it was already turned on by the config.
+void profile_attach(Profiler *p, HANDLE *threads, int count)
+{
+    for (int i = 0; i < count && p->thread_count < PROFILE_MAX_THREADS; i++) {
+        p->threads[p->thread_count++] = threads[i];
+    }
+
+    if (p->hz && !profile_start(p)) p->hz = 0;
+}
+
+void profile_set_rates(Profiler *p, s64 hz, s64 trace_every)
+{
+    p->trace_every = (LONG)trace_every;
+    if (hz && p->thread_count && !profile_start(p)) hz = 0;
+    p->hz = (LONG)hz;
+}
+
+//
+// The collapsed stacks
+//
+
+struct Profile_Symbol {
+    u64 key; // The address, or the start of the function
+    int name;
+};
+
+struct Profile_Symbols {
+    Profile_Symbol *by_address;
+    Profile_Symbol *by_function;
+    s64 capacity; // Of both, a power of 2 above the number of frames
+
+    String text;        // The names one after the other
+    s64 *name_offsets;  // Into the 'text', one more than the names
+    int name_count;
+};
+
+// A distinct stack of the ring.
+struct Profile_Stack {
+    s64 first; // The index of its first sample + 1, 0 for an empty slot
+    s64 count;
+};
+
+// 'key' + 1 is stored, 0 means an empty slot.
+Profile_Symbol *profile_symbol_slot(Profile_Symbol *table, s64 capacity, u64 key)
+{
+    u64 h = (key + 1) * 0x9E3779B97F4A7C15ULL;
+    for (s64 i = (s64)(h >> 20) & (capacity-1);; i = (i+1) & (capacity-1)) {
+        if (table[i].key == 0 || table[i].key == key + 1) return table + i;
+    }
+}
+
+int profile_symbol_name(Profile_Symbols *sy, u64 address)
+{
+    Profile_Symbol *slot = profile_symbol_slot(sy->by_address, sy->capacity, address);
+    if (slot->key) return slot->name;
+
+    char buf[sizeof(SYMBOL_INFO) + PROFILE_MAX_NAME];
+    SYMBOL_INFO *symbol = (SYMBOL_INFO *)buf;
+    ZERO_MEMORY(buf, sizeof(buf));
+    symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+    symbol->MaxNameLen   = PROFILE_MAX_NAME - 1;
+
+    // The frames of the same function share a name
+    DWORD64 displacement = 0;
+    bool found = SymFromAddr(GetCurrentProcess(), address, &displacement, symbol) != 0;
+    u64 function = found ? symbol->Address : address;
+
+    Profile_Symbol *by_function = profile_symbol_slot(sy->by_function, sy->capacity, function);
+    if (!by_function->key) {
+        char name[PROFILE_MAX_NAME + 32];
+        if (found) snprintf(name, sizeof(name), "%s", symbol->Name);
+        else       snprintf(name, sizeof(name), "0x%llx", address);
+
+        // ';' separates the frames, a space the count
+        for (char *c = name; *c; c++) {
+            if (*c == ';' || *c == ' ') *c = '_';
+        }
+
+        by_function->key  = function + 1;
+        by_function->name = sy->name_count++;
+        join(&sy->text, name, (s64)strlen(name));
+        sy->name_offsets[sy->name_count] = sy->text.count;
+    }
+
+    slot->key  = address + 1;
+    slot->name = by_function->name;
+    return slot->name;
+}
+
+// Every distinct stack of the ring, the outermost frame first, with the number of its samples.
+String profile_collapsed(Profiler *p)
+{
+    String out = string_create(BYTES_TO_KB(64));
+    if (!p->samples) return out;
+
+    Profile_Sample *samples = (Profile_Sample *)malloc(PROFILE_RING_SIZE * sizeof(Profile_Sample));
+    assert(samples);
+
+    EnterCriticalSection(&p->lock);
+    s64 count = p->sample_count < PROFILE_RING_SIZE ? p->sample_count : PROFILE_RING_SIZE;
+    memcpy(samples, p->samples, count * sizeof(Profile_Sample));
+    LeaveCriticalSection(&p->lock);
+
+    EnterCriticalSection(&p->symbol_lock);
+    if (!p->symbols_loaded) {
+        SymSetOptions(SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS);
+        p->symbols_loaded = SymInitialize(GetCurrentProcess(), NULL, TRUE) != 0;
+        if (!p->symbols_loaded) fprintf(stderr, "[profile]: No symbols, the frames are addresses. Error code: %lu\n", GetLastError());
+    }
+
+    Profile_Symbols sy;
+    ZERO_MEMORY(&sy, sizeof(sy));
+    sy.capacity = 1024;
+    while (sy.capacity < count * PROFILE_MAX_FRAMES * 2) sy.capacity *= 2;
+    sy.by_address  = (Profile_Symbol *)calloc(sy.capacity, sizeof(Profile_Symbol));
+    sy.by_function = (Profile_Symbol *)calloc(sy.capacity, sizeof(Profile_Symbol));
+    sy.name_offsets = (s64 *)calloc(sy.capacity + 1, sizeof(s64));
+    sy.text = string_create(BYTES_TO_KB(64));
+    assert(sy.by_address && sy.by_function && sy.name_offsets);
+
+    // The frames become name indices, the return addresses are past their call
+    for (s64 i = 0; i < count; i++) {
+        Profile_Sample *sample = samples + i;
+        for (int f = 0; f < sample->frame_count; f++) {
+            sample->frames[f] = (u64)profile_symbol_name(&sy, f ? sample->frames[f] - 1 : sample->frames[f]);
+        }
+    }
+    LeaveCriticalSection(&p->symbol_lock);
+
+    // The same stack of names once
+    s64 stack_capacity = 1024;
+    while (stack_capacity < count * 2) stack_capacity *= 2;
+    Profile_Stack *stacks = (Profile_Stack *)calloc(stack_capacity, sizeof(Profile_Stack));
+    assert(stacks);
+
+    for (s64 i = 0; i < count; i++) {
+        Profile_Sample *sample = samples + i;
+        u64 h = 14695981039346656037ULL;
+        for (int f = 0; f < sample->frame_count; f++) h = (h ^ sample->frames[f]) * 1099511628211ULL;
+
+        for (s64 j = (s64)(h & (stack_capacity-1));; j = (j+1) & (stack_capacity-1)) {
+            if (stacks[j].first == 0) {
+                stacks[j].first = i + 1;
+                stacks[j].count = 1;
+                break;
+            }
+
+            Profile_Sample *other = samples + stacks[j].first - 1;
+            if (other->frame_count == sample->frame_count && memcmp(other->frames, sample->frames, sample->frame_count * sizeof(u64)) == 0) {
+                stacks[j].count += 1;
+                break;
+            }
+        }
+    }
+
+    for (s64 j = 0; j < stack_capacity; j++) {
+        if (stacks[j].first == 0) continue;
+
+        Profile_Sample *sample = samples + stacks[j].first - 1;
+        for (int f = sample->frame_count - 1; f >= 0; f--) {
+            s64 start = sy.name_offsets[sample->frames[f]];
+            join(&out, sy.text.data + start, sy.name_offsets[sample->frames[f] + 1] - start);
+            if (f) join(&out, ";", 1);
+        }
+
+        char line[32];
+        int len = snprintf(line, sizeof(line), " %lld\n", stacks[j].count);
+        join(&out, line, len);
+    }
+
+    free(sy.text);
+    free(sy.name_offsets);
+    free(sy.by_address);
+    free(sy.by_function);
+    free(stacks);
+    free(samples);
+
+    return out;
+}
+
+// The phase totals of the traced requests, and the last of them, as JSON.
+String profile_requests_json(Profiler *p)
+{
+    String json = string_create(BYTES_TO_KB(16));
+    char line[512];
+
+    snprintf(line, sizeof(line), "{\"hz\": %ld, \"trace_every\": %ld, \"samples\": %lld, \"idle_skips\": %lld, \"failed_samples\": %lld, \"traced\": %lld, \"phases_us\": {",
+             p->hz, p->trace_every, p->sample_count, p->idle_skips, p->failed_samples, p->traced);
+    join(&json, line);
+    for (int i = 0; i < PROFILE_PHASE_COUNT; i++) {
+        snprintf(line, sizeof(line), "%s\"%s\": %lld", i ? ", " : "", PROFILE_PHASE_NAMES[i], profile_ticks_to_us(p, p->phase_ticks[i]));
+        join(&json, line);
+    }
+    join(&json, "}, \"requests\": [");
+
+    EnterCriticalSection(&p->lock);
+    s64 count = p->request_count < PROFILE_TRACE_HISTORY ? p->request_count : PROFILE_TRACE_HISTORY;
+    for (s64 i = 0; i < count; i++) {
+        // The newest first
+        Profile_Request *r = p->requests + (p->request_count - 1 - i) % PROFILE_TRACE_HISTORY;
+        snprintf(line, sizeof(line), "%s{\"method\": \"%s\", \"path\": \"%s\", \"total_us\": %lld", i ? ", " : "", r->method, r->path, profile_ticks_to_us(p, r->ticks));
+        join(&json, line);
+
+        for (int f = 0; f < PROFILE_PHASE_COUNT; f++) {
+            snprintf(line, sizeof(line), ", \"%s_us\": %lld", PROFILE_PHASE_NAMES[f], profile_ticks_to_us(p, r->phase_ticks[f]));
+            join(&json, line);
+        }
+        join(&json, "}");
+    }
+    LeaveCriticalSection(&p->lock);
+
+    join(&json, "]}");
+    return json;
+}
+
+#endif
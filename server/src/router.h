@@ -0,0 +1,184 @@
+#ifndef H_CUPIDO_ROUTER
+#define H_CUPIDO_ROUTER
+
+#include "server.h"
+
+// The route table is turned into a character trie at compile time (see router_build), so the
+// dispatch is one walk over the path: a couple of branches per character and no string
+// comparisons per route. Patterns:
+//   /upload-batch    static
+//   /files/:id       ':' captures one path segment
+//   /files/*path     '*' captures the rest of the path (it must be the last one)
+// Static children win over ':' and ':' wins over '*'. The captures are passed to the handler
+// in the order they appear in the pattern.
+
+const int ROUTER_MAX_NODES  = 512;
+const int ROUTER_MAX_PARAMS = 4;
+
+struct Route_Params {
+    String values[ROUTER_MAX_PARAMS];
+    int count;
+};
+
+typedef void (*Route_Handler)(Server *s, Request *c, Route_Params *params);
+
+struct Route {
+    Http_Method method;
+    const char *pattern;
+    Route_Handler handler;
+};
+
+// Zero means none everywhere: the node 0 is the root, so it is never a child, and the
+// routes are stored as index+1.
+struct Router_Node {
+    char ch;
+    u16 first_child;
+    u16 next_sibling;
+    u16 param_child;
+    u16 wildcard_child;
+    u16 routes[HTTP_METHOD_COUNT];
+    bool has_routes;
+};
+
+struct Router_Table {
+    Router_Node nodes[ROUTER_MAX_NODES];
+    int count;
+};
+
+constexpr u16 router_new_node(Router_Table &t, char ch)
+{
+    // Throwing in a constant expression is a compile error, that's our static_assert here
+    return t.count < ROUTER_MAX_NODES ? (t.nodes[t.count].ch = ch, (u16)t.count++) : throw "ROUTER_MAX_NODES is too small";
+}
+
+constexpr u16 router_static_child(Router_Table &t, u16 parent, char ch)
+{
+    for (u16 c = t.nodes[parent].first_child; c; c = t.nodes[c].next_sibling) {
+        if (t.nodes[c].ch == ch) return c;
+    }
+
+    u16 n = router_new_node(t, ch);
+    t.nodes[n].next_sibling = t.nodes[parent].first_child;
+    t.nodes[parent].first_child = n;
+
+    return n;
+}
+
+constexpr Router_Table router_build(const Route *routes, int route_count)
+{
+    Router_Table t = {};
+    router_new_node(t, '/'); // The root
+
+    for (int r = 0; r < route_count; r++) {
+        const char *p = routes[r].pattern;
+        if (*p != '/') throw "The route patterns must start with '/'";
+        p += 1;
+
+        u16 node = 0;
+        while (*p) {
+            if (*p == ':') {
+                if (!t.nodes[node].param_child) t.nodes[node].param_child = router_new_node(t, ':');
+                node = t.nodes[node].param_child;
+                while (*p && *p != '/') p += 1;
+            } else if (*p == '*') {
+                if (!t.nodes[node].wildcard_child) t.nodes[node].wildcard_child = router_new_node(t, '*');
+                node = t.nodes[node].wildcard_child;
+                while (*p) p += 1;
+            } else {
+                node = router_static_child(t, node, *p);
+                p += 1;
+            }
+        }
+
+        if (t.nodes[node].routes[routes[r].method]) throw "Duplicated route";
+        t.nodes[node].routes[routes[r].method] = (u16)(r + 1);
+        t.nodes[node].has_routes = true;
+    }
+
+    return t;
+}
+
+// Returns the node where the path ends, or 0. It only recurses at the nodes where a capture
+// can start, everything else is a plain loop over the characters.
+u16 router_find(const Router_Table *t, u16 node, String path, Route_Params *params)
+{
+    while (true) {
+        const Router_Node *n = t->nodes + node;
+
+        if (path.count == 0) {
+            if (n->has_routes) return node;
+            if (n->wildcard_child && params->count < ROUTER_MAX_PARAMS) {
+                params->values[params->count++] = path;
+                return n->wildcard_child;
+            }
+            return 0;
+        }
+
+        u16 next = 0;
+        char ch = path.data[0];
+        for (u16 c = n->first_child; c; c = t->nodes[c].next_sibling) {
+            if (t->nodes[c].ch == ch) {
+                next = c;
+                break;
+            }
+        }
+
+        if (!n->param_child && !n->wildcard_child) {
+            if (!next) return 0;
+
+            node = next;
+            advance(&path, 1);
+            continue;
+        }
+
+        int saved_count = params->count;
+
+        if (next) {
+            u16 r = router_find(t, next, advance(path, 1), params);
+            if (r) return r;
+            params->count = saved_count;
+        }
+
+        if (n->param_child && params->count < ROUTER_MAX_PARAMS) {
+            s64 len = 0;
+            while (len < path.count && path.data[len] != '/') len += 1;
+
+            if (len) {
+                params->values[params->count++] = String(path.data, len);
+                u16 r = router_find(t, n->param_child, advance(path, len), params);
+                if (r) return r;
+                params->count = saved_count;
+            }
+        }
+
+        if (n->wildcard_child && params->count < ROUTER_MAX_PARAMS) {
+            params->values[params->count++] = path;
+            return n->wildcard_child;
+        }
+
+        return 0;
+    }
+}
+
+enum Route_Match {
+    ROUTE_FOUND = 0,
+    ROUTE_NOT_FOUND,
+    ROUTE_METHOD_NOT_ALLOWED,
+};
+
+Route_Match router_match(const Router_Table *t, const Route *routes, Http_Method method, String path, Route_Params *params, Route_Handler *handler)
+{
+    params->count = 0;
+    if (path.count == 0 || path.data[0] != '/') return ROUTE_NOT_FOUND;
+
+    u16 node = router_find(t, 0, advance(path, 1), params);
+    if (!node) return ROUTE_NOT_FOUND;
+
+    u16 r = t->nodes[node].routes[method];
+    if (!r) return ROUTE_METHOD_NOT_ALLOWED;
+
+    *handler = routes[r-1].handler;
+    return ROUTE_FOUND;
+}
+
+#endif
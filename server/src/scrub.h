@@ -0,0 +1,240 @@
+#ifndef H_CUPIDO_SCRUB
+#define H_CUPIDO_SCRUB
+
+#include "storage.h"
+
+// Background re-verification of the stored files against the digests in the index. A pass
+// runs on a few low priority threads (background CPU and I/O priority on Windows) and all of
+// them share one byte budget per second, so it competes little with the foreground requests.
+
+const int   SCRUB_THREAD_COUNT        = 2;
+const s64   SCRUB_DEFAULT_BYTES_PER_SEC = BYTES_TO_MB(32); // See the config
+const s64   SCRUB_READ_SIZE           = BYTES_TO_MB(1);
+const s64   SCRUB_CLAIM_SLOTS         = 64;
+const DWORD SCRUB_FIRST_PASS_DELAY_MS = 10 * 60 * 1000;
+const DWORD SCRUB_INTERVAL_MS         = 24 * 60 * 60 * 1000;
+
+struct Scrubber {
+    Storage *st;
+    HANDLE scheduler;
+
+    volatile LONGLONG cursor; // The next slot of the index to check
+
+    CRITICAL_SECTION throttle_lock;
+    volatile s64 bytes_per_sec;
+    ULONGLONG throttle_start_ms;
+    s64 throttle_bytes;
+
+    // Counters of the last (or the current) pass
+    volatile LONGLONG verified;
+    volatile LONGLONG corrupted;
+    volatile LONGLONG repaired; // Of the corrupted ones, rebuilt from the other shards
+    volatile LONGLONG missing;
+    volatile LONGLONG bytes;
+};
+
+void scrub_throttle(Scrubber *sc, s64 count)
+{
+    EnterCriticalSection(&sc->throttle_lock);
+    sc->throttle_bytes += count;
+    s64 bytes_per_sec = sc->bytes_per_sec;
+    s64 allowed = (s64)(GetTickCount64() - sc->throttle_start_ms) * bytes_per_sec / 1000;
+    s64 ahead = sc->throttle_bytes - allowed;
+    LeaveCriticalSection(&sc->throttle_lock);
+
+    if (ahead > 0) Sleep((DWORD)(ahead * 1000 / bytes_per_sec));
+}
+
+// Returns false if the file can't be read.
+bool scrub_hash_file(Scrubber *sc, Storage_Reader *r, u8 digest[SHA256_DIGEST_SIZE], char *buf)
+{
+    Sha256 sha;
+    sha256_init(&sha);
+
+    bool success = true;
+    for (s64 left = r->size; left > 0;) {
+        s64 n = left < SCRUB_READ_SIZE ? left : SCRUB_READ_SIZE;
+        if (!storage_read(r, buf, n)) {
+            success = false;
+            break;
+        }
+
+        sha256_update(&sha, buf, n);
+        left -= n;
+        InterlockedExchangeAdd64(&sc->bytes, n);
+
+        scrub_throttle(sc, n);
+    }
+
+    sha256_final(&sha, digest);
+
+    return success;
+}
+
+// A file on the disks that hashes wrong although every unit matched its checksum: read it without
+// each shard in turn. Returns the shard the digest comes out right without, -1 if there is none.
+int scrub_find_bad_shard(Scrubber *sc, char *rel_path, Storage_Entry *e, char *buf)
+{
+    Erasure_Set *set = sc->st->disks;
+    for (int s = 0; s < set->disk_count; s++) {
+        bool exclude[ERASURE_MAX_DISKS] = {};
+        exclude[s] = true;
+
+        Storage_Reader r;
+        r.handle = INVALID_HANDLE_VALUE;
+        int found = erasure_open(set, rel_path, &r.ec, exclude);
+        bool match = false;
+        if (found >= set->data_shards) {
+            u8 digest[SHA256_DIGEST_SIZE];
+            r.size = r.ec.header.size;
+            match = r.size == e->size && scrub_hash_file(sc, &r, digest, buf) && memcmp(digest, e->digest, SHA256_DIGEST_SIZE) == 0;
+        }
+        erasure_close(&r.ec);
+
+        if (match) return s;
+    }
+
+    return -1;
+}
+
+DWORD WINAPI scrub_thread(void *param)
+{
+    Scrubber *sc = (Scrubber *)param;
+    Storage *st = sc->st;
+
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+
+    char *buf = (char *)malloc(SCRUB_READ_SIZE);
+    assert(buf);
+
+    while (true) {
+        s64 first = InterlockedExchangeAdd64(&sc->cursor, SCRUB_CLAIM_SLOTS);
+
+        AcquireSRWLockShared(&st->index.lock);
+        s64 capacity = st->index.capacity;
+        ReleaseSRWLockShared(&st->index.lock);
+        if (first >= capacity) break;
+
+        for (s64 slot = first; slot < first + SCRUB_CLAIM_SLOTS && slot < capacity; slot++) {
+            // The index can grow during the pass, then we may skip or check twice some files;
+            // the next pass catches those.
+            Storage_Entry e;
+            char rel_path[MAX_PATH];
+
+            AcquireSRWLockShared(&st->index.lock);
+            bool ok = slot < st->index.capacity && st->index.entries[slot].path && st->index.entries[slot].has_digest;
+            if (ok) {
+                e = st->index.entries[slot];
+                memcpy(rel_path, e.path, e.path_count+1);
+            }
+            ReleaseSRWLockShared(&st->index.lock);
+            if (!ok) continue;
+
+            u8 digest[SHA256_DIGEST_SIZE];
+            Storage_Reader r;
+            bool opened = storage_open(st, rel_path, &r);
+            bool readable = opened && scrub_hash_file(sc, &r, digest, buf);
+            s64 size = opened ? r.size : 0;
+
+            // A file still readable from the disks gets back the shards it lost (to a bad sector, say),
+            // the ones that failed their checksums included
+            bool on_disks = opened && r.handle == INVALID_HANDLE_VALUE;
+            bool repair = readable && on_disks && r.ec.present < st->disks->disk_count;
+            bool damaged[ERASURE_MAX_DISKS] = {};
+            if (on_disks) memcpy(damaged, r.ec.damaged, sizeof(damaged));
+            if (opened) storage_close(&r);
+
+            if (!readable) {
+                printf("[scrub]: Missing or unreadable file %s\n", rel_path);
+                InterlockedIncrement64(&sc->missing);
+                continue;
+            }
+
+            if (size == e.size && memcmp(digest, e.digest, SHA256_DIGEST_SIZE) == 0) {
+                if (repair) erasure_repair(st->disks, rel_path, damaged);
+                InterlockedIncrement64(&sc->verified);
+                continue;
+            }
+
+            // It could be overwritten by an upload while we were reading it
+            Storage_Entry now;
+            if (storage_lookup(st, String(rel_path), &now) && memcmp(now.digest, e.digest, SHA256_DIGEST_SIZE) != 0) {
+                continue;
+            }
+
+            char expected[SHA256_HEX_SIZE+1], got[SHA256_HEX_SIZE+1];
+            sha256_to_hex(e.digest, expected);
+            sha256_to_hex(digest, got);
+            printf("[scrub]: Corrupted file %s -> size %lld/%lld, sha256 %s, expected %s\n", rel_path, size, e.size, got, expected);
+            InterlockedIncrement64(&sc->corrupted);
+
+            int bad = on_disks ? scrub_find_bad_shard(sc, rel_path, &e, buf) : -1;
+            if (bad >= 0) {
+                bool exclude[ERASURE_MAX_DISKS] = {};
+                exclude[bad] = true;
+                if (erasure_repair(st->disks, rel_path, exclude)) {
+                    printf("[scrub]: Rebuilt the shard %d of %s from the others\n", bad, rel_path);
+                    InterlockedIncrement64(&sc->repaired);
+                }
+            }
+        }
+    }
+
+    free(buf);
+    return 0;
+}
+
+DWORD WINAPI scrub_scheduler_thread(void *param)
+{
+    Scrubber *sc = (Scrubber *)param;
+
+    Sleep(SCRUB_FIRST_PASS_DELAY_MS);
+
+    while (true) {
+        sc->cursor    = 0;
+        sc->verified  = 0;
+        sc->corrupted = 0;
+        sc->repaired  = 0;
+        sc->missing   = 0;
+        sc->bytes     = 0;
+        sc->throttle_start_ms = GetTickCount64();
+        sc->throttle_bytes    = 0;
+
+        printf("[scrub]: Pass started\n");
+
+        HANDLE threads[SCRUB_THREAD_COUNT];
+        int count = 0;
+        for (int i = 0; i < SCRUB_THREAD_COUNT; i++) {
+            threads[count] = CreateThread(NULL, 0, scrub_thread, sc, 0, NULL);
+            if (threads[count]) count += 1;
+        }
+
+        WaitForMultipleObjects(count, threads, TRUE, INFINITE);
+        for (int i = 0; i < count; i++) CloseHandle(threads[i]);
+
+        printf("[scrub]: Pass finished -> %lld verified, %lld corrupted (%lld repaired), %lld missing, %lld bytes read\n",
+               sc->verified, sc->corrupted, sc->repaired, sc->missing, sc->bytes);
+
+        Sleep(SCRUB_INTERVAL_MS);
+    }
+
+    return 0;
+}
+
+bool scrub_start(Scrubber *sc, Storage *st)
+{
+    ZERO_MEMORY(sc, sizeof(Scrubber));
+    sc->st = st;
+    sc->bytes_per_sec = SCRUB_DEFAULT_BYTES_PER_SEC;
+    InitializeCriticalSection(&sc->throttle_lock);
+
+    sc->scheduler = CreateThread(NULL, 0, scrub_scheduler_thread, sc, 0, NULL);
+    if (sc->scheduler == NULL) {
+        fprintf(stderr, "[scrub]: Failed to start the scheduler thread! Error code: %lu\n", GetLastError());
+        return false;
+    }
+
+    return true;
+}
+
+#endif
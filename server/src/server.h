@@ -2,15 +2,21 @@
 #define H_CUPIDO_SERVER
 
 #include "core.h"
+#include "storage.h"
+#include "scrub.h"
+#include "cache.h"
+#include "tls.h"
+#include "shaper.h"
+#include "config.h"
+#include "handoff.h"
+#include "profile.h"
 
 #define CRLF "\r\n"
 #define CRLF_LEN constexpr(strlen(CRLF))
 #define HTTP_1_1 "HTTP/1.1"
 
-#define RECV_BUF_SIZE BYTES_TO_KB(256)
+const s64 TRANSMIT_FILE_MAX_CALL = 2147483646; // The most bytes one TransmitFile() call can send
 
-const int MAX_CLIENTS = 128; 
-const int REQUEST_MAX_SIZE = (1024*1024*64);
 
 enum Mime_Type {
     Mime_None = 0,
@@ -38,6 +44,8 @@ enum Mime_Type {
     Mime_Video_Mp4,
     Mime_Video_Webm,
     
+    Mime_Multipart_FormData,
+    
     Mime_Count
 };
 
@@ -82,14 +90,31 @@ enum Http_Response_Status {
 enum Http_Request_State {
     HTTP_STATE_CONN_RECEIVED = 0,
     HTTP_STATE_HEADER_PARSED = 0b00000001,
+    HTTP_STATE_H2_PREFACE    = 0b00000010, // The connection speaks HTTP/2, see http2.h
 };
 
+struct H2_Conn;
+struct H2_Stream;
+
 struct Request {
     u32 id;
 
     bool connected;
     bool should_close;
     SOCKET socket = INVALID_SOCKET;
+    
+    bool wants_tls; // Accepted on the TLS port, the worker does the handshake
+    Tls_Conn *tls;  // nullptr on plain connections
+    
+    H2_Conn   *h2;        // Only on the requests of HTTP/2 streams
+    H2_Stream *h2_stream;
+    
+    // The shaping of the responses, see shaper.h. The streams of HTTP/2 are shaped by the
+    // request of their connection.
+    Shaper_Flow *flow;
+    Token_Bucket send_bucket;
+    
+    Profile_Trace trace; // The phases, if the request is sampled (see profile.h)
 
     String raw_body;
 
@@ -97,24 +122,57 @@ struct Request {
     Http_Request_State state;
     
     Http_Method method;
-    String path;
+    String path;  // Normalized in place by url_normalize_path() before the routing
+    String query; // Raw, the parameters are decoded on demand by url_query_get()
     String protocol;
     
     Mime_Type content_type;
-    s32 content_length = -1;
+    String boundary; // multipart/form-data only, points into the 'buf'
+    s64 content_length = -1;
+    s64 body_received;
+    
+    u8   expected_sha256[SHA256_DIGEST_SIZE]; // X-Expected-SHA256
+    bool has_expected_sha256;
     
     String header;
-    String body;
-    char buf[4096];
+    String body; // The part of the body that arrived with the header
+    char *buf;   // Kept by the client slot, 'header_buffer_size' of the config
+    s64 buf_size;
 };
 
 struct Server {
+    Config config;
+    CRITICAL_SECTION config_lock; // Serializes the reloads
+    
     SOCKET socket = INVALID_SOCKET;
     int port;
-    bool running = false; 
+    volatile bool running = false; 
+    volatile bool draining = false; // Finishing the accepted connections, see server_drain()
+    
+    SOCKET tls_socket = INVALID_SOCKET; // Only if there is a certificate
+    Tls_Server tls;
     
+    // 'max_clients' of the config of each
     Request *clients;
-    bool    free_clients[MAX_CLIENTS];
+    bool    *free_clients;
+    
+    // Accepted connections waiting for a worker, guarded by the 'clients_lock' like the 'free_clients'
+    CRITICAL_SECTION   clients_lock;
+    CONDITION_VARIABLE queue_not_empty;
+    Request **queue;
+    int queue_head;
+    int queue_count;
+    
+    HANDLE *workers;
+    
+    Handoff handoff;      // If the sockets came from an older process
+    HANDLE upgrade_event; // See server_upgrade_thread()
+    
+    Storage  storage;
+    Scrubber scrubber;
+    Cache    cache;
+    Shaper   shaper;
+    Profiler profiler;
 };
 
 Http_Method http_method_str_to_enum(String method)
@@ -126,6 +184,18 @@ Http_Method http_method_str_to_enum(String method)
     return HTTP_METHOD_NONE;
 }
 
+const char *http_method_enum_to_str(Http_Method method)
+{
+    switch (method) {
+        case HTTP_METHOD_GET:    return "GET";
+        case HTTP_METHOD_POST:   return "POST";
+        case HTTP_METHOD_DELETE: return "DELETE";
+        default: break;
+    }
+    
+    return "-";
+}
+
 Mime_Type content_type_str_to_enum(String s)
 {
     bool ok = true;
@@ -152,10 +222,166 @@ Mime_Type content_type_str_to_enum(String s)
         RET_IF_MATCH("gif",  Mime_Image_Gif);
         RET_IF_MATCH("webp",  Mime_Image_Webp);
     }
+    else if (string_starts_with_and_step(&left, "multipart/")) {
+        RET_IF_MATCH("form-data", Mime_Multipart_FormData);
+    }
     
     #undef RET_IF_MATCH
     
     return Mime_None;
 }
 
+Mime_Type content_type_from_extension(String path)
+{
+    s64 dot = -1;
+    for (s64 i = path.count - 1; i >= 0 && path.data[i] != '/'; i--) {
+        if (path.data[i] == '.') {
+            dot = i;
+            break;
+        }
+    }
+    if (dot < 0) return Mime_App_OctetStream;
+    
+    String ext = advance(path, (unsigned int)dot + 1);
+    
+    #define RET_IF_MATCH(_cstr, _enum) if (string_equal_ignore_case(ext, String(_cstr))) return _enum;
+    
+    RET_IF_MATCH("jpg",  Mime_Image_Jpg);
+    RET_IF_MATCH("jpeg", Mime_Image_Jpg);
+    RET_IF_MATCH("png",  Mime_Image_Png);
+    RET_IF_MATCH("gif",  Mime_Image_Gif);
+    RET_IF_MATCH("webp", Mime_Image_Webp);
+    RET_IF_MATCH("mp3",  Mime_Audio_Mp3);
+    RET_IF_MATCH("wav",  Mime_Audio_Wav);
+    RET_IF_MATCH("mp4",  Mime_Video_Mp4);
+    RET_IF_MATCH("webm", Mime_Video_Webm);
+    RET_IF_MATCH("txt",  Mime_Text_Plain);
+    RET_IF_MATCH("html", Mime_Text_Html);
+    RET_IF_MATCH("json", Mime_App_Json);
+    RET_IF_MATCH("pdf",  Mime_App_Pdf);
+    RET_IF_MATCH("zip",  Mime_App_Zip);
+    RET_IF_MATCH("gz",   Mime_App_Gzip);
+    RET_IF_MATCH("tar",  Mime_App_Tar);
+    RET_IF_MATCH("rar",  Mime_App_Rar);
+    
+    #undef RET_IF_MATCH
+    
+    return Mime_App_OctetStream;
+}
+
+char *content_type_enum_to_str(Mime_Type type)
+{
+    switch (type) {
+        case Mime_App_OctetStream:    return "application/octet-stream";
+        case Mime_App_Zip:            return "application/zip";
+        case Mime_App_Gzip:           return "application/gzip";
+        case Mime_App_Tar:            return "application/x-tar";
+        case Mime_App_Rar:            return "application/vnd.rar";
+        case Mime_App_Pdf:            return "application/pdf";
+        case Mime_App_Json:           return "application/json";
+        case Mime_Text_Plain:         return "text/plain";
+        case Mime_Text_Html:          return "text/html";
+        case Mime_Image_Jpg:          return "image/jpeg";
+        case Mime_Image_Png:          return "image/png";
+        case Mime_Image_Gif:          return "image/gif";
+        case Mime_Image_Webp:         return "image/webp";
+        case Mime_Audio_Mp3:          return "audio/mpeg";
+        case Mime_Audio_Wav:          return "audio/wav";
+        case Mime_Audio_Webm:         return "audio/webm";
+        case Mime_Video_Mp4:          return "video/mp4";
+        case Mime_Video_Webm:         return "video/webm";
+        case Mime_Multipart_FormData: return "multipart/form-data";
+        default: break;
+    }
+    
+    return "application/octet-stream";
+}
+
+// Applies the header fields the request handling cares about. Returns false on an invalid
+// value. The boundary keeps pointing into the 'value'.
+bool http_request_apply_header(Request *c, String key, String value)
+{
+    if (string_equal_ignore_case(key, String("Content-Type"))) {
+        c->content_type = content_type_str_to_enum(value);
+        if (c->content_type == Mime_None) {
+            printf("Content type not handled as enum -> " SFMT "\n", SARG(value));
+        }
+        
+        if (c->content_type == Mime_Multipart_FormData) {
+            bool has_boundary = false;
+            split(value, "boundary=", &c->boundary, &has_boundary);
+            if (!has_boundary) c->boundary = String();
+            
+            if (c->boundary.count >= 2 && c->boundary.data[0] == '"') {
+                c->boundary = split(advance(c->boundary, 1), "\"");
+            }
+        }
+        
+    } else if (string_equal_ignore_case(key, String("X-Expected-SHA256"))) {
+        c->has_expected_sha256 = sha256_from_hex(value, c->expected_sha256);
+        if (!c->has_expected_sha256) {
+            fprintf(stderr, "Invalid X-Expected-SHA256 -> " SFMT "\n", SARG(value));
+            return false;
+        }
+        
+    } else if (string_equal_ignore_case(key, String("Content-Length"))) {
+        bool to_int_ok = true;
+        c->content_length = string_to_s64(value, &to_int_ok);
+        
+        if (!to_int_ok || c->content_length < 0) {
+            fprintf(stderr, "Failed to parse Content-Length to int -> " SFMT "\n", SARG(value));
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+int h2_recv(Request *c, char *dest, int max);
+
+// recv() of the connection, decrypted on the TLS ones. On the HTTP/2 streams it is the
+// DATA of the stream.
+inline int request_recv(Request *c, char *dest, int max)
+{
+    if (c->h2)  return h2_recv(c, dest, max);
+    if (c->tls) return tls_recv(c->tls, c->socket, dest, max);
+    return recv(c->socket, dest, max, 0);
+}
+
+// Reads the next part of the request body into the 'dest'. First it gives back the bytes
+// that arrived together with the header, then it continues with recv(). Returns the number of
+// bytes read, 0 if the whole body has been read, or -1 on error.
+s64 request_recv_body(Request *c, char *dest, s64 max)
+{
+    s64 remain = c->content_length - c->body_received;
+    if (remain <= 0) return 0;
+    if (max > remain) max = remain;
+    
+    if (c->body.count) {
+        s64 n = c->body.count < max ? c->body.count : max;
+        memcpy(dest, c->body.data, n);
+        advance(&c->body, n);
+        c->body_received += n;
+        return n;
+    }
+    
+    if (max > INT_MAX) max = INT_MAX;
+    
+    while (true) {
+        int r = request_recv(c, dest, (int)max);
+        if (r == SOCKET_ERROR) {
+            if (WSAGetLastError() == WSAEWOULDBLOCK) continue;
+            
+            fprintf(stderr, "#%lld: recv() failed while reading the body. Error code: %d\n", c->socket, WSAGetLastError());
+            return -1;
+        } else if (r == 0) {
+            fprintf(stderr, "#%lld: Connection closed before the end of the body! (%lld/%lld)\n", c->socket, c->body_received, c->content_length);
+            return -1;
+        }
+        
+        c->body_received += r;
+        return r;
+    }
+}
+
 #endif 
\ No newline at end of file
@@ -0,0 +1,233 @@
+#ifndef H_CUPIDO_SHA256
+#define H_CUPIDO_SHA256
+
+#include "core.h"
+
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SHA_NI_TARGET
+#else
+#include <cpuid.h>
+#define SHA_NI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+#endif
+
+// Streaming SHA-256. The blocks are compressed with the SHA extensions when the CPU has them,
+// otherwise with the scalar code, so the upload path can hash inline without a second pass.
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_HEX_SIZE    64
+
+struct Sha256 {
+    u32 state[8];
+    u8  block[64];
+    s64 block_count;
+    u64 total;
+};
+
+alignas(16) static const u32 SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_blocks_scalar(u32 state[8], u8 *data, s64 blocks)
+{
+    for (s64 b = 0; b < blocks; b++, data += 64) {
+        u32 w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = ((u32)data[i*4] << 24) | ((u32)data[i*4+1] << 16) | ((u32)data[i*4+2] << 8) | (u32)data[i*4+3];
+        }
+        for (int i = 16; i < 64; i++) {
+            u32 s0 = SHA256_ROTR(w[i-15], 7) ^ SHA256_ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+            u32 s1 = SHA256_ROTR(w[i-2], 17) ^ SHA256_ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+
+        u32 a = state[0], b_ = state[1], c = state[2], d = state[3];
+        u32 e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 64; i++) {
+            u32 t1 = h + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+            u32 t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22)) + ((a & b_) ^ (a & c) ^ (b_ & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b_; b_ = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b_; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f;  state[6] += g; state[7] += h;
+    }
+}
+
+SHA_NI_TARGET void sha256_blocks_shani(u32 state[8], u8 *data, s64 blocks)
+{
+    const __m128i BSWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp    = _mm_loadu_si128((__m128i *)&state[0]);
+    __m128i state1 = _mm_loadu_si128((__m128i *)&state[4]);
+    tmp    = _mm_shuffle_epi32(tmp, 0xB1);          // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1B);       // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);    // CDGH
+
+    for (s64 b = 0; b < blocks; b++, data += 64) {
+        __m128i abef_save = state0;
+        __m128i cdgh_save = state1;
+        __m128i m[4];
+
+        // 16 x 4 rounds, the message schedule runs 3 groups ahead of the rounds
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) m[i] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(data + i*16)), BSWAP);
+
+            __m128i msg = _mm_add_epi32(m[i & 3], _mm_load_si128((__m128i *)(SHA256_K + i*4)));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+
+            if (i >= 3 && i < 15) {
+                __m128i t = _mm_alignr_epi8(m[i & 3], m[(i+3) & 3], 4);
+                m[(i+1) & 3] = _mm_add_epi32(m[(i+1) & 3], t);
+                m[(i+1) & 3] = _mm_sha256msg2_epu32(m[(i+1) & 3], m[i & 3]);
+            }
+
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+            if (i >= 1 && i < 13) m[(i-1) & 3] = _mm_sha256msg1_epu32(m[(i-1) & 3], m[i & 3]);
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+    }
+
+    tmp    = _mm_shuffle_epi32(state0, 0x1B);       // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);       // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);    // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);       // ABEF
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+bool sha256_cpu_has_shani()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuidex(info, 7, 0);
+    bool sha = (info[1] >> 29) & 1;
+    __cpuid(info, 1);
+    bool sse41 = (info[2] >> 19) & 1;
+#else
+    unsigned int a, b, c, d;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+    bool sha = (b >> 29) & 1;
+    __get_cpuid(1, &a, &b, &c, &d);
+    bool sse41 = (c >> 19) & 1;
+#endif
+    return sha && sse41;
+}
+
+typedef void (*Sha256_Blocks_Proc)(u32 state[8], u8 *data, s64 blocks);
+static Sha256_Blocks_Proc sha256_blocks = nullptr;
+
+void sha256_init(Sha256 *ctx)
+{
+    if (sha256_blocks == nullptr) {
+        sha256_blocks = sha256_cpu_has_shani() ? sha256_blocks_shani : sha256_blocks_scalar;
+    }
+
+    static const u32 initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->state, initial_state, sizeof(initial_state));
+    ctx->block_count = 0;
+    ctx->total = 0;
+}
+
+void sha256_update(Sha256 *ctx, void *_data, s64 count)
+{
+    u8 *data = (u8 *)_data;
+    ctx->total += count;
+
+    if (ctx->block_count) {
+        s64 n = 64 - ctx->block_count;
+        if (n > count) n = count;
+        memcpy(ctx->block + ctx->block_count, data, n);
+        ctx->block_count += n;
+        data  += n;
+        count -= n;
+
+        if (ctx->block_count < 64) return;
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->block_count = 0;
+    }
+
+    // The full blocks straight from the caller's buffer
+    s64 blocks = count / 64;
+    if (blocks) {
+        sha256_blocks(ctx->state, data, blocks);
+        data  += blocks * 64;
+        count -= blocks * 64;
+    }
+
+    memcpy(ctx->block, data, count);
+    ctx->block_count = count;
+}
+
+void sha256_final(Sha256 *ctx, u8 digest[SHA256_DIGEST_SIZE])
+{
+    u64 bits = ctx->total * 8;
+
+    u8 pad[72] = {0x80};
+    s64 pad_count = (ctx->block_count < 56 ? 56 : 120) - ctx->block_count;
+    for (int i = 0; i < 8; i++) pad[pad_count + i] = (u8)(bits >> (56 - i*8));
+
+    u64 total = ctx->total;
+    sha256_update(ctx, pad, pad_count + 8);
+    ctx->total = total;
+    assert(ctx->block_count == 0);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i*4+0] = (u8)(ctx->state[i] >> 24);
+        digest[i*4+1] = (u8)(ctx->state[i] >> 16);
+        digest[i*4+2] = (u8)(ctx->state[i] >> 8);
+        digest[i*4+3] = (u8)(ctx->state[i]);
+    }
+}
+
+void sha256_to_hex(u8 digest[SHA256_DIGEST_SIZE], char hex[SHA256_HEX_SIZE+1])
+{
+    static const char *digits = "0123456789abcdef";
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        hex[i*2]   = digits[digest[i] >> 4];
+        hex[i*2+1] = digits[digest[i] & 15];
+    }
+    hex[SHA256_HEX_SIZE] = '\0';
+}
+
+bool sha256_from_hex(String hex, u8 digest[SHA256_DIGEST_SIZE])
+{
+    if (hex.count != SHA256_HEX_SIZE) return false;
+
+    for (int i = 0; i < SHA256_HEX_SIZE; i++) {
+        char ch = hex.data[i];
+        u8 v;
+        if      (ch >= '0' && ch <= '9') v = ch - '0';
+        else if (ch >= 'a' && ch <= 'f') v = ch - 'a' + 10;
+        else if (ch >= 'A' && ch <= 'F') v = ch - 'A' + 10;
+        else return false;
+
+        if (i & 1) digest[i/2] |= v;
+        else       digest[i/2]  = v << 4;
+    }
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,311 @@
+#ifndef H_CUPIDO_SHAPER
+#define H_CUPIDO_SHAPER
+
+#include "core.h"
+
+// Bandwidth shaping of the responses. Every send asks for a grant of at most SHAPER_QUANTUM
+// bytes first:
+//   1. The token bucket of the connection and the one of the client address (a device, with
+//      every connection it has open) have to allow it, that's the per client rate limit.
+//   2. With a total rate the grants of the uplink go around the addresses that wait for one in
+//      deficit round robin: each address in turn gets a quantum of credit and sends until it's
+//      used up. An address with eight parallel downloads gets the same share as the phone
+//      with one, not eight times as much.
+// A rate of zero is no limit. Without any limit the grant is immediate and only counted.
+//
+// The waiting is done under one lock, a grant is some tens of KB so that's a few thousand
+// acquisitions per second at most.
+
+const s64 SHAPER_QUANTUM   = BYTES_TO_KB(64);
+const s64 SHAPER_MIN_BURST = BYTES_TO_KB(4);
+
+struct Token_Bucket {
+    s64 tokens; // In thousandths of a byte: rate (bytes/s) * elapsed ms, nothing is lost to rounding
+    ULONGLONG refilled_ms; // Zero until the first use
+};
+
+struct Shaper;
+
+// One per client address while it has a connection
+struct Shaper_Flow {
+    Shaper *shaper;
+    u32 address; // IPv4, network byte order
+    int connections;
+
+    Token_Bucket bucket;
+
+    // In the round robin ring while 'waiting' is not zero
+    int waiting;
+    s64 deficit;
+    Shaper_Flow *next;
+    Shaper_Flow *prev;
+
+    volatile LONGLONG bytes_sent;
+    volatile LONGLONG throttled_ms;
+};
+
+struct Shaper {
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE wake;
+
+    // Bytes per second, set by the config
+    volatile s64 total_rate;
+    volatile s64 address_rate;
+    volatile s64 connection_rate;
+
+    Token_Bucket total;
+    Shaper_Flow *current; // The address whose turn it is, nullptr if no one waits
+
+    // As many as the connections at most. Looked up at the accepts only, so it's a plain array.
+    Shaper_Flow *flows;
+    int flow_capacity;
+
+    volatile LONGLONG bytes_sent;
+    volatile LONGLONG throttled_ms;
+    volatile LONGLONG grants;
+};
+
+void shaper_init(Shaper *sh, int max_connections)
+{
+    ZERO_MEMORY(sh, sizeof(Shaper));
+    InitializeCriticalSection(&sh->lock);
+    InitializeConditionVariable(&sh->wake);
+
+    sh->flow_capacity = max_connections;
+    sh->flows = (Shaper_Flow *)calloc(max_connections, sizeof(Shaper_Flow));
+    assert(sh->flows);
+}
+
+void shaper_set_rates(Shaper *sh, s64 total, s64 per_address, s64 per_connection)
+{
+    EnterCriticalSection(&sh->lock);
+    sh->total_rate      = total;
+    sh->address_rate    = per_address;
+    sh->connection_rate = per_connection;
+    WakeAllConditionVariable(&sh->wake);
+    LeaveCriticalSection(&sh->lock);
+}
+
+inline bool shaper_is_limited(Shaper *sh)
+{
+    return sh->total_rate || sh->address_rate || sh->connection_rate;
+}
+
+// A bucket holds 100 ms worth of sending, so a pause doesn't turn into a long burst later.
+inline s64 token_bucket_capacity(s64 rate)
+{
+    s64 capacity = rate / 10;
+    return capacity < SHAPER_MIN_BURST ? SHAPER_MIN_BURST : capacity;
+}
+
+void token_bucket_refill(Token_Bucket *b, s64 rate, ULONGLONG now)
+{
+    s64 capacity = token_bucket_capacity(rate) * 1000;
+
+    // Full on the first use, and stays full without a limit
+    if (b->refilled_ms == 0 || rate == 0) {
+        b->tokens = capacity;
+        b->refilled_ms = now;
+        return;
+    }
+
+    // A full bucket takes 100 ms, more of a pause doesn't matter (and can't overflow)
+    ULONGLONG elapsed = now - b->refilled_ms;
+    if (elapsed > 1000) elapsed = 1000;
+
+    b->tokens += rate * (s64)elapsed;
+    b->refilled_ms = now;
+    if (b->tokens > capacity) b->tokens = capacity;
+}
+
+inline void token_bucket_charge(Token_Bucket *b, s64 count)
+{
+    b->tokens -= count * 1000;
+}
+
+// How many ms until the bucket has 'count' bytes.
+inline DWORD token_bucket_wait_ms(Token_Bucket *b, s64 rate, s64 count)
+{
+    if (rate == 0 || b->tokens >= count * 1000) return 0;
+    return (DWORD)((count * 1000 - b->tokens) / rate) + 1;
+}
+
+// Under the lock.
+void shaper_ring_remove(Shaper *sh, Shaper_Flow *f)
+{
+    if (f->next == f) {
+        sh->current = nullptr;
+    } else {
+        f->prev->next = f->next;
+        f->next->prev = f->prev;
+        if (sh->current == f) {
+            sh->current = f->next;
+            sh->current->deficit += SHAPER_QUANTUM;
+        }
+    }
+
+    f->next = f->prev = nullptr;
+    f->deficit = 0; // DRR drops the credit of an address that has nothing to send
+}
+
+// Under the lock.
+void shaper_ring_append(Shaper *sh, Shaper_Flow *f)
+{
+    if (sh->current == nullptr) {
+        f->next = f->prev = f;
+        f->deficit = SHAPER_QUANTUM;
+        sh->current = f;
+        return;
+    }
+
+    // Behind the others: right before the current one
+    Shaper_Flow *last = sh->current->prev;
+    f->prev = last;
+    f->next = sh->current;
+    last->next = f;
+    sh->current->prev = f;
+}
+
+// The flow of the address of a new connection.
+Shaper_Flow *shaper_acquire(Shaper *sh, u32 address)
+{
+    Shaper_Flow *found = nullptr;
+    Shaper_Flow *free_flow = nullptr;
+
+    EnterCriticalSection(&sh->lock);
+    for (int i = 0; i < sh->flow_capacity && !found; i++) {
+        Shaper_Flow *f = sh->flows + i;
+        if (f->connections && f->address == address) found = f;
+        if (f->connections == 0 && free_flow == nullptr) free_flow = f;
+    }
+
+    if (found == nullptr) {
+        found = free_flow; // There's always one, each connection has at most one flow
+        assert(found);
+        ZERO_MEMORY(found, sizeof(Shaper_Flow));
+        found->shaper  = sh;
+        found->address = address;
+    }
+    found->connections += 1;
+    LeaveCriticalSection(&sh->lock);
+
+    return found;
+}
+
+void shaper_release(Shaper_Flow *f)
+{
+    Shaper *sh = f->shaper;
+    EnterCriticalSection(&sh->lock);
+    f->connections -= 1;
+    LeaveCriticalSection(&sh->lock);
+}
+
+// At most a quantum, and no more than the buckets can hold: a larger grant would never fit.
+// Under the lock, the rates can change while a grant waits.
+s64 shaper_grant_size(Shaper *sh, s64 want)
+{
+    s64 n = want < SHAPER_QUANTUM ? want : SHAPER_QUANTUM;
+    if (sh->connection_rate && n > token_bucket_capacity(sh->connection_rate)) n = token_bucket_capacity(sh->connection_rate);
+    if (sh->address_rate    && n > token_bucket_capacity(sh->address_rate))    n = token_bucket_capacity(sh->address_rate);
+    if (sh->total_rate      && n > token_bucket_capacity(sh->total_rate))      n = token_bucket_capacity(sh->total_rate);
+    return n;
+}
+
+// Blocks until up to 'want' bytes can be sent on the connection, returns how many. They are
+// counted as sent, what ends up not being sent goes back with shaper_give_back().
+s64 shaper_take(Shaper_Flow *f, Token_Bucket *connection, s64 want)
+{
+    Shaper *sh = f->shaper;
+
+    if (!shaper_is_limited(sh)) {
+        InterlockedExchangeAdd64(&f->bytes_sent, want);
+        InterlockedExchangeAdd64(&sh->bytes_sent, want);
+        return want;
+    }
+
+    EnterCriticalSection(&sh->lock);
+
+    s64 n = want;
+    ULONGLONG started = GetTickCount64();
+
+    // 1. The limits of the connection and the address. The size is taken again on every pass,
+    // a reload can lower the rates below it.
+    while (true) {
+        n = shaper_grant_size(sh, n);
+
+        ULONGLONG now = GetTickCount64();
+        token_bucket_refill(connection, sh->connection_rate, now);
+        token_bucket_refill(&f->bucket, sh->address_rate, now);
+
+        DWORD wait_ms = token_bucket_wait_ms(connection, sh->connection_rate, n);
+        DWORD address_wait_ms = token_bucket_wait_ms(&f->bucket, sh->address_rate, n);
+        if (address_wait_ms > wait_ms) wait_ms = address_wait_ms;
+        if (wait_ms == 0) break;
+
+        // Woken early by a rate change
+        SleepConditionVariableCS(&sh->wake, &sh->lock, wait_ms);
+    }
+
+    // 2. The uplink, in turns
+    if (sh->total_rate) {
+        if (f->waiting++ == 0) shaper_ring_append(sh, f);
+
+        while (true) {
+            n = shaper_grant_size(sh, n); // Only smaller, the connection and address buckets have it
+            token_bucket_refill(&sh->total, sh->total_rate, GetTickCount64());
+
+            if (sh->current->deficit <= 0) {
+                sh->current = sh->current->next;
+                sh->current->deficit += SHAPER_QUANTUM;
+                WakeAllConditionVariable(&sh->wake);
+            }
+
+            DWORD wait_ms = token_bucket_wait_ms(&sh->total, sh->total_rate, n);
+            if (sh->current == f && wait_ms == 0) break;
+            if (sh->total_rate == 0) break; // Turned off while we waited
+
+            SleepConditionVariableCS(&sh->wake, &sh->lock, wait_ms ? wait_ms : INFINITE);
+        }
+
+        token_bucket_charge(&sh->total, n);
+        f->deficit -= n; // Can go below zero, the next turn of the address pays it back
+
+        if (--f->waiting == 0) shaper_ring_remove(sh, f);
+        WakeAllConditionVariable(&sh->wake);
+    }
+
+    token_bucket_charge(connection, n);
+    token_bucket_charge(&f->bucket, n);
+
+    LeaveCriticalSection(&sh->lock);
+
+    ULONGLONG waited = GetTickCount64() - started;
+    if (waited) {
+        InterlockedExchangeAdd64(&f->throttled_ms, (LONGLONG)waited);
+        InterlockedExchangeAdd64(&sh->throttled_ms, (LONGLONG)waited);
+    }
+    InterlockedExchangeAdd64(&f->bytes_sent, n);
+    InterlockedExchangeAdd64(&sh->bytes_sent, n);
+    InterlockedIncrement64(&sh->grants);
+
+    return n;
+}
+
+// The part of a grant that wasn't sent after all.
+void shaper_give_back(Shaper_Flow *f, Token_Bucket *connection, s64 count)
+{
+    Shaper *sh = f->shaper;
+
+    InterlockedExchangeAdd64(&f->bytes_sent, -count);
+    InterlockedExchangeAdd64(&sh->bytes_sent, -count);
+    if (!shaper_is_limited(sh)) return;
+
+    EnterCriticalSection(&sh->lock);
+    token_bucket_charge(connection, -count);
+    token_bucket_charge(&f->bucket, -count);
+    if (sh->total_rate) token_bucket_charge(&sh->total, -count);
+    WakeAllConditionVariable(&sh->wake);
+    LeaveCriticalSection(&sh->lock);
+}
+
+#endif
@@ -0,0 +1,911 @@
+#ifndef H_CUPIDO_STORAGE
+#define H_CUPIDO_STORAGE
+
+#include "core.h"
+#include "sha256.h"
+#include "erasure.h"
+
+// Everything lives under the storage root:
+//   <root>/.tmp/       -> partially received files, moved into place on commit
+//   <root>/index.log   -> append-only "size\tsha256\tpath" lines, replayed on startup
+//   <root>/<path>      -> the committed files
+// With the 'disks' option the committed files are erasure-coded over the disks instead (see
+// erasure.h), the ones stored before that are still read from the root.
+
+#define STORAGE_DEFAULT_ROOT "storage"
+#define STORAGE_TMP_DIR   ".tmp"
+#define STORAGE_INDEX_LOG "index.log"
+
+const int STORAGE_BATCH_MAX_FILES = 64;
+const s64 STORAGE_BATCH_MAX_BYTES = BYTES_TO_MB(64);
+const s64 STORAGE_INDEX_MIN_CAPACITY = 1024;
+
+// How long the committer waits for the other uploads to join a group, unless the group is
+// already full. Everything in a group shares the directory and index log flushes. The config
+// can change it, this is the default.
+const DWORD STORAGE_DEFAULT_COMMIT_WINDOW_MS = 5;
+const int   STORAGE_GROUP_COMMIT_MAX_FILES = 1024;
+const int   STORAGE_GROUP_COMMIT_MAX_DIRS  = 64;
+
+struct Storage_Entry {
+    char *path = nullptr; // Relative to the root, zero terminated, heap allocated
+    s64 path_count;
+    u64 hash;
+
+    s64 size;
+    u8   digest[SHA256_DIGEST_SIZE];
+    bool has_digest;
+};
+
+struct Storage_Index {
+    Storage_Entry *entries = nullptr;
+    s64 capacity = 0;
+    s64 count = 0;
+
+    SRWLOCK lock; // Written by the committer thread (and storage_index_refresh)
+    HANDLE log = INVALID_HANDLE_VALUE;
+    s64 log_replayed; // Bytes of the log already in the index
+    CRITICAL_SECTION log_lock; // A refresh never sees our lines before they are published
+};
+
+struct Storage_File {
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    char tmp_path[MAX_PATH];
+    char rel_path[MAX_PATH];
+    s64 size;
+    bool committed;
+
+    // Hashed inline while it's being written, checked against the expected digest (if any)
+    Sha256 sha;
+    u8   digest[SHA256_DIGEST_SIZE];
+    u8   expected_digest[SHA256_DIGEST_SIZE];
+    bool has_expected_digest;
+};
+
+struct Storage_Batch;
+
+// A chunk of a batch, handed over to the committer thread.
+struct Storage_Commit {
+    Storage_File files[STORAGE_BATCH_MAX_FILES];
+    int count;
+    s64 bytes;
+
+    Storage_Batch *batch;
+    Storage_Commit *next;
+};
+
+// The files of an upload. Full chunks are submitted to the committer while the upload is
+// still receiving, storage_batch_commit() submits the rest and waits for all of them.
+struct Storage_Batch {
+    Storage_Commit *current;
+    int pending; // Guarded by the Storage::commit_lock
+
+    s64 committed_files;
+    s64 committed_bytes;
+    s64 failed_files;
+    String digests; // '"path": "sha256"' pairs of the committed files, comma separated
+};
+
+// Called on the committer thread for every committed file, after it's in the index.
+typedef void (*Storage_Change_Proc)(void *user, String rel_path);
+
+struct Storage {
+    char root[MAX_PATH];
+    Storage_Index index;
+    volatile LONG tmp_counter;
+
+    HANDLE committer;
+    CRITICAL_SECTION commit_lock;
+    CONDITION_VARIABLE commit_wake;
+    CONDITION_VARIABLE commit_finished;
+    Storage_Commit *commit_first;
+    Storage_Commit *commit_last;
+    int commit_files;
+
+    bool dir_flush_unsupported;
+    volatile LONG commit_window_ms;
+
+    Storage_Change_Proc on_change;
+    void *on_change_user;
+
+    Erasure_Set *disks; // nullptr: the files are under the root
+};
+
+// A stored file opened for reading: the plain file under the root, or the shards on the disks.
+struct Storage_Reader {
+    HANDLE handle; // The plain file, INVALID_HANDLE_VALUE if it's from the disks
+    Erasure_Reader ec;
+    s64 size;
+    FILETIME written;
+};
+
+inline u64 storage_hash(String s)
+{
+    // FNV-1a
+    u64 h = 14695981039346656037ULL;
+    for (s64 i = 0; i < s.count; i++) {
+        h ^= (u8)s.data[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+Storage_Entry *storage_index_find(Storage_Index *index, String path)
+{
+    if (index->capacity == 0) return nullptr;
+
+    u64 h = storage_hash(path);
+    for (s64 i = h & (index->capacity-1);; i = (i+1) & (index->capacity-1)) {
+        Storage_Entry *e = index->entries + i;
+        if (e->path == nullptr) return nullptr;
+        if (e->hash == h && string_equal(String(e->path, e->path_count), path)) return e;
+    }
+}
+
+void storage_index_grow(Storage_Index *index)
+{
+    Storage_Entry *old = index->entries;
+    s64 old_capacity = index->capacity;
+
+    index->capacity = old_capacity ? old_capacity * 2 : STORAGE_INDEX_MIN_CAPACITY;
+    index->entries = (Storage_Entry *)calloc(index->capacity, sizeof(Storage_Entry));
+    assert(index->entries);
+
+    for (s64 i = 0; i < old_capacity; i++) {
+        if (old[i].path == nullptr) continue;
+
+        s64 j = old[i].hash & (index->capacity-1);
+        while (index->entries[j].path) j = (j+1) & (index->capacity-1);
+        index->entries[j] = old[i];
+    }
+
+    free(old);
+}
+
+Storage_Entry *storage_index_put(Storage_Index *index, String path, s64 size, u8 *digest)
+{
+    // Keep the load factor under 70%
+    if ((index->count+1) * 10 >= index->capacity * 7) storage_index_grow(index);
+
+    u64 h = storage_hash(path);
+    s64 i = h & (index->capacity-1);
+    for (;; i = (i+1) & (index->capacity-1)) {
+        Storage_Entry *e = index->entries + i;
+        if (e->path == nullptr) break;
+        if (e->hash == h && string_equal(String(e->path, e->path_count), path)) break;
+    }
+
+    Storage_Entry *e = index->entries + i;
+    if (e->path == nullptr) {
+        e->path       = string_to_new_cstr(path);
+        e->path_count = path.count;
+        e->hash       = h;
+        index->count += 1;
+    }
+
+    e->size = size;
+    e->has_digest = digest != nullptr;
+    if (digest) memcpy(e->digest, digest, SHA256_DIGEST_SIZE);
+
+    return e;
+}
+
+// Thread safe lookup for the readers, the entry is copied out without the path.
+bool storage_lookup(Storage *st, String path, Storage_Entry *out)
+{
+    AcquireSRWLockShared(&st->index.lock);
+    Storage_Entry *e = storage_index_find(&st->index, path);
+    if (e) {
+        *out = *e;
+        out->path = nullptr;
+    }
+    ReleaseSRWLockShared(&st->index.lock);
+
+    return e != nullptr;
+}
+
+inline bool storage_file_exists(char *path)
+{
+    return GetFileAttributesA(path) != INVALID_FILE_ATTRIBUTES;
+}
+
+bool storage_make_dir(char *path)
+{
+    if (CreateDirectoryA(path, NULL)) return true;
+    return GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+// Creates every missing directory of the 'full_path' but not the last component.
+bool storage_make_parent_dirs(char *full_path)
+{
+    char tmp[MAX_PATH];
+    s64 len = strlen(full_path);
+    if (len >= MAX_PATH) return false;
+    memcpy(tmp, full_path, len+1);
+
+    for (s64 i = 1; i < len; i++) {
+        if (tmp[i] != '/' && tmp[i] != '\\') continue;
+
+        tmp[i] = '\0';
+        bool ok = storage_make_dir(tmp);
+        tmp[i] = '/';
+        if (!ok) return false;
+    }
+
+    return true;
+}
+
+// The names Windows opens as devices, in any case and with any extension: "nul.txt" is NUL.
+bool storage_is_device_name(String segment)
+{
+    static const char *devices[] = { "CON", "PRN", "AUX", "NUL", "CONIN$", "CONOUT$" };
+
+    String base = string_trim_white_right(split(segment, "."));
+    for (int i = 0; i < ARRAY_SIZE(devices); i++) {
+        if (string_equal_ignore_case(base, String(devices[i]))) return true;
+    }
+
+    // COM0-9 and LPT0-9
+    if (base.count == 4 && IS_DIGIT(base.data[3])) {
+        String prefix = String(base.data, 3);
+        if (string_equal_ignore_case(prefix, String("COM")) || string_equal_ignore_case(prefix, String("LPT"))) return true;
+    }
+
+    return false;
+}
+
+// Paths are coming from the clients (multipart filenames, tar entries), so we only accept
+// plain relative paths, without any '..', '.', empty, or drive/stream components, device
+// names, or our own files at the root. NTFS ignores the case, so do the comparisons.
+bool storage_path_is_safe(String path)
+{
+    if (path.count == 0 || path.count >= MAX_PATH) return false;
+    if (path.data[0] == '/' || path.data[0] == '\\') return false;
+
+    s64 segment_start = 0;
+    for (s64 i = 0; i <= path.count; i++) {
+        char ch = i < path.count ? path.data[i] : '/';
+
+        if ((u8)ch < 0x20 || ch == ':' || ch == '\\' || ch == '*' || ch == '?' || ch == '"' || ch == '<' || ch == '>' || ch == '|') {
+            return false;
+        }
+
+        if (ch == '/') {
+            String segment = String(path.data + segment_start, i - segment_start);
+            if (segment.count == 0 || segment == "." || segment == "..") return false;
+            if (segment.data[segment.count-1] == '.' || segment.data[segment.count-1] == ' ') return false;
+            if (storage_is_device_name(segment)) return false;
+
+            if (segment_start == 0 && (string_equal_ignore_case(segment, String(STORAGE_TMP_DIR)) || string_equal_ignore_case(segment, String(STORAGE_INDEX_LOG)))) {
+                return false;
+            }
+            segment_start = i+1;
+        }
+    }
+
+    return true;
+}
+
+bool storage_write_all(HANDLE h, char *data, s64 count)
+{
+    while (count > 0) {
+        DWORD chunk = count > BYTES_TO_MB(64) ? BYTES_TO_MB(64) : (DWORD)count;
+        DWORD written = 0;
+        if (!WriteFile(h, data, chunk, &written, NULL)) return false;
+
+        data  += written;
+        count -= written;
+    }
+
+    return true;
+}
+
+// Writes at the end of the file even if another process appended since our last write.
+bool storage_append_all(HANDLE h, char *data, s64 count)
+{
+    while (count > 0) {
+        DWORD chunk = count > BYTES_TO_MB(64) ? BYTES_TO_MB(64) : (DWORD)count;
+        DWORD written = 0;
+
+        OVERLAPPED at_end;
+        ZERO_MEMORY(&at_end, sizeof(at_end));
+        at_end.Offset     = 0xFFFFFFFF;
+        at_end.OffsetHigh = 0xFFFFFFFF;
+        if (!WriteFile(h, data, chunk, &written, &at_end)) return false;
+
+        data  += written;
+        count -= written;
+    }
+
+    return true;
+}
+
+// Fails if the file is shorter than 'count'.
+bool storage_read_all(HANDLE h, char *data, s64 count)
+{
+    while (count > 0) {
+        DWORD chunk = count > BYTES_TO_MB(64) ? BYTES_TO_MB(64) : (DWORD)count;
+        DWORD read = 0;
+        if (!ReadFile(h, data, chunk, &read, NULL) || read == 0) return false;
+
+        data  += read;
+        count -= read;
+    }
+
+    return true;
+}
+
+bool storage_open(Storage *st, char *rel_path, Storage_Reader *r)
+{
+    r->handle = INVALID_HANDLE_VALUE;
+
+    if (st->disks) {
+        int found = erasure_open(st->disks, rel_path, &r->ec);
+        if (found && found >= st->disks->data_shards) {
+            r->size = r->ec.header.size;
+            r->written.dwLowDateTime  = (DWORD)r->ec.header.written;
+            r->written.dwHighDateTime = (DWORD)(r->ec.header.written >> 32);
+            return true;
+        }
+        erasure_close(&r->ec);
+
+        if (found) {
+            fprintf(stderr, "[storage]: %s has %d shard(s) of the %d needed\n", rel_path, found, st->disks->data_shards);
+            return false;
+        }
+    }
+
+    char full_path[MAX_PATH];
+    snprintf(full_path, MAX_PATH, "%s/%s", st->root, rel_path);
+
+    r->handle = CreateFileA(full_path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (r->handle == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(r->handle, &size) || !GetFileTime(r->handle, NULL, NULL, &r->written)) {
+        CloseHandle(r->handle);
+        r->handle = INVALID_HANDLE_VALUE;
+        return false;
+    }
+    r->size = size.QuadPart;
+
+    return true;
+}
+
+// The next 'count' bytes, fails if the file is shorter.
+inline bool storage_read(Storage_Reader *r, char *data, s64 count)
+{
+    if (r->handle == INVALID_HANDLE_VALUE) return erasure_read(&r->ec, data, count);
+    return storage_read_all(r->handle, data, count);
+}
+
+inline bool storage_rewind(Storage_Reader *r)
+{
+    if (r->handle == INVALID_HANDLE_VALUE) {
+        r->ec.position = 0;
+        return true;
+    }
+
+    LARGE_INTEGER start = {0};
+    return SetFilePointerEx(r->handle, start, NULL, FILE_BEGIN) != 0;
+}
+
+void storage_close(Storage_Reader *r)
+{
+    if (r->handle == INVALID_HANDLE_VALUE) {
+        erasure_close(&r->ec);
+        return;
+    }
+
+    CloseHandle(r->handle);
+    r->handle = INVALID_HANDLE_VALUE;
+}
+
+// Applies the complete lines of the log. Returns the bytes used, a torn last line is left for
+// later. With 'live' the index is already shared with the readers and the changes are announced.
+// Then only the last line of a path counts, and only if it differs from the index: an older line
+// (ours among them) would put back a replaced version for a moment.
+s64 storage_index_replay(Storage *st, String content, bool live)
+{
+    Storage_Index latest;
+    Storage_Index *into = live ? &latest : &st->index;
+
+    String rest = content;
+    s64 used = 0;
+
+    while (rest.count) {
+        bool found = false;
+        String line = split_and_move(&rest, "\n", &found);
+        if (!found) break; // Torn last line, the commit of it never finished (or is still going on)
+        used = content.count - rest.count;
+
+        String file_path;
+        String size_str = split(line, "\t", &file_path, &found);
+        if (!found) continue;
+
+        // The lines written before the hashing was added have no digest
+        u8 digest[SHA256_DIGEST_SIZE];
+        String after_digest;
+        String digest_str = split(file_path, "\t", &after_digest, &found);
+        bool has_digest = found && sha256_from_hex(digest_str, digest);
+        if (has_digest) file_path = after_digest;
+
+        bool ok = true;
+        s64 size = string_to_s64(size_str, &ok);
+        if (!ok || !storage_path_is_safe(file_path)) continue;
+
+        storage_index_put(into, file_path, size, has_digest ? digest : nullptr);
+    }
+
+    if (!live) return used;
+
+    for (s64 i = 0; i < latest.capacity; i++) {
+        Storage_Entry *e = latest.entries + i;
+        if (e->path == nullptr) continue;
+
+        String file_path = String(e->path, (u32)e->path_count);
+
+        AcquireSRWLockExclusive(&st->index.lock);
+        Storage_Entry *current = storage_index_find(&st->index, file_path);
+        bool same = current && current->size == e->size && current->has_digest == e->has_digest &&
+                    (!e->has_digest || memcmp(current->digest, e->digest, SHA256_DIGEST_SIZE) == 0);
+        if (!same) storage_index_put(&st->index, file_path, e->size, e->has_digest ? e->digest : nullptr);
+        ReleaseSRWLockExclusive(&st->index.lock);
+
+        if (!same && st->on_change) st->on_change(st->on_change_user, file_path);
+        free(e->path);
+    }
+    free(latest.entries);
+
+    return used;
+}
+
+bool storage_index_load(Storage *st)
+{
+    char path[MAX_PATH];
+    snprintf(path, MAX_PATH, "%s/" STORAGE_INDEX_LOG, st->root);
+
+    if (storage_file_exists(path)) {
+        String content = read_entire_file(String(path), "rb");
+        st->index.log_replayed = storage_index_replay(st, content, false);
+        free(content);
+    }
+
+    // Shared for writing: while an upgrade overlaps two processes, both of them append (see
+    // storage_append_all)
+    st->index.log = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (st->index.log == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "[storage]: Failed to open the index log %s. Error code: %lu\n", path, GetLastError());
+        return false;
+    }
+
+    printf("[storage]: %lld file(s) in the index\n", st->index.count);
+
+    return true;
+}
+
+// Applies the lines appended to the log by another process since the load or the last refresh.
+// Our own lines come back too, they are already published (see 'log_lock') and match the index.
+void storage_index_refresh(Storage *st)
+{
+    char path[MAX_PATH];
+    snprintf(path, MAX_PATH, "%s/" STORAGE_INDEX_LOG, st->root);
+
+    HANDLE h = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE) return;
+
+    EnterCriticalSection(&st->index.log_lock);
+
+    LARGE_INTEGER size;
+    LARGE_INTEGER from;
+    from.QuadPart = st->index.log_replayed;
+    if (GetFileSizeEx(h, &size) && size.QuadPart > from.QuadPart && SetFilePointerEx(h, from, NULL, FILE_BEGIN)) {
+        s64 count = size.QuadPart - from.QuadPart;
+        char *data = (char *)malloc(count);
+        if (data && storage_read_all(h, data, count)) {
+            st->index.log_replayed += storage_index_replay(st, String(data, (u32)count), true);
+        }
+        free(data);
+    }
+
+    LeaveCriticalSection(&st->index.log_lock);
+    CloseHandle(h);
+}
+
+bool storage_file_begin(Storage *st, String rel_path, Storage_File *f)
+{
+    if (!storage_path_is_safe(rel_path)) {
+        printf("[storage]: Unsafe path rejected -> " SFMT "\n", SARG(rel_path));
+        return false;
+    }
+    
+    if (strlen(st->root) + 1 + rel_path.count >= MAX_PATH) {
+        printf("[storage]: Too long path rejected -> " SFMT "\n", SARG(rel_path));
+        return false;
+    }
+
+    memcpy(f->rel_path, rel_path.data, rel_path.count);
+    f->rel_path[rel_path.count] = '\0';
+    f->size = 0;
+    f->committed = false;
+    f->has_expected_digest = false;
+    sha256_init(&f->sha);
+
+    LONG n = InterlockedIncrement(&st->tmp_counter);
+    snprintf(f->tmp_path, MAX_PATH, "%s/" STORAGE_TMP_DIR "/%lu-%ld.part", st->root, GetCurrentProcessId(), n);
+
+    f->handle = CreateFileA(f->tmp_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (f->handle == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "[storage]: Failed to create %s. Error code: %lu\n", f->tmp_path, GetLastError());
+        return false;
+    }
+
+    return true;
+}
+
+bool storage_file_write(Storage_File *f, char *data, s64 count)
+{
+    if (!storage_write_all(f->handle, data, count)) {
+        fprintf(stderr, "[storage]: Failed to write %s. Error code: %lu\n", f->tmp_path, GetLastError());
+        return false;
+    }
+
+    sha256_update(&f->sha, data, count);
+    f->size += count;
+    return true;
+}
+
+// Call it after the last write. Returns false if the content doesn't match the expected digest.
+bool storage_file_finish(Storage_File *f)
+{
+    sha256_final(&f->sha, f->digest);
+
+    if (f->has_expected_digest && memcmp(f->digest, f->expected_digest, SHA256_DIGEST_SIZE) != 0) {
+        char got[SHA256_HEX_SIZE+1], expected[SHA256_HEX_SIZE+1];
+        sha256_to_hex(f->digest, got);
+        sha256_to_hex(f->expected_digest, expected);
+        printf("[storage]: Digest mismatch of %s -> got %s, expected %s\n", f->rel_path, got, expected);
+        return false;
+    }
+
+    return true;
+}
+
+void storage_file_abort(Storage_File *f)
+{
+    if (f->handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(f->handle);
+        f->handle = INVALID_HANDLE_VALUE;
+    }
+
+    DeleteFileA(f->tmp_path);
+}
+
+// Best effort to make the renames durable with one flush per directory. On the file systems
+// where it's not supported we fall back to write-through moves.
+bool storage_flush_dir(Storage *st, char *dir)
+{
+    HANDLE h = CreateFileA(dir, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    bool ok = h != INVALID_HANDLE_VALUE && FlushFileBuffers(h);
+    if (h != INVALID_HANDLE_VALUE) CloseHandle(h);
+
+    if (!ok) {
+        fprintf(stderr, "[storage]: Failed to flush the directory %s, switching to write-through moves. Error code: %lu\n", dir, GetLastError());
+        st->dir_flush_unsupported = true;
+    }
+
+    return ok;
+}
+
+void storage_commit_group(Storage *st, Storage_Commit *group)
+{
+    // 1. Flush the content of every file first, so the writeback of the whole group can overlap.
+    // The files for the disks are only read once more, it's their shards that are flushed.
+    for (Storage_Commit *c = group; c; c = c->next) {
+        for (int i = 0; i < c->count; i++) {
+            Storage_File *f = c->files + i;
+            if (!st->disks && !FlushFileBuffers(f->handle)) {
+                fprintf(stderr, "[storage]: Failed to flush %s. Error code: %lu\n", f->tmp_path, GetLastError());
+                storage_file_abort(f);
+                f->tmp_path[0] = '\0';
+                continue;
+            }
+
+            CloseHandle(f->handle);
+            f->handle = INVALID_HANDLE_VALUE;
+        }
+    }
+
+    // 2. Move them into place, the parent directories are flushed once per group
+    char dirs[STORAGE_GROUP_COMMIT_MAX_DIRS][MAX_PATH];
+    int dir_count = 0;
+    bool write_through = st->dir_flush_unsupported;
+
+    String log_lines = string_create(4096);
+
+    for (Storage_Commit *c = group; c; c = c->next) {
+        for (int i = 0; i < c->count; i++) {
+            Storage_File *f = c->files + i;
+            if (f->tmp_path[0] == '\0') continue;
+
+            char final_path[MAX_PATH];
+            snprintf(final_path, MAX_PATH, "%s/%s", st->root, f->rel_path);
+
+            if (st->disks) {
+                // The shards are flushed and renamed by erasure_put(), an older copy under the root would only be stale
+                bool stored = erasure_put(st->disks, f->tmp_path, f->rel_path, f->digest);
+                DeleteFileA(f->tmp_path);
+                if (!stored) continue;
+                DeleteFileA(final_path);
+            } else {
+                DWORD flags = MOVEFILE_REPLACE_EXISTING | (write_through ? MOVEFILE_WRITE_THROUGH : 0);
+                if (!storage_make_parent_dirs(final_path) || !MoveFileExA(f->tmp_path, final_path, flags)) {
+                    fprintf(stderr, "[storage]: Failed to move %s -> %s. Error code: %lu\n", f->tmp_path, final_path, GetLastError());
+                    storage_file_abort(f);
+                    continue;
+                }
+            }
+
+            if (!st->disks && !write_through) {
+                char *slash = strrchr(final_path, '/');
+                *slash = '\0';
+
+                bool seen = false;
+                for (int d = 0; d < dir_count && !seen; d++) seen = strcmp(dirs[d], final_path) == 0;
+
+                if (!seen && dir_count < STORAGE_GROUP_COMMIT_MAX_DIRS) {
+                    memcpy(dirs[dir_count++], final_path, strlen(final_path)+1);
+                } else if (!seen) {
+                    storage_flush_dir(st, final_path);
+                }
+            }
+
+            char hex[SHA256_HEX_SIZE+1];
+            sha256_to_hex(f->digest, hex);
+
+            char line[MAX_PATH + SHA256_HEX_SIZE + 32];
+            int len = snprintf(line, sizeof(line), "%lld\t%s\t%s\n", f->size, hex, f->rel_path);
+            join(&log_lines, line, len);
+            f->committed = true;
+        }
+    }
+
+    for (int d = 0; d < dir_count; d++) storage_flush_dir(st, dirs[d]);
+
+    // 3. One append and one flush of the index log for the whole group
+    EnterCriticalSection(&st->index.log_lock);
+    bool log_ok = true;
+    if (log_lines.count) {
+        log_ok = storage_append_all(st->index.log, log_lines.data, log_lines.count) && FlushFileBuffers(st->index.log);
+        if (!log_ok) fprintf(stderr, "[storage]: Failed to append the index log. Error code: %lu\n", GetLastError());
+    }
+    free(log_lines);
+
+    // 4. Publish them in the in-memory index
+    AcquireSRWLockExclusive(&st->index.lock);
+    for (Storage_Commit *c = group; c; c = c->next) {
+        for (int i = 0; i < c->count; i++) {
+            Storage_File *f = c->files + i;
+            if (!f->committed) continue;
+
+            if (!log_ok) {
+                f->committed = false;
+                continue;
+            }
+
+            storage_index_put(&st->index, String(f->rel_path), f->size, f->digest);
+        }
+    }
+    ReleaseSRWLockExclusive(&st->index.lock);
+    LeaveCriticalSection(&st->index.log_lock);
+
+    if (st->on_change) {
+        for (Storage_Commit *c = group; c; c = c->next) {
+            for (int i = 0; i < c->count; i++) {
+                if (c->files[i].committed) st->on_change(st->on_change_user, String(c->files[i].rel_path));
+            }
+        }
+    }
+}
+
+DWORD WINAPI storage_committer_thread(void *param)
+{
+    Storage *st = (Storage *)param;
+
+    while (true) {
+        EnterCriticalSection(&st->commit_lock);
+        while (st->commit_first == nullptr) {
+            SleepConditionVariableCS(&st->commit_wake, &st->commit_lock, INFINITE);
+        }
+
+        // The group commit window, the concurrent uploads can join before we pay for the flushes
+        ULONGLONG deadline = GetTickCount64() + st->commit_window_ms;
+        while (st->commit_files < STORAGE_GROUP_COMMIT_MAX_FILES) {
+            ULONGLONG now = GetTickCount64();
+            if (now >= deadline) break;
+            SleepConditionVariableCS(&st->commit_wake, &st->commit_lock, (DWORD)(deadline - now));
+        }
+
+        Storage_Commit *group = st->commit_first;
+        st->commit_first = nullptr;
+        st->commit_last  = nullptr;
+        st->commit_files = 0;
+        LeaveCriticalSection(&st->commit_lock);
+
+        storage_commit_group(st, group);
+
+        EnterCriticalSection(&st->commit_lock);
+        while (group) {
+            Storage_Commit *c = group;
+            group = c->next;
+
+            for (int i = 0; i < c->count; i++) {
+                Storage_File *f = c->files + i;
+                if (f->committed) {
+                    c->batch->committed_files += 1;
+                    c->batch->committed_bytes += f->size;
+
+                    char hex[SHA256_HEX_SIZE+1];
+                    sha256_to_hex(f->digest, hex);
+                    if (c->batch->digests.count) join(&c->batch->digests, ", ");
+                    join(&c->batch->digests, "\"");
+                    join(&c->batch->digests, f->rel_path);
+                    join(&c->batch->digests, "\": \"");
+                    join(&c->batch->digests, hex);
+                    join(&c->batch->digests, "\"");
+                } else {
+                    c->batch->failed_files += 1;
+                }
+            }
+
+            c->batch->pending -= 1;
+            free(c);
+        }
+        WakeAllConditionVariable(&st->commit_finished);
+        LeaveCriticalSection(&st->commit_lock);
+    }
+
+    return 0;
+}
+
+void storage_batch_submit(Storage *st, Storage_Batch *b)
+{
+    Storage_Commit *c = b->current;
+    if (c == nullptr) return;
+    b->current = nullptr;
+
+    EnterCriticalSection(&st->commit_lock);
+    c->next = nullptr;
+    if (st->commit_last) st->commit_last->next = c;
+    else                 st->commit_first = c;
+    st->commit_last   = c;
+    st->commit_files += c->count;
+    b->pending       += 1;
+    WakeConditionVariable(&st->commit_wake);
+    LeaveCriticalSection(&st->commit_lock);
+}
+
+// Submits the rest of the batch and waits until every file of it is durable (or failed).
+// The response of an upload must be sent only after this.
+bool storage_batch_commit(Storage *st, Storage_Batch *b)
+{
+    s64 failed_before = b->failed_files;
+    storage_batch_submit(st, b);
+
+    EnterCriticalSection(&st->commit_lock);
+    while (b->pending > 0) {
+        SleepConditionVariableCS(&st->commit_finished, &st->commit_lock, INFINITE);
+    }
+    bool success = b->failed_files == failed_before;
+    LeaveCriticalSection(&st->commit_lock);
+
+    return success;
+}
+
+// Takes the ownership of the file. Full chunks are committed in the background.
+void storage_batch_add(Storage *st, Storage_Batch *b, Storage_File *f)
+{
+    if (b->current == nullptr) {
+        b->current = (Storage_Commit *)calloc(1, sizeof(Storage_Commit));
+        assert(b->current);
+        b->current->batch = b;
+    }
+
+    Storage_Commit *c = b->current;
+    c->files[c->count++] = *f;
+    c->bytes += f->size;
+    f->handle = INVALID_HANDLE_VALUE;
+
+    if (c->count == STORAGE_BATCH_MAX_FILES || c->bytes >= STORAGE_BATCH_MAX_BYTES) {
+        storage_batch_submit(st, b);
+    }
+}
+
+// Rewrites the missing shards of every file in the index, for the disks without their marker
+// (a new or a replaced one). Then they get their marker, unless some shards couldn't be written.
+DWORD WINAPI storage_rebuild_thread(void *param)
+{
+    Storage *st = (Storage *)param;
+    Erasure_Set *set = st->disks;
+
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    printf("[storage]: Rebuilding the disks\n");
+
+    bool success = true;
+    s64 files = 0;
+    for (s64 capacity = -1; capacity != st->index.capacity;) {
+        // The index can grow during the pass and move the files around, then we go again
+        AcquireSRWLockShared(&st->index.lock);
+        capacity = st->index.capacity;
+        ReleaseSRWLockShared(&st->index.lock);
+
+        for (s64 slot = 0; slot < capacity; slot++) {
+            char rel_path[MAX_PATH];
+
+            AcquireSRWLockShared(&st->index.lock);
+            bool ok = slot < st->index.capacity && st->index.entries[slot].path;
+            if (ok) memcpy(rel_path, st->index.entries[slot].path, st->index.entries[slot].path_count+1);
+            ReleaseSRWLockShared(&st->index.lock);
+            if (!ok) continue;
+
+            success = erasure_repair(set, rel_path) && success;
+            files += 1;
+        }
+    }
+
+    if (success) erasure_mark_complete(set);
+    printf("[storage]: Rebuild %s -> %lld files checked, %lld shards rewritten, %lld files lost\n",
+           success ? "finished" : "incomplete", files, set->rebuilt_shards, set->lost_files);
+
+    InterlockedExchange(&set->rebuilding, 0);
+    return 0;
+}
+
+// 'disks' (';' separated, or nullptr) keeps the files erasure-coded over those directories.
+bool storage_create(Storage *st, char *root, char *disks = nullptr, int parity = 0)
+{
+    ZERO_MEMORY(st, sizeof(Storage));
+    st->index.log = INVALID_HANDLE_VALUE;
+    st->commit_window_ms = STORAGE_DEFAULT_COMMIT_WINDOW_MS;
+    snprintf(st->root, MAX_PATH, "%s", root);
+
+    char tmp_dir[MAX_PATH];
+    snprintf(tmp_dir, MAX_PATH, "%s/" STORAGE_TMP_DIR, st->root);
+    if (!storage_make_dir(st->root) || !storage_make_dir(tmp_dir)) {
+        fprintf(stderr, "[storage]: Failed to create the %s directory! Error code: %lu\n", tmp_dir, GetLastError());
+        return false;
+    }
+
+    if (!storage_index_load(st)) return false;
+
+    InitializeSRWLock(&st->index.lock);
+    InitializeCriticalSection(&st->index.log_lock);
+    InitializeCriticalSection(&st->commit_lock);
+    InitializeConditionVariable(&st->commit_wake);
+    InitializeConditionVariable(&st->commit_finished);
+
+    st->committer = CreateThread(NULL, 0, storage_committer_thread, st, 0, NULL);
+    if (st->committer == NULL) {
+        fprintf(stderr, "[storage]: Failed to start the committer thread! Error code: %lu\n", GetLastError());
+        return false;
+    }
+
+    if (disks && disks[0]) {
+        st->disks = (Erasure_Set *)calloc(1, sizeof(Erasure_Set));
+        if (!st->disks || !erasure_attach(st->disks, disks, parity)) return false;
+
+        if (erasure_has_incomplete_disk(st->disks)) {
+            st->disks->rebuilding = 1;
+            st->disks->rebuilder = CreateThread(NULL, 0, storage_rebuild_thread, st, 0, NULL);
+            if (st->disks->rebuilder == NULL) {
+                fprintf(stderr, "[storage]: Failed to start the rebuild thread! Error code: %lu\n", GetLastError());
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,375 @@
+#ifndef H_CUPIDO_TLS
+#define H_CUPIDO_TLS
+
+#include "core.h"
+
+#define SECURITY_WIN32
+#include <windows.h>
+#include <wincrypt.h>
+#include <security.h>
+#include <schannel.h>
+
+// TLS termination with Schannel. All the connections share one credential handle, so
+// Schannel's server side session cache works across them and a returning phone resumes its
+// session instead of doing the full handshake (that's most of the CPU of a short request).
+// The handshake runs on the worker that serves the connection, never on the accept loop.
+//
+// The certificate is looked up by subject in the "MY" store of the machine (then of the
+// user). Without one the TLS port is simply not opened.
+
+#define TLS_CERT_SUBJECT "cupido"
+
+const int   TLS_DEFAULT_PORT        = 6970;
+const DWORD TLS_SESSION_LIFESPAN_MS = 10 * 60 * 60 * 1000;
+const s64   TLS_MAX_RECORD_SIZE     = 5 + 16384 + 2048; // Header + the largest ciphertext
+
+struct Tls_Server {
+    bool enabled;
+    CredHandle cred;
+    HCERTSTORE store;
+    PCCERT_CONTEXT cert;
+
+    volatile LONGLONG handshakes;
+    volatile LONGLONG resumed;
+    volatile LONGLONG failed;
+};
+
+struct Tls_Conn {
+    CtxtHandle ctx;
+    bool has_ctx;
+    SecPkgContext_StreamSizes sizes;
+
+    // Received records. DecryptMessage works in place, so the plain text given out by
+    // tls_recv() points into this and the bytes of the next record(s) follow it.
+    char in[TLS_MAX_RECORD_SIZE];
+    s64  in_count;
+    char *plain;
+    s64  plain_count;
+    char *extra;
+    s64  extra_count;
+
+    char out[TLS_MAX_RECORD_SIZE]; // Header + message + trailer of the record being sent
+};
+
+bool tls_server_create(Tls_Server *t)
+{
+    ZERO_MEMORY(t, sizeof(Tls_Server));
+
+    DWORD locations[] = { CERT_SYSTEM_STORE_LOCAL_MACHINE, CERT_SYSTEM_STORE_CURRENT_USER };
+    for (int i = 0; i < ARRAY_SIZE(locations) && !t->cert; i++) {
+        t->store = CertOpenStore(CERT_STORE_PROV_SYSTEM_A, 0, 0, locations[i] | CERT_STORE_READONLY_FLAG, "MY");
+        if (!t->store) continue;
+
+        t->cert = CertFindCertificateInStore(t->store, X509_ASN_ENCODING, 0, CERT_FIND_SUBJECT_STR_A, TLS_CERT_SUBJECT, NULL);
+        if (!t->cert) {
+            CertCloseStore(t->store, 0);
+            t->store = NULL;
+        }
+    }
+
+    if (!t->cert) {
+        printf("[tls]: No certificate with the subject \"" TLS_CERT_SUBJECT "\", TLS is disabled.\n");
+        return false;
+    }
+
+    SCHANNEL_CRED sc;
+    ZERO_MEMORY(&sc, sizeof(sc));
+    sc.dwVersion             = SCHANNEL_CRED_VERSION;
+    sc.cCreds                = 1;
+    sc.paCred                = &t->cert;
+    sc.grbitEnabledProtocols = SP_PROT_TLS1_2_SERVER;
+    sc.dwSessionLifespan     = TLS_SESSION_LIFESPAN_MS;
+    sc.dwFlags               = SCH_USE_STRONG_CRYPTO;
+
+    SECURITY_STATUS status = AcquireCredentialsHandleA(NULL, (LPSTR)UNISP_NAME_A, SECPKG_CRED_INBOUND, NULL, &sc, NULL, NULL, &t->cred, NULL);
+    if (status != SEC_E_OK) {
+        fprintf(stderr, "[tls]: AcquireCredentialsHandle() failed! Error code: 0x%lx\n", (unsigned long)status);
+        CertFreeCertificateContext(t->cert);
+        CertCloseStore(t->store, 0);
+        return false;
+    }
+
+    t->enabled = true;
+    return true;
+}
+
+bool tls_send_raw(SOCKET socket, char *data, s64 count)
+{
+    while (count > 0) {
+        int sent = send(socket, data, count > INT_MAX ? INT_MAX : (int)count, 0);
+        if (sent == SOCKET_ERROR || sent == 0) return false;
+
+        data  += sent;
+        count -= sent;
+    }
+
+    return true;
+}
+
+// Returns false on a closed connection or on error. Appends to the 'in' buffer.
+bool tls_recv_raw(Tls_Conn *t, SOCKET socket)
+{
+    if (t->in_count == TLS_MAX_RECORD_SIZE) return false; // A record can't be this large
+
+    int r = recv(socket, t->in + t->in_count, (int)(TLS_MAX_RECORD_SIZE - t->in_count), 0);
+    if (r == SOCKET_ERROR || r == 0) return false;
+
+    t->in_count += r;
+    return true;
+}
+
+// The server side of the handshake. Returns the connection state, or nullptr if the handshake
+// failed (the socket still has to be closed by the caller).
+Tls_Conn *tls_accept(Tls_Server *ts, SOCKET socket)
+{
+    Tls_Conn *t = (Tls_Conn *)malloc(sizeof(Tls_Conn));
+    assert(t);
+    ZERO_MEMORY(t, sizeof(Tls_Conn));
+
+    const ULONG flags = ASC_REQ_SEQUENCE_DETECT | ASC_REQ_REPLAY_DETECT | ASC_REQ_CONFIDENTIALITY |
+                        ASC_REQ_EXTENDED_ERROR | ASC_REQ_ALLOCATE_MEMORY | ASC_REQ_STREAM;
+
+    // ALPN: we offer h2, the connection preface tells later which one the client speaks
+    const char protocols[] = "\x02h2\x08http/1.1";
+    alignas(8) char alpn[64];
+    SEC_APPLICATION_PROTOCOLS *ap = (SEC_APPLICATION_PROTOCOLS *)alpn;
+    SEC_APPLICATION_PROTOCOL_LIST *list = ap->ProtocolLists;
+    list->ProtoNegoExt     = SecApplicationProtocolNegotiationExt_ALPN;
+    list->ProtocolListSize = sizeof(protocols) - 1;
+    memcpy(list->ProtocolList, protocols, sizeof(protocols) - 1);
+    ap->ProtocolListsSize = (ULONG)(offsetof(SEC_APPLICATION_PROTOCOL_LIST, ProtocolList) + list->ProtocolListSize);
+    ULONG alpn_size = (ULONG)(offsetof(SEC_APPLICATION_PROTOCOLS, ProtocolLists) + ap->ProtocolListsSize);
+
+    bool need_more = true;
+    while (true) {
+        if (need_more && !tls_recv_raw(t, socket)) break;
+
+        SecBuffer in_bufs[3] = {
+            { (ULONG)t->in_count, SECBUFFER_TOKEN, t->in },
+            { 0, SECBUFFER_EMPTY, NULL },
+            { alpn_size, SECBUFFER_APPLICATION_PROTOCOLS, alpn },
+        };
+        SecBuffer out_bufs[1] = { { 0, SECBUFFER_TOKEN, NULL } };
+        SecBufferDesc in_desc  = { SECBUFFER_VERSION, 3, in_bufs };
+        SecBufferDesc out_desc = { SECBUFFER_VERSION, 1, out_bufs };
+
+        ULONG out_flags = 0;
+        SECURITY_STATUS status = AcceptSecurityContext(&ts->cred, t->has_ctx ? &t->ctx : NULL, &in_desc, flags, 0,
+                                                       &t->ctx, &out_desc, &out_flags, NULL);
+
+        if (status == SEC_E_INCOMPLETE_MESSAGE) {
+            need_more = true;
+            continue;
+        }
+
+        if (status == SEC_E_OK || status == SEC_I_CONTINUE_NEEDED) t->has_ctx = true;
+
+        if (out_bufs[0].pvBuffer) {
+            bool sent = out_bufs[0].cbBuffer == 0 || tls_send_raw(socket, (char *)out_bufs[0].pvBuffer, out_bufs[0].cbBuffer);
+            FreeContextBuffer(out_bufs[0].pvBuffer);
+            if (!sent) break;
+        }
+
+        if (status != SEC_E_OK && status != SEC_I_CONTINUE_NEEDED) {
+            fprintf(stderr, "[tls]: #%lld: Handshake failed! Error code: 0x%lx\n", (s64)socket, (unsigned long)status);
+            break;
+        }
+
+        // Whatever follows the handshake message stays for the next round (or it's the
+        // beginning of the request)
+        if (in_bufs[1].BufferType == SECBUFFER_EXTRA) {
+            memmove(t->in, t->in + t->in_count - in_bufs[1].cbBuffer, in_bufs[1].cbBuffer);
+            t->in_count = in_bufs[1].cbBuffer;
+        } else {
+            t->in_count = 0;
+        }
+
+        if (status == SEC_I_CONTINUE_NEEDED) {
+            need_more = t->in_count == 0;
+            continue;
+        }
+
+        status = QueryContextAttributesA(&t->ctx, SECPKG_ATTR_STREAM_SIZES, &t->sizes);
+        if (status != SEC_E_OK || t->sizes.cbHeader + t->sizes.cbMaximumMessage + t->sizes.cbTrailer > TLS_MAX_RECORD_SIZE) {
+            fprintf(stderr, "[tls]: #%lld: Unexpected stream sizes! Error code: 0x%lx\n", (s64)socket, (unsigned long)status);
+            break;
+        }
+
+        SecPkgContext_SessionInfo session;
+        if (QueryContextAttributesA(&t->ctx, SECPKG_ATTR_SESSION_INFO, &session) == SEC_E_OK && (session.dwFlags & SSL_SESSION_RECONNECT)) {
+            InterlockedIncrement64(&ts->resumed);
+        }
+        InterlockedIncrement64(&ts->handshakes);
+
+        return t;
+    }
+
+    InterlockedIncrement64(&ts->failed);
+    if (t->has_ctx) DeleteSecurityContext(&t->ctx);
+    free(t);
+
+    return nullptr;
+}
+
+// The plain text is used up, the bytes of the next record(s) go to the front of 'in'.
+inline void tls_keep_extra(Tls_Conn *t)
+{
+    if (t->extra_count) memmove(t->in, t->extra, t->extra_count);
+    t->in_count    = t->extra_count;
+    t->extra_count = 0;
+}
+
+// Works like recv(): returns the number of bytes, 0 if the peer closed the connection, or
+// SOCKET_ERROR.
+int tls_recv(Tls_Conn *t, SOCKET socket, char *dest, int max)
+{
+    while (true) {
+        if (t->plain_count) {
+            int n = t->plain_count < max ? (int)t->plain_count : max;
+            memcpy(dest, t->plain, n);
+            t->plain       += n;
+            t->plain_count -= n;
+
+            if (t->plain_count == 0) tls_keep_extra(t);
+
+            return n;
+        }
+
+        if (t->in_count) {
+            SecBuffer bufs[4] = {
+                { (ULONG)t->in_count, SECBUFFER_DATA, t->in },
+                { 0, SECBUFFER_EMPTY, NULL },
+                { 0, SECBUFFER_EMPTY, NULL },
+                { 0, SECBUFFER_EMPTY, NULL },
+            };
+            SecBufferDesc desc = { SECBUFFER_VERSION, 4, bufs };
+
+            SECURITY_STATUS status = DecryptMessage(&t->ctx, &desc, 0, NULL);
+            if (status == SEC_E_OK) {
+                t->plain = nullptr;
+                t->extra = nullptr;
+                t->plain_count = 0;
+                t->extra_count = 0;
+
+                for (int i = 1; i < 4; i++) {
+                    if (bufs[i].BufferType == SECBUFFER_DATA) {
+                        t->plain = (char *)bufs[i].pvBuffer;
+                        t->plain_count = bufs[i].cbBuffer;
+                    } else if (bufs[i].BufferType == SECBUFFER_EXTRA) {
+                        t->extra = (char *)bufs[i].pvBuffer;
+                        t->extra_count = bufs[i].cbBuffer;
+                    }
+                }
+
+                if (t->plain_count == 0) tls_keep_extra(t);
+                continue;
+            }
+
+            if (status == SEC_I_CONTEXT_EXPIRED) return 0; // close_notify
+
+            if (status == SEC_I_RENEGOTIATE) {
+                // Only TLS 1.2 is enabled (see tls_server_create), there this is the client asking
+                // to renegotiate. We don't, the connection is dropped.
+                fprintf(stderr, "[tls]: #%lld: The client asked to renegotiate, closing.\n", (s64)socket);
+                WSASetLastError(WSAECONNABORTED);
+                return SOCKET_ERROR;
+            }
+
+            if (status != SEC_E_INCOMPLETE_MESSAGE) {
+                fprintf(stderr, "[tls]: #%lld: DecryptMessage() failed! Error code: 0x%lx\n", (s64)socket, (unsigned long)status);
+                WSASetLastError(WSAECONNABORTED);
+                return SOCKET_ERROR;
+            }
+        }
+
+        if (t->in_count == TLS_MAX_RECORD_SIZE) {
+            WSASetLastError(WSAEMSGSIZE);
+            return SOCKET_ERROR;
+        }
+
+        int r = recv(socket, t->in + t->in_count, (int)(TLS_MAX_RECORD_SIZE - t->in_count), 0);
+        if (r == SOCKET_ERROR || r == 0) return r;
+        t->in_count += r;
+    }
+}
+
+// Encrypts the message that is already at 'out + cbHeader' in place and sends the record.
+bool tls_send_record(Tls_Conn *t, SOCKET socket, s64 count)
+{
+    SecBuffer bufs[4] = {
+        { t->sizes.cbHeader,  SECBUFFER_STREAM_HEADER,  t->out },
+        { (ULONG)count,       SECBUFFER_DATA,           t->out + t->sizes.cbHeader },
+        { t->sizes.cbTrailer, SECBUFFER_STREAM_TRAILER, t->out + t->sizes.cbHeader + count },
+        { 0, SECBUFFER_EMPTY, NULL },
+    };
+    SecBufferDesc desc = { SECBUFFER_VERSION, 4, bufs };
+
+    SECURITY_STATUS status = EncryptMessage(&t->ctx, 0, &desc, 0);
+    if (status != SEC_E_OK) {
+        fprintf(stderr, "[tls]: #%lld: EncryptMessage() failed! Error code: 0x%lx\n", (s64)socket, (unsigned long)status);
+        return false;
+    }
+
+    return tls_send_raw(socket, t->out, bufs[0].cbBuffer + bufs[1].cbBuffer + bufs[2].cbBuffer);
+}
+
+bool tls_send(Tls_Conn *t, SOCKET socket, char *data, s64 count)
+{
+    while (count > 0) {
+        s64 n = count < t->sizes.cbMaximumMessage ? count : t->sizes.cbMaximumMessage;
+        memcpy(t->out + t->sizes.cbHeader, data, n);
+        if (!tls_send_record(t, socket, n)) return false;
+
+        data  += n;
+        count -= n;
+    }
+
+    return true;
+}
+
+// The file is read straight into the record buffer and encrypted there, so a download costs
+// no more copies than the encryption itself.
+bool tls_send_file(Tls_Conn *t, SOCKET socket, HANDLE h, s64 size)
+{
+    while (size > 0) {
+        DWORD r = 0;
+        DWORD want = size < t->sizes.cbMaximumMessage ? (DWORD)size : t->sizes.cbMaximumMessage;
+        if (!ReadFile(h, t->out + t->sizes.cbHeader, want, &r, NULL) || r == 0) {
+            fprintf(stderr, "[tls]: #%lld: Failed to read the file! Error code: %lu\n", (s64)socket, GetLastError());
+            return false;
+        }
+
+        if (!tls_send_record(t, socket, r)) return false;
+        size -= r;
+    }
+
+    return true;
+}
+
+// Sends close_notify (best effort) and releases the connection state.
+void tls_close(Tls_Server *ts, Tls_Conn *t, SOCKET socket)
+{
+    DWORD type = SCHANNEL_SHUTDOWN;
+    SecBuffer token = { sizeof(type), SECBUFFER_TOKEN, &type };
+    SecBufferDesc token_desc = { SECBUFFER_VERSION, 1, &token };
+
+    if (ApplyControlToken(&t->ctx, &token_desc) == SEC_E_OK) {
+        SecBuffer out_bufs[1] = { { 0, SECBUFFER_TOKEN, NULL } };
+        SecBufferDesc out_desc = { SECBUFFER_VERSION, 1, out_bufs };
+        ULONG out_flags = 0;
+
+        const ULONG flags = ASC_REQ_SEQUENCE_DETECT | ASC_REQ_REPLAY_DETECT | ASC_REQ_CONFIDENTIALITY |
+                            ASC_REQ_EXTENDED_ERROR | ASC_REQ_ALLOCATE_MEMORY | ASC_REQ_STREAM;
+        AcceptSecurityContext(&ts->cred, &t->ctx, NULL, flags, 0, NULL, &out_desc, &out_flags, NULL);
+
+        if (out_bufs[0].pvBuffer) {
+            tls_send_raw(socket, (char *)out_bufs[0].pvBuffer, out_bufs[0].cbBuffer);
+            FreeContextBuffer(out_bufs[0].pvBuffer);
+        }
+    }
+
+    DeleteSecurityContext(&t->ctx);
+    free(t);
+}
+
+#endif
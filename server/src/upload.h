@@ -0,0 +1,434 @@
+#ifndef H_CUPIDO_UPLOAD
+#define H_CUPIDO_UPLOAD
+
+#include "server.h"
+
+// Pull based reader over the request body. The parsers below work on the [start, end) window
+// of the buffer, and they only refill it when they need more bytes, so a file entry is written
+// to the disk as it arrives and the whole body is never kept in memory.
+struct Upload_Stream {
+    Request *c;
+
+    char *data;
+    s64 start;
+    s64 end;
+    s64 capacity;
+};
+
+struct Upload_Result {
+    s64 files;
+    s64 bytes;
+    s64 failed;
+    s64 mismatched; // Failed because of the X-Expected-SHA256
+    String digests;
+};
+
+inline s64 upload_stream_available(Upload_Stream *u)
+{
+    return u->end - u->start;
+}
+
+// Returns false if there is no more data or no more room in the buffer.
+bool upload_stream_fill(Upload_Stream *u)
+{
+    if (u->start > 0) {
+        memmove(u->data, u->data + u->start, u->end - u->start);
+        u->end  -= u->start;
+        u->start = 0;
+    }
+
+    if (u->end == u->capacity) return false;
+
+    s64 r = request_recv_body(u->c, u->data + u->end, u->capacity - u->end);
+    if (r <= 0) return false;
+
+    u->end += r;
+    return true;
+}
+
+bool upload_stream_need(Upload_Stream *u, s64 count)
+{
+    assert(count <= u->capacity);
+
+    while (upload_stream_available(u) < count) {
+        if (!upload_stream_fill(u)) return false;
+    }
+
+    return true;
+}
+
+inline void upload_stream_consume(Upload_Stream *u, s64 count)
+{
+    assert(count <= upload_stream_available(u));
+    u->start += count;
+}
+
+// Moves 'count' bytes from the stream into the file, or just drops them if there is no file.
+bool upload_stream_copy(Upload_Stream *u, Storage_File *f, s64 count, bool *write_failed)
+{
+    while (count > 0) {
+        if (upload_stream_available(u) == 0 && !upload_stream_fill(u)) return false;
+
+        s64 n = upload_stream_available(u);
+        if (n > count) n = count;
+
+        if (f && !*write_failed && !storage_file_write(f, u->data + u->start, n)) {
+            *write_failed = true;
+        }
+
+        upload_stream_consume(u, n);
+        count -= n;
+    }
+
+    return true;
+}
+
+inline s64 upload_stream_find(Upload_Stream *u, char *needle)
+{
+    return find_index_from_left(String(u->data + u->start, upload_stream_available(u)), needle);
+}
+
+String upload_clean_path(char *buf, String path)
+{
+    assert(path.count < MAX_PATH);
+
+    for (s64 i = 0; i < path.count; i++) {
+        buf[i] = path.data[i] == '\\' ? '/' : path.data[i];
+    }
+
+    String r = String(buf, path.count);
+    while (string_starts_with_and_step(&r, "./")) {}
+
+    return r;
+}
+
+void upload_finish_file(Storage *st, Storage_Batch *b, Storage_File *f, bool write_failed, Upload_Result *res)
+{
+    if (write_failed) {
+        storage_file_abort(f);
+        res->failed += 1;
+        return;
+    }
+
+    if (!storage_file_finish(f)) {
+        storage_file_abort(f);
+        res->failed += 1;
+        res->mismatched += 1;
+        return;
+    }
+
+    storage_batch_add(st, b, f);
+}
+
+//
+// Tar (ustar + the GNU long name extension)
+//
+
+const s64 TAR_BLOCK_SIZE = 512;
+
+// Returns -1 for the base-256 values that are negative or don't fit in an s64.
+s64 tar_parse_number(char *field, int len)
+{
+    // GNU base-256 for the files over 8GB, the second bit is the sign
+    if ((u8)field[0] & 0x80) {
+        if ((u8)field[0] & 0x40) return -1;
+
+        s64 r = field[0] & 0x3f;
+        for (int i = 1; i < len; i++) {
+            if (r > (LLONG_MAX >> 8)) return -1;
+            r = (r << 8) | (u8)field[i];
+        }
+        return r;
+    }
+
+    s64 r = 0;
+    int i = 0;
+    while (i < len && field[i] == ' ') i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) r = r*8 + (field[i] - '0');
+
+    return r;
+}
+
+bool tar_header_is_valid(char *h)
+{
+    s64 sum = 0;
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : (u8)h[i];
+    }
+
+    return sum == tar_parse_number(h + 148, 8);
+}
+
+bool upload_ingest_tar(Storage *st, Request *c, Upload_Stream *u, Storage_Batch *b, Upload_Result *res)
+{
+    char long_name[MAX_PATH];
+    s64 long_name_count = -1;
+    s64 files = 0;
+
+    while (true) {
+        if (!upload_stream_need(u, TAR_BLOCK_SIZE)) return false;
+
+        char *h = u->data + u->start;
+
+        bool zero_block = true;
+        for (int i = 0; i < TAR_BLOCK_SIZE && zero_block; i++) zero_block = h[i] == 0;
+        if (zero_block) return true; // End of the archive, we don't care about the second zero block
+
+        if (!tar_header_is_valid(h)) {
+            fprintf(stderr, "[upload]: Invalid tar header checksum!\n");
+            return false;
+        }
+
+        s64 size = tar_parse_number(h + 124, 12);
+        if (size < 0) {
+            fprintf(stderr, "[upload]: Invalid tar entry size!\n");
+            return false;
+        }
+        s64 padding = (TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+        char type = h[156];
+
+        char name_buf[MAX_PATH];
+        String name;
+
+        if (long_name_count >= 0) {
+            name = String(long_name, long_name_count);
+            long_name_count = -1;
+        } else {
+            s64 name_count = strnlen(h, 100);
+            s64 prefix_count = memcmp(h + 257, "ustar", 5) == 0 ? strnlen(h + 345, 155) : 0;
+
+            s64 at = 0;
+            if (prefix_count) {
+                memcpy(name_buf, h + 345, prefix_count);
+                name_buf[prefix_count] = '/';
+                at = prefix_count + 1;
+            }
+            memcpy(name_buf + at, h, name_count);
+            name = String(name_buf, at + name_count);
+        }
+
+        upload_stream_consume(u, TAR_BLOCK_SIZE);
+
+        bool write_failed = false;
+
+        if (type == 'L') {
+            // GNU long name, the data is the name of the next entry
+            if (size >= MAX_PATH) {
+                if (!upload_stream_copy(u, NULL, size + padding, &write_failed)) return false;
+                continue;
+            }
+
+            if (!upload_stream_need(u, size)) return false;
+            memcpy(long_name, u->data + u->start, size);
+            long_name_count = strnlen(long_name, size);
+            upload_stream_consume(u, size);
+
+            if (!upload_stream_copy(u, NULL, padding, &write_failed)) return false;
+            continue;
+        }
+
+        if (type != '0' && type != '\0' && type != '7') {
+            // Directories are created on commit, links and pax headers are ignored
+            if (!upload_stream_copy(u, NULL, size + padding, &write_failed)) return false;
+            continue;
+        }
+
+        // The X-Expected-SHA256 of the request is the digest of one file
+        if (c->has_expected_sha256 && ++files > 1) {
+            fprintf(stderr, "[upload]: X-Expected-SHA256 with more than one file in the tar!\n");
+            return false;
+        }
+
+        char clean_buf[MAX_PATH];
+        String path = upload_clean_path(clean_buf, name);
+
+        Storage_File f;
+        bool has_file = storage_file_begin(st, path, &f);
+        if (!has_file) res->failed += 1;
+
+        if (has_file && c->has_expected_sha256) {
+            f.has_expected_digest = true;
+            memcpy(f.expected_digest, c->expected_sha256, SHA256_DIGEST_SIZE);
+        }
+
+        if (!upload_stream_copy(u, has_file ? &f : NULL, size, &write_failed)) {
+            if (has_file) storage_file_abort(&f);
+            return false;
+        }
+
+        if (has_file) upload_finish_file(st, b, &f, write_failed, res);
+
+        if (!upload_stream_copy(u, NULL, padding, &write_failed)) return false;
+    }
+}
+
+//
+// multipart/form-data
+//
+
+String multipart_header_param(String value, char *param)
+{
+    bool found = false;
+    String rest;
+    split(value, param, &rest, &found);
+    if (!found) return String();
+
+    return split(rest, "\"");
+}
+
+bool upload_ingest_multipart(Storage *st, Request *c, Upload_Stream *u, Storage_Batch *b, Upload_Result *res)
+{
+    String boundary = c->boundary;
+    if (boundary.count == 0 || boundary.count > 70) {
+        fprintf(stderr, "[upload]: Invalid multipart boundary -> " SFMT "\n", SARG(boundary));
+        return false;
+    }
+
+    char delimiter[80];
+    snprintf(delimiter, sizeof(delimiter), CRLF "--" SFMT, SARG(boundary));
+    s64 delimiter_count = strlen(delimiter);
+
+    // The first boundary is not preceded by a CRLF, we pretend that it is
+    memcpy(u->data, CRLF, 2);
+    u->end = 2;
+
+    bool write_failed = false;
+    s64 request_digest_files = 0;
+
+    // Skip the preamble
+    while (true) {
+        s64 at = upload_stream_find(u, delimiter);
+        if (at >= 0) {
+            upload_stream_consume(u, at + delimiter_count);
+            break;
+        }
+
+        s64 safe = upload_stream_available(u) - (delimiter_count-1);
+        if (safe > 0) upload_stream_consume(u, safe);
+        if (!upload_stream_fill(u)) return false;
+    }
+
+    while (true) {
+        if (!upload_stream_need(u, 2)) return false;
+        if (memcmp(u->data + u->start, "--", 2) == 0) return true; // The close delimiter, the epilogue is ignored
+        if (memcmp(u->data + u->start, CRLF, 2) != 0) return false;
+        upload_stream_consume(u, 2);
+
+        // The headers of the part
+        s64 headers_end = -1;
+        while ((headers_end = upload_stream_find(u, CRLF CRLF)) < 0) {
+            if (!upload_stream_fill(u)) return false;
+        }
+
+        char name_buf[MAX_PATH];
+        String name;
+
+        // A part can have its own expected digest, otherwise the one of the request is used
+        bool has_expected = c->has_expected_sha256;
+        bool own_expected = false;
+        u8 expected[SHA256_DIGEST_SIZE];
+        if (has_expected) memcpy(expected, c->expected_sha256, SHA256_DIGEST_SIZE);
+
+        String headers = String(u->data + u->start, headers_end);
+        bool found = true;
+        while (headers.count && found) {
+            String line = split_and_move(&headers, CRLF, &found);
+
+            bool ok = false;
+            String value;
+            String key = split(line, ": ", &value, &ok);
+            if (!ok) continue;
+
+            if (string_equal_ignore_case(key, "Content-Disposition")) {
+                String filename = multipart_header_param(value, "filename=\"");
+                if (filename.count && filename.count < MAX_PATH) name = upload_clean_path(name_buf, filename);
+            } else if (string_equal_ignore_case(key, "X-Expected-SHA256")) {
+                has_expected = sha256_from_hex(string_trim_white(value), expected);
+                if (!has_expected) return false;
+                own_expected = true;
+            }
+        }
+
+        upload_stream_consume(u, headers_end + 4);
+
+        // Like in a tar, the digest of the request can only be the one of a single file
+        if (name.count && has_expected && !own_expected && ++request_digest_files > 1) {
+            fprintf(stderr, "[upload]: X-Expected-SHA256 with more than one file without its own!\n");
+            return false;
+        }
+
+        // The content of the part, only the files are stored
+        Storage_File f;
+        bool has_file = name.count && storage_file_begin(st, name, &f);
+        if (name.count && !has_file) res->failed += 1;
+        write_failed = false;
+
+        if (has_file && has_expected) {
+            f.has_expected_digest = true;
+            memcpy(f.expected_digest, expected, SHA256_DIGEST_SIZE);
+        }
+
+        while (true) {
+            s64 at = upload_stream_find(u, delimiter);
+            s64 n = at >= 0 ? at : upload_stream_available(u) - (delimiter_count-1);
+
+            if (n > 0) {
+                if (has_file && !write_failed && !storage_file_write(&f, u->data + u->start, n)) write_failed = true;
+                upload_stream_consume(u, n);
+            }
+
+            if (at >= 0) {
+                upload_stream_consume(u, delimiter_count);
+                break;
+            }
+
+            if (!upload_stream_fill(u)) {
+                if (has_file) storage_file_abort(&f);
+                return false;
+            }
+        }
+
+        if (has_file) upload_finish_file(st, b, &f, write_failed, res);
+    }
+}
+
+// Stores every file of the body (multipart/form-data or tar). The files are committed in
+// groups by the storage committer; the ones received before a broken stream are kept.
+bool upload_ingest(Storage *st, Request *c, s64 buffer_size, Upload_Result *res)
+{
+    ZERO_MEMORY(res, sizeof(Upload_Result));
+
+    if (c->content_type != Mime_Multipart_FormData && c->content_type != Mime_App_Tar) {
+        return false;
+    }
+
+    Upload_Stream u = {};
+    u.c        = c;
+    u.capacity = buffer_size;
+    u.data     = (char *)malloc(u.capacity);
+    assert(u.data);
+
+    Storage_Batch b = {};
+
+    bool success = false;
+    if (c->content_type == Mime_App_Tar) {
+        success = upload_ingest_tar(st, c, &u, &b, res);
+    } else {
+        success = upload_ingest_multipart(st, c, &u, &b, res);
+    }
+
+    // The response is sent only after everything we've received is durable
+    if (!storage_batch_commit(st, &b)) success = false;
+    res->files   = b.committed_files;
+    res->bytes   = b.committed_bytes;
+    res->failed += b.failed_files;
+    res->digests = b.digests;
+
+    printf("#%lld: [upload]: %lld file(s), %lld bytes, %lld failed\n", c->socket, res->files, res->bytes, res->failed);
+
+    free(u.data);
+
+    return success;
+}
+
+#endif
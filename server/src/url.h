@@ -0,0 +1,207 @@
+#ifndef H_CUPIDO_URL
+#define H_CUPIDO_URL
+
+#include "core.h"
+
+#include <emmintrin.h>
+
+// Percent-decoding and path normalization of the request target, in place in the receive
+// buffer and without any allocation. The ordinary bytes are skipped (and moved, if the output
+// is already behind) 16 at a time, only the special ones go through the scalar code.
+
+inline int url_hex_value(char ch)
+{
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+// Bit mask of the bytes in the 16 bytes at 'p' that are '%', '/', '.', '\\', ':', or control.
+inline int url_special_mask16(char *p)
+{
+    __m128i x = _mm_loadu_si128((__m128i *)p);
+
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('%')), _mm_cmpeq_epi8(x, _mm_set1_epi8('/'))),
+        _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('.')), _mm_cmpeq_epi8(x, _mm_set1_epi8('\\'))));
+    special = _mm_or_si128(special, _mm_cmpeq_epi8(x, _mm_set1_epi8(':')));
+    special = _mm_or_si128(special, _mm_cmpeq_epi8(x, _mm_set1_epi8(0x7f)));
+
+    // Unsigned x < 0x20: signed x < 0x20 but not negative (the UTF-8 bytes are negative)
+    __m128i control = _mm_andnot_si128(_mm_cmplt_epi8(x, _mm_setzero_si128()), _mm_cmplt_epi8(x, _mm_set1_epi8(0x20)));
+
+    return _mm_movemask_epi8(_mm_or_si128(special, control));
+}
+
+inline int url_lowest_bit(int mask)
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, mask);
+    return (int)i;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Closes the segment that starts at 'segment_start' in the output. Returns false on a ".."
+// that would go above the root.
+inline bool url_close_segment(char *out, s64 *w, s64 *segment_start, bool final)
+{
+    s64 len = *w - *segment_start;
+    char *seg = out + *segment_start;
+
+    if (len == 0) return true; // Empty segment: "//" or a trailing '/'
+
+    if (len == 1 && seg[0] == '.') {
+        *w = *segment_start;
+        return true;
+    }
+
+    if (len == 2 && seg[0] == '.' && seg[1] == '.') {
+        if (*segment_start == 1) return false;
+
+        // Back to the start of the previous segment
+        s64 i = *segment_start - 2;
+        while (out[i] != '/') i -= 1;
+        *segment_start = i + 1;
+        *w = *segment_start;
+        return true;
+    }
+
+    if (!final) {
+        out[(*w)++] = '/';
+        *segment_start = *w;
+    }
+
+    return true;
+}
+
+// Turns the raw path of the request line into its canonical form in place: percent-decoded,
+// no empty, "." or ".." segments and no trailing '/' (except the root). It fails on anything
+// that could escape the storage root or confuse the Windows paths: ".." above the root,
+// '\\', ':', control characters, NUL and malformed escapes.
+bool url_normalize_path(String *path)
+{
+    char *in  = path->data;
+    s64 count = path->count;
+    if (count == 0 || in[0] != '/') return false;
+
+    char *out = in;
+    s64 r = 1, w = 1;
+    s64 segment_start = 1;
+
+    while (r < count) {
+        // The fast path over the ordinary bytes
+        while (r + 16 <= count) {
+            int mask = url_special_mask16(in + r);
+            s64 n = mask ? url_lowest_bit(mask) : 16;
+
+            if (w != r) memmove(out + w, in + r, n);
+            r += n;
+            w += n;
+
+            if (mask) break;
+        }
+        if (r >= count) break;
+
+        char ch = in[r++];
+
+        if (ch == '%') {
+            if (r + 2 > count) return false;
+            int hi = url_hex_value(in[r]), lo = url_hex_value(in[r+1]);
+            if (hi < 0 || lo < 0) return false;
+            r += 2;
+
+            ch = (char)(hi*16 + lo);
+            if (ch == '.' || ch == '/') {
+                // Let the segment logic see the decoded separators and dots as well
+            } else if ((u8)ch < 0x20 || ch == 0x7f || ch == '\\' || ch == ':') {
+                return false;
+            } else {
+                out[w++] = ch;
+                continue;
+            }
+        }
+
+        if (ch == '/') {
+            if (!url_close_segment(out, &w, &segment_start, false)) return false;
+            continue;
+        }
+
+        if ((u8)ch < 0x20 || ch == 0x7f || ch == '\\' || ch == ':') return false;
+
+        out[w++] = ch;
+    }
+
+    if (!url_close_segment(out, &w, &segment_start, true)) return false;
+    if (w > 1 && out[w-1] == '/') w -= 1;
+
+    path->count = w;
+    return true;
+}
+
+// Decodes a query component into 'out' ('+' is a space there). Returns the decoded length,
+// or -1 on a malformed escape or if 'out' is too small.
+s64 url_decode_component(String in, char *out, s64 out_size)
+{
+    s64 w = 0;
+
+    for (s64 r = 0; r < in.count; r++) {
+        if (w == out_size) return -1;
+
+        char ch = in.data[r];
+        if (ch == '+') {
+            ch = ' ';
+        } else if (ch == '%') {
+            if (r + 2 >= in.count) return -1;
+            int hi = url_hex_value(in.data[r+1]), lo = url_hex_value(in.data[r+2]);
+            if (hi < 0 || lo < 0) return -1;
+            ch = (char)(hi*16 + lo);
+            r += 2;
+        }
+
+        out[w++] = ch;
+    }
+
+    return w;
+}
+
+// The query is kept raw in the request and only the asked parameters are decoded (into the
+// caller's buffer). Returns false if the key is not there or the value doesn't fit.
+bool url_query_get(String query, char *key, String *value, char *buf, s64 buf_size)
+{
+    s64 key_count = strlen(key);
+
+    while (query.count) {
+        bool found = false;
+        String pair = split_and_move(&query, "&", &found);
+        if (!found) query.count = 0;
+
+        String raw_value;
+        String raw_key = split(pair, "=", &raw_value, &found);
+        if (!found) raw_value = String();
+
+        // The keys we ask for are plain ASCII, so the encoded keys are only decoded if needed
+        char key_buf[64];
+        s64 decoded_count = raw_key.count;
+        char *decoded_key = raw_key.data;
+        if (find_index_from_left(raw_key, "%") >= 0 || find_index_from_left(raw_key, "+") >= 0) {
+            decoded_count = url_decode_component(raw_key, key_buf, sizeof(key_buf));
+            decoded_key = key_buf;
+        }
+
+        if (decoded_count != key_count || memcmp(decoded_key, key, key_count) != 0) continue;
+
+        s64 n = url_decode_component(raw_value, buf, buf_size);
+        if (n < 0) return false;
+
+        *value = String(buf, n);
+        return true;
+    }
+
+    return false;
+}
+
+#endif